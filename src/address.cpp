@@ -59,6 +59,7 @@ void Address::Set(char *szServer, int nPort)
 			
 	strncpy(_szServer, szServer, MAX_SERVER_LEN);
 	_szServer[MAX_SERVER_LEN] = '\0';
+	_nPort = nPort;
 }
 
 
@@ -90,7 +91,7 @@ void Address::Set(unsigned char *pRaw)
 	
 	sprintf(_szServer, "%u.%u.%u.%u", (unsigned int) pRaw[0], (unsigned int) pRaw[1], (unsigned int) pRaw[2], (unsigned int) pRaw[3]);
 	_nPort = (pRaw[4] << 8);
-	_nPort = pRaw[5];
+	_nPort += pRaw[5];
 	
 	ASSERT(_nPort > 0);
 	printf("Address::Get() = %s:%d\n", _szServer, _nPort);
@@ -155,3 +156,16 @@ bool Address::IsSame(unsigned char *pRaw)
 	return(bSame);
 }
 
+
+//-----------------------------------------------------------------------------
+// CJW: Compare this address against another address object.  Both must have 
+// 		valid information in them.
+bool Address::IsSame(Address *pAddr)
+{
+	unsigned char pData[6];
+	
+	ASSERT(pAddr != NULL);
+	
+	pAddr->Get(pData);
+	return(IsSame(pData));
+}
@@ -57,6 +57,7 @@ struct Address
 		void Get(unsigned char *pRaw);
 		
 		bool IsSame(unsigned char *pRaw);
+		bool IsSame(Address *pAddr);
 	
 	protected:
 		
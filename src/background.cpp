@@ -0,0 +1,363 @@
+//-----------------------------------------------------------------------------
+// background.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See background.h for details.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+#include <DevPlus.h>
+
+#include "background.h"
+
+
+//-----------------------------------------------------------------------------
+// CJW: Constructor.  The worker isnt started until there is something for it
+// 		to do.
+Background::Background()
+{
+	_pList = NULL;
+	_bRunning = false;
+	_bStop = false;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Deconstructor.  If the worker is in the middle of a job, we have to
+// 		wait for it to finish, because it is using the job.  Then anything
+// 		left in the list is freed.
+Background::~Background()
+{
+	strJob *pJob;
+	bool bRunning;
+
+	_xLock.Lock();
+	_bStop = true;
+	bRunning = _bRunning;
+	_xLock.Unlock();
+
+	while (bRunning == true) {
+		usleep(10000);
+		_xLock.Lock();
+		bRunning = _bRunning;
+		_xLock.Unlock();
+	}
+
+	while (_pList != NULL) {
+		pJob = _pList;
+		_pList = pJob->pNext;
+		if (pJob->pArg != NULL && pJob->fnFree != NULL) {
+			(*pJob->fnFree)(pJob->pArg);
+		}
+		free(pJob->szKey);
+		free(pJob);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Find a job by its key.  Needs to be called while locked.
+strJob * Background::Find(char *szKey)
+{
+	strJob *pJob;
+
+	ASSERT(szKey != NULL);
+
+	pJob = _pList;
+	while (pJob != NULL && strcmp(pJob->szKey, szKey) != 0) {
+		pJob = pJob->pNext;
+	}
+
+	return(pJob);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Queue a job.  The argument belongs to the job until it is taken, and
+// 		fnFree is used to free it if it never is.  If there is already a job
+// 		with this key, or the worker couldnt be started, we return false and
+// 		the caller still owns the argument.  The jobs are done in the order
+// 		they were added.
+bool Background::Add(char *szKey, fnJobWork fnWork, fnJobFree fnFree, void *pArg)
+{
+	strJob *pJob, *pLast;
+	pthread_t xThread;
+	pthread_attr_t xAttr;
+	bool bAdded = false;
+
+	ASSERT(szKey != NULL && fnWork != NULL && fnFree != NULL && pArg != NULL);
+
+	_xLock.Lock();
+
+	if (_bStop == false && Find(szKey) == NULL) {
+		bAdded = true;
+		if (_bRunning == false) {
+			pthread_attr_init(&xAttr);
+			pthread_attr_setdetachstate(&xAttr, PTHREAD_CREATE_DETACHED);
+			if (pthread_create(&xThread, &xAttr, WorkThread, this) != 0) {
+				bAdded = false;
+			}
+			else {
+				_bRunning = true;
+			}
+			pthread_attr_destroy(&xAttr);
+		}
+
+		if (bAdded == true) {
+			pJob = (strJob *) malloc(sizeof(strJob));
+			ASSERT(pJob != NULL);
+			pJob->szKey = strdup(szKey);
+			ASSERT(pJob->szKey != NULL);
+			pJob->fnWork = fnWork;
+			pJob->fnFree = fnFree;
+			pJob->pArg = pArg;
+			pJob->nState = JOB_PENDING;
+			pJob->tDone = 0;
+			pJob->pNext = NULL;
+
+			// the worker takes them from the front.
+			if (_pList == NULL) {
+				_pList = pJob;
+			}
+			else {
+				pLast = _pList;
+				while (pLast->pNext != NULL) {
+					pLast = pLast->pNext;
+				}
+				pLast->pNext = pJob;
+			}
+		}
+	}
+
+	_xLock.Unlock();
+
+	return(bAdded);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the state of a job, JOB_NONE if there isnt one with this key.
+int Background::GetState(char *szKey)
+{
+	strJob *pJob;
+	int nState = JOB_NONE;
+
+	ASSERT(szKey != NULL);
+
+	_xLock.Lock();
+	pJob = Find(szKey);
+	if (pJob != NULL) {
+		nState = pJob->nState;
+	}
+	_xLock.Unlock();
+
+	return(nState);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Take a finished job out of the list, and return its argument, which
+// 		the caller then needs to free.  Returns NULL if there isnt a finished
+// 		job with this key.
+void * Background::Take(char *szKey)
+{
+	strJob *pJob, *pPrev;
+	void *pArg = NULL;
+
+	ASSERT(szKey != NULL);
+
+	_xLock.Lock();
+
+	pPrev = NULL;
+	pJob = _pList;
+	while (pJob != NULL && strcmp(pJob->szKey, szKey) != 0) {
+		pPrev = pJob;
+		pJob = pJob->pNext;
+	}
+
+	if (pJob != NULL && (pJob->nState == JOB_DONE || pJob->nState == JOB_FAILED)) {
+		if (pPrev == NULL)	{ _pList = pJob->pNext; }
+		else				{ pPrev->pNext = pJob->pNext; }
+		pArg = pJob->pArg;
+		free(pJob->szKey);
+		free(pJob);
+	}
+
+	_xLock.Unlock();
+
+	return(pArg);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Take the first finished job that has a key starting with szPrefix, 
+// 		for when the caller doesnt know which ones it is waiting for any 
+// 		more.  Returns NULL if none of them have finished.
+void * Background::TakeFinished(char *szPrefix)
+{
+	strJob *pJob, *pPrev;
+	void *pArg = NULL;
+	int nLen;
+
+	ASSERT(szPrefix != NULL);
+
+	nLen = strlen(szPrefix);
+
+	_xLock.Lock();
+
+	pPrev = NULL;
+	pJob = _pList;
+	while (pJob != NULL && (strncmp(pJob->szKey, szPrefix, nLen) != 0 || (pJob->nState != JOB_DONE && pJob->nState != JOB_FAILED))) {
+		pPrev = pJob;
+		pJob = pJob->pNext;
+	}
+
+	if (pJob != NULL) {
+		if (pPrev == NULL)	{ _pList = pJob->pNext; }
+		else				{ pPrev->pNext = pJob->pNext; }
+		pArg = pJob->pArg;
+		free(pJob->szKey);
+		free(pJob);
+	}
+
+	_xLock.Unlock();
+
+	return(pArg);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Throw away the jobs that finished more than nSeconds ago and were
+// 		never taken.  A failed job can be left in the list on purpose for a
+// 		while, so that the same work isnt tried again straight away.
+void Background::Expire(int nSeconds)
+{
+	strJob *pJob, *pPrev, *pNext;
+	time_t tNow;
+
+	ASSERT(nSeconds >= 0);
+
+	tNow = time(NULL);
+
+	_xLock.Lock();
+
+	pPrev = NULL;
+	pJob = _pList;
+	while (pJob != NULL) {
+		pNext = pJob->pNext;
+		if ((pJob->nState == JOB_DONE || pJob->nState == JOB_FAILED) && (tNow - pJob->tDone) >= nSeconds) {
+			if (pPrev == NULL)	{ _pList = pNext; }
+			else				{ pPrev->pNext = pNext; }
+			(*pJob->fnFree)(pJob->pArg);
+			free(pJob->szKey);
+			free(pJob);
+		}
+		else {
+			pPrev = pJob;
+		}
+		pJob = pNext;
+	}
+
+	_xLock.Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the number of jobs that are waiting or being done.  The 
+// 		finished ones that havent been taken arent counted.
+int Background::GetCount(void)
+{
+	strJob *pJob;
+	int nCount = 0;
+
+	_xLock.Lock();
+	pJob = _pList;
+	while (pJob != NULL) {
+		if (pJob->nState == JOB_PENDING || pJob->nState == JOB_BUSY) {
+			nCount++;
+		}
+		pJob = pJob->pNext;
+	}
+	_xLock.Unlock();
+
+	return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Do the jobs that are waiting, one at a time, until there are none
+// 		left (or we are told to stop).  The list isnt locked while a job is
+// 		being done, but the job cant be taken or expired until it is
+// 		finished, so it wont go away under us.
+void Background::Work(void)
+{
+	strJob *pJob;
+	bool bOk;
+
+	_xLock.Lock();
+
+	pJob = _pList;
+	while (pJob != NULL && pJob->nState != JOB_PENDING) {
+		pJob = pJob->pNext;
+	}
+
+	while (pJob != NULL && _bStop == false) {
+		pJob->nState = JOB_BUSY;
+		_xLock.Unlock();
+
+		bOk = (*pJob->fnWork)(pJob->pArg);
+
+		_xLock.Lock();
+		pJob->nState = (bOk == true) ? JOB_DONE : JOB_FAILED;
+		pJob->tDone = time(NULL);
+
+		pJob = _pList;
+		while (pJob != NULL && pJob->nState != JOB_PENDING) {
+			pJob = pJob->pNext;
+		}
+	}
+
+	_bRunning = false;
+	_xLock.Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The worker thread.
+void * Background::WorkThread(void *pArg)
+{
+	ASSERT(pArg != NULL);
+	((Background *) pArg)->Work();
+	return(NULL);
+}
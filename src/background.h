@@ -0,0 +1,96 @@
+//-----------------------------------------------------------------------------
+// background.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      Work that takes too long to do on the network thread (reading and
+//      hashing whole files, making deltas) is queued here and done one job at
+//      a time by a worker thread.  The network looks at the state of a job
+//      by its key each time it goes round, and takes the result once it is
+//      done.  The worker is only running while there are jobs waiting.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __BACKGROUND_H
+#define __BACKGROUND_H
+
+#include <time.h>
+
+#include <DpLock.h>
+
+//-----------------------------------------------------------------------------
+// The state of a job.  JOB_NONE is returned for a key that isnt queued.
+#define JOB_NONE        0
+#define JOB_PENDING     1
+#define JOB_BUSY        2
+#define JOB_DONE        3
+#define JOB_FAILED      4
+
+// Does the work of a job in the worker thread, and returns false if it
+// failed.  It must only touch what it is given.
+typedef bool (*fnJobWork)(void *pArg);
+
+// Frees the argument of a job that nobody took.
+typedef void (*fnJobFree)(void *pArg);
+
+
+struct strJob {
+	char *szKey;
+	fnJobWork fnWork;
+	fnJobFree fnFree;
+	void *pArg;
+	int nState;
+	time_t tDone;		// when it finished.
+	strJob *pNext;
+};
+
+
+class Background
+{
+    public:
+        Background();
+        virtual ~Background();
+
+        bool Add(char *szKey, fnJobWork fnWork, fnJobFree fnFree, void *pArg);
+        int GetState(char *szKey);
+        void * Take(char *szKey);
+        void * TakeFinished(char *szPrefix);
+        void Expire(int nSeconds);
+        int GetCount(void);
+
+    private:
+        DpLock _xLock;
+        strJob *_pList;
+        bool _bRunning;         // the worker thread is going.
+        bool _bStop;            // we are being destroyed, the worker must stop.
+
+        strJob * Find(char *szKey);
+        void Work(void);
+        static void * WorkThread(void *pArg);
+};
+
+
+#endif
@@ -37,6 +37,13 @@
 
 #include <DpServerInterface.h>
 
+//-----------------------------------------------------------------------------
+// Each phase of the network and server loops is timed.  If one takes longer 
+// than LOOP_BUDGET ms (loop-budget in the config), it is logged, but no more 
+// than once every LOOP_WARN_TIME seconds for each loop.
+#define LOOP_BUDGET		100
+#define LOOP_WARN_TIME	1
+
 class BaseServer : public DpServerInterface
 {
 	public:
@@ -0,0 +1,597 @@
+//-----------------------------------------------------------------------------
+// cdc.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See cdc.h for details.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+#include <DevPlus.h>
+
+#include "cdc.h"
+#include "sha256.h"
+#include "delta.h"
+
+
+unsigned int ChunkStore::_pGear[256];
+bool ChunkStore::_bGear = false;
+
+
+//---------------------------------------------------------------------
+// CJW: Constructor.   Start with an empty index.
+ChunkStore::ChunkStore()
+{
+	int i;
+	
+	for (i=0; i<CDC_BUCKETS; i++) {
+		_pBuckets[i] = NULL;
+	}
+	_pFiles = NULL;
+	_nCount = 0;
+	_szPath = NULL;
+	
+	InitGear();
+}
+    
+//---------------------------------------------------------------------
+// CJW: Deconstructor.  Clean up the lists.
+ChunkStore::~ChunkStore()
+{
+	strCdcChunk *pChunk;
+	strCdcFile *pFile;
+	int i;
+	
+	for (i=0; i<CDC_BUCKETS; i++) {
+		while (_pBuckets[i] != NULL) {
+			pChunk = _pBuckets[i];
+			_pBuckets[i] = pChunk->pNext;
+			free(pChunk);
+			_nCount--;
+		}
+	}
+	ASSERT(_nCount == 0);
+	
+	while (_pFiles != NULL) {
+		pFile = _pFiles;
+		_pFiles = pFile->pNext;
+		free(pFile->szFile);
+		free(pFile);
+	}
+	
+	if (_szPath != NULL) {
+		free(_szPath);
+		_szPath = NULL;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Every node has to cut files in the same places, so the gear table 
+// 		is made from a fixed seed rather than being random.
+void ChunkStore::InitGear(void)
+{
+	unsigned int x = 0x9e3779b9;
+	int i;
+	
+	if (_bGear == false) {
+		for (i=0; i<256; i++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			_pGear[i] = x;
+		}
+		_bGear = true;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Set the directory that the packages are in.
+void ChunkStore::SetPath(char *szPath)
+{
+	ASSERT(szPath != NULL);
+	
+	if (_szPath != NULL) {
+		free(_szPath);
+	}
+	_szPath = strdup(szPath);
+	ASSERT(_szPath != NULL);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the length of the chunk that starts at pData.  The gear hash 
+// 		only depends on the last 32 bytes, and we use the high bits of it 
+// 		because they depend on more of those bytes than the low bits do.
+int ChunkStore::NextCut(char *pData, int nLength)
+{
+	unsigned char *pTmp = (unsigned char *) pData;
+	unsigned int h = 0;
+	int nMax, nCut, i;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(_bGear == true);
+	
+	nMax = nLength;
+	if (nMax > CDC_MAX_CHUNK) { nMax = CDC_MAX_CHUNK; }
+	nCut = nMax;
+	
+	if (nLength > CDC_MIN_CHUNK) {
+		for (i=CDC_MIN_CHUNK - 32; i<nMax && nCut == nMax; i++) {
+			h = (h << 1) + _pGear[pTmp[i]];
+			if (i >= CDC_MIN_CHUNK && ((h >> 16) & CDC_MASK) == 0) {
+				nCut = i + 1;
+			}
+		}
+	}
+	
+	return(nCut);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Work out which bucket a hash goes in.  The hash is already random, 
+// 		so we just use the first bytes of it.
+unsigned int ChunkStore::GetBucket(unsigned char *pHash)
+{
+	ASSERT(pHash != NULL);
+	return(((pHash[0] << 8) | pHash[1]) % CDC_BUCKETS);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Add a chunk to the index.  If we already have a chunk with the same 
+// 		hash, we dont need another one, that is the whole point.
+void ChunkStore::Add(strCdcFile *pFile, unsigned char *pHash, int nOffset, int nLength)
+{
+	strCdcChunk *pChunk;
+	unsigned int nBucket;
+	
+	ASSERT(pFile != NULL && pHash != NULL);
+	ASSERT(nOffset >= 0 && nLength > 0);
+	
+	nBucket = GetBucket(pHash);
+	pChunk = _pBuckets[nBucket];
+	while (pChunk != NULL && memcmp(pChunk->pHash, pHash, CDC_HASH_SIZE) != 0) {
+		pChunk = pChunk->pNext;
+	}
+	
+	if (pChunk == NULL && _nCount < CDC_MAX_CHUNKS) {
+		pChunk = (strCdcChunk *) malloc(sizeof(strCdcChunk));
+		ASSERT(pChunk != NULL);
+		memcpy(pChunk->pHash, pHash, CDC_HASH_SIZE);
+		pChunk->pFile = pFile;
+		pChunk->nOffset = nOffset;
+		pChunk->nLength = nLength;
+		pChunk->pNext = _pBuckets[nBucket];
+		_pBuckets[nBucket] = pChunk;
+		_nCount++;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: A file has gone from the cache (or changed), so we remove all the 
+// 		chunks that we had in it.  This doesnt happen often, so we just go 
+// 		thru the whole index.
+void ChunkStore::RemoveFile(strCdcFile *pFile)
+{
+	strCdcChunk *pChunk, *pPrev, *pNext;
+	strCdcFile *pTmp;
+	int i;
+	
+	ASSERT(pFile != NULL);
+	
+	for (i=0; i<CDC_BUCKETS; i++) {
+		pPrev = NULL;
+		pChunk = _pBuckets[i];
+		while (pChunk != NULL) {
+			pNext = pChunk->pNext;
+			if (pChunk->pFile == pFile) {
+				if (pPrev == NULL)	{ _pBuckets[i] = pNext; }
+				else 				{ pPrev->pNext = pNext; }
+				free(pChunk);
+				_nCount--;
+			}
+			else {
+				pPrev = pChunk;
+			}
+			pChunk = pNext;
+		}
+	}
+	
+	if (_pFiles == pFile) {
+		_pFiles = pFile->pNext;
+	}
+	else {
+		pTmp = _pFiles;
+		while (pTmp != NULL && pTmp->pNext != pFile) {
+			pTmp = pTmp->pNext;
+		}
+		ASSERT(pTmp != NULL);
+		pTmp->pNext = pFile->pNext;
+	}
+	
+	free(pFile->szFile);
+	free(pFile);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Find a file that we have indexed.  Needs to be called while locked.
+strCdcFile * ChunkStore::FindFile(char *szFile)
+{
+	strCdcFile *pFile;
+	
+	ASSERT(szFile != NULL);
+	
+	pFile = _pFiles;
+	while (pFile != NULL && strcmp(pFile->szFile, szFile) != 0) {
+		pFile = pFile->pNext;
+	}
+	
+	return(pFile);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return true if we have already indexed this file.
+bool ChunkStore::IsIndexed(char *szFile)
+{
+	bool bIndexed;
+	
+	ASSERT(szFile != NULL);
+	
+	_xLock.Lock();
+	bIndexed = (FindFile(szFile) != NULL);
+	_xLock.Unlock();
+	
+	return(bIndexed);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Cut the data of a file (which is in the package cache) into chunks, 
+// 		and add them to the index.  The hashing is done before we lock, so 
+// 		that the index can still be used while a big file is being done.
+void ChunkStore::IndexData(char *szFile, char *pData, int nLength)
+{
+	strCdcFile *pFile;
+	unsigned char *pHashes;
+	int *pCuts;
+	int nMax, nChunks, nPos, i;
+	
+	ASSERT(szFile != NULL && pData != NULL && nLength > 0);
+	
+	if (IsIndexed(szFile) == false) {
+		nMax = (nLength / CDC_MIN_CHUNK) + 1;
+		pHashes = (unsigned char *) malloc(nMax * CDC_HASH_SIZE);
+		pCuts = (int *) malloc(nMax * sizeof(int));
+		ASSERT(pHashes != NULL && pCuts != NULL);
+		
+		nChunks = 0;
+		nPos = 0;
+		while (nPos < nLength) {
+			ASSERT(nChunks < nMax);
+			pCuts[nChunks] = NextCut(&pData[nPos], nLength - nPos);
+			Sha256 sha;
+			sha.Update(&pData[nPos], pCuts[nChunks]);
+			sha.Final(&pHashes[nChunks * CDC_HASH_SIZE]);
+			nPos += pCuts[nChunks];
+			nChunks++;
+		}
+		
+		_xLock.Lock();
+		if (FindFile(szFile) == NULL) {
+			pFile = (strCdcFile *) malloc(sizeof(strCdcFile));
+			ASSERT(pFile != NULL);
+			pFile->szFile = strdup(szFile);
+			ASSERT(pFile->szFile != NULL);
+			pFile->pNext = _pFiles;
+			_pFiles = pFile;
+			
+			nPos = 0;
+			for (i=0; i<nChunks && _nCount < CDC_MAX_CHUNKS; i++) {
+				Add(pFile, &pHashes[i * CDC_HASH_SIZE], nPos, pCuts[i]);
+				nPos += pCuts[i];
+			}
+		}
+		_xLock.Unlock();
+		
+		free(pHashes);
+		free(pCuts);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Read a file from the package cache and index it.  Returns false if 
+// 		it couldnt be read (or is too big to bother with).
+bool ChunkStore::IndexFile(char *szFile)
+{
+	char szPath[2048];
+	char *pData;
+	struct stat st;
+	int nLength;
+	bool bIndexed = false;
+	
+	ASSERT(szFile != NULL);
+	ASSERT(_szPath != NULL);
+	
+	if ((strlen(_szPath) + strlen(szFile) + 2) < sizeof(szPath)) {
+		sprintf(szPath, "%s/%s", _szPath, szFile);
+		if (stat(szPath, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= CDC_MAX_FILE) {
+			pData = Delta::ReadFile(szPath, &nLength);
+			if (pData != NULL) {
+				IndexData(szFile, pData, nLength);
+				free(pData);
+				bIndexed = true;
+			}
+		}
+	}
+	
+	return(bIndexed);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Find a chunk by its hash, and read it out of the file it is in.  
+// 		pData needs to be CDC_MAX_CHUNK long.  The data is checked against 
+// 		the hash, and if the file has changed since we indexed it, we forget 
+// 		about the file.
+bool ChunkStore::Find(unsigned char *pHash, char *pData, int *nLength)
+{
+	strCdcChunk *pChunk;
+	unsigned char pCheck[SHA256_SIZE];
+	char szPath[2048];
+	FILE *fp;
+	bool bFound = false;
+	bool bBad = false;
+	
+	ASSERT(pHash != NULL && pData != NULL && nLength != NULL);
+	ASSERT(_szPath != NULL);
+	
+	_xLock.Lock();
+	
+	pChunk = _pBuckets[GetBucket(pHash)];
+	while (pChunk != NULL && memcmp(pChunk->pHash, pHash, CDC_HASH_SIZE) != 0) {
+		pChunk = pChunk->pNext;
+	}
+	
+	if (pChunk != NULL && (strlen(_szPath) + strlen(pChunk->pFile->szFile) + 2) < sizeof(szPath)) {
+		ASSERT(pChunk->nLength <= CDC_MAX_CHUNK);
+		bBad = true;
+		sprintf(szPath, "%s/%s", _szPath, pChunk->pFile->szFile);
+		fp = fopen(szPath, "rb");
+		if (fp != NULL) {
+			if (fseek(fp, pChunk->nOffset, SEEK_SET) == 0 && fread(pData, 1, pChunk->nLength, fp) == (size_t) pChunk->nLength) {
+				Sha256 sha;
+				sha.Update(pData, pChunk->nLength);
+				sha.Final(pCheck);
+				if (memcmp(pCheck, pHash, CDC_HASH_SIZE) == 0) {
+					*nLength = pChunk->nLength;
+					bFound = true;
+					bBad = false;
+				}
+			}
+			fclose(fp);
+		}
+		
+		if (bBad == true) {
+			RemoveFile(pChunk->pFile);
+		}
+	}
+	
+	_xLock.Unlock();
+	
+	return(bFound);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Make the recipe for a file.  The caller needs to free it.
+char * ChunkStore::MakeRecipe(char *pData, int nLength, int *nRecipe)
+{
+	unsigned char *pRecipe;
+	int nChunks, nMax, nPos, nCut, i;
+	
+	ASSERT(pData != NULL && nLength > 0 && nRecipe != NULL);
+	
+	InitGear();
+	
+	// there cant be more chunks than this.
+	nMax = (nLength / CDC_MIN_CHUNK) + 1;
+	pRecipe = (unsigned char *) malloc(12 + (nMax * (2 + CDC_HASH_SIZE)));
+	ASSERT(pRecipe != NULL);
+	
+	memcpy(pRecipe, CDC_MAGIC, 4);
+	pRecipe[4] = (nLength >> 24) & 0xff;
+	pRecipe[5] = (nLength >> 16) & 0xff;
+	pRecipe[6] = (nLength >> 8) & 0xff;
+	pRecipe[7] = nLength & 0xff;
+	
+	i = 12;
+	nChunks = 0;
+	nPos = 0;
+	while (nPos < nLength) {
+		nCut = NextCut(&pData[nPos], nLength - nPos);
+		ASSERT(nChunks < nMax);
+		pRecipe[i++] = (nCut >> 8) & 0xff;
+		pRecipe[i++] = nCut & 0xff;
+		Sha256 sha;
+		sha.Update(&pData[nPos], nCut);
+		sha.Final(&pRecipe[i]);
+		i += CDC_HASH_SIZE;
+		nPos += nCut;
+		nChunks++;
+	}
+	
+	pRecipe[8] = (nChunks >> 24) & 0xff;
+	pRecipe[9] = (nChunks >> 16) & 0xff;
+	pRecipe[10] = (nChunks >> 8) & 0xff;
+	pRecipe[11] = nChunks & 0xff;
+	
+	*nRecipe = i;
+	return((char *) pRecipe);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Turn a recipe that we have got from a node into a list of chunks.  
+// 		Everything is checked, and NULL is returned if it is no good.  The 
+// 		caller needs to free the list.
+strCdcEntry * ChunkStore::ParseRecipe(char *pRecipe, int nRecipe, int *nEntries, int *nLength)
+{
+	unsigned char *pTmp = (unsigned char *) pRecipe;
+	strCdcEntry *pList = NULL;
+	int nFile, nChunks, nPos, i;
+	bool bOK = true;
+	
+	ASSERT(pRecipe != NULL && nEntries != NULL && nLength != NULL);
+	
+	if (nRecipe < 12 || memcmp(pRecipe, CDC_MAGIC, 4) != 0) {
+		bOK = false;
+	}
+	else {
+		nFile = (pTmp[4] << 24) | (pTmp[5] << 16) | (pTmp[6] << 8) | pTmp[7];
+		nChunks = (pTmp[8] << 24) | (pTmp[9] << 16) | (pTmp[10] << 8) | pTmp[11];
+		if (nFile <= 0 || nChunks <= 0 || nChunks > (nRecipe - 12) / (2 + CDC_HASH_SIZE) || nRecipe != 12 + (nChunks * (2 + CDC_HASH_SIZE))) {
+			bOK = false;
+		}
+	}
+	
+	if (bOK == true) {
+		pList = (strCdcEntry *) malloc(sizeof(strCdcEntry) * nChunks);
+		ASSERT(pList != NULL);
+		
+		nPos = 0;
+		pTmp += 12;
+		for (i=0; i<nChunks && bOK == true; i++) {
+			pList[i].nLength = (pTmp[0] << 8) | pTmp[1];
+			memcpy(pList[i].pHash, &pTmp[2], CDC_HASH_SIZE);
+			pList[i].nOffset = nPos;
+			pList[i].bHave = false;
+			pList[i].nNode = 0;
+			pList[i].nRefused = 0;
+			pTmp += 2 + CDC_HASH_SIZE;
+			
+			if (pList[i].nLength <= 0 || pList[i].nLength > CDC_MAX_CHUNK || pList[i].nLength > (nFile - nPos)) {
+				bOK = false;
+			}
+			nPos += pList[i].nLength;
+		}
+		
+		if (bOK == false || nPos != nFile) {
+			free(pList);
+			pList = NULL;
+		}
+		else {
+			*nEntries = nChunks;
+			*nLength = nFile;
+		}
+	}
+	
+	return(pList);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return true if this is the name of a recipe, rather than a file.
+bool ChunkStore::IsRecipeName(char *szName)
+{
+	int nLen, nExt;
+	
+	ASSERT(szName != NULL);
+	
+	nLen = strlen(szName);
+	nExt = strlen(CDC_EXTENSION);
+	
+	return(nLen > nExt && strcmp(&szName[nLen - nExt], CDC_EXTENSION) == 0);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Make the name of the recipe for a file.  Returns false if it wont 
+// 		fit.
+bool ChunkStore::MakeRecipeName(char *szFile, char *szName, int nMax)
+{
+	bool bMade = false;
+	
+	ASSERT(szFile != NULL && szName != NULL);
+	
+	if ((int) (strlen(szFile) + strlen(CDC_EXTENSION) + 1) <= nMax) {
+		sprintf(szName, "%s%s", szFile, CDC_EXTENSION);
+		bMade = true;
+	}
+	
+	return(bMade);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Get the name of the file back out of the name of its recipe.
+bool ChunkStore::SplitRecipeName(char *szName, char *szFile, int nMax)
+{
+	bool bSplit = false;
+	int nLen;
+	
+	ASSERT(szName != NULL && szFile != NULL);
+	
+	if (IsRecipeName(szName) == true) {
+		nLen = strlen(szName) - strlen(CDC_EXTENSION);
+		if (nLen > 0 && nLen < nMax) {
+			memcpy(szFile, szName, nLen);
+			szFile[nLen] = '\0';
+			if (strchr(szFile, '/') == NULL && szFile[0] != '.') {
+				bSplit = true;
+			}
+		}
+	}
+	
+	return(bSplit);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the number of chunks in the index.
+int ChunkStore::GetCount(void)
+{
+	int nCount;
+	
+	_xLock.Lock();
+	ASSERT(_nCount >= 0);
+	nCount = _nCount;
+	_xLock.Unlock();
+	
+	return(nCount);
+}
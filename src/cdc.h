@@ -0,0 +1,146 @@
+//-----------------------------------------------------------------------------
+// cdc.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      Content defined chunking.  Instead of cutting a file every
+//      MAX_CHUNK_SIZE bytes, the cut points are picked by a rolling (gear)
+//      hash of the data, so a part of a file that hasnt changed between two
+//      versions is cut into the same chunks, no matter what was inserted or
+//      removed before it.  Each chunk is known by its sha256.
+//
+//      The chunk store is an index of every chunk in every package in the
+//      cache, by hash.  The data itself stays in the package files, so each
+//      chunk is only on the disk once however many packages it is in.
+//
+//      The list of chunks in a file (its recipe) is passed around the
+//      network as if it was a file called <file>.recipe, and the chunks that
+//      a node doesnt already have are asked for by their hash.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __CDC_H
+#define __CDC_H
+
+#include <time.h>
+
+#include <DpLock.h>
+
+//-----------------------------------------------------------------------------
+// Chunks are at least CDC_MIN_CHUNK long, and are cut where the low bits of 
+// the hash (CDC_MASK) are all 0, which makes them about 8k on average after 
+// the minimum.  They are never longer than CDC_MAX_CHUNK, so that they fit in 
+// a FileInfo chunk and a node telegram.
+#define CDC_MIN_CHUNK       2048
+#define CDC_MASK            0x1fff
+#define CDC_MAX_CHUNK       32767
+#define CDC_HASH_SIZE       32
+
+// The index is a hash table of linked lists.  We dont index more than 
+// CDC_MAX_CHUNKS chunks, or files bigger than CDC_MAX_FILE.
+#define CDC_BUCKETS         65536
+#define CDC_MAX_CHUNKS      1048576
+#define CDC_MAX_FILE        (256*1024*1024)
+
+// The package cache is looked at for new files to index every CDC_INDEX_TIME 
+// seconds, one file at a time.  The recipes we make are kept in CDC_DIR in 
+// the cache.
+#define CDC_INDEX_TIME      600
+#define CDC_DIR             ".pacsrv-cdc"
+
+// A recipe starts with CDC_MAGIC, the length of the file and the number of 
+// chunks (4 bytes each), then <len*2><hash*32> for each chunk.
+#define CDC_MAGIC           "PCR1"
+#define CDC_EXTENSION       ".recipe"
+
+
+struct strCdcFile {
+	char *szFile;
+	strCdcFile *pNext;
+};
+
+struct strCdcChunk {
+	unsigned char pHash[CDC_HASH_SIZE];
+	strCdcFile *pFile;
+	int nOffset;
+	int nLength;
+	strCdcChunk *pNext;
+};
+
+// One chunk in a recipe.
+struct strCdcEntry {
+	unsigned char pHash[CDC_HASH_SIZE];
+	int nOffset;            // where it goes in the file.
+	int nLength;
+	bool bHave;
+	int nNode;              // node we have asked for it, 0 if none.
+	int nRefused;           // last node that didnt have it.
+};
+
+
+// The index is used by the background worker as well as the network thread, 
+// so it has its own lock.
+class ChunkStore 
+{
+    private:
+        DpLock _xLock;
+        strCdcChunk *_pBuckets[CDC_BUCKETS];
+        strCdcFile *_pFiles;
+        int _nCount;
+        char *_szPath;
+        
+        static unsigned int _pGear[256];
+        static bool _bGear;
+        static void InitGear(void);
+        
+        static unsigned int GetBucket(unsigned char *pHash);
+        void Add(strCdcFile *pFile, unsigned char *pHash, int nOffset, int nLength);
+        void RemoveFile(strCdcFile *pFile);
+        strCdcFile * FindFile(char *szFile);
+    
+    public:
+        ChunkStore();
+        virtual ~ChunkStore();
+        
+        void SetPath(char *szPath);
+        
+        static int NextCut(char *pData, int nLength);
+        static char * MakeRecipe(char *pData, int nLength, int *nRecipe);
+        static strCdcEntry * ParseRecipe(char *pRecipe, int nRecipe, int *nEntries, int *nLength);
+        static bool IsRecipeName(char *szName);
+        static bool MakeRecipeName(char *szFile, char *szName, int nMax);
+        static bool SplitRecipeName(char *szName, char *szFile, int nMax);
+        
+        bool IsIndexed(char *szFile);
+        void IndexData(char *szFile, char *pData, int nLength);
+        bool IndexFile(char *szFile);
+        bool Find(unsigned char *pHash, char *pData, int *nLength);
+        int GetCount(void);
+};
+
+
+#endif
+
@@ -39,6 +39,8 @@
 #include "client.h"
 #include "config.h"
 #include "logger.h"
+#include "metrics.h"
+#include "trace.h"
 
 
 //-----------------------------------------------------------------------------
@@ -55,9 +57,8 @@ int Client::_nNextClientID = 1;
 Client::Client()
 {
 	Lock();
-    _szQuery  = NULL;
-    _nChunk   = 0;
-    _nLength  = 0;
+    _Streams.pList  = NULL;
+    _Streams.nCount = 0;
     _nVersion = 0;
     _nClientID = _nNextClientID++;
     if (_nNextClientID > 999999) _nNextClientID = 1;
@@ -66,13 +67,21 @@ Client::Client()
 
 
 //-----------------------------------------------------------------------------
-// CJW: Deconstructor.  Clean up everything we created.  
+// CJW: Deconstructor.  Clean up everything we created.  The server should 
+//      have stopped all our queries with the network before deleting us.
 Client::~Client()
 {
 	Unlock();
-    if (_szQuery != NULL) {
-        free(_szQuery);
-        _szQuery = NULL;
+    while (_Streams.nCount > 0) {
+        _Streams.nCount--;
+        if (_Streams.pList[_Streams.nCount] != NULL) {
+            delete _Streams.pList[_Streams.nCount];
+            _Streams.pList[_Streams.nCount] = NULL;
+        }
+    }
+    if (_Streams.pList != NULL) {
+        free(_Streams.pList);
+        _Streams.pList = NULL;
     }
    	Lock();
 }
@@ -102,8 +111,6 @@ void Client::OnIdle(void)
 //      much data in our outgoing dataqueue that we can.  If we cant send it
 //      all right now, we can send it the next time this function is called.
 //
-//      If
-//
 //      Since the Server object is processing each client in the list, we want
 //      this function to finish as quickly as possible, so we will only process
 //      one data command at a time.  If there are more than one telegram ready
@@ -132,7 +139,10 @@ int Client::OnReceive(char *pData, int nLength)
 			break;
 
 		case 'F':       // File Request.
-			if (nLength >= 3) {
+			if (_nVersion >= 3) {
+				nProcessed = ProcessStreamRequest(pData, nLength);
+			}
+			else if (nLength >= 3) {
 				nTmp = ProcessFileRequest(pData, nLength);
 				ASSERT(nTmp >= 0);
 				if (nTmp > 0) {
@@ -142,6 +152,18 @@ int Client::OnReceive(char *pData, int nLength)
 			}
 			break;
 
+		case 'W':       // Window update (version 3).
+			nProcessed = ProcessWindow(pData, nLength);
+			break;
+
+		case 'E':       // End of stream (version 3).
+			nProcessed = ProcessStreamEnd(pData, nLength);
+			break;
+
+		case 'U':       // Url of the file for a stream (version 3).
+			nProcessed = ProcessStreamUrl(pData, nLength);
+			break;
+
 		case 'R':       // Chunk received.
 			// We dont really care about this one, but must remove it from the queue if we get it.  Currently the client is not programmed to send this.
 			if (nLength >= 3) {
@@ -162,74 +184,443 @@ int Client::OnReceive(char *pData, int nLength)
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: Return the number of slots in our stream list.  Some of them might be 
+//      empty.  The server will go thru each slot to process the streams.
+int Client::GetStreamSlots(void)
+{
+    int nCount;
+    
+    Lock();
+    nCount = _Streams.nCount;
+    Unlock();
+    
+    return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Fill in a copy of each stream that is open, up to nMax of them.  
+//      Returns the number filled in.
+int Client::GetStreamStats(strStreamStats *pList, int nMax)
+{
+    strStream *pStream;
+    int nCount = 0;
+    int i;
+    
+    ASSERT(pList != NULL && nMax >= 0);
+    
+    Lock();
+    for (i=0; i<_Streams.nCount && nCount < nMax; i++) {
+        pStream = _Streams.pList[i];
+        if (pStream != NULL && pStream->szQuery != NULL && pStream->bEnded == false) {
+            pList[nCount].nClient = _nClientID;
+            pList[nCount].nStream = pStream->nStream;
+            strncpy(pList[nCount].szQuery, pStream->szQuery, 255);
+            pList[nCount].szQuery[255] = '\0';
+            pList[nCount].nChunk = pStream->nChunk;
+            pList[nCount].nChunks = pStream->sent.nChunks;
+            pList[nCount].nSent = pStream->sent.nSent;
+            pList[nCount].nLast = pStream->nLast > 0 ? pStream->nLast : pStream->nStart;
+            nCount++;
+        }
+    }
+    Unlock();
+    
+    return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the client has asked for a file in this slot that the 
+//      network hasnt been told about yet.  This will only return true once 
+//      for each stream, and the server must tell the network to stop the 
+//      query (QueryStop or QueryFinished) when we are done with it.  The 
+//      string is still owned by the client.
+bool Client::QueryStart(int n, char **szQuery)
+{
+    bool bStart = false;
+    strStream *pStream;
+    
+    ASSERT(n >= 0 && szQuery != NULL);
+    
+    Lock();
+    if (n < _Streams.nCount) {
+        pStream = _Streams.pList[n];
+        if (pStream != NULL) {
+            ASSERT(pStream->szQuery != NULL);
+            if (pStream->bStarted == false && pStream->bEnded == false) {
+                *szQuery = pStream->szQuery;
+                pStream->bStarted = true;
+                bStart = true;
+            }
+        }
+    }
+    Unlock();
+    
+    return(bStart);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the network was told about the query in this slot, so 
+//      that the server can tell the network that we are finished with it.  
+//      This is used when the client is going away.
+bool Client::QueryStop(int n, char **szQuery)
+{
+    bool bStop = false;
+    strStream *pStream;
+    
+    ASSERT(n >= 0 && szQuery != NULL);
+    
+    Lock();
+    if (n < _Streams.nCount) {
+        pStream = _Streams.pList[n];
+        if (pStream != NULL) {
+            if (pStream->bStarted == true) {
+                ASSERT(pStream->szQuery != NULL);
+                *szQuery = pStream->szQuery;
+                pStream->bStarted = false;
+                bStop = true;
+            }
+        }
+    }
+    Unlock();
+    
+    return(bStop);
+}
+
 
 //-----------------------------------------------------------------------------
-// CJW: Return a true if this client has a pending query.   We will put the 
-//      string in the query parameter.  The calling routine which will be
-//      responsible for freeing the memory.
-bool Client::QueryData(char **query, int *nChunk)
+// CJW: Return true if the stream in this slot is finished with, either 
+//      because the client ended it, or because all of the file has been 
+//      sent.  If the network was told about it, the server needs to tell the 
+//      network it is finished, and then call QueryRelease().  If the network 
+//      was never told about it, we just remove it.
+bool Client::QueryFinished(int n, char **szQuery)
 {
-    bool bResult = false;
+    bool bFinished = false;
+    strStream *pStream;
+    
+    ASSERT(n >= 0 && szQuery != NULL);
     
+    Lock();
+    if (n < _Streams.nCount) {
+        pStream = _Streams.pList[n];
+        if (pStream != NULL) {
+            if (pStream->bEnded == true || (pStream->sent.pList != NULL && pStream->sent.nSent == pStream->sent.nChunks)) {
+                if (pStream->bStarted == true) {
+                    *szQuery = pStream->szQuery;
+                    pStream->bStarted = false;
+                    bFinished = true;
+                }
+                else if (pStream->bEnded == true && _nVersion >= 3) {
+                    delete pStream;
+                    _Streams.pList[n] = NULL;
+                }
+            }
+        }
+    }
+    Unlock();
+    
+    return(bFinished);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The server has told the network that the stream is finished, so we can 
+//      remove it.  An older client only ever has the one stream, so we keep 
+//      it (marked as ended) so that we know the client has already asked for 
+//      its file.
+void Client::QueryRelease(int n)
+{
+    Lock();
+    ASSERT(n >= 0 && n < _Streams.nCount);
+    ASSERT(_Streams.pList[n] != NULL);
+    ASSERT(_Streams.pList[n]->bStarted == false);
+    if (_nVersion >= 3) {
+        delete _Streams.pList[n];
+        _Streams.pList[n] = NULL;
+    }
+    else {
+        _Streams.pList[n]->bEnded = true;
+    }
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the client has told us the url for the file in this 
+//      slot, and the network hasnt been told about it yet.  This will only 
+//      return true once for each stream, and only after QueryStart().  The 
+//      strings are still owned by the client.
+bool Client::QueryMirror(int n, char **szQuery, char **szUrl)
+{
+    bool bMirror = false;
+    strStream *pStream;
+    
+    ASSERT(n >= 0 && szQuery != NULL && szUrl != NULL);
+    
+    Lock();
+    if (n < _Streams.nCount) {
+        pStream = _Streams.pList[n];
+        if (pStream != NULL) {
+            if (pStream->bStarted == true && pStream->szUrl != NULL && pStream->bUrlSent == false) {
+                *szQuery = pStream->szQuery;
+                *szUrl = pStream->szUrl;
+                pStream->bUrlSent = true;
+                bMirror = true;
+            }
+        }
+    }
+    Unlock();
+    
+    return(bMirror);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If the stream in this slot has a pending query, we return the number 
+//      of chunks that it is waiting for, and put them in pChunks (up to nMax 
+//      of them).  We will put the string in the query parameter, but the 
+//      client still owns it.  A version 1 client can only take the next 
+//      chunk in order.  Other clients can take any chunk, so we give it a 
+//      window of the chunks that havent been sent yet.  Until we know how 
+//      big the file is, we can only ask for the first one.  A version 3 
+//      client also limits how many chunks we can send it with its credit.
+int Client::QueryData(int n, char **query, int *pChunks, int nMax)
+{
+    int nCount = 0;
+    strStream *pStream = NULL;
+    int i;
+    
+    ASSERT(n >= 0);
     ASSERT(query != NULL);
     ASSERT(*query == NULL);
-    ASSERT(nChunk != NULL);
+    ASSERT(pChunks != NULL && nMax > 0);
     
     Lock();
     
-    ASSERT((_szQuery == NULL && _nChunk == 0) || (_szQuery != NULL && _nChunk >= 0));
+    if (n < _Streams.nCount) {
+        pStream = _Streams.pList[n];
+    }
     
-    if (_szQuery != NULL) {
-        *query = _szQuery;
-        *nChunk = _nChunk;
-        bResult = true;
+    if (pStream != NULL && pStream->bStarted == true) {
+        ASSERT(pStream->szQuery != NULL && pStream->nChunk >= 0);
+        *query = pStream->szQuery;
+        
+        if (pStream->nCredit >= 0 && pStream->nCredit < nMax) {
+            nMax = pStream->nCredit;
+        }
+        
+        if (nMax == 0) {
+            // the client doesnt want any more until it has caught up.
+        }
+        else if (pStream->sent.pList != NULL && pStream->nChunk >= pStream->sent.nChunks) {
+            // everything has been sent.
+            ASSERT(pStream->sent.nSent == pStream->sent.nChunks);
+        }
+        else if (_nVersion < 2 || pStream->sent.pList == NULL) {
+            pChunks[0] = pStream->nChunk;
+            nCount = 1;
+        }
+        else {
+            for (i=pStream->nChunk; i<pStream->sent.nChunks && nCount < nMax; i++) {
+                if (pStream->sent.pList[i] == 0) {
+                    pChunks[nCount] = i;
+                    nCount++;
+                }
+            }
+        }
     }
     
     Unlock();
     
-    return(bResult);
+    return(nCount);
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: The network has searched for the file and nobody has it.  A version 3 
+//      client is told straight away so that it can get the file from the 
+//      mirror instead of waiting for its timeout.  Older clients dont know 
+//      about this, so they will just have to wait.  The stream is finished 
+//      with either way once the server sees it has ended.  The client might 
+//      already know how big the file is (from the sync databases), since 
+//      that doesnt mean anyone has it.
+//
+//      <-- N<stream*2>
+void Client::QueryNotFound(int n)
+{
+    strStream *pStream;
+    unsigned char pTmp[3];
+    
+    ASSERT(n >= 0);
+    
+    Lock();
+    ASSERT(n < _Streams.nCount);
+    pStream = _Streams.pList[n];
+    ASSERT(pStream != NULL);
+    if (_nVersion >= 3 && pStream->bEnded == false) {
+        pTmp[0] = 'N';
+        pTmp[1] = (unsigned char) ((pStream->nStream >> 8) & 0xff);
+        pTmp[2] = (unsigned char) (pStream->nStream & 0xff);
+        Send((char *)pTmp, 3);
+        pStream->bEnded = true;
+    }
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The network knows how big the file is, even though it might not have 
+//      any chunks for us yet.  We tell the client straight away, and we can 
+//      now ask for more than one chunk at a time.
+void Client::QueryLength(int n, int nLength)
+{
+    strStream *pStream;
+    
+    ASSERT(n >= 0 && nLength > 0);
+    
+    Lock();
+    ASSERT(n < _Streams.nCount);
+    pStream = _Streams.pList[n];
+    ASSERT(pStream != NULL);
+    if (pStream->nLength == 0) {
+        SendLength(pStream, nLength);
+    }
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Send the 'L' telegram to the client with the length of the file, and 
+//      setup the list of chunks that have been sent.  We assume that the 
+//      object is already locked.
+//
+//      <-- L<length*4>                 (version 1 and 2)
+//      <-- L<stream*2><length*4>       (version 3)
+void Client::SendLength(strStream *pStream, int nLength)
+{
+    unsigned char pTmp[7];
+    int i = 0;
+    
+    ASSERT(pStream != NULL);
+    ASSERT(nLength > 0);
+    ASSERT(pStream->nLength == 0);
+    ASSERT(pStream->sent.pList == NULL);
+    
+    pStream->nLength = nLength;
+
+    pTmp[i++] = 'L';
+    if (_nVersion >= 3) {
+        pTmp[i++] = (unsigned char) ((pStream->nStream >> 8) & 0xff);
+        pTmp[i++] = (unsigned char) (pStream->nStream & 0xff);
+    }
+    pTmp[i++] = (unsigned char) ((nLength >> 24) & 0xff);
+    pTmp[i++] = (unsigned char) ((nLength >> 16) & 0xff);
+    pTmp[i++] = (unsigned char) ((nLength >> 8) & 0xff);
+    pTmp[i++] = (unsigned char) (nLength & 0xff);
+    Send((char *)pTmp, i);
+    
+    pStream->sent.nChunks = (nLength + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE;
+    pStream->sent.pList = (char *) calloc(pStream->sent.nChunks, sizeof(char));
+    ASSERT(pStream->sent.pList != NULL);
+    pStream->sent.nSent = 0;
+}
+
 
 //-----------------------------------------------------------------------------
 // CJW: We have received some data for the file we are looking for, and we need
 //      to send that down to the client.   We dont care if this is the last
-//      chunk or not, because the client will disconnect when it has all the
-//      chunks it needs.
-void Client::QueryResult(int nChunk, char *pData, int nSize, int nLength)
+//      chunk or not, because the client will disconnect (or end the stream) 
+//      when it has all the chunks it needs.
+//
+//      <-- C<chunk*2><len*2><data>                     (version 1)
+//      <-- P<offset*4><len*2><data>                    (version 2)
+//      <-- P<stream*2><offset*4><len*2><data>          (version 3)
+void Client::QueryResult(int n, int nChunk, char *pData, int nSize, int nLength)
 {
-    unsigned char pTmp[5];
+    static strMetric *pFirst = Metrics::Histogram("pacsrv_client_first_chunk_ms", "Time from a client asking for a file to the first chunk being sent.");
+    static strMetric *pGap = Metrics::Histogram("pacsrv_client_chunk_gap_ms", "Time between chunks sent to a client for the same file.");
+    unsigned char pTmp[9];
+    strStream *pStream;
+    int nOffset;
+    long long nNow;
+    long long nTrace = 0;
+    int i = 0;
     
+    ASSERT(n >= 0);
     ASSERT(nChunk >= 0 && pData != NULL && nSize > 0 && nLength > 0);
     
+    if (Tracer::IsOn() == true) {
+        nTrace = Tracer::Now();
+    }
+    
     Lock();
-    ASSERT(_nChunk == nChunk);
+    ASSERT(n < _Streams.nCount);
+    pStream = _Streams.pList[n];
+    ASSERT(pStream != NULL);
 
     // if the stored length is 0, then we store the new length and send a 'L' telegram to the client.
-    if (_nLength == 0) {
-        _nLength = nLength;
-
-        // ** This would probably be better off being a arithmatic calculation rather than a bitwise calculation... to be portable.
-        pTmp[4] = (unsigned char) (nLength & 0xff);
-        pTmp[3] = (unsigned char) ((nLength >> 8) & 0xff);
-        pTmp[2] = (unsigned char) ((nLength >> 16) & 0xff);
-        pTmp[1] = (unsigned char) ((nLength >> 24) & 0xff);
-        pTmp[0] = 'L';
-        Send((char *)pTmp, 5);
-    }
-    
-    // send the chunk to the client.
-    pTmp[4] = (unsigned char) (nSize & 0xff);
-    pTmp[3] = (unsigned char) ((nSize >> 8) & 0xff);
-    pTmp[2] = (unsigned char) (nChunk & 0xff);
-    pTmp[1] = (unsigned char) ((nChunk >> 8) & 0xff);
-    pTmp[0] = 'C';
-    Send((char *)pTmp, 5);
+    if (pStream->nLength == 0) {
+        SendLength(pStream, nLength);
+    }
+    ASSERT(pStream->sent.pList != NULL);
+    ASSERT(nChunk < pStream->sent.nChunks);
+    ASSERT(pStream->sent.pList[nChunk] == 0);
+    
+    if (_nVersion < 2) {
+        // send the chunk to the client.
+        ASSERT(pStream->nChunk == nChunk);
+        pTmp[i++] = 'C';
+        pTmp[i++] = (unsigned char) ((nChunk >> 8) & 0xff);
+        pTmp[i++] = (unsigned char) (nChunk & 0xff);
+    }
+    else {
+        // send the chunk with the offset in the file that it belongs at, so 
+        // that the client can write it straight there.
+        nOffset = nChunk * MAX_CHUNK_SIZE;
+        pTmp[i++] = 'P';
+        if (_nVersion >= 3) {
+            pTmp[i++] = (unsigned char) ((pStream->nStream >> 8) & 0xff);
+            pTmp[i++] = (unsigned char) (pStream->nStream & 0xff);
+        }
+        pTmp[i++] = (unsigned char) ((nOffset >> 24) & 0xff);
+        pTmp[i++] = (unsigned char) ((nOffset >> 16) & 0xff);
+        pTmp[i++] = (unsigned char) ((nOffset >> 8) & 0xff);
+        pTmp[i++] = (unsigned char) (nOffset & 0xff);
+    }
+    pTmp[i++] = (unsigned char) ((nSize >> 8) & 0xff);
+    pTmp[i++] = (unsigned char) (nSize & 0xff);
+    Send((char *)pTmp, i);
     Send(pData, nSize);
+    
+    nNow = GetTimeMs();
+    if (pStream->sent.nSent == 0) {
+        Metrics::Record(pFirst, nNow - pStream->nStart);
+    }
+    else {
+        Metrics::Record(pGap, nNow - pStream->nLast);
+    }
+    pStream->nLast = nNow;
+    
+    pStream->sent.pList[nChunk] = 1;
+    pStream->sent.nSent++;
+    if (pStream->nCredit > 0) {
+        pStream->nCredit--;
+    }
 
-    // increment the chunk counter.
-    _nChunk++;
+    // move the chunk counter past all the chunks that have been sent.
+    while (pStream->nChunk < pStream->sent.nChunks && pStream->sent.pList[pStream->nChunk] != 0) {
+        pStream->nChunk++;
+    }
+    
+    // the chunks are numbered from 1 everywhere else.
+    if (nTrace > 0) {
+        ASSERT(pStream->szQuery != NULL);
+        Tracer::Span(Tracer::FileTrack(pStream->szQuery), "QueryResult", nTrace, NULL, "chunk", nChunk + 1);
+    }
     
     Unlock();
 }
@@ -245,16 +636,17 @@ void Client::ProcessInit(char *pData, int nLength)
     ASSERT(pData != NULL && nLength >= 3);
     ASSERT(pData[0] == 'I');
     
-    if (_szQuery != NULL || _nChunk != 0 || _nLength != 0 || _nVersion != 0) {
+    if (_Streams.nCount != 0 || _nVersion != 0) {
         Send("Q", 1);
     }
     else {
     
-		_nVersion = (pData[1] << 8) | pData[2];
+		_nVersion = (((unsigned char) pData[1]) << 8) | ((unsigned char) pData[2]);
 		printf("INIT - Version %d\n", _nVersion);
 
-		// right now we only know how to handle protocol version 1.
-		if (_nVersion != 1) {
+		// we can handle version 1 (chunks in order), version 2 (chunks 
+		// with offsets, in any order) and version 3 (many files at once).
+		if (_nVersion < 1 || _nVersion > CLIENT_PROTOCOL_VER) {
 			Send("Q", 1);
 		}
 		else {
@@ -265,18 +657,95 @@ void Client::ProcessInit(char *pData, int nLength)
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: Add a new stream to our list.  We will try and re-use any vacant slots 
+//      in the list, otherwise it is added to the end.  We take control of 
+//      the query string.
+strStream * Client::AddStream(int nStream, char *szQuery)
+{
+    strStream *pStream;
+    bool bDone = false;
+    int i;
+    
+    ASSERT(nStream >= 0 && szQuery != NULL);
+    
+    pStream = new strStream;
+    pStream->nStream = nStream;
+    pStream->szQuery = szQuery;
+    if (_nVersion >= 3) {
+        pStream->nCredit = CLIENT_WINDOW;
+    }
+    
+    for (i=0; i<_Streams.nCount && bDone == false; i++) {
+        if (_Streams.pList[i] == NULL) {
+            _Streams.pList[i] = pStream;
+            bDone = true;
+        }
+    }
+    
+    if (bDone == false) {
+        _Streams.pList = (strStream **) realloc(_Streams.pList, sizeof(strStream *) * (_Streams.nCount + 1));
+        ASSERT(_Streams.pList != NULL);
+        _Streams.pList[_Streams.nCount] = pStream;
+        _Streams.nCount++;
+    }
+    
+    return(pStream);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Find the stream with this id.  Returns NULL if we dont have it.
+strStream * Client::FindStream(int nStream)
+{
+    strStream *pStream = NULL;
+    int i;
+    
+    for (i=0; i<_Streams.nCount && pStream == NULL; i++) {
+        if (_Streams.pList[i] != NULL) {
+            if (_Streams.pList[i]->nStream == nStream) {
+                pStream = _Streams.pList[i];
+            }
+        }
+    }
+    
+    return(pStream);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the client has asked for any files.
+bool Client::HasQuery(void)
+{
+    bool bQuery = false;
+    int i;
+    
+    for (i=0; i<_Streams.nCount && bQuery == false; i++) {
+        if (_Streams.pList[i] != NULL) {
+            bQuery = true;
+        }
+    }
+    
+    return(bQuery);
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: The client has requested a particular file.  We need to get that 
 //      information and store it so that the Server object can then ask us for
-//      it, so that it can be passed on the network of nodes.
+//      it, so that it can be passed on the network of nodes.  Version 1 and 2 
+//      clients can only ask for one file.
+//
+//      --> F<flen><file*flen>
 int Client::ProcessFileRequest(char *pData, int nLength)
 {   
     unsigned char nFileLength = 0;
+    char *szQuery;
 
     ASSERT(pData != NULL && nLength >= 0);
     
     // All the existing data needs to be in a particular state or the
-    if (_szQuery != NULL || _nChunk != 0 || _nLength != 0 || _nVersion == 0) {
+    if (_Streams.nCount != 0 || _nVersion == 0) {
         Send("Q", 1);
     }
     else {
@@ -292,16 +761,19 @@ int Client::ProcessFileRequest(char *pData, int nLength)
 
 			// If we dont have enough data yet, then put the data back that we already have, and then try again during the next loop.
 			if (nLength >= nFileLength+2) {
-				ASSERT(_szQuery == NULL);
-				_szQuery = (char *) malloc(nFileLength + 1);
-				ASSERT(_szQuery);
+				szQuery = (char *) malloc(nFileLength + 1);
+				ASSERT(szQuery);
 
-				strncpy(_szQuery, (const char *) &pData[2], nFileLength);
-				_szQuery[nFileLength] = '\0';
+				strncpy(szQuery, (const char *) &pData[2], nFileLength);
+				szQuery[nFileLength] = '\0';
+				AddStream(0, szQuery);
 
 				// Since we got some data, we need to use it as a heartbeat indicator also.
 				_Heartbeat.Clear();
 			}
+			else {
+				nFileLength = 0;
+			}
 		}
     }
     
@@ -309,6 +781,170 @@ int Client::ProcessFileRequest(char *pData, int nLength)
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: A version 3 client is asking for a file on a new stream.  If it is 
+//      using a stream id that is already in use, or it has too many streams 
+//      already, then we refuse the stream with an 'X'.  Returns the number of 
+//      bytes processed, or 0 if we dont have it all yet.
+//
+//      --> F<stream*2><flen><file*flen>
+//      <-- X<stream*2>
+int Client::ProcessStreamRequest(char *pData, int nLength)
+{
+    int nProcessed = 0;
+    int nStream, nActive, i;
+    unsigned char nFileLength;
+    char *szQuery;
+    
+    ASSERT(pData != NULL && nLength > 0);
+    ASSERT(pData[0] == 'F');
+    ASSERT(_nVersion >= 3);
+    
+    if (nLength >= 4) {
+        nStream = (((unsigned char) pData[1]) << 8) | ((unsigned char) pData[2]);
+        nFileLength = (unsigned char) pData[3];
+        
+        if (nFileLength == 0) {
+            Send("Q", 1);
+            Close();
+            nProcessed = 4;
+        }
+        else if (nLength >= 4 + nFileLength) {
+            nProcessed = 4 + nFileLength;
+            
+            nActive = 0;
+            for (i=0; i<_Streams.nCount; i++) {
+                if (_Streams.pList[i] != NULL) { nActive++; }
+            }
+            
+            if (FindStream(nStream) != NULL || nActive >= CLIENT_MAX_STREAMS) {
+                Send("X", 1);
+                Send(&pData[1], 2);
+            }
+            else {
+                szQuery = (char *) malloc(nFileLength + 1);
+                ASSERT(szQuery);
+                strncpy(szQuery, (const char *) &pData[4], nFileLength);
+                szQuery[nFileLength] = '\0';
+                AddStream(nStream, szQuery);
+            }
+            
+            _Heartbeat.Clear();
+        }
+    }
+    
+    return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A version 3 client has written some of the chunks we sent it, so it 
+//      is giving us more credit for that stream.  We will not send more 
+//      chunks for a stream than the client has given us credit for, so that 
+//      one big file doesnt fill up the connection while the client is 
+//      waiting for the small ones.
+//
+//      --> W<stream*2><credit*2>
+int Client::ProcessWindow(char *pData, int nLength)
+{
+    int nProcessed = 0;
+    int nStream;
+    strStream *pStream;
+    
+    ASSERT(pData != NULL && nLength > 0);
+    ASSERT(pData[0] == 'W');
+    
+    if (_nVersion < 3) {
+        Close();
+    }
+    else if (nLength >= 5) {
+        nStream = (((unsigned char) pData[1]) << 8) | ((unsigned char) pData[2]);
+        pStream = FindStream(nStream);
+        if (pStream != NULL) {
+            ASSERT(pStream->nCredit >= 0);
+            pStream->nCredit += (((unsigned char) pData[3]) << 8) | ((unsigned char) pData[4]);
+        }
+        _Heartbeat.Clear();
+        nProcessed = 5;
+    }
+    
+    return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A version 3 client is telling us the url that it would get the file 
+//      for this stream from, if we couldnt give it to them.  The network will 
+//      get parts of the file from there while it searches the nodes.  It is 
+//      sent straight after the 'F'.
+//
+//      --> U<stream*2><ulen*2><url*ulen>
+int Client::ProcessStreamUrl(char *pData, int nLength)
+{
+    int nProcessed = 0;
+    int nStream, nUrlLength;
+    strStream *pStream;
+    
+    ASSERT(pData != NULL && nLength > 0);
+    ASSERT(pData[0] == 'U');
+    
+    if (_nVersion < 3) {
+        Close();
+    }
+    else if (nLength >= 5) {
+        nStream = (((unsigned char) pData[1]) << 8) | ((unsigned char) pData[2]);
+        nUrlLength = (((unsigned char) pData[3]) << 8) | ((unsigned char) pData[4]);
+        
+        if (nLength >= 5 + nUrlLength) {
+            nProcessed = 5 + nUrlLength;
+            
+            pStream = FindStream(nStream);
+            if (pStream != NULL && pStream->szUrl == NULL && nUrlLength > 0) {
+                pStream->szUrl = (char *) malloc(nUrlLength + 1);
+                ASSERT(pStream->szUrl != NULL);
+                strncpy(pStream->szUrl, &pData[5], nUrlLength);
+                pStream->szUrl[nUrlLength] = '\0';
+            }
+            _Heartbeat.Clear();
+        }
+    }
+    
+    return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A version 3 client doesnt want a stream anymore.  It either has the 
+//      whole file, or it has given up on it.  The server will tell the 
+//      network that we are finished with the file.
+//
+//      --> E<stream*2>
+int Client::ProcessStreamEnd(char *pData, int nLength)
+{
+    int nProcessed = 0;
+    int nStream;
+    strStream *pStream;
+    
+    ASSERT(pData != NULL && nLength > 0);
+    ASSERT(pData[0] == 'E');
+    
+    if (_nVersion < 3) {
+        Close();
+    }
+    else if (nLength >= 3) {
+        nStream = (((unsigned char) pData[1]) << 8) | ((unsigned char) pData[2]);
+        pStream = FindStream(nStream);
+        if (pStream != NULL) {
+            pStream->bEnded = true;
+        }
+        _Heartbeat.Clear();
+        nProcessed = 3;
+    }
+    
+    return(nProcessed);
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: Since we dont really care that the client received the chunk, we just 
 //      assume that it did, we will just remove this message from the data
@@ -341,7 +977,7 @@ bool Client::ProcessHeartbeat(void)
     if (nTime > _Heartbeat.nLastCheck) {
         _Heartbeat.nDelay++;
     
-        if (_szQuery == NULL) {
+        if (HasQuery() == false) {
             _Heartbeat.nWait++;
         }
     
@@ -362,6 +998,8 @@ bool Client::ProcessHeartbeat(void)
                 }
             }
         }
+        
+        _Heartbeat.nLastCheck = nTime;
     }
 
     return(bOK);
@@ -41,18 +41,91 @@
 #ifndef __CLIENT_H
 #define __CLIENT_H
 
+#include <stdlib.h>
+
 #include "common.h"
 #include "baseclient.h"
 
+//-----------------------------------------------------------------------------
+// Each file that the client is getting from us is a stream.  Version 1 and 2 
+// clients only have one stream, version 3 clients can have many over the 
+// same connection, and they give each one an id.
+struct strStream {
+	int nStream;		// id given by the client.  Always 0 for older clients.
+	char *szQuery;
+	char *szUrl;		// where the client would get the file from otherwise.
+	bool bUrlSent;		// network has been told about the url.
+	int nChunk;			// lowest chunk that hasnt been sent yet.
+	int nLength;
+	int nCredit;		// number of chunks the client will accept.  -1 for no limit.
+	bool bStarted;		// network has been told about the query.
+	bool bEnded;		// client doesnt want it anymore.
+	long long nStart;	// when the stream was opened (ms).
+	long long nLast;	// when we last sent the client a chunk (ms).
+	
+	// the chunks can be sent out of order, so we need to keep track of 
+	// which ones have been sent.
+	struct {
+		char *pList;
+		int nChunks;
+		int nSent;
+	} sent;
+	
+	strStream() {
+		nStream = 0;
+		szQuery = NULL;
+		szUrl = NULL;
+		bUrlSent = false;
+		nChunk = 0;
+		nLength = 0;
+		nCredit = -1;
+		bStarted = false;
+		bEnded = false;
+		nStart = GetTimeMs();
+		nLast = 0;
+		sent.pList = NULL;
+		sent.nChunks = 0;
+		sent.nSent = 0;
+	}
+	
+	~strStream() {
+		ASSERT(bStarted == false);
+		if (szQuery != NULL) { free(szQuery); szQuery = NULL; }
+		if (szUrl != NULL) { free(szUrl); szUrl = NULL; }
+		if (sent.pList != NULL) { free(sent.pList); sent.pList = NULL; }
+	}
+};
+
+
+// A copy of what one of a client's streams is doing, for pacsrvtop.
+struct strStreamStats {
+	int nClient;
+	int nStream;
+	char szQuery[256];
+	int nChunk;			// lowest chunk that hasnt been sent.
+	int nChunks;		// 0 if we dont know the length yet.
+	int nSent;
+	long long nLast;	// when we last sent a chunk (ms), or when the stream started.
+};
+
+
 class Client : public BaseClient
 {
     public:
         Client();
         virtual ~Client();
     
-//         bool Process(bool bCheck=false);
-        bool QueryData(char **szQuery, int *nChunk);
-        void QueryResult(int nChunk, char *pData, int nSize, int nLength);
+        int  GetStreamSlots(void);
+        int  GetStreamStats(strStreamStats *pList, int nMax);
+        bool QueryStart(int n, char **szQuery);
+        bool QueryStop(int n, char **szQuery);
+        bool QueryFinished(int n, char **szQuery);
+        void QueryRelease(int n);
+        bool QueryMirror(int n, char **szQuery, char **szUrl);
+        int  QueryData(int n, char **szQuery, int *pChunks, int nMax);
+        void QueryLength(int n, int nLength);
+        void QueryResult(int n, int nChunk, char *pData, int nSize, int nLength);
+        void QueryNotFound(int n);
     
     protected:
     
@@ -67,10 +140,19 @@ class Client : public BaseClient
         bool ProcessHeartbeat(void);
         void ProcessChunkReceived(char *pData, int nLength);
         int ProcessFileRequest(char *pData, int nLength);
+        int ProcessStreamRequest(char *pData, int nLength);
+        int ProcessWindow(char *pData, int nLength);
+        int ProcessStreamEnd(char *pData, int nLength);
+        int ProcessStreamUrl(char *pData, int nLength);
+        void SendLength(strStream *pStream, int nLength);
+        strStream * AddStream(int nStream, char *szQuery);
+        strStream * FindStream(int nStream);
+        bool HasQuery(void);
     
-        char *_szQuery;
-        int   _nChunk;
-        int   _nLength;
+        struct {
+        	strStream **pList;
+        	int nCount;
+        } _Streams;
     
         struct strHeartbeat _Heartbeat;
         unsigned _nVersion;        // protocol version.
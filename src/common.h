@@ -35,11 +35,27 @@
 #define __COMMON_H
 
 #include <time.h>
+#include <sys/time.h>
 
 #define PKG_PATH	"/var/cache/pacman/pkg"
 
 #define MAX_CHUNK_SIZE	32767
 
+//-----------------------------------------------------------------------------
+// Version of the protocol between the client and the daemon.  Version 1 
+// sends the chunks in order with 'C'.  Version 2 sends them in any order with 
+// 'P', which includes the offset in the file.  Version 3 can get many files 
+// over the one connection, each telegram has a stream id.
+#define CLIENT_PROTOCOL_VER	3
+
+// Number of chunks that we will try to have on the way to a client at once 
+// for each file.  For version 3 clients, this is also the credit that each 
+// stream starts with.
+#define CLIENT_WINDOW		16
+
+// Maximum number of files a version 3 client can be getting at once.
+#define CLIENT_MAX_STREAMS	64
+
 #define HEARTBEAT_DELAY     5
 #define HEARTBEAT_MISS      3
 
@@ -47,6 +63,32 @@
 #define INI_FILE "/etc/pacsrv.conf"
 #endif
 
+#ifndef PEER_FILE
+#define PEER_FILE "/var/cache/pacsrv/peers"
+#endif
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the current time in milliseconds.  time() only gives us one 
+// 		second resolution, which is not good enough when we want to measure 
+// 		how quickly chunks are being transferred.
+static inline long long GetTimeMs(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return(((long long) tv.tv_sec * 1000) + (tv.tv_usec / 1000));
+}
+
+//-----------------------------------------------------------------------------
+// CJW: Same as above, in microseconds, for timing things that are usually 
+// 		quicker than a millisecond.
+static inline long long GetTimeUs(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return(((long long) tv.tv_sec * 1000000) + tv.tv_usec);
+}
+
 
 struct strHeartbeat 
 {
@@ -30,13 +30,20 @@
  ***************************************************************************/
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "config.h"
 
 DpLock Config::_lock;
-DpIniFile *Config::_pIniFile = NULL;
+char *Config::_szFile = NULL;
+strConfigSnapshot * volatile Config::_pSnapshot = NULL;
+volatile int Config::_nReload = 0;
 ServerEntry *Config::_pServers = NULL; 
 int Config::_nServers = 0;
 
@@ -60,30 +67,92 @@ Config::~Config()
 }
 
 //---------------------------------------------------------------------------
+// CJW: Load the config file and publish it as the first snapshot.  If the 
+//		file cant be read we still publish an empty one, so that everything 
+//		will just use its defaults.
 bool Config::Load(char *szFile)
 {
-	bool result;
+	bool result = false;
+	strConfigSnapshot *pSnapshot;
 	
     ASSERT(szFile != NULL);
     
     Lock();
-    ASSERT(_pIniFile == NULL);
-    _pIniFile = new DpIniFile;
-    ASSERT(_pIniFile != NULL);
-    result = _pIniFile->Load(szFile);
+    ASSERT(_pSnapshot == NULL);
+    ASSERT(_szFile == NULL);
+    _szFile = strdup(szFile);
+    ASSERT(_szFile != NULL);
+    
+    pSnapshot = Parse(_szFile);
+    if (pSnapshot != NULL) {
+    	result = true;
+    }
+    else {
+		pSnapshot = (strConfigSnapshot *) malloc(sizeof(strConfigSnapshot));
+		ASSERT(pSnapshot != NULL);
+		pSnapshot->pEntries = NULL;
+		pSnapshot->nEntries = 0;
+		pSnapshot->pRetired = NULL;
+    }
+    pSnapshot->nGeneration = 1;
+    
+    __sync_synchronize();
+    _pSnapshot = pSnapshot;
     Unlock();
 	
 	return(result);
 }
 
+
+//---------------------------------------------------------------------------
+// CJW: Read the config file again and swap in the new snapshot.  Anything 
+//		that has already read a value will keep it until it looks again, and 
+//		GetGeneration() is how it can tell that it should.  If the file cant 
+//		be read, the old snapshot is left where it is.
+bool Config::Reload(void)
+{
+	bool result = false;
+	strConfigSnapshot *pSnapshot;
+	
+	Lock();
+	ASSERT(_szFile != NULL);
+	ASSERT(_pSnapshot != NULL);
+	
+	pSnapshot = Parse(_szFile);
+	if (pSnapshot != NULL) {
+		pSnapshot->nGeneration = _pSnapshot->nGeneration + 1;
+		pSnapshot->pRetired = _pSnapshot;
+		
+		// the snapshot has to be completely written before anyone can see it.
+		__sync_synchronize();
+		_pSnapshot = pSnapshot;
+		result = true;
+	}
+	Unlock();
+	
+	return(result);
+}
+
+
 //---------------------------------------------------------------------------
 void Config::Release(void)
 {
-    Lock();
-    ASSERT(_pIniFile != NULL);
-    delete _pIniFile;
-    _pIniFile = NULL;
+	strConfigSnapshot *pSnapshot;
 	
+    Lock();
+    ASSERT(_pSnapshot != NULL);
+    
+    // by now the threads that read the config have stopped, so all the 
+    // snapshots can go.
+    while (_pSnapshot != NULL) {
+    	pSnapshot = _pSnapshot;
+    	_pSnapshot = pSnapshot->pRetired;
+    	FreeSnapshot(pSnapshot);
+    }
+    
+    ASSERT(_szFile != NULL);
+    free(_szFile);
+    _szFile = NULL;
 	
 	ASSERT((_nServers == 0 && _pServers == NULL) || (_nServers > 0 && _pServers != NULL));
 	if (_pServers != NULL) {
@@ -97,44 +166,315 @@ void Config::Release(void)
 
 
 //---------------------------------------------------------------------------
+// CJW: Get the current snapshot without locking.  The pointer is only ever 
+//		set after the snapshot it points to is complete, and a snapshot is 
+//		never changed or freed while the daemon is running, so whatever we 
+//		get is safe to read.
+strConfigSnapshot *Config::GetSnapshot(void)
+{
+	strConfigSnapshot *pSnapshot;
+	
+	pSnapshot = _pSnapshot;
+	ASSERT(pSnapshot != NULL);
+	
+	return(pSnapshot);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Find a value in the snapshot.  There are only ever a few dozen, so 
+//		going through the list is fine.
+strConfigEntry *Config::Find(strConfigSnapshot *pSnapshot, char *grp, char *name)
+{
+	strConfigEntry *pEntry = NULL;
+	int i;
+	
+	ASSERT(pSnapshot != NULL);
+	ASSERT(grp != NULL);
+	ASSERT(name != NULL);
+	
+	for (i=0; i<pSnapshot->nEntries && pEntry == NULL; i++) {
+		if (strcmp(pSnapshot->pEntries[i].szName, name) == 0 && strcmp(pSnapshot->pEntries[i].szGroup, grp) == 0) {
+			pEntry = &pSnapshot->pEntries[i];
+		}
+	}
+	
+	return(pEntry);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: The value is returned in memory that the caller must free.
 bool Config::Get(char *grp, char *name, char **value)
 {
     bool result = false;
+    strConfigEntry *pEntry;
     
     ASSERT(grp != NULL);
     ASSERT(name != NULL);
     ASSERT(value != NULL);
 
-    Lock();
-    ASSERT(_pIniFile != NULL);
-    if (_pIniFile->SetGroup(grp) != false) {
-        result = _pIniFile->GetValue(name, value);
+    pEntry = Find(GetSnapshot(), grp, name);
+    if (pEntry != NULL) {
+    	*value = strdup(pEntry->szValue);
+    	ASSERT(*value != NULL);
+    	result = true;
     }
-    Unlock();
     
     return(result);
 }
 
 //---------------------------------------------------------------------------
+// CJW: Only values that are a whole number will be returned.
 bool Config::Get(char *grp, char *name, int *value)
 {
     bool result = false;
+    strConfigEntry *pEntry;
     
     ASSERT(grp != NULL);
     ASSERT(name != NULL);
     ASSERT(value != NULL);
 
-    Lock();
-    ASSERT(_pIniFile != NULL);
-    if (_pIniFile->SetGroup(grp) != false) {
-        result = _pIniFile->GetValue(name, value);
+    pEntry = Find(GetSnapshot(), grp, name);
+    if (pEntry != NULL && pEntry->bNumber == true) {
+    	*value = pEntry->nValue;
+    	result = true;
     }
-    Unlock();
     
     return(result);
 }
 
 
+//---------------------------------------------------------------------------
+// CJW: Check an address (host order) against the allow= and deny= lines of 
+//		a group.  If there is no allow line then everything is allowed, and 
+//		deny wins over allow.
+bool Config::IsAllowed(char *grp, unsigned int nAddr)
+{
+	bool result = true;
+	strConfigSnapshot *pSnapshot;
+	strConfigEntry *pEntry;
+	
+	ASSERT(grp != NULL);
+	
+	pSnapshot = GetSnapshot();
+	pEntry = Find(pSnapshot, grp, "allow");
+	if (pEntry != NULL) {
+		ASSERT(pEntry->pAcl != NULL);
+		result = IsInAcl(pEntry->pAcl, nAddr);
+	}
+	
+	if (result == true) {
+		pEntry = Find(pSnapshot, grp, "deny");
+		if (pEntry != NULL) {
+			ASSERT(pEntry->pAcl != NULL);
+			if (IsInAcl(pEntry->pAcl, nAddr) == true) {
+				result = false;
+			}
+		}
+	}
+	
+	return(result);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Each snapshot has a number, so that the things that have copied 
+//		values out of the config can tell when they need to look again.
+int Config::GetGeneration(void)
+{
+	return(GetSnapshot()->nGeneration);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Called from the SIGHUP handler, so all it can do is set a flag.  The 
+//		server picks it up and does the actual reload.
+void Config::RequestReload(void)
+{
+	_nReload = 1;
+}
+
+//---------------------------------------------------------------------------
+// CJW: Returns true once for each reload that was asked for.
+bool Config::IsReloadRequested(void)
+{
+	return(__sync_lock_test_and_set(&_nReload, 0) != 0);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Read the config file into a new snapshot.  It is a normal ini file, 
+//		with [group] headers, name=value lines, and comments that start with 
+//		# or ;.  Returns NULL if the file couldnt be opened.
+strConfigSnapshot *Config::Parse(char *szFile)
+{
+	strConfigSnapshot *pSnapshot = NULL;
+	strConfigEntry *pEntry;
+	FILE *fp;
+	char szLine[1024];
+	char *szGroup = NULL;
+	char *szStart, *szEnd, *szValue, *szStop;
+	
+	ASSERT(szFile != NULL);
+	
+	fp = fopen(szFile, "r");
+	if (fp != NULL) {
+		pSnapshot = (strConfigSnapshot *) malloc(sizeof(strConfigSnapshot));
+		ASSERT(pSnapshot != NULL);
+		pSnapshot->nGeneration = 0;
+		pSnapshot->pEntries = NULL;
+		pSnapshot->nEntries = 0;
+		pSnapshot->pRetired = NULL;
+		
+		while (fgets(szLine, sizeof(szLine), fp) != NULL) {
+			
+			// trim the whitespace off both ends.
+			szStart = szLine;
+			while (isspace(*szStart)) { szStart++; }
+			szEnd = szStart + strlen(szStart);
+			while (szEnd > szStart && isspace(szEnd[-1])) { szEnd--; }
+			*szEnd = '\0';
+			
+			if (szStart[0] == '\0' || szStart[0] == '#' || szStart[0] == ';') {
+				// blank lines and comments are skipped.
+			}
+			else if (szStart[0] == '[') {
+				szStart++;
+				if (szEnd > szStart && szEnd[-1] == ']') {
+					szEnd[-1] = '\0';
+				}
+				if (szGroup != NULL) {
+					free(szGroup);
+				}
+				szGroup = strdup(szStart);
+				ASSERT(szGroup != NULL);
+			}
+			else if (szGroup != NULL && (szValue = strchr(szStart, '=')) != NULL) {
+				szEnd = szValue;
+				while (szEnd > szStart && isspace(szEnd[-1])) { szEnd--; }
+				*szEnd = '\0';
+				szValue++;
+				while (isspace(*szValue)) { szValue++; }
+				
+				pSnapshot->pEntries = (strConfigEntry *) realloc(pSnapshot->pEntries, sizeof(strConfigEntry) * (pSnapshot->nEntries + 1));
+				ASSERT(pSnapshot->pEntries != NULL);
+				pEntry = &pSnapshot->pEntries[pSnapshot->nEntries];
+				pSnapshot->nEntries++;
+				
+				pEntry->szGroup = strdup(szGroup);
+				pEntry->szName = strdup(szStart);
+				pEntry->szValue = strdup(szValue);
+				ASSERT(pEntry->szGroup != NULL && pEntry->szName != NULL && pEntry->szValue != NULL);
+				
+				pEntry->nValue = (int) strtol(szValue, &szStop, 10);
+				pEntry->bNumber = (szValue[0] != '\0' && *szStop == '\0');
+				
+				pEntry->pAcl = NULL;
+				if (strcmp(pEntry->szName, "allow") == 0 || strcmp(pEntry->szName, "deny") == 0) {
+					pEntry->pAcl = (strAcl *) malloc(sizeof(strAcl));
+					ASSERT(pEntry->pAcl != NULL);
+					ParseAcl(pEntry->pAcl, pEntry->szValue);
+				}
+			}
+		}
+		
+		fclose(fp);
+		if (szGroup != NULL) {
+			free(szGroup);
+		}
+	}
+	
+	return(pSnapshot);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: An ACL is "all", "none", or a list of addresses and subnets 
+//		(192.168.1.0/24) seperated by commas or spaces.  Anything we cant 
+//		understand is skipped.
+void Config::ParseAcl(strAcl *pAcl, char *szValue)
+{
+	char *szList, *szItem, *szBits, *szNext;
+	struct in_addr addr;
+	int nBits;
+	
+	ASSERT(pAcl != NULL);
+	ASSERT(szValue != NULL);
+	
+	pAcl->bAll = false;
+	pAcl->nCount = 0;
+	
+	szList = strdup(szValue);
+	ASSERT(szList != NULL);
+	
+	szItem = strtok_r(szList, ", \t", &szNext);
+	while (szItem != NULL) {
+		if (strcmp(szItem, "all") == 0) {
+			pAcl->bAll = true;
+		}
+		else if (strcmp(szItem, "none") != 0 && pAcl->nCount < MAX_ACL_ENTRIES) {
+			nBits = 32;
+			szBits = strchr(szItem, '/');
+			if (szBits != NULL) {
+				*szBits = '\0';
+				nBits = atoi(szBits + 1);
+			}
+			if (nBits >= 0 && nBits <= 32 && inet_aton(szItem, &addr) != 0) {
+				pAcl->pMask[pAcl->nCount] = (nBits == 0) ? 0 : (0xffffffff << (32 - nBits));
+				pAcl->pAddr[pAcl->nCount] = ntohl(addr.s_addr) & pAcl->pMask[pAcl->nCount];
+				pAcl->nCount++;
+			}
+		}
+		szItem = strtok_r(NULL, ", \t", &szNext);
+	}
+	
+	free(szList);
+}
+
+
+//---------------------------------------------------------------------------
+bool Config::IsInAcl(strAcl *pAcl, unsigned int nAddr)
+{
+	bool result;
+	int i;
+	
+	ASSERT(pAcl != NULL);
+	
+	result = pAcl->bAll;
+	for (i=0; i<pAcl->nCount && result == false; i++) {
+		if ((nAddr & pAcl->pMask[i]) == pAcl->pAddr[i]) {
+			result = true;
+		}
+	}
+	
+	return(result);
+}
+
+
+//---------------------------------------------------------------------------
+void Config::FreeSnapshot(strConfigSnapshot *pSnapshot)
+{
+	int i;
+	
+	ASSERT(pSnapshot != NULL);
+	ASSERT((pSnapshot->pEntries == NULL && pSnapshot->nEntries == 0) || (pSnapshot->pEntries != NULL && pSnapshot->nEntries > 0));
+	
+	for (i=0; i<pSnapshot->nEntries; i++) {
+		free(pSnapshot->pEntries[i].szGroup);
+		free(pSnapshot->pEntries[i].szName);
+		free(pSnapshot->pEntries[i].szValue);
+		if (pSnapshot->pEntries[i].pAcl != NULL) {
+			free(pSnapshot->pEntries[i].pAcl);
+		}
+	}
+	if (pSnapshot->pEntries != NULL) {
+		free(pSnapshot->pEntries);
+	}
+	free(pSnapshot);
+}
+
+
 //---------------------------------------------------------------------------
 // CJW: We have some server information we want to add to the list of 
 //		servers.  At some point we can add functionality to clean up the list 
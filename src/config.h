@@ -9,6 +9,11 @@
 //		static member variables, so all you have to do is create an instance of 
 //		this object and you can access the config information.
 //
+//		The file is parsed once into a snapshot that is never changed after 
+//		it is published, so reading it doesnt need a lock.  A reload builds a 
+//		new snapshot and swaps the pointer.  The old ones are kept until 
+//		Release() since a reader in another thread could still be using them.
+//
 //-----------------------------------------------------------------------------
 
 /***************************************************************************
@@ -36,7 +41,6 @@
 #ifndef __CONFIG_H
 #define __CONFIG_H
 
-#include <DpIniFile.h>
 #include <DpLock.h>
 
 #define MAX_SERVER_LEN			15
@@ -50,6 +54,9 @@
 #define SERVER_STATUS_GONE		2
 #define SERVER_STATUS_DEAD		3
 
+// the most addresses (or subnets) an allow= or deny= line can have.
+#define MAX_ACL_ENTRIES		16
+
 
 //-----------------------------------------------------------------------------
 // When we send a file request over the network... this is the number of hops 
@@ -57,7 +64,9 @@
 // configurable value at some point.
 #define DEFAULT_TTL			15
 
-#define NODE_PROTOCOL_VER	1
+// Version 2 nodes can also take part in the DHT.  Version 1 nodes are still 
+// accepted, and we fall back to version 1 if the other node refuses us.
+#define NODE_PROTOCOL_VER	2
 
 
 
@@ -70,6 +79,37 @@ struct ServerEntry
 	int nStatus;
 };
 
+//-----------------------------------------------------------------------------
+// An allow= or deny= line, parsed into addresses and masks (host order).
+struct strAcl
+{
+	bool bAll;
+	int nCount;
+	unsigned int pAddr[MAX_ACL_ENTRIES];
+	unsigned int pMask[MAX_ACL_ENTRIES];
+};
+
+// one value from the file.  Numbers are converted when the file is loaded, 
+// and allow/deny lines are parsed into an ACL.
+struct strConfigEntry
+{
+	char *szGroup;
+	char *szName;
+	char *szValue;
+	bool bNumber;
+	int nValue;
+	strAcl *pAcl;			// NULL unless it is an allow= or deny= line.
+};
+
+struct strConfigSnapshot
+{
+	int nGeneration;		// goes up by one on each reload.
+	strConfigEntry *pEntries;
+	int nEntries;
+	strConfigSnapshot *pRetired;	// older snapshots, freed by Release().
+};
+
+
 class Config 
 {
     public:
@@ -80,6 +120,12 @@ class Config
         void Release(void);
         bool Get(char *grp, char *name, char **value);
         bool Get(char *grp, char *name, int   *value);
+        
+        static bool Reload(void);
+        static bool IsAllowed(char *grp, unsigned int nAddr);
+        static int GetGeneration(void);
+        static void RequestReload(void);
+        static bool IsReloadRequested(void);
 
 		void AddServer(char *ip, int port, int type);
 		
@@ -87,11 +133,20 @@ class Config
         
     private:
 		
-		void Lock(void)     { _lock.Lock(); }
-		void Unlock(void)	{ _lock.Unlock(); }
+		static void Lock(void)   { _lock.Lock(); }
+		static void Unlock(void) { _lock.Unlock(); }
+		
+		static strConfigSnapshot *GetSnapshot(void);
+		static strConfigEntry *Find(strConfigSnapshot *pSnapshot, char *grp, char *name);
+		static strConfigSnapshot *Parse(char *szFile);
+		static void ParseAcl(strAcl *pAcl, char *szValue);
+		static bool IsInAcl(strAcl *pAcl, unsigned int nAddr);
+		static void FreeSnapshot(strConfigSnapshot *pSnapshot);
 		
 		static DpLock     _lock;
-        static DpIniFile *_pIniFile;
+		static char *_szFile;
+		static strConfigSnapshot * volatile _pSnapshot;
+		static volatile int _nReload;
 		static ServerEntry *_pServers;
 		static int _nServers;
 };
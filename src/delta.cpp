@@ -0,0 +1,509 @@
+//-----------------------------------------------------------------------------
+// delta.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See delta.h for details.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+
+#include <DevPlus.h>
+
+#include "delta.h"
+
+
+//---------------------------------------------------------------------
+// CJW: The delta is built in a buffer that grows as it needs to.
+struct strDeltaBuffer {
+	char *pData;
+	int nLength;
+	int nMax;
+};
+
+
+//---------------------------------------------------------------------
+// CJW: Add some bytes to the end of the buffer.
+static void DeltaAppend(strDeltaBuffer *pBuf, const char *pData, int nLength)
+{
+	ASSERT(pBuf != NULL && pData != NULL && nLength >= 0);
+	
+	if ((pBuf->nLength + nLength) > pBuf->nMax) {
+		while ((pBuf->nLength + nLength) > pBuf->nMax) {
+			pBuf->nMax = (pBuf->nMax * 2) + 1024;
+		}
+		pBuf->pData = (char *) realloc(pBuf->pData, pBuf->nMax);
+		ASSERT(pBuf->pData != NULL);
+	}
+	
+	memcpy(&pBuf->pData[pBuf->nLength], pData, nLength);
+	pBuf->nLength += nLength;
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Add an operation header, the type followed by up to two numbers.
+static void DeltaAppendOp(strDeltaBuffer *pBuf, char cOp, int nFirst, int nSecond, bool bSecond)
+{
+	unsigned char pTmp[9];
+	int i = 0;
+	
+	pTmp[i++] = cOp;
+	pTmp[i++] = (nFirst >> 24) & 0xff;
+	pTmp[i++] = (nFirst >> 16) & 0xff;
+	pTmp[i++] = (nFirst >> 8) & 0xff;
+	pTmp[i++] = nFirst & 0xff;
+	if (bSecond == true) {
+		pTmp[i++] = (nSecond >> 24) & 0xff;
+		pTmp[i++] = (nSecond >> 16) & 0xff;
+		pTmp[i++] = (nSecond >> 8) & 0xff;
+		pTmp[i++] = nSecond & 0xff;
+	}
+	DeltaAppend(pBuf, (char *) pTmp, i);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Read a 4 byte number out of the delta.
+static int DeltaGetInt(char *pData)
+{
+	unsigned char *pTmp = (unsigned char *) pData;
+	return((pTmp[0] << 24) | (pTmp[1] << 16) | (pTmp[2] << 8) | pTmp[3]);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return true if this is the name of a delta, rather than a file.
+bool Delta::IsDeltaName(char *szName)
+{
+	bool bDelta = false;
+	int nLen, nExt;
+	
+	ASSERT(szName != NULL);
+	
+	nLen = strlen(szName);
+	nExt = strlen(DELTA_EXTENSION);
+	if (nLen > nExt && strcmp(&szName[nLen - nExt], DELTA_EXTENSION) == 0 && strchr(szName, DELTA_SEPARATOR) != NULL) {
+		bDelta = true;
+	}
+	
+	return(bDelta);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Make the name of the delta that gets the target from the base.  
+// 		Returns false if it wont fit.
+bool Delta::MakeName(char *szTarget, char *szBase, char *szName, int nMax)
+{
+	bool bMade = false;
+	
+	ASSERT(szTarget != NULL && szBase != NULL && szName != NULL);
+	
+	if ((int) (strlen(szTarget) + strlen(szBase) + strlen(DELTA_EXTENSION) + 2) <= nMax) {
+		sprintf(szName, "%s%c%s%s", szTarget, DELTA_SEPARATOR, szBase, DELTA_EXTENSION);
+		bMade = true;
+	}
+	
+	return(bMade);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Get the names of the target and the base back out of the name of a 
+// 		delta.  Both buffers need to be nMax long.
+bool Delta::SplitName(char *szName, char *szTarget, char *szBase, int nMax)
+{
+	bool bSplit = false;
+	char *pSep;
+	int nTarget, nBase;
+	
+	ASSERT(szName != NULL && szTarget != NULL && szBase != NULL);
+	
+	if (IsDeltaName(szName) == true) {
+		pSep = strchr(szName, DELTA_SEPARATOR);
+		nTarget = pSep - szName;
+		nBase = strlen(pSep + 1) - strlen(DELTA_EXTENSION);
+		if (nTarget > 0 && nBase > 0 && nTarget < nMax && nBase < nMax) {
+			memcpy(szTarget, szName, nTarget);
+			szTarget[nTarget] = '\0';
+			memcpy(szBase, pSep + 1, nBase);
+			szBase[nBase] = '\0';
+			
+			// neither can be a path, or another delta.
+			if (strchr(szTarget, '/') == NULL && strchr(szBase, '/') == NULL && strchr(szBase, DELTA_SEPARATOR) == NULL && szTarget[0] != '.' && szBase[0] != '.') {
+				bSplit = true;
+			}
+		}
+	}
+	
+	return(bSplit);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Make a delta that turns the base into the target.  We index every 
+// 		block of the base by its weak checksum, then roll a window over the 
+// 		target one byte at a time.  When the checksum of the window matches 
+// 		a block (and the bytes really are the same, we have both files so 
+// 		we dont need a strong checksum), we copy it from the base, and carry 
+// 		on matching past the end of the block for as long as it keeps 
+// 		matching.  Anything that doesnt match is sent as literal data.  The 
+// 		caller needs to free the delta.
+bool Delta::Create(char *pBase, int nBase, char *pTarget, int nTarget, char **pDelta, int *nDelta)
+{
+	strDeltaBuffer buf;
+	unsigned char *pB = (unsigned char *) pBase;
+	unsigned char *pT = (unsigned char *) pTarget;
+	unsigned char pHeader[8];
+	int *pHeads = NULL, *pNext = NULL;
+	unsigned int nMask = 0;
+	unsigned int a, b, nKey;
+	int nBlocks, nTable, i, j;
+	int nPos, nLiteral, nMatch, nOffset, nLen;
+	int nLastOffset = -1, nLastLen = 0, nLastOp = -1;
+	
+	ASSERT(pBase != NULL && nBase >= 0);
+	ASSERT(pTarget != NULL && nTarget > 0);
+	ASSERT(pDelta != NULL && nDelta != NULL);
+	
+	buf.pData = NULL;
+	buf.nLength = 0;
+	buf.nMax = 0;
+	
+	memcpy(pHeader, DELTA_MAGIC, 4);
+	pHeader[4] = (nTarget >> 24) & 0xff;
+	pHeader[5] = (nTarget >> 16) & 0xff;
+	pHeader[6] = (nTarget >> 8) & 0xff;
+	pHeader[7] = nTarget & 0xff;
+	DeltaAppend(&buf, (char *) pHeader, 8);
+	
+	// index the blocks of the base.
+	nBlocks = nBase / DELTA_BLOCK;
+	if (nBlocks > 0) {
+		nTable = 1024;
+		while (nTable < nBlocks * 2) { nTable *= 2; }
+		nMask = nTable - 1;
+		pHeads = (int *) malloc(sizeof(int) * nTable);
+		pNext = (int *) malloc(sizeof(int) * nBlocks);
+		ASSERT(pHeads != NULL && pNext != NULL);
+		for (i=0; i<nTable; i++) { pHeads[i] = -1; }
+		
+		for (i=0; i<nBlocks; i++) {
+			a = 0; b = 0;
+			for (j=0; j<DELTA_BLOCK; j++) {
+				a += pB[(i * DELTA_BLOCK) + j];
+				b += a;
+			}
+			nKey = ((a & 0xffff) ^ ((b & 0xffff) << 16)) & nMask;
+			pNext[i] = pHeads[nKey];
+			pHeads[nKey] = i;
+		}
+	}
+	
+	nPos = 0;
+	nLiteral = 0;
+	a = 0; b = 0;
+	if (nBlocks > 0 && nTarget >= DELTA_BLOCK) {
+		for (j=0; j<DELTA_BLOCK; j++) {
+			a += pT[j];
+			b += a;
+		}
+	}
+	
+	while (nBlocks > 0 && (nPos + DELTA_BLOCK) <= nTarget) {
+		nMatch = -1;
+		nKey = ((a & 0xffff) ^ ((b & 0xffff) << 16)) & nMask;
+		for (i = pHeads[nKey]; i >= 0 && nMatch < 0; i = pNext[i]) {
+			if (memcmp(&pB[i * DELTA_BLOCK], &pT[nPos], DELTA_BLOCK) == 0) {
+				nMatch = i;
+			}
+		}
+		
+		if (nMatch >= 0) {
+			nOffset = nMatch * DELTA_BLOCK;
+			nLen = DELTA_BLOCK;
+			while ((nOffset + nLen) < nBase && (nPos + nLen) < nTarget && pB[nOffset + nLen] == pT[nPos + nLen]) {
+				nLen++;
+			}
+			
+			if (nPos > nLiteral) {
+				DeltaAppendOp(&buf, DELTA_LITERAL, nPos - nLiteral, 0, false);
+				DeltaAppend(&buf, (char *) &pT[nLiteral], nPos - nLiteral);
+				nLastOp = -1;
+			}
+			
+			// if this copy follows straight on from the last one, we can 
+			// just make the last one longer.
+			if (nLastOp >= 0 && (nLastOffset + nLastLen) == nOffset) {
+				nLastLen += nLen;
+				buf.nLength = nLastOp;
+			}
+			else {
+				nLastOffset = nOffset;
+				nLastLen = nLen;
+			}
+			nLastOp = buf.nLength;
+			DeltaAppendOp(&buf, DELTA_COPY, nLastOffset, nLastLen, true);
+			
+			nPos += nLen;
+			nLiteral = nPos;
+			
+			a = 0; b = 0;
+			if ((nPos + DELTA_BLOCK) <= nTarget) {
+				for (j=0; j<DELTA_BLOCK; j++) {
+					a += pT[nPos + j];
+					b += a;
+				}
+			}
+		}
+		else {
+			// roll the window on by one byte.
+			if ((nPos + DELTA_BLOCK) < nTarget) {
+				a = a - pT[nPos] + pT[nPos + DELTA_BLOCK];
+				b = b - (DELTA_BLOCK * pT[nPos]) + a;
+			}
+			nPos++;
+		}
+	}
+	
+	if (nTarget > nLiteral) {
+		DeltaAppendOp(&buf, DELTA_LITERAL, nTarget - nLiteral, 0, false);
+		DeltaAppend(&buf, (char *) &pT[nLiteral], nTarget - nLiteral);
+	}
+	
+	if (pHeads != NULL) { free(pHeads); }
+	if (pNext != NULL) { free(pNext); }
+	
+	*pDelta = buf.pData;
+	*nDelta = buf.nLength;
+	
+	return(true);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Rebuild the target from the base and the delta.  Everything in the 
+// 		delta is checked, so a bad delta (or the wrong base) just returns 
+// 		false.  The caller needs to free the target.
+bool Delta::Apply(char *pBase, int nBase, char *pDelta, int nDelta, char **pTarget, int *nTarget)
+{
+	bool bOK = true;
+	char *pOut = NULL;
+	int nOut = 0, nLength = 0;
+	int nPos, nOffset, nLen;
+	
+	ASSERT(pBase != NULL && nBase >= 0);
+	ASSERT(pDelta != NULL && nDelta >= 0);
+	ASSERT(pTarget != NULL && nTarget != NULL);
+	
+	if (nDelta < 8 || memcmp(pDelta, DELTA_MAGIC, 4) != 0) {
+		bOK = false;
+	}
+	else {
+		nLength = DeltaGetInt(&pDelta[4]);
+		if (nLength <= 0) {
+			bOK = false;
+		}
+		else {
+			pOut = (char *) malloc(nLength);
+			ASSERT(pOut != NULL);
+		}
+	}
+	
+	nPos = 8;
+	while (bOK == true && nPos < nDelta) {
+		if (pDelta[nPos] == DELTA_COPY && (nPos + 9) <= nDelta) {
+			nOffset = DeltaGetInt(&pDelta[nPos + 1]);
+			nLen = DeltaGetInt(&pDelta[nPos + 5]);
+			nPos += 9;
+			if (nOffset < 0 || nLen <= 0 || nLen > (nBase - nOffset) || nLen > (nLength - nOut)) {
+				bOK = false;
+			}
+			else {
+				memcpy(&pOut[nOut], &pBase[nOffset], nLen);
+				nOut += nLen;
+			}
+		}
+		else if (pDelta[nPos] == DELTA_LITERAL && (nPos + 5) <= nDelta) {
+			nLen = DeltaGetInt(&pDelta[nPos + 1]);
+			nPos += 5;
+			if (nLen <= 0 || nLen > (nDelta - nPos) || nLen > (nLength - nOut)) {
+				bOK = false;
+			}
+			else {
+				memcpy(&pOut[nOut], &pDelta[nPos], nLen);
+				nOut += nLen;
+				nPos += nLen;
+			}
+		}
+		else {
+			bOK = false;
+		}
+	}
+	
+	if (bOK == true && nOut != nLength) {
+		bOK = false;
+	}
+	
+	if (bOK == true) {
+		*pTarget = pOut;
+		*nTarget = nLength;
+	}
+	else if (pOut != NULL) {
+		free(pOut);
+	}
+	
+	return(bOK);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Read a whole file into memory.  Returns NULL if it couldnt be read, 
+// 		or is empty.  The caller needs to free it.
+char * Delta::ReadFile(char *szPath, int *nLength)
+{
+	FILE *fp;
+	char *pData = NULL;
+	long nLen;
+	
+	ASSERT(szPath != NULL && nLength != NULL);
+	
+	fp = fopen(szPath, "rb");
+	if (fp != NULL) {
+		if (fseek(fp, 0, SEEK_END) == 0) {
+			nLen = ftell(fp);
+			if (nLen > 0 && nLen < 0x7fffffff && fseek(fp, 0, SEEK_SET) == 0) {
+				pData = (char *) malloc(nLen);
+				ASSERT(pData != NULL);
+				if (fread(pData, 1, nLen, fp) != (size_t) nLen) {
+					free(pData);
+					pData = NULL;
+				}
+				else {
+					*nLength = (int) nLen;
+				}
+			}
+		}
+		fclose(fp);
+	}
+	
+	return(pData);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Write a file that we have made (a delta or a recipe) into one of our 
+// 		directories in the cache, creating the directory if it isnt there.  
+// 		It is written to a hidden temp file and synced first, then renamed, 
+// 		so a half written file is never served.  Returns false if it couldnt 
+// 		be written.
+bool Delta::WriteFile(char *szDir, char *szName, char *pData, int nLength)
+{
+	char szPath[2048], szTemp[2048];
+	FILE *fp;
+	bool bWritten = false;
+	
+	ASSERT(szDir != NULL && szName != NULL);
+	ASSERT(pData != NULL && nLength > 0);
+	
+	if ((strlen(szDir) + strlen(szName) + 3) < sizeof(szPath)) {
+		mkdir(szDir, 0755);
+		sprintf(szPath, "%s/%s", szDir, szName);
+		sprintf(szTemp, "%s/.%s", szDir, szName);
+		fp = fopen(szTemp, "wb");
+		if (fp != NULL) {
+			if (fwrite(pData, 1, nLength, fp) == (size_t) nLength && fflush(fp) == 0 && fsync(fileno(fp)) == 0) {
+				bWritten = true;
+			}
+			if (fclose(fp) != 0) {
+				bWritten = false;
+			}
+			if (bWritten == true && rename(szTemp, szPath) != 0) {
+				bWritten = false;
+			}
+			if (bWritten == false) {
+				unlink(szTemp);
+			}
+		}
+	}
+	
+	return(bWritten);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Keep no more than nMax deltas in the directory.  The ones that were 
+// 		made the longest ago are removed first.  The temporary files that 
+// 		WriteFile uses start with a '.', so they are left alone.
+void Delta::Prune(char *szDir, int nMax)
+{
+	DIR *pDir;
+	struct dirent *pEntry;
+	struct stat st;
+	char szPath[2048], szOldest[2048];
+	time_t tOldest;
+	int nCount;
+	bool bMore = true;
+	
+	ASSERT(szDir != NULL && nMax >= 0);
+	
+	while (bMore == true) {
+		bMore = false;
+		nCount = 0;
+		tOldest = 0;
+		szOldest[0] = '\0';
+		
+		pDir = opendir(szDir);
+		if (pDir != NULL) {
+			while ((pEntry = readdir(pDir)) != NULL) {
+				if (pEntry->d_name[0] != '.' && IsDeltaName(pEntry->d_name) == true && (strlen(szDir) + strlen(pEntry->d_name) + 2) < sizeof(szPath)) {
+					sprintf(szPath, "%s/%s", szDir, pEntry->d_name);
+					if (stat(szPath, &st) == 0 && S_ISREG(st.st_mode)) {
+						nCount++;
+						if (szOldest[0] == '\0' || st.st_mtime < tOldest) {
+							strcpy(szOldest, szPath);
+							tOldest = st.st_mtime;
+						}
+					}
+				}
+			}
+			closedir(pDir);
+		}
+		
+		if (nCount > nMax && szOldest[0] != '\0' && unlink(szOldest) == 0) {
+			bMore = true;
+		}
+	}
+}
@@ -0,0 +1,78 @@
+//-----------------------------------------------------------------------------
+// delta.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      Binary deltas between two versions of a package.  The delta is made
+//      by matching blocks of the old file (the base) in the new file (the
+//      target) with a rolling checksum, the same way rsync does, and is a
+//      list of copies from the base and literal data.
+//
+//      A delta is passed around the network as if it was a file, with a name
+//      made from the two files (<target>~<base>.delta), so that it can be
+//      got in chunks from the nodes like any other file.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __DELTA_H
+#define __DELTA_H
+
+//-----------------------------------------------------------------------------
+// Size of the blocks of the base that we look for in the target.
+#define DELTA_BLOCK         2048
+
+// Every delta starts with this, followed by the length of the target.
+#define DELTA_MAGIC         "PDL1"
+
+// The operations in a delta.
+//      C<offset*4><len*4>      copy len bytes from offset in the base.
+//      L<len*4><data*len>      literal data.
+#define DELTA_COPY          'C'
+#define DELTA_LITERAL       'L'
+
+// The separator and extension in the name of a delta.
+#define DELTA_SEPARATOR     '~'
+#define DELTA_EXTENSION     ".delta"
+
+
+class Delta 
+{
+    public:
+        static bool IsDeltaName(char *szName);
+        static bool MakeName(char *szTarget, char *szBase, char *szName, int nMax);
+        static bool SplitName(char *szName, char *szTarget, char *szBase, int nMax);
+        
+        static bool Create(char *pBase, int nBase, char *pTarget, int nTarget, char **pDelta, int *nDelta);
+        static bool Apply(char *pBase, int nBase, char *pDelta, int nDelta, char **pTarget, int *nTarget);
+        
+        static char * ReadFile(char *szPath, int *nLength);
+        static bool WriteFile(char *szDir, char *szName, char *pData, int nLength);
+        static void Prune(char *szDir, int nMax);
+};
+
+
+#endif
+
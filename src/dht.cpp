@@ -0,0 +1,483 @@
+//-----------------------------------------------------------------------------
+// dht.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+// 
+//      See "dht.h" for more information about this class.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#include <DevPlus.h>
+
+#include "dht.h"
+
+
+//---------------------------------------------------------------------
+// CJW: Constructor.   Start with an empty list.
+Dht::Dht()
+{
+    _pList = NULL;
+    _nCount = 0;
+}
+    
+//---------------------------------------------------------------------
+// CJW: Deconstructor.  Clean up the linked-list.
+Dht::~Dht()
+{
+    strDhtRecord *pTmp;
+
+    while(_pList != NULL) {
+        pTmp = _pList;
+        _pList = pTmp->pNext;
+        ASSERT(pTmp->szFile != NULL);
+        free(pTmp->szFile);
+        free(pTmp);
+    }
+    _nCount = 0;
+}
+
+
+//---------------------------------------------------------------------
+// CJW: The key for a file is the 32-bit FNV-1a hash of its name.  Node 
+// 		ids are in the same space, so we can tell which node is closest 
+// 		to a file.
+unsigned int Dht::Hash(char *szFile)
+{
+	unsigned int nHash = 2166136261U;
+	unsigned char *pTmp;
+	
+	ASSERT(szFile != NULL);
+	
+	pTmp = (unsigned char *) szFile;
+	while (*pTmp != '\0') {
+		nHash ^= *pTmp;
+		nHash *= 16777619U;
+		pTmp++;
+	}
+	
+	return(nHash);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Like kademlia, the distance between two ids is the XOR of them.
+unsigned int Dht::Distance(unsigned int nFirst, unsigned int nSecond)
+{
+	return(nFirst ^ nSecond);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: A node has told us that it has this file.  If we already knew, we 
+// 		just keep the record for longer.  Returns false if we have too 
+// 		many records to keep it.
+bool Dht::Store(char *szFile, unsigned char *pHolder)
+{
+	bool bStored = false;
+	strDhtRecord *pRecord;
+	unsigned int nKey;
+	int nHolders = 0;
+	
+	ASSERT(szFile != NULL && pHolder != NULL);
+	
+	nKey = Hash(szFile);
+	pRecord = _pList;
+	while (pRecord != NULL && bStored == false) {
+		if (pRecord->nKey == nKey && strcmp(pRecord->szFile, szFile) == 0) {
+			if (memcmp(pRecord->pHolder, pHolder, 6) == 0) {
+				pRecord->tExpire = time(NULL) + DHT_RECORD_TIME;
+				bStored = true;
+			}
+			else {
+				nHolders++;
+			}
+		}
+		pRecord = pRecord->pNext;
+	}
+	
+	if (bStored == false && nHolders < DHT_MAX_HOLDERS && _nCount < DHT_MAX_RECORDS) {
+		pRecord = (strDhtRecord *) malloc(sizeof(strDhtRecord));
+		ASSERT(pRecord != NULL);
+		pRecord->szFile = strdup(szFile);
+		ASSERT(pRecord->szFile != NULL);
+		pRecord->nKey = nKey;
+		memcpy(pRecord->pHolder, pHolder, 6);
+		pRecord->tExpire = time(NULL) + DHT_RECORD_TIME;
+		pRecord->pNext = _pList;
+		_pList = pRecord;
+		_nCount++;
+		bStored = true;
+	}
+	
+	return(bStored);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Copy the addresses of the holders of this file into pHolders, 6 
+// 		bytes each, and return how many there were.  pHolders must have 
+// 		room for nMax of them.
+int Dht::Find(char *szFile, unsigned char *pHolders, int nMax)
+{
+	strDhtRecord *pRecord;
+	unsigned int nKey;
+	time_t tNow;
+	int nCount = 0;
+	
+	ASSERT(szFile != NULL && pHolders != NULL && nMax > 0);
+	
+	nKey = Hash(szFile);
+	tNow = time(NULL);
+	pRecord = _pList;
+	while (pRecord != NULL && nCount < nMax) {
+		if (pRecord->nKey == nKey && pRecord->tExpire > tNow && strcmp(pRecord->szFile, szFile) == 0) {
+			memcpy(&pHolders[nCount * 6], pRecord->pHolder, 6);
+			nCount++;
+		}
+		pRecord = pRecord->pNext;
+	}
+	
+	return(nCount);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: The holder has gone, so remove all the records for it.
+void Dht::RemoveHolder(unsigned char *pHolder)
+{
+	strDhtRecord *pRecord;
+	strDhtRecord *pPrev = NULL;
+	strDhtRecord *pTmp;
+	
+	ASSERT(pHolder != NULL);
+	
+	pRecord = _pList;
+	while (pRecord != NULL) {
+		if (memcmp(pRecord->pHolder, pHolder, 6) == 0) {
+			pTmp = pRecord->pNext;
+			if (pPrev == NULL)	{ _pList = pTmp; }
+			else 				{ pPrev->pNext = pTmp; }
+			free(pRecord->szFile);
+			free(pRecord);
+			_nCount--;
+			pRecord = pTmp;
+		}
+		else {
+			pPrev = pRecord;
+			pRecord = pRecord->pNext;
+		}
+	}
+	
+	ASSERT(_nCount >= 0);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Go thru the list and remove the records that havent been 
+// 		published again in time.
+void Dht::Process(void)
+{
+	strDhtRecord *pRecord;
+	strDhtRecord *pPrev = NULL;
+	strDhtRecord *pTmp;
+	time_t tNow;
+	
+	tNow = time(NULL);
+	pRecord = _pList;
+	while (pRecord != NULL) {
+		if (pRecord->tExpire <= tNow) {
+			pTmp = pRecord->pNext;
+			if (pPrev == NULL)	{ _pList = pTmp; }
+			else 				{ pPrev->pNext = pTmp; }
+			free(pRecord->szFile);
+			free(pRecord);
+			_nCount--;
+			pRecord = pTmp;
+		}
+		else {
+			pPrev = pRecord;
+			pRecord = pRecord->pNext;
+		}
+	}
+	
+	ASSERT(_nCount >= 0);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the number of records that we are keeping.
+int Dht::GetCount(void)
+{
+	ASSERT(_nCount >= 0);
+	return(_nCount);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Constructor.  The buckets are for distances from nId.
+DhtTable::DhtTable(unsigned int nId)
+{
+	int i;
+	
+	_nId = nId;
+	for (i=0; i<DHT_BUCKETS; i++) {
+		_pBuckets[i] = NULL;
+		_pCounts[i] = 0;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Deconstructor.  Clean up the buckets.
+DhtTable::~DhtTable()
+{
+	strDhtContact *pTmp;
+	int i;
+	
+	for (i=0; i<DHT_BUCKETS; i++) {
+		while (_pBuckets[i] != NULL) {
+			pTmp = _pBuckets[i];
+			_pBuckets[i] = pTmp->pNext;
+			free(pTmp);
+		}
+		_pCounts[i] = 0;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the bucket that nSecond goes in, from the point of view of 
+// 		nFirst.  That is the highest bit that is set in the distance 
+// 		between them, so bucket 31 is the half of the id space furthest 
+// 		away.  Returns -1 if they are the same.
+int DhtTable::GetBucket(unsigned int nFirst, unsigned int nSecond)
+{
+	unsigned int nDistance;
+	int nBucket = -1;
+	
+	nDistance = Dht::Distance(nFirst, nSecond);
+	while (nDistance != 0) {
+		nBucket++;
+		nDistance >>= 1;
+	}
+	
+	ASSERT(nBucket >= -1 && nBucket < DHT_BUCKETS);
+	return(nBucket);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: We have heard from a node, or been told about it.  The buckets are 
+// 		kept with the most recently seen at the front.  If the bucket is 
+// 		full, the new node only goes in if the one we heard from least 
+// 		recently has been quiet for a while, like kademlia we would rather 
+// 		keep nodes that have been around for a long time.  Returns false if 
+// 		the node wasnt kept.
+bool DhtTable::Add(unsigned int nId, unsigned char *pAddress)
+{
+	strDhtContact *pContact, *pPrev, *pLast;
+	bool bAdded = false;
+	int nBucket, i;
+	
+	ASSERT(pAddress != NULL);
+	
+	// if we already know the address under a different id, the node must 
+	// have restarted with a new one, so we forget the old one.
+	nBucket = GetBucket(_nId, nId);
+	for (i=0; i<DHT_BUCKETS && nId != 0 && nBucket >= 0; i++) {
+		if (i != nBucket) {
+			pContact = _pBuckets[i];
+			while (pContact != NULL && memcmp(pContact->pAddress, pAddress, 6) != 0) {
+				pContact = pContact->pNext;
+			}
+			if (pContact != NULL) {
+				Remove(pAddress);
+			}
+		}
+	}
+	
+	if (nId != 0 && nBucket >= 0) {
+		
+		pPrev = NULL;
+		pLast = NULL;
+		pContact = _pBuckets[nBucket];
+		while (pContact != NULL && memcmp(pContact->pAddress, pAddress, 6) != 0) {
+			pPrev = pLast;
+			pLast = pContact;
+			pContact = pContact->pNext;
+		}
+		
+		if (pContact != NULL) {
+			// we already have it, so it just needs to go to the front.
+			if (pLast != NULL) {
+				pLast->pNext = pContact->pNext;
+				pContact->pNext = _pBuckets[nBucket];
+				_pBuckets[nBucket] = pContact;
+			}
+			bAdded = true;
+		}
+		else if (_pCounts[nBucket] < DHT_BUCKET_SIZE) {
+			pContact = (strDhtContact *) malloc(sizeof(strDhtContact));
+			ASSERT(pContact != NULL);
+			pContact->pNext = _pBuckets[nBucket];
+			_pBuckets[nBucket] = pContact;
+			_pCounts[nBucket]++;
+			bAdded = true;
+		}
+		else if (pLast != NULL && (time(NULL) - pLast->tSeen) >= DHT_CONTACT_TIME) {
+			// the last one is the one we heard from least recently.
+			pContact = pLast;
+			if (pPrev != NULL) {
+				pPrev->pNext = NULL;
+				pContact->pNext = _pBuckets[nBucket];
+				_pBuckets[nBucket] = pContact;
+			}
+			bAdded = true;
+		}
+		
+		if (bAdded == true) {
+			pContact->nId = nId;
+			memcpy(pContact->pAddress, pAddress, 6);
+			pContact->tSeen = time(NULL);
+		}
+	}
+	
+	return(bAdded);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Forget the node with this address, if we know it.
+void DhtTable::Remove(unsigned char *pAddress)
+{
+	strDhtContact *pContact, *pPrev;
+	int i;
+	
+	ASSERT(pAddress != NULL);
+	
+	for (i=0; i<DHT_BUCKETS; i++) {
+		pPrev = NULL;
+		pContact = _pBuckets[i];
+		while (pContact != NULL && memcmp(pContact->pAddress, pAddress, 6) != 0) {
+			pPrev = pContact;
+			pContact = pContact->pNext;
+		}
+		
+		if (pContact != NULL) {
+			if (pPrev == NULL)	{ _pBuckets[i] = pContact->pNext; }
+			else				{ pPrev->pNext = pContact->pNext; }
+			free(pContact);
+			_pCounts[i]--;
+		}
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Copy the nMax nodes that we know of that are closest to the key into 
+// 		pIds and pAddresses (6 bytes each), the closest first.  Returns how 
+// 		many there were.
+int DhtTable::Closest(unsigned int nKey, unsigned int *pIds, unsigned char *pAddresses, int nMax)
+{
+	strDhtContact *pContact;
+	unsigned int nDistance;
+	int nCount = 0;
+	int i, j;
+	
+	ASSERT(pIds != NULL && pAddresses != NULL && nMax > 0);
+	
+	for (i=0; i<DHT_BUCKETS; i++) {
+		pContact = _pBuckets[i];
+		while (pContact != NULL) {
+			nDistance = Dht::Distance(pContact->nId, nKey);
+			
+			// find where it goes, and move the further ones down.
+			j = nCount;
+			while (j > 0 && Dht::Distance(pIds[j-1], nKey) > nDistance) {
+				if (j < nMax) {
+					pIds[j] = pIds[j-1];
+					memcpy(&pAddresses[j * 6], &pAddresses[(j-1) * 6], 6);
+				}
+				j--;
+			}
+			
+			if (j < nMax) {
+				pIds[j] = pContact->nId;
+				memcpy(&pAddresses[j * 6], pContact->pAddress, 6);
+				if (nCount < nMax) {
+					nCount++;
+				}
+			}
+			
+			pContact = pContact->pNext;
+		}
+	}
+	
+	ASSERT(nCount >= 0 && nCount <= nMax);
+	return(nCount);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Copy the address of the node in the bucket that we heard from most 
+// 		recently.  Returns false if the bucket is empty.
+bool DhtTable::GetContact(int nBucket, unsigned char *pAddress)
+{
+	bool bFound = false;
+	
+	ASSERT(nBucket >= 0 && nBucket < DHT_BUCKETS);
+	ASSERT(pAddress != NULL);
+	
+	if (_pBuckets[nBucket] != NULL) {
+		memcpy(pAddress, _pBuckets[nBucket]->pAddress, 6);
+		bFound = true;
+	}
+	
+	return(bFound);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the number of nodes in the table.
+int DhtTable::GetCount(void)
+{
+	int nCount = 0;
+	int i;
+	
+	for (i=0; i<DHT_BUCKETS; i++) {
+		ASSERT(_pCounts[i] >= 0 && _pCounts[i] <= DHT_BUCKET_SIZE);
+		nCount += _pCounts[i];
+	}
+	
+	return(nCount);
+}
+
@@ -0,0 +1,133 @@
+//-----------------------------------------------------------------------------
+// dht.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      This object holds the DHT records that this node is responsible for.
+//      Each record says that a node (the holder) has a file.  Records are
+//      kept by the nodes whose ids are closest to the hash of the filename.
+//      DhtTable is the routing table of the nodes we know the ids of.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __DHT_H
+#define __DHT_H
+
+#include <time.h>
+
+//-----------------------------------------------------------------------------
+// Files are published to the DHT every DHT_PUBLISH_TIME seconds, a few at a 
+// time.  A record that isnt published again within DHT_RECORD_TIME seconds 
+// is dropped, because the holder has probably gone.
+#define DHT_PUBLISH_TIME    300
+#define DHT_PUBLISH_BATCH   16
+#define DHT_RECORD_TIME     900
+
+// We dont keep more than this many holders for one file, or more than this 
+// many records in total.
+#define DHT_MAX_HOLDERS     8
+#define DHT_MAX_RECORDS     65536
+
+
+//-----------------------------------------------------------------------------
+// Like the k-buckets in kademlia, the routing table keeps up to 
+// DHT_BUCKET_SIZE nodes for each bit of distance from our id.  A contact that 
+// we havent heard from for DHT_CONTACT_TIME seconds can be replaced by a new 
+// one.  Every DHT_REFRESH_TIME seconds we make sure that we are connected to 
+// a node in each bucket that we know of, so that each step of a lookup gets 
+// at least one bit closer to the key.
+#define DHT_BUCKETS         32
+#define DHT_BUCKET_SIZE     8
+#define DHT_CONTACT_TIME    900
+#define DHT_REFRESH_TIME    60
+
+// Records are kept by the node closest to the file, and copied to this many 
+// of the next closest, which lookups also ask.
+#define DHT_REPLICAS        3
+
+
+struct strDhtRecord {
+	char *szFile;
+	unsigned int nKey;
+	unsigned char pHolder[6];
+	time_t tExpire;
+	strDhtRecord *pNext;
+};
+
+
+class Dht 
+{
+    private:
+        strDhtRecord *_pList;
+        int _nCount;
+    
+    public:
+        Dht();
+        virtual ~Dht();
+
+        static unsigned int Hash(char *szFile);
+        static unsigned int Distance(unsigned int nFirst, unsigned int nSecond);
+        
+        bool Store(char *szFile, unsigned char *pHolder);
+        int Find(char *szFile, unsigned char *pHolders, int nMax);
+        void RemoveHolder(unsigned char *pHolder);
+        void Process(void);
+        int GetCount(void);
+};
+
+
+// A node that we know the DHT id of, whether we are connected to it or not.
+struct strDhtContact {
+	unsigned int nId;
+	unsigned char pAddress[6];
+	time_t tSeen;
+	strDhtContact *pNext;
+};
+
+
+class DhtTable
+{
+    private:
+        strDhtContact *_pBuckets[DHT_BUCKETS];
+        int _pCounts[DHT_BUCKETS];
+        unsigned int _nId;
+    
+    public:
+        DhtTable(unsigned int nId);
+        virtual ~DhtTable();
+        
+        static int GetBucket(unsigned int nFirst, unsigned int nSecond);
+        
+        bool Add(unsigned int nId, unsigned char *pAddress);
+        void Remove(unsigned char *pAddress);
+        int Closest(unsigned int nKey, unsigned int *pIds, unsigned char *pAddresses, int nMax);
+        bool GetContact(int nBucket, unsigned char *pAddress);
+        int GetCount(void);
+};
+
+
+#endif
+
@@ -31,11 +31,20 @@
  ***************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include <DevPlus.h>
 
 #include "fileinfo.h"
 #include "common.h"
+#include "sha256.h"
+#include "metrics.h"
+#include "trace.h"
+
+
+long long FileInfo::_nCached = 0;
 
 
 //-----------------------------------------------------------------------------
@@ -44,15 +53,37 @@ FileInfo::FileInfo()
 {
     _pNext = NULL;
 	_szFilename = NULL;
+	_szUrl = NULL;
+	_nMirrorFails = 0;
+	
+	_Search.nState = FILE_SEARCH_NONE;
+	_Search.nTime = 0;
+	_Search.nWait = 0;
+	_Search.nTtl = 0;
+	_Search.nNodes = 0;
+	_Search.bFound = false;
 	_nFileLength = 0;
 	_nUseCount = 0;
 	_bLocal = false;
+	_bSaved = false;
+	_nBadSums = 0;
+	_Delta.szBase = NULL;
+	_Delta.szName = NULL;
+	_Delta.nStart = 0;
+	_Trace.nStart = 0;
+	_Trace.nSearch = 0;
+	_Trace.bMissed = false;
+	_Trace.bDone = false;
 		
 	_LocalFile.pFilePtr = NULL;
 	_LocalFile.nLocation = 0;
+	_LocalFile.bFailed = false;
 		
 	_RemoteFile.pChunkList = NULL;
 	_RemoteFile.nChunks = 0;
+	
+	_Window.nNode = 0;
+	_Window.nMax = 0;
 }
     
 //-----------------------------------------------------------------------------
@@ -61,12 +92,20 @@ FileInfo::~FileInfo()
 {
 	int i;
 	
-    ASSERT(_pNext != NULL);
+    ASSERT(_pNext == NULL);
 	ASSERT(_nUseCount == 0);
+	if (_Trace.nStart > 0 && _Trace.bDone == false) {
+		TraceDone("abandoned");
+	}
 	if (_szFilename != NULL) {
 		free(_szFilename);
 		_szFilename = NULL;
 	}
+	if (_szUrl != NULL) {
+		free(_szUrl);
+		_szUrl = NULL;
+	}
+	ClearDelta();
 	if (_LocalFile.pFilePtr != NULL) {
 		ASSERT(_bLocal == true);
 		fclose(_LocalFile.pFilePtr);
@@ -77,6 +116,7 @@ FileInfo::~FileInfo()
 		ASSERT(_RemoteFile.nChunks > 0);
 		for(i=0; i<_RemoteFile.nChunks; i++) {
 			if (_RemoteFile.pChunkList[i] != NULL) {
+				Uncache(_RemoteFile.pChunkList[i]);
 				delete _RemoteFile.pChunkList[i];
 				_RemoteFile.pChunkList[i] = NULL;
 			}
@@ -99,11 +139,11 @@ FileInfo * FileInfo::GetNext(void)
 
 //-----------------------------------------------------------------------------
 // CJW: Add the object to the list.  This can only be done if there is no 
-// 		object already in the next prosition.
+// 		object already in the next prosition.  A NULL can be supplied to 
+// 		unlink the object from the list.
 void FileInfo::SetNext(FileInfo *pInfo)
 {
-	ASSERT(_pNext == NULL);
-	ASSERT(pInfo != NULL);
+	ASSERT(_pNext == NULL || pInfo == NULL);
 	
 	_pNext = pInfo;
 }
@@ -136,15 +176,17 @@ char * FileInfo::GetFilename(void)
 
 //-----------------------------------------------------------------------------
 // CJW: Return a chunk of the file if we know it.  If the file is local, then 
-// 		we will open the file (if its not already open), and get the chunk and 
-// 		return it, without storing it.   If the file is not local (is remote), 
-// 		then we will look to see if we have that chunk.  If we do, we will 
-// 		return it and a true, otherwise we will return a false without 
+// 		we will read the chunk out of the file (which was opened by SetLocal), 
+// 		and return it, without storing it.   If the file is not local (is 
+// 		remote), then we will look to see if we have that chunk.  If we do, we 
+// 		will return it and a true, otherwise we will return a false without 
 // 		disturbing the parameters supplied.
+//
+//		Chunks are numbered from 1, the same as they are in the node protocol.  
+//		Chunk 1 starts at the begining of the file.
 bool FileInfo::GetChunk(int nChunk, char **pData, int *nSize, int *nLength)
 {
 	bool bGotIt = false;
-	char szPath[2048];
 	long nLoc;
 	size_t nLen;
 	size_t nReadSize;
@@ -157,25 +199,14 @@ bool FileInfo::GetChunk(int nChunk, char **pData, int *nSize, int *nLength)
 	ASSERT(_szFilename != NULL);
 	
 	if (_bLocal == true) {
-		if (_LocalFile.pFilePtr == NULL) {
-			sprintf(szPath, "%s/%s", PKG_PATH, _szFilename);
-			_LocalFile.pFilePtr = fopen(szPath, "rb");
-			if (_LocalFile.pFilePtr == NULL) {
-				_bLocal = false;
-			}
-			else {
-				fseek(_LocalFile.pFilePtr, 0, SEEK_END);
-				_nFileLength = ftell(_LocalFile.pFilePtr);
-				fseek(_LocalFile.pFilePtr, 0, SEEK_SET);
-			}
-			
-			ASSERT(_LocalFile.nLocation == 0);
-		}
+		ASSERT(_LocalFile.pFilePtr != NULL);
+		ASSERT(_nFileLength > 0);
 		
 		if (_LocalFile.chunk.nChunk == nChunk) {
+			// this is the same chunk we read last time, so we dont need to 
+			// read it again.
 			ASSERT(_LocalFile.chunk.pData != NULL);
 			ASSERT(_LocalFile.chunk.nLength > 0);
-			ASSERT(_nFileLength > 0);
 			
 			*pData = _LocalFile.chunk.pData;
 			*nSize = _LocalFile.chunk.nLength;
@@ -184,42 +215,54 @@ bool FileInfo::GetChunk(int nChunk, char **pData, int *nSize, int *nLength)
 			bGotIt = true;
 		}
 		else {
-			
-			if (_LocalFile.pFilePtr != NULL) {
-				nLoc = nChunk * MAX_CHUNK_SIZE;
+			nLoc = (long) (nChunk - 1) * MAX_CHUNK_SIZE;
+			if (nLoc < _nFileLength) {
+				
+				// if the chunks are being requested in order, we will already 
+				// be at the right location in the file.
 				if (nLoc != _LocalFile.nLocation) {
 					if (fseek(_LocalFile.pFilePtr, nLoc, SEEK_SET) != 0) {
 						fclose(_LocalFile.pFilePtr);
 						_LocalFile.pFilePtr = NULL;
-						_LocalFile.nLocation = nLoc;
+						_LocalFile.nLocation = 0;
+						_LocalFile.bFailed = true;
 						_bLocal = false;
 					}
+					else {
+						_LocalFile.nLocation = nLoc;
+					}
 				}
-			}
 			
-			if (_LocalFile.pFilePtr != NULL) {
-				
-				// determine the size of the chunk we are getting.
-				nReadSize = _nFileLength - _LocalFile.nLocation;
-				ASSERT(nReadSize >= 0);
-				if (nReadSize > MAX_CHUNK_SIZE) { nReadSize = MAX_CHUNK_SIZE; }
-				if (nReadSize > 0) {
+				if (_LocalFile.pFilePtr != NULL) {
+					
+					// determine the size of the chunk we are getting.
+					nReadSize = _nFileLength - nLoc;
+					if (nReadSize > MAX_CHUNK_SIZE) { nReadSize = MAX_CHUNK_SIZE; }
+					ASSERT(nReadSize > 0);
 				
 					if (_LocalFile.chunk.pData == NULL) {
 						_LocalFile.chunk.pData = (char *) malloc(MAX_CHUNK_SIZE);
 					}
 					ASSERT(_LocalFile.chunk.pData != NULL);
 					
-					nLen = fread(_LocalFile.chunk.pData, nReadSize, 1, _LocalFile.pFilePtr);
-					if (nLen == 0) {
-						// we shouldnt get to this state, because we are checking for file lengths.  If we get here, then something happened to the file (which is possible).
+					nLen = fread(_LocalFile.chunk.pData, 1, nReadSize, _LocalFile.pFilePtr);
+					if (nLen != nReadSize) {
+						// we shouldnt get to this state, because we are 
+						// checking for file lengths.  If we get here, then 
+						// something happened to the file (which is possible).
 						_bLocal = false;
 						fclose(_LocalFile.pFilePtr);
 						_LocalFile.pFilePtr = NULL;
 						_LocalFile.nLocation = 0;
+						_LocalFile.bFailed = true;
+						
+						free(_LocalFile.chunk.pData);
+						_LocalFile.chunk.pData = NULL;
+						_LocalFile.chunk.nChunk = 0;
+						_LocalFile.chunk.nLength = 0;
 					}
 					else {
-						ASSERT(nLen == nReadSize);
+						_LocalFile.chunk.nChunk = nChunk;
 						_LocalFile.chunk.nLength = nLen;
 						_LocalFile.nLocation += nLen;
 						ASSERT(_LocalFile.nLocation <= _nFileLength);
@@ -234,26 +277,38 @@ bool FileInfo::GetChunk(int nChunk, char **pData, int *nSize, int *nLength)
 			}
 		}
 	}
-	else {
-		// Its not a local file, so see if we have this chunk in our array.
-		
-		ASSERT(nChunk <= _RemoteFile.nChunks);
-		ASSERT(_RemoteFile.pChunkList != NULL);
+	else if (_RemoteFile.pChunkList != NULL) {
+		// Its not a local file, so see if we have this chunk in our array.  
+		// If we dont know the length of the file yet, then we wont have an 
+		// array, and we certainly wont have the chunk.
 		
-		if (_RemoteFile.pChunkList[nChunk-1] != NULL) {
-			ASSERT(_RemoteFile.pChunkList[nChunk-1]->pData != NULL);
-			ASSERT(_RemoteFile.pChunkList[nChunk-1]->nChunk == nChunk);
-			ASSERT(_RemoteFile.pChunkList[nChunk-1]->nLength > 0);
-			ASSERT(_RemoteFile.pChunkList[nChunk-1]->nLength <= MAX_CHUNK_SIZE);
+		ASSERT(_RemoteFile.nChunks > 0);
+		if (nChunk <= _RemoteFile.nChunks && _RemoteFile.pChunkList[nChunk-1] != NULL) {
+			if (_RemoteFile.pChunkList[nChunk-1]->nNode == CHUNK_PASSED) {
+				// we have already passed this one on, and it is being asked 
+				// for again, so we need to get it again.
+				ASSERT(_RemoteFile.pChunkList[nChunk-1]->pData == NULL);
+				_RemoteFile.pChunkList[nChunk-1]->nNode = 0;
+			}
+			else if (_RemoteFile.pChunkList[nChunk-1]->pData != NULL) {
+				ASSERT(_RemoteFile.pChunkList[nChunk-1]->nChunk == nChunk);
+				ASSERT(_RemoteFile.pChunkList[nChunk-1]->nLength > 0);
+				ASSERT(_RemoteFile.pChunkList[nChunk-1]->nLength <= MAX_CHUNK_SIZE);
 			
-			*pData = _RemoteFile.pChunkList[nChunk-1]->pData;
-			*nSize = _RemoteFile.pChunkList[nChunk-1]->nLength;
-			*nLength = _nFileLength;
+				*pData = _RemoteFile.pChunkList[nChunk-1]->pData;
+				*nSize = _RemoteFile.pChunkList[nChunk-1]->nLength;
+				*nLength = _nFileLength;
 			
-			bGotIt = true;
+				bGotIt = true;
+			}
 		}
 	}
 	
+	if (bGotIt == true) {
+		static strMetric *pServed = Metrics::Counter("pacsrv_chunks_served_total", "Chunks handed out to clients and nodes.");
+		Metrics::Add(pServed, 1);
+	}
+	
 	return(bGotIt);
 }
 
@@ -264,18 +319,25 @@ bool FileInfo::GetChunk(int nChunk, char **pData, int *nSize, int *nLength)
 // 		from a different node.
 void FileInfo::ChunkRequested(int nChunk, int nNode)
 {
+	static strMetric *pRequested = Metrics::Counter("pacsrv_chunks_requested_total", "Chunks asked of nodes.");
+	
 	ASSERT(nChunk > 0 && nNode > 0);
 	
 	ASSERT(nChunk <= _RemoteFile.nChunks);
 	ASSERT(_RemoteFile.pChunkList != NULL);
-	ASSERT(_RemoteFile.pChunkList[nChunk-1] == NULL);
 	
-	_RemoteFile.pChunkList[nChunk-1] = new Chunk;
+	// if the chunk was asked of a node that has since been closed, we will 
+	// already have an entry for it, we just need to point it at the new node.
+	if (_RemoteFile.pChunkList[nChunk-1] == NULL) {
+		_RemoteFile.pChunkList[nChunk-1] = new Chunk;
+	}
+	ASSERT(_RemoteFile.pChunkList[nChunk-1]->nNode == 0);
 	
 	_RemoteFile.pChunkList[nChunk-1]->nChunk = nChunk;
 	_RemoteFile.pChunkList[nChunk-1]->nNode  = nNode;
 	
 	ASSERT(_RemoteFile.pChunkList[nChunk-1]->pData == NULL);
+	Metrics::Add(pRequested, 1);
 }
 
 
@@ -285,22 +347,182 @@ void FileInfo::ChunkRequested(int nChunk, int nNode)
 // 		check for that.   We also need to make sure that the chunk-size matches 
 // 		what we expect it should be (all should be MAX_CHUNK_SIZE except for 
 // 		the last chunk of the file).
+//
+//		If the node that the chunk was asked of was closed, the chunk may have 
+//		already been asked of another node, and we might even have received it 
+//		already.  In that case we just throw away the duplicate.  The first 
+//		chunk can also arrive from the mirror without being asked for, while 
+//		we were finding out how long the file is.
 void FileInfo::SaveChunk(char *pData, int nChunk, int nSize)
 {
+	static strMetric *pReceived = Metrics::Counter("pacsrv_chunks_received_total", "Chunks received for remote files.");
+	static strMetric *pDuplicate = Metrics::Counter("pacsrv_chunks_duplicate_total", "Chunks received that we already had.");
+	
 	ASSERT(pData != NULL);
 	ASSERT(nChunk > 0);
 	ASSERT(nSize > 0);
 	
 	ASSERT(nChunk <= _RemoteFile.nChunks);
 	ASSERT(_RemoteFile.pChunkList != NULL);
-	ASSERT(_RemoteFile.pChunkList[nChunk-1] != NULL);
 	
-	ASSERT(_RemoteFile.pChunkList[nChunk-1]->nNode > 0);
-	ASSERT(_RemoteFile.pChunkList[nChunk-1]->pData == NULL);
+	if (_RemoteFile.pChunkList[nChunk-1] == NULL) {
+		_RemoteFile.pChunkList[nChunk-1] = new Chunk;
+	}
 	
-	_RemoteFile.pChunkList[nChunk-1]->pData = pData;
-	_RemoteFile.pChunkList[nChunk-1]->nChunk = nChunk;
-	_RemoteFile.pChunkList[nChunk-1]->nLength = nSize;
+	if (_RemoteFile.pChunkList[nChunk-1]->pData != NULL || _RemoteFile.pChunkList[nChunk-1]->nNode == CHUNK_PASSED) {
+		free(pData);
+		Metrics::Add(pDuplicate, 1);
+	}
+	else {
+		_RemoteFile.pChunkList[nChunk-1]->pData = pData;
+		_RemoteFile.pChunkList[nChunk-1]->nChunk = nChunk;
+		_RemoteFile.pChunkList[nChunk-1]->nLength = nSize;
+		Metrics::Add(pReceived, 1);
+		
+		if (_Trace.nStart > 0 && _Trace.bDone == false && IsReceived() == true) {
+			TraceDone("chunks");
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We are getting the file only so that we can pass it on to nNode, so we 
+// 		dont need to keep all of it.  Only nMax chunks are waiting to be sent 
+// 		or being asked for at a time.  Once a chunk has been sent to the node, 
+// 		it is only kept while there is room (see ChunkSent).
+void FileInfo::SetWindow(int nNode, int nMax)
+{
+	ASSERT(nNode > 0 && nMax > 0);
+	ASSERT(_bLocal == false);
+	
+	_Window.nNode = nNode;
+	_Window.nMax = nMax;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Something other than nNode wants the file (nNode is 0 for a client), 
+// 		so we need all of it after all.  The chunks we have already let go 
+// 		of need to be got again, and the ones we kept are part of the file 
+// 		again.
+void FileInfo::EndWindow(int nNode)
+{
+	int nCount;
+	
+	if (_Window.nNode > 0 && _Window.nNode != nNode) {
+		_Window.nNode = 0;
+		_Window.nMax = 0;
+		
+		if (_RemoteFile.pChunkList != NULL) {
+			for (nCount=0; nCount < _RemoteFile.nChunks; nCount++) {
+				if (_RemoteFile.pChunkList[nCount] != NULL && _RemoteFile.pChunkList[nCount]->nNode == CHUNK_PASSED) {
+					ASSERT(_RemoteFile.pChunkList[nCount]->pData == NULL);
+					_RemoteFile.pChunkList[nCount]->nNode = 0;
+				}
+				else if (_RemoteFile.pChunkList[nCount] != NULL) {
+					Uncache(_RemoteFile.pChunkList[nCount]);
+				}
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if we are only passing the file on, and already have as 
+// 		many chunks as we are allowed, either waiting to be sent or still 
+// 		being got.  The nodes should wait until some of them have been sent 
+// 		before asking for any more.  The ones that have been sent dont 
+// 		count.
+bool FileInfo::IsWindowFull(void)
+{
+	bool bFull = false;
+	int nCount, nHeld;
+	
+	if (_Window.nMax > 0 && _RemoteFile.pChunkList != NULL) {
+		nHeld = 0;
+		for (nCount=0; nCount < _RemoteFile.nChunks; nCount++) {
+			if (_RemoteFile.pChunkList[nCount] != NULL) {
+				if ((_RemoteFile.pChunkList[nCount]->pData != NULL && _RemoteFile.pChunkList[nCount]->nNode != CHUNK_SENT) || _RemoteFile.pChunkList[nCount]->nNode > 0) {
+					nHeld++;
+				}
+			}
+		}
+		
+		if (nHeld >= _Window.nMax) {
+			bFull = true;
+		}
+	}
+	
+	return(bFull);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A chunk has been sent to a node.  If it is the node that we are 
+// 		passing the file on to, the chunk no longer counts against the 
+// 		window, but we keep it in case it is asked for again.  If that takes 
+// 		the chunks kept like this over CHUNK_CACHE_MAX, we let go of ours, 
+// 		the ones nearest the start of the file first, since they were sent 
+// 		the longest ago.
+void FileInfo::ChunkSent(int nChunk, int nNode)
+{
+	Chunk *pChunk;
+	int nCount;
+	
+	ASSERT(nChunk > 0 && nNode > 0);
+	
+	if (_Window.nNode == nNode && _bLocal == false && _RemoteFile.pChunkList != NULL) {
+		ASSERT(nChunk <= _RemoteFile.nChunks);
+		ASSERT(_RemoteFile.pChunkList[nChunk-1] != NULL);
+		ASSERT(_RemoteFile.pChunkList[nChunk-1]->pData != NULL);
+		
+		// it might have been sent already, and been asked for again.
+		pChunk = _RemoteFile.pChunkList[nChunk-1];
+		if (pChunk->nNode != CHUNK_SENT) {
+			pChunk->nNode = CHUNK_SENT;
+			_nCached += pChunk->nLength;
+		}
+		
+		for (nCount=0; nCount < _RemoteFile.nChunks && _nCached > CHUNK_CACHE_MAX; nCount++) {
+			pChunk = _RemoteFile.pChunkList[nCount];
+			if (pChunk != NULL && pChunk->nNode == CHUNK_SENT) {
+				Uncache(pChunk);
+				free(pChunk->pData);
+				pChunk->pData = NULL;
+				pChunk->nLength = 0;
+				pChunk->nNode = CHUNK_PASSED;
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If a chunk was being kept after it was passed on, it isnt counted as 
+// 		one any more.  It is either about to go, or is part of the file 
+// 		again.
+void FileInfo::Uncache(Chunk *pChunk)
+{
+	ASSERT(pChunk != NULL);
+	
+	if (pChunk->nNode == CHUNK_SENT) {
+		ASSERT(pChunk->pData != NULL && pChunk->nLength > 0);
+		_nCached -= pChunk->nLength;
+		ASSERT(_nCached >= 0);
+		pChunk->nNode = 0;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the bytes of the chunks that are being kept after they were 
+// 		passed on, in all of the files.
+long long FileInfo::GetCachedBytes(void)
+{
+	ASSERT(_nCached >= 0);
+	return(_nCached);
 }
 
 
@@ -314,12 +536,11 @@ void FileInfo::RemoveNode(int nNode)
 	int nCount;
 	
 	ASSERT(nNode > 0);
-	if (_bLocal == false) {
+	if (_bLocal == false && _RemoteFile.pChunkList != NULL) {
 		ASSERT(_RemoteFile.nChunks > 0);
-		ASSERT(_RemoteFile.pChunkList != NULL);
 		
 		for (nCount=0; nCount < _RemoteFile.nChunks; nCount++) {
-			if (_RemoteFile.pChunkList[nCount] != NULL) {
+			if (_RemoteFile.pChunkList[nCount] != NULL && _RemoteFile.pChunkList[nCount]->pData == NULL) {
 				if (_RemoteFile.pChunkList[nCount]->nNode == nNode) {
 					_RemoteFile.pChunkList[nCount]->nNode = 0;
 				}
@@ -328,36 +549,184 @@ void FileInfo::RemoveNode(int nNode)
 	}
 }
 
+//-----------------------------------------------------------------------------
+// CJW: Count the chunks of a remote file that we have got, and the ones that 
+// 		have been asked of a node and havent arrived yet.
+void FileInfo::GetProgress(int *nReceived, int *nRequested)
+{
+	int nCount;
+	
+	ASSERT(nReceived != NULL && nRequested != NULL);
+	
+	*nReceived = 0;
+	*nRequested = 0;
+	if (_bLocal == false && _RemoteFile.pChunkList != NULL) {
+		for (nCount=0; nCount < _RemoteFile.nChunks; nCount++) {
+			if (_RemoteFile.pChunkList[nCount] != NULL) {
+				if (_RemoteFile.pChunkList[nCount]->pData != NULL) {
+					(*nReceived)++;
+				}
+				else if (_RemoteFile.pChunkList[nCount]->nNode > 0) {
+					(*nRequested)++;
+				}
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// CJW: A client has asked for the file and it isnt in our cache, so if we are 
+// 		tracing, the request starts now.  The file gets its own track in the 
+// 		trace.
+void FileInfo::TraceStart(void)
+{
+	ASSERT(_szFilename != NULL);
+	
+	if (Tracer::IsOn() == true && _Trace.nStart == 0) {
+		_Trace.nStart = Tracer::Now();
+		Tracer::NameTrack(Tracer::FileTrack(_szFilename), _szFilename);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A client has asked for a chunk that we dont have.  Only the first one 
+// 		is marked, since the client keeps asking until it arrives.
+void FileInfo::TraceMiss(void)
+{
+	if (_Trace.nStart > 0 && _Trace.bMissed == false) {
+		_Trace.bMissed = true;
+		Tracer::Instant(Tracer::FileTrack(_szFilename), "first miss", NULL, NULL, 0);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A search (F) has been sent out to the network.  The search span runs 
+// 		from the first one until a node replies or we give up.
+void FileInfo::TraceSearch(int nTtl)
+{
+	if (_Trace.nStart > 0 && _Trace.bDone == false) {
+		if (_Trace.nSearch == 0) {
+			_Trace.nSearch = Tracer::Now();
+		}
+		Tracer::Instant(Tracer::FileTrack(_szFilename), "F flood", NULL, "ttl", nTtl);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A reply (G) for the file has come back thru this node.
+void FileInfo::TraceReply(int nNode)
+{
+	if (_Trace.nStart > 0 && _Trace.bDone == false) {
+		Tracer::Instant(Tracer::FileTrack(_szFilename), "G reply", NULL, "node", nNode);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The search has finished, either because a holder was found or 
+// 		because it went as far as it could.
+void FileInfo::TraceSearchEnd(bool bFound)
+{
+	if (_Trace.nStart > 0 && _Trace.nSearch > 0) {
+		Tracer::Span(Tracer::FileTrack(_szFilename), "search", _Trace.nSearch, NULL, "found", bFound == true ? 1 : 0);
+		_Trace.nSearch = 0;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The request has finished, because we have all of the file or because 
+// 		it was removed from the list before we got it.  The key says which.  A 
+// 		search that is still out is ended first so that it stays inside the 
+// 		request span.
+void FileInfo::TraceDone(char *szKey)
+{
+	ASSERT(szKey != NULL);
+	
+	if (_Trace.nStart > 0 && _Trace.bDone == false) {
+		TraceSearchEnd(false);
+		Tracer::Span(Tracer::FileTrack(_szFilename), "request", _Trace.nStart, NULL, szKey, _RemoteFile.nChunks);
+		_Trace.bDone = true;
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: If there are any chunks we need for this file, return it.  We will 
-// 		return false if there are no more chunks needed for this file.  We will 
-// 		return true if all the chunks have been asked.
+// 		return false if there are no more chunks needed for this file (all the 
+// 		chunks have been asked).  We will return true if we found a chunk that 
+// 		still needs to be asked for.  If we dont know the length of the file 
+// 		yet, then we cant ask for any chunks.
 bool FileInfo::GetNextChunk(int *nChunk)
 {
-	bool bDone = true;
+	bool bFound = false;
 	int nCount;
 	
 	ASSERT(nChunk != NULL);
 	ASSERT(_bLocal == false);
 	
-	ASSERT(_RemoteFile.nChunks > 0);
-	ASSERT(_RemoteFile.pChunkList != NULL);
+	if (_RemoteFile.pChunkList != NULL) {
+		ASSERT(_RemoteFile.nChunks > 0);
 	
-	for (nCount=0; nCount < _RemoteFile.nChunks && bDone == true; nCount++) {
-		if (_RemoteFile.pChunkList[nCount] != NULL) {
-			if (_RemoteFile.pChunkList[nCount]->nNode == 0) {
-				_RemoteFile.pChunkList[nCount]->nNode = 0;
-				*nChunk = nCount + 1;
-				bDone = false;
+		for (nCount=0; nCount < _RemoteFile.nChunks && bFound == false; nCount++) {
+			if (_RemoteFile.pChunkList[nCount] != NULL) {
+				if (_RemoteFile.pChunkList[nCount]->nNode == 0 && _RemoteFile.pChunkList[nCount]->pData == NULL) {
+					*nChunk = nCount + 1;
+					bFound = true;
+				}
+			}
+			else {
+				*nChunk = nCount+1;
+				bFound = true;
 			}
 		}
-		else {
-			*nChunk = nCount+1;
-			bDone = false;
+	}
+	
+	return(bFound);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Find a run of chunks that still need to be asked for, starting from 
+// 		the end of the file and working backwards.  The nodes ask for chunks 
+// 		from the start of the file, so the mirror asks from the end so that 
+// 		they dont get in each others way.  The run will be no more than nMax 
+// 		chunks.  Returns false if there is nothing left to ask for.
+bool FileInfo::GetLastChunks(int nMax, int *nFirst, int *nCount)
+{
+	bool bFound = false;
+	int nLast = 0;
+	int i;
+	
+	ASSERT(nMax > 0);
+	ASSERT(nFirst != NULL && nCount != NULL);
+	ASSERT(_bLocal == false);
+	
+	if (_RemoteFile.pChunkList != NULL) {
+		ASSERT(_RemoteFile.nChunks > 0);
+		
+		for (i=_RemoteFile.nChunks-1; i >= 0 && (nLast == 0 || (nLast - i) <= nMax); i--) {
+			if (_RemoteFile.pChunkList[i] == NULL || (_RemoteFile.pChunkList[i]->nNode == 0 && _RemoteFile.pChunkList[i]->pData == NULL)) {
+				if (nLast == 0) { nLast = i + 1; }
+				*nFirst = i + 1;
+				bFound = true;
+			}
+			else if (nLast > 0) {
+				// the run has ended.
+				i = -1;
+			}
+		}
+		
+		if (bFound == true) {
+			*nCount = (nLast - *nFirst) + 1;
+			ASSERT(*nCount > 0 && *nCount <= nMax);
 		}
 	}
 	
-	return(bDone);
+	return(bFound);
 }
 
 
@@ -379,12 +748,14 @@ bool FileInfo::IsComplete(void)
 	
 	ASSERT(_bLocal == false);
 	
-	ASSERT(_RemoteFile.nChunks > 0);
-	ASSERT(_RemoteFile.pChunkList != NULL);
+	// if we dont know how big the file is, we cant have asked for all of it.
+	if (_RemoteFile.pChunkList == NULL) {
+		bComplete = false;
+	}
 	
 	for (nCount=_RemoteFile.nChunks-1; nCount >= 0 && bComplete == true; nCount--) {
 		if (_RemoteFile.pChunkList[nCount] != NULL) {
-			if (_RemoteFile.pChunkList[nCount]->nNode == 0) {
+			if (_RemoteFile.pChunkList[nCount]->nNode == 0 && _RemoteFile.pChunkList[nCount]->pData == NULL) {
 				bComplete = false;
 			}
 		}
@@ -398,6 +769,340 @@ bool FileInfo::IsComplete(void)
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: Unlike IsComplete, this checks that we have actually got the data for 
+// 		every chunk, and not just asked for them.
+bool FileInfo::IsReceived(void)
+{
+	bool bReceived = true;
+	int nCount;
+	
+	ASSERT(_bLocal == false);
+	
+	if (_RemoteFile.pChunkList == NULL) {
+		bReceived = false;
+	}
+	
+	for (nCount=_RemoteFile.nChunks-1; nCount >= 0 && bReceived == true; nCount--) {
+		if (_RemoteFile.pChunkList[nCount] == NULL) {
+			bReceived = false;
+		}
+		else if (_RemoteFile.pChunkList[nCount]->pData == NULL) {
+			bReceived = false;
+		}
+	}
+	
+	return(bReceived);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have got all of a remote file, and want to make sure it is the same 
+// 		as the one in the sync database before we keep it.  szSha256 is the 
+// 		checksum in hex.
+bool FileInfo::CheckSha256(char *pData, int nLength, char *szSha256)
+{
+	Sha256 sha;
+	unsigned char pDigest[SHA256_SIZE];
+	char szHex[(SHA256_SIZE*2)+1];
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(szSha256 != NULL);
+	
+	sha.Update(pData, nLength);
+	sha.Final(pDigest);
+	Sha256::ToHex(pDigest, szHex);
+	
+	return(strcasecmp(szHex, szSha256) == 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return a copy of all the data in a remote file that we have all of.  
+// 		The caller needs to free it.
+char * FileInfo::CopyData(int *nLength)
+{
+	char *pData;
+	int nCount, nPos;
+	
+	ASSERT(nLength != NULL);
+	ASSERT(_bLocal == false);
+	ASSERT(IsReceived() == true);
+	ASSERT(_nFileLength > 0);
+	
+	pData = (char *) malloc(_nFileLength);
+	ASSERT(pData != NULL);
+	
+	nPos = 0;
+	for (nCount=0; nCount < _RemoteFile.nChunks; nCount++) {
+		ASSERT((nPos + _RemoteFile.pChunkList[nCount]->nLength) <= _nFileLength);
+		memcpy(&pData[nPos], _RemoteFile.pChunkList[nCount]->pData, _RemoteFile.pChunkList[nCount]->nLength);
+		nPos += _RemoteFile.pChunkList[nCount]->nLength;
+	}
+	ASSERT(nPos == _nFileLength);
+	
+	*nLength = nPos;
+	return(pData);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have all the data for a remote file from somewhere else (such as 
+// 		a delta), so we fill in all the chunks.  The length of the file must 
+// 		already be set.  Any chunks we already had are kept.
+void FileInfo::SaveData(char *pData, int nLength)
+{
+	char *pChunk;
+	int nChunk, nSize;
+	
+	ASSERT(pData != NULL);
+	ASSERT(_bLocal == false);
+	ASSERT(nLength == _nFileLength);
+	ASSERT(_RemoteFile.pChunkList != NULL);
+	
+	for (nChunk=1; nChunk <= _RemoteFile.nChunks; nChunk++) {
+		nSize = nLength - ((nChunk - 1) * MAX_CHUNK_SIZE);
+		if (nSize > MAX_CHUNK_SIZE) { nSize = MAX_CHUNK_SIZE; }
+		ASSERT(nSize > 0);
+		
+		pChunk = (char *) malloc(nSize);
+		ASSERT(pChunk != NULL);
+		memcpy(pChunk, &pData[(nChunk - 1) * MAX_CHUNK_SIZE], nSize);
+		SaveChunk(pChunk, nChunk, nSize);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We are going to try and get a delta from an older version of the 
+// 		file that we have, instead of getting all of it.  A recipe is got the 
+// 		same way, but doesnt have a base (szBase is NULL).
+void FileInfo::SetDelta(char *szBase, char *szDelta)
+{
+	ASSERT(szDelta != NULL);
+	ASSERT(_Delta.szBase == NULL && _Delta.szName == NULL);
+	ASSERT(_bLocal == false);
+	
+	if (szBase != NULL) {
+		_Delta.szBase = strdup(szBase);
+		ASSERT(_Delta.szBase != NULL);
+	}
+	_Delta.szName = strdup(szDelta);
+	ASSERT(_Delta.szName != NULL);
+	_Delta.nStart = GetTimeMs();
+}
+
+
+//-----------------------------------------------------------------------------
+char * FileInfo::GetDeltaBase(void)
+{
+	return(_Delta.szBase);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the name of the delta we are trying to get, or NULL if we arent.
+char * FileInfo::GetDeltaName(void)
+{
+	return(_Delta.szName);
+}
+
+
+//-----------------------------------------------------------------------------
+long long FileInfo::GetDeltaTime(void)
+{
+	return(_Delta.nStart);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have finished with the delta (whether we got it or not).  If we 
+// 		didnt get it, the file will be got from the nodes like normal.
+void FileInfo::ClearDelta(void)
+{
+	if (_Delta.szBase != NULL) {
+		free(_Delta.szBase);
+		_Delta.szBase = NULL;
+	}
+	if (_Delta.szName != NULL) {
+		free(_Delta.szName);
+		_Delta.szName = NULL;
+	}
+	_Delta.nStart = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if we have already tried to write the file to the cache.
+bool FileInfo::IsSaved(void)
+{
+	return(_bSaved);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have received all of a remote file, so we write it into the cache 
+// 		directory, where it can be served from next time without going to 
+// 		the network.  This does all of it at once.  The network does the 
+// 		same thing in three parts, so that the slow part (WriteFile) can be 
+// 		done in the background.  Returns one of the FILE_SAVE_ values.
+int FileInfo::SaveFile(char *szPath, char *szSha256, bool bVerify)
+{
+	char *pData;
+	int nLength, nResult;
+	
+	ASSERT(szPath != NULL);
+	
+	pData = StartSave(&nLength);
+	nResult = WriteFile(szPath, _szFilename, pData, nLength, szSha256, bVerify);
+	free(pData);
+	EndSave(nResult);
+	
+	return(nResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Mark the file as saved, and return a copy of all of it to be written 
+// 		to the cache.  We only try once, whether it works or not, unless the 
+// 		chunks are dropped and got again.  The caller needs to free the copy.
+char * FileInfo::StartSave(int *nLength)
+{
+	ASSERT(nLength != NULL);
+	ASSERT(_szFilename != NULL);
+	ASSERT(_bLocal == false);
+	ASSERT(_bSaved == false);
+	
+	_bSaved = true;
+	return(CopyData(nLength));
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The file has been written to the cache (or not).  We keep count of 
+// 		how many times in a row it didnt match its checksum.
+void FileInfo::EndSave(int nResult)
+{
+	ASSERT(_bSaved == true);
+	
+	if (nResult == FILE_SAVE_BADSUM) {
+		_nBadSums++;
+	}
+	else if (nResult == FILE_SAVE_OK) {
+		_nBadSums = 0;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Write the data of a file into the cache directory.  If we know its 
+// 		checksum (szSha256, can be NULL), it has to match.  If bVerify is 
+// 		set, a file that we dont know the checksum of isnt saved at all.  It 
+// 		is written to a hidden temp file first and synced, then renamed, so 
+// 		that nobody (including pacman) can ever see half a file with the 
+// 		real name.  If the file is already there (the client might have put 
+// 		it there itself), we leave it alone.  This doesnt touch any FileInfo, 
+// 		so it can be used from another thread.  Returns one of the 
+// 		FILE_SAVE_ values.
+int FileInfo::WriteFile(char *szPath, char *szFilename, char *pData, int nLength, char *szSha256, bool bVerify)
+{
+	char szTemp[2048], szFinal[2048];
+	FILE *fp;
+	int nDir;
+	int nResult = FILE_SAVE_OK;
+	
+	ASSERT(szPath != NULL && szFilename != NULL);
+	ASSERT(pData != NULL && nLength > 0);
+	
+	// we dont write anything that could end up outside of the cache.
+	if (szFilename[0] == '.' || strchr(szFilename, '/') != NULL || (strlen(szPath) + strlen(szFilename) + 16) >= sizeof(szTemp)) {
+		nResult = FILE_SAVE_FAILED;
+	}
+	else {
+		sprintf(szTemp, "%s/.%s.pacsrv", szPath, szFilename);
+		sprintf(szFinal, "%s/%s", szPath, szFilename);
+		if (access(szFinal, F_OK) == 0) {
+			nResult = FILE_SAVE_EXISTS;
+		}
+		else if (szSha256 == NULL && bVerify == true) {
+			nResult = FILE_SAVE_UNVERIFIED;
+		}
+		else if (szSha256 != NULL && CheckSha256(pData, nLength, szSha256) == false) {
+			nResult = FILE_SAVE_BADSUM;
+		}
+	}
+	
+	if (nResult == FILE_SAVE_OK) {
+		fp = fopen(szTemp, "wb");
+		if (fp == NULL) {
+			nResult = FILE_SAVE_FAILED;
+		}
+		else {
+			if (fwrite(pData, 1, nLength, fp) != (size_t) nLength) {
+				nResult = FILE_SAVE_FAILED;
+			}
+			
+			if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+				nResult = FILE_SAVE_FAILED;
+			}
+			if (fclose(fp) != 0) {
+				nResult = FILE_SAVE_FAILED;
+			}
+			
+			if (nResult == FILE_SAVE_OK && rename(szTemp, szFinal) != 0) {
+				nResult = FILE_SAVE_FAILED;
+			}
+			
+			if (nResult != FILE_SAVE_OK) {
+				unlink(szTemp);
+			}
+			else {
+				// make sure the rename itself is on the disk.
+				nDir = open(szPath, O_RDONLY);
+				if (nDir >= 0) {
+					fsync(nDir);
+					close(nDir);
+				}
+			}
+		}
+	}
+	
+	return(nResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The file we got didnt match its checksum.  We dont know which of the 
+// 		chunks are bad, so we throw them all away, and the nodes will get the 
+// 		whole file again.  It will be checked again once we have it.
+void FileInfo::DropChunks(void)
+{
+	int nCount;
+	
+	ASSERT(_bLocal == false);
+	ASSERT(_RemoteFile.pChunkList != NULL);
+	
+	for (nCount=0; nCount < _RemoteFile.nChunks; nCount++) {
+		if (_RemoteFile.pChunkList[nCount] != NULL) {
+			Uncache(_RemoteFile.pChunkList[nCount]);
+			delete _RemoteFile.pChunkList[nCount];
+			_RemoteFile.pChunkList[nCount] = NULL;
+		}
+	}
+	_bSaved = false;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the number of times the file we got didnt match its checksum, 
+// 		since the last time it did.
+int FileInfo::GetBadSums(void)
+{
+	ASSERT(_nBadSums >= 0);
+	return(_nBadSums);
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: Return true if this file is being filled from a local file, rather than 
 // 		from the network of nodes.
@@ -407,31 +1112,198 @@ bool FileInfo::IsLocal(void)
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: If the local file couldnt be read (it was truncated or removed while 
+// 		we had it open), then we cant serve it, and the chunks that nodes are 
+// 		waiting for will never come.
+bool FileInfo::IsReadFailed(void)
+{
+	return(_LocalFile.bFailed);
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: Indicate that this file is going to be in use by a node (or client).   
 // 		We do this because we dont want this object to be destroyed before we 
-// 		have finished using it.
+// 		have finished using it.  Every FileStart must be matched by a 
+// 		FileComplete.
 void FileInfo::FileStart(void)
 {
+	ASSERT(_nUseCount >= 0);
+	_nUseCount ++;
 }
 
 
-
+//-----------------------------------------------------------------------------
+// CJW: Set the name of the file that this object represents.  This should 
+// 		only be done once, straight after the object is created.
 void FileInfo::SetFile(char *szFilename)
 {
 	ASSERT(szFilename != NULL);
 	ASSERT(_szFilename == NULL);
 	
+	_szFilename = (char *) malloc(strlen(szFilename) + 1);
+	ASSERT(_szFilename != NULL);
+	strcpy(_szFilename, szFilename);
 }
 
 
-
+//-----------------------------------------------------------------------------
+// CJW: We now know how big the file is (a node has told us).  Since we know 
+// 		how big it is, we know how many chunks there are, so we can create the 
+// 		array that the chunks will be stored in as they arrive.
 void FileInfo::SetLength(int nLength)
 {
 	ASSERT(nLength > 0);
 	ASSERT(_szFilename != NULL);
 	ASSERT(_nFileLength == 0);
+	ASSERT(_bLocal == false);
+	ASSERT(_RemoteFile.pChunkList == NULL && _RemoteFile.nChunks == 0);
+	
 	_nFileLength = nLength;
+	
+	_RemoteFile.nChunks = (nLength + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE;
+	_RemoteFile.pChunkList = (Chunk **) calloc(_RemoteFile.nChunks, sizeof(Chunk *));
+	ASSERT(_RemoteFile.pChunkList != NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Set the url that this file can be got from, so that some of it can be 
+// 		got from the mirror while the network is searched.  We only keep the 
+// 		first one we are given.
+void FileInfo::SetUrl(char *szUrl)
+{
+	ASSERT(szUrl != NULL);
+	
+	if (_szUrl == NULL && _nMirrorFails < MIRROR_MAX_FAILS) {
+		_szUrl = strdup(szUrl);
+		ASSERT(_szUrl != NULL);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the url of the file, or NULL if we dont know it.
+char * FileInfo::GetUrl(void)
+{
+	return(_szUrl);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A request to the mirror for this file has failed.  If it keeps 
+// 		failing, then we forget the url so that we stop trying, and the file 
+// 		will only be got from the network.
+void FileInfo::MirrorFailed(void)
+{
+	_nMirrorFails++;
+	if (_nMirrorFails >= MIRROR_MAX_FAILS && _szUrl != NULL) {
+		free(_szUrl);
+		_szUrl = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Keep track of the state of the network search for this file, and when 
+// 		it was set.
+void FileInfo::SetSearch(int nState)
+{
+	ASSERT(nState >= FILE_SEARCH_NONE && nState <= FILE_SEARCH_NOTFOUND);
+	_Search.nState = nState;
+	_Search.nTime = GetTimeMs();
+}
+
+int FileInfo::GetSearch(void)
+{
+	return(_Search.nState);
+}
+
+long long FileInfo::GetSearchTime(void)
+{
+	return(_Search.nTime);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The number of ms that we will wait for a reply to our search before we 
+// 		decide that the network doesnt have the file.
+void FileInfo::SetSearchWait(int nWait)
+{
+	ASSERT(nWait > 0);
+	_Search.nWait = nWait;
+}
+
+int FileInfo::GetSearchWait(void)
+{
+	return(_Search.nWait);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The TTL that the last search for this file was sent with.  If it isnt 
+// 		found, the next search goes further.
+void FileInfo::SetSearchTtl(int nTtl)
+{
+	ASSERT(nTtl > 0);
+	_Search.nTtl = nTtl;
+}
+
+int FileInfo::GetSearchTtl(void)
+{
+	return(_Search.nTtl);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Keep count of how many nodes we have sent the search to.  If it never 
+// 		got to any, then not finding the file doesnt tell us anything.
+void FileInfo::AddSearchNodes(int nNodes)
+{
+	ASSERT(nNodes >= 0);
+	_Search.nNodes += nNodes;
+}
+
+int FileInfo::GetSearchNodes(void)
+{
+	return(_Search.nNodes);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A node has replied to our search, so the network has the file.  
+void FileInfo::SearchFound(void)
+{
+	_Search.bFound = true;
+	if (_Search.nState == FILE_SEARCH_NOTFOUND) {
+		_Search.nState = FILE_SEARCH_SENT;
+	}
+}
+
+bool FileInfo::IsFound(void)
+{
+	return(_Search.bFound);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if we know how big this file is.  Remote files will not 
+// 		know this until one of the nodes has replied to our file request.
+bool FileInfo::HasLength(void)
+{
+	ASSERT(_nFileLength >= 0);
+	return(_nFileLength > 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the number of chunks that the file is made up of.  We must know 
+// 		the length of the file before this can be called.
+int FileInfo::GetChunkCount(void)
+{
+	ASSERT(_nFileLength > 0);
+	return((_nFileLength + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE);
 }
 
 
@@ -442,8 +1314,38 @@ int FileInfo::GetUseCount(void)
 }
 
 
-void FileInfo::SetLocal(void)
+//-----------------------------------------------------------------------------
+// CJW: The file is in our package cache, so we will open it and find out how 
+// 		long it is.  The file will stay open until this object is destroyed so 
+// 		that we can serve chunks out of it.  If we cant open the file, or it is 
+// 		empty, then we return false and the file is not treated as local.
+bool FileInfo::SetLocal(char *szPath)
 {	
-	_bLocal = true;
+	char szFull[2048];
+	
+	ASSERT(_szFilename != NULL);
+	ASSERT(_bLocal == false);
+	ASSERT(_LocalFile.pFilePtr == NULL);
+	ASSERT(_nFileLength == 0);
+	ASSERT(szPath != NULL);
+	
+	sprintf(szFull, "%s/%s", szPath, _szFilename);
+	_LocalFile.pFilePtr = fopen(szFull, "rb");
+	if (_LocalFile.pFilePtr != NULL) {
+		fseek(_LocalFile.pFilePtr, 0, SEEK_END);
+		_nFileLength = ftell(_LocalFile.pFilePtr);
+		fseek(_LocalFile.pFilePtr, 0, SEEK_SET);
+		_LocalFile.nLocation = 0;
+		
+		if (_nFileLength > 0) {
+			_bLocal = true;
+		}
+		else {
+			fclose(_LocalFile.pFilePtr);
+			_LocalFile.pFilePtr = NULL;
+			_nFileLength = 0;
+		}
+	}
+	
+	return(_bLocal);
 }
-
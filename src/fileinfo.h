@@ -39,6 +39,47 @@
 
 #include <stdio.h>
 
+//-----------------------------------------------------------------------------
+// Number of times a request to the mirror for a file can fail before we stop 
+// using the mirror for that file.
+#define MIRROR_MAX_FAILS	3
+
+
+//-----------------------------------------------------------------------------
+// The state of the search of the network for a remote file.  A search can be 
+// held back for a moment while we find out if the file is small enough to 
+// just get from the mirror instead.
+#define FILE_SEARCH_NONE	0
+#define FILE_SEARCH_PENDING	1
+#define FILE_SEARCH_SENT	2
+#define FILE_SEARCH_BYPASS	3
+#define FILE_SEARCH_NOTFOUND	4
+
+//-----------------------------------------------------------------------------
+// What happened when we tried to write a remote file into the package cache.
+#define FILE_SAVE_OK		0
+#define FILE_SAVE_EXISTS	1
+#define FILE_SAVE_FAILED	2
+#define FILE_SAVE_BADSUM	3
+#define FILE_SAVE_UNVERIFIED	4
+
+//-----------------------------------------------------------------------------
+// Number of times we will throw away a remote file that doesnt match its 
+// checksum and get it again, before we give up on it.
+#define FILE_MAX_BADSUMS	2
+
+//-----------------------------------------------------------------------------
+// A chunk that we have passed on and let go of, because we were only getting 
+// the file for another node.  It goes in Chunk::nNode.  A chunk that has been 
+// passed on is kept (as CHUNK_SENT) in case it is asked for again, until the 
+// chunks kept like this in all of the files come to more than 
+// CHUNK_CACHE_MAX bytes.  Then the file that is passing on a chunk lets go 
+// of its own, from the start of the file.
+#define CHUNK_PASSED		-1
+#define CHUNK_SENT			-2
+#define CHUNK_CACHE_MAX		(32*1024*1024)
+
+
 struct Chunk {
 
 	public:
@@ -74,6 +115,7 @@ class FileInfo
         bool GetChunk(int nChunk, char **pData, int *nSize, int *nLength);
 		void SaveChunk(char *pData, int nChunk, int nSize);
 		bool GetNextChunk(int *nChunk);
+		bool GetLastChunks(int nMax, int *nFirst, int *nCount);
 
 		FileInfo * GetNext(void);
 		void SetNext(FileInfo *pInfo);
@@ -83,31 +125,115 @@ class FileInfo
 		
 		void ChunkRequested(int nChunk, int nNode);
 		
+		void SetWindow(int nNode, int nMax);
+		void EndWindow(int nNode);
+		bool IsWindowFull(void);
+		void ChunkSent(int nChunk, int nNode);
+		static long long GetCachedBytes(void);
+		
 		void SetFile(char *szFilename);
-		void SetLocal(void);
+		bool SetLocal(char *szPath);
 		void SetLength(int nLength);
+		void SetUrl(char *szUrl);
+		char *GetUrl(void);
+		void MirrorFailed(void);
+		
+		void SetSearch(int nState);
+		int GetSearch(void);
+		long long GetSearchTime(void);
+		void SetSearchWait(int nWait);
+		int GetSearchWait(void);
+		void SetSearchTtl(int nTtl);
+		int GetSearchTtl(void);
+		void AddSearchNodes(int nNodes);
+		int GetSearchNodes(void);
+		void SearchFound(void);
+		bool IsFound(void);
 		
 		char *GetFilename(void);
 		bool IsLocal(void);
+		bool IsReadFailed(void);
 		bool IsComplete(void);
+		bool IsReceived(void);
+		bool HasLength(void);
+		bool IsSaved(void);
+		int SaveFile(char *szPath, char *szSha256, bool bVerify);
+		char * StartSave(int *nLength);
+		void EndSave(int nResult);
+		static int WriteFile(char *szPath, char *szFilename, char *pData, int nLength, char *szSha256, bool bVerify);
+		void DropChunks(void);
+		int GetBadSums(void);
+		static bool CheckSha256(char *pData, int nLength, char *szSha256);
+		char * CopyData(int *nLength);
+		void SaveData(char *pData, int nLength);
+		
+		void SetDelta(char *szBase, char *szDelta);
+		char * GetDeltaBase(void);
+		char * GetDeltaName(void);
+		long long GetDeltaTime(void);
+		void ClearDelta(void);
 		
 		int GetUseCount(void);
 		void RemoveNode(int nNode);
 		
 		int GetLength(void);
+		int GetChunkCount(void);
+		void GetProgress(int *nReceived, int *nRequested);
+		
+		void TraceStart(void);
+		void TraceMiss(void);
+		void TraceSearch(int nTtl);
+		void TraceReply(int nNode);
+		void TraceSearchEnd(bool bFound);
+		void TraceDone(char *szKey);
 		
     protected:
 
     private:
+        static long long _nCached;	// bytes of CHUNK_SENT chunks, in all files.
+        
+        void Uncache(Chunk *pChunk);
+        
         FileInfo *_pNext;
 		char *_szFilename;
+		char *_szUrl;
+		int _nMirrorFails;
+		
+		struct {
+			int nState;
+			long long nTime;	// time (ms) the state was set.
+			int nWait;			// ms to wait for a reply before it is not found.
+			int nTtl;			// how far the last search was sent.
+			int nNodes;			// nodes the searches have been sent to.
+			bool bFound;		// a node has told us it has the file.
+		} _Search;
 		int _nFileLength;
 		int _nUseCount;
 		bool _bLocal;
+		bool _bSaved;		// we have tried to write the file to the cache.
+		int _nBadSums;		// times it didnt match its checksum.
+		
+		// While we are trying to get a delta for the file, it isnt got from 
+		// the nodes itself.
+		struct {
+			char *szBase;		// older version of the file that we have.
+			char *szName;		// name of the delta we are getting.
+			long long nStart;	// time (ms) we started trying.
+		} _Delta;
+		
+		// Times (from Tracer::Now) for the trace of a request for the file.  
+		// nStart is 0 if it isnt being traced.
+		struct {
+			long long nStart;	// a client asked for it.
+			long long nSearch;	// the search was sent, 0 if it isnt out.
+			bool bMissed;		// a client has asked for a chunk we didnt have.
+			bool bDone;
+		} _Trace;
 		
 		struct {
 			FILE *pFilePtr;
 			int nLocation;
+			bool bFailed;		// the file couldnt be read, so it cant be served.
 			Chunk chunk;
 		} _LocalFile;
 		
@@ -115,6 +241,14 @@ class FileInfo
 			Chunk **pChunkList;
 			int nChunks;
 		} _RemoteFile;
+		
+		// When we are only getting the file to pass on to one node, we keep 
+		// no more than nMax chunks at a time that havent been sent to it 
+		// yet.  The ones that have been sent are kept while there is room.
+		struct {
+			int nNode;			// node we are passing it to, 0 if we arent.
+			int nMax;
+		} _Window;
 };
 
 
@@ -33,12 +33,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 
 #include <DevPlus.h>
 
 #include "filelist.h"
+#include "common.h"
 
 
 //---------------------------------------------------------------------
@@ -46,6 +50,8 @@
 FileList::FileList()
 {
     _pList = NULL;
+    _szPath = strdup(PKG_PATH);
+    ASSERT(_szPath != NULL);
 }
     
 //---------------------------------------------------------------------
@@ -60,6 +66,10 @@ FileList::~FileList()
         pTmp->SetNext(NULL);
         delete pTmp;
     }
+    
+    ASSERT(_szPath != NULL);
+    free(_szPath);
+    _szPath = NULL;
 }
     
 
@@ -100,23 +110,32 @@ FileInfo * FileList::GetFileInfo(char *szFilename)
 //
 //	TODO: Need to check the filename for funky chars...
 FileInfo * FileList::LoadFile(char *szFilename)
+{
+	ASSERT(szFilename != NULL);
+	ASSERT(_szPath != NULL);
+	
+	return(LoadFile(szFilename, _szPath));
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Same as above, but the file is in a different directory to the 
+// 		package cache (such as the deltas that we make).
+FileInfo * FileList::LoadFile(char *szFilename, char *szPath)
 {
 	FileInfo *pInfo = NULL;
-	char szPath[2048];
 	
-	ASSERT(szFilename != NULL);
+	ASSERT(szFilename != NULL && szPath != NULL);
 	
-	sprintf(szPath, "/var/cache/pacman/pkg/%s", szFilename);
-	if (access(szPath, R_OK) == 0) {
+	pInfo = new FileInfo;
+	pInfo->SetFile(szFilename);
+	if (pInfo->SetLocal(szPath) == true) {
 		// The file was found, so we add it to our local list of files.
-		
-		pInfo = new FileInfo;
-		pInfo->SetFile(szFilename);
-		pInfo->SetLocal();
 		AddFile(pInfo);
 	}
 	else {
-		ASSERT(pInfo == NULL);
+		delete pInfo;
+		pInfo = NULL;
 	}
 
 	return(pInfo);
@@ -202,18 +221,411 @@ void FileList::RemoveNode(int nNode)
 }
 
 
+//---------------------------------------------------------------------
+// CJW: Set the directory that local files are loaded from, and that 
+// 		completed files are saved to.
+void FileList::SetPath(char *szPath)
+{
+	ASSERT(szPath != NULL && szPath[0] != '\0');
+	ASSERT(_szPath != NULL);
+	
+	free(_szPath);
+	_szPath = strdup(szPath);
+	ASSERT(_szPath != NULL);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the directory that local files are in.
+char * FileList::GetPath(void)
+{
+	ASSERT(_szPath != NULL);
+	return(_szPath);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Package files are named <name>-<version>-<release>-<arch>.pkg.tar.*, 
+// 		and the name itself can have '-' in it.  We return the length of the 
+// 		name, and the part from the arch onwards, which two versions of the 
+// 		same package will have the same.
+bool FileList::SplitPackage(char *szFilename, int *nName, char **szTail)
+{
+	bool bSplit = false;
+	char *pExt;
+	int nPos, nDashes;
+	
+	ASSERT(szFilename != NULL && nName != NULL && szTail != NULL);
+	
+	pExt = strstr(szFilename, ".pkg.tar");
+	if (pExt != NULL) {
+		nDashes = 0;
+		nPos = pExt - szFilename;
+		while (nPos > 0 && nDashes < 3) {
+			nPos--;
+			if (szFilename[nPos] == '-') {
+				nDashes++;
+				if (nDashes == 1) {
+					*szTail = &szFilename[nPos];
+				}
+			}
+		}
+		
+		if (nDashes == 3 && nPos > 0) {
+			*nName = nPos;
+			bSplit = true;
+		}
+	}
+	
+	return(bSplit);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Compare one part of a version (the epoch, version or release) the 
+// 		way pacman does.  The strings are split into runs of digits and 
+// 		runs of letters, and the runs are compared in turn, numbers by 
+// 		their value and letters alphabetically.  A number is always newer 
+// 		than letters, so 1.0 is newer than 1.0rc1.  Returns less than 0 if 
+// 		szA is older, 0 if they are the same, and more than 0 if it is 
+// 		newer.
+int FileList::CompareSegments(char *szA, char *szB)
+{
+	char *pA, *pB, *pStartA, *pStartB;
+	int nLenA, nLenB, nResult = 0;
+	bool bNum, bDone = false;
+	
+	ASSERT(szA != NULL && szB != NULL);
+	
+	pA = szA;
+	pB = szB;
+	while (bDone == false && *pA != '\0' && *pB != '\0') {
+		pStartA = pA;
+		pStartB = pB;
+		while (*pA != '\0' && isalnum(*pA) == 0) { pA++; }
+		while (*pB != '\0' && isalnum(*pB) == 0) { pB++; }
+		
+		if (*pA == '\0' || *pB == '\0') {
+			bDone = true;
+		}
+		else if ((pA - pStartA) != (pB - pStartB)) {
+			// more separators means a newer version (1..0 against 1.0).
+			nResult = ((pA - pStartA) < (pB - pStartB)) ? -1 : 1;
+			bDone = true;
+		}
+		else {
+			pStartA = pA;
+			pStartB = pB;
+			bNum = (isdigit(*pA) != 0);
+			if (bNum == true) {
+				while (isdigit(*pA) != 0) { pA++; }
+				while (isdigit(*pB) != 0) { pB++; }
+			}
+			else {
+				while (isalpha(*pA) != 0) { pA++; }
+				while (isalpha(*pB) != 0) { pB++; }
+			}
+			
+			if (pB == pStartB) {
+				// a number against letters.
+				nResult = (bNum == true) ? 1 : -1;
+				bDone = true;
+			}
+			else {
+				if (bNum == true) {
+					while (*pStartA == '0' && pStartA < (pA - 1)) { pStartA++; }
+					while (*pStartB == '0' && pStartB < (pB - 1)) { pStartB++; }
+				}
+				
+				nLenA = pA - pStartA;
+				nLenB = pB - pStartB;
+				if (bNum == true && nLenA != nLenB) {
+					nResult = (nLenA < nLenB) ? -1 : 1;
+				}
+				else {
+					nResult = strncmp(pStartA, pStartB, (nLenA < nLenB) ? nLenA : nLenB);
+					if (nResult == 0 && nLenA != nLenB) {
+						nResult = (nLenA < nLenB) ? -1 : 1;
+					}
+				}
+				
+				if (nResult != 0) {
+					nResult = (nResult < 0) ? -1 : 1;
+					bDone = true;
+				}
+			}
+		}
+	}
+	
+	// one of them has run out.  Whatever is left over decides it, unless 
+	// it is only letters (1.0 is newer than 1.0a).
+	if (bDone == false || (nResult == 0 && (*pA != '\0' || *pB != '\0'))) {
+		if (*pA == '\0' && *pB == '\0') {
+			nResult = 0;
+		}
+		else if ((*pA == '\0' && isalpha(*pB) == 0) || isalpha(*pA) != 0) {
+			nResult = -1;
+		}
+		else {
+			nResult = 1;
+		}
+	}
+	
+	return(nResult);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Compare two versions in the form [epoch:]version[-release], the 
+// 		same way as pacman's vercmp.  A missing epoch is 0, and the 
+// 		releases are only compared if both of them have one.  Returns less 
+// 		than 0 if szA is older, 0 if they are the same, and more than 0 if 
+// 		it is newer.
+int FileList::CompareVersions(char *szA, char *szB)
+{
+	char szBufA[256], szBufB[256];
+	char *pEpochA, *pEpochB, *pVerA, *pVerB, *pRelA, *pRelB, *pTmp;
+	int nResult;
+	
+	ASSERT(szA != NULL && szB != NULL);
+	
+	strncpy(szBufA, szA, sizeof(szBufA) - 1);
+	szBufA[sizeof(szBufA) - 1] = '\0';
+	strncpy(szBufB, szB, sizeof(szBufB) - 1);
+	szBufB[sizeof(szBufB) - 1] = '\0';
+	
+	pEpochA = (char *) "0";
+	pVerA = szBufA;
+	for (pTmp = szBufA; isdigit(*pTmp) != 0; pTmp++) { }
+	if (*pTmp == ':') {
+		*pTmp = '\0';
+		pEpochA = szBufA;
+		pVerA = pTmp + 1;
+		if (pEpochA[0] == '\0') { pEpochA = (char *) "0"; }
+	}
+	pRelA = strrchr(pVerA, '-');
+	if (pRelA != NULL) {
+		*pRelA = '\0';
+		pRelA++;
+	}
+	
+	pEpochB = (char *) "0";
+	pVerB = szBufB;
+	for (pTmp = szBufB; isdigit(*pTmp) != 0; pTmp++) { }
+	if (*pTmp == ':') {
+		*pTmp = '\0';
+		pEpochB = szBufB;
+		pVerB = pTmp + 1;
+		if (pEpochB[0] == '\0') { pEpochB = (char *) "0"; }
+	}
+	pRelB = strrchr(pVerB, '-');
+	if (pRelB != NULL) {
+		*pRelB = '\0';
+		pRelB++;
+	}
+	
+	nResult = CompareSegments(pEpochA, pEpochB);
+	if (nResult == 0) {
+		nResult = CompareSegments(pVerA, pVerB);
+		if (nResult == 0 && pRelA != NULL && pRelB != NULL) {
+			nResult = CompareSegments(pRelA, pRelB);
+		}
+	}
+	
+	return(nResult);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Copy the [epoch:]version-release part out of a package filename.  
+// 		Returns false if it isnt a package, or the version wont fit.
+bool FileList::GetVersion(char *szFilename, char *szVersion, int nMax)
+{
+	char *szTail;
+	int nName, nLen;
+	bool bOk = false;
+	
+	ASSERT(szFilename != NULL && szVersion != NULL && nMax > 0);
+	
+	if (SplitPackage(szFilename, &nName, &szTail) == true) {
+		nLen = szTail - &szFilename[nName + 1];
+		if (nLen > 0 && nLen < nMax) {
+			strncpy(szVersion, &szFilename[nName + 1], nLen);
+			szVersion[nLen] = '\0';
+			bOk = true;
+		}
+	}
+	
+	return(bOk);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Compare two versions of the same package by their filenames.  If 
+// 		pacman would say they are the same version, the one that was put in 
+// 		the cache last is taken to be the newer.
+int FileList::ComparePackages(char *szA, time_t tA, char *szB, time_t tB)
+{
+	char szVerA[256], szVerB[256];
+	int nResult = 0;
+	
+	ASSERT(szA != NULL && szB != NULL);
+	
+	if (GetVersion(szA, szVerA, sizeof(szVerA)) == true && GetVersion(szB, szVerB, sizeof(szVerB)) == true) {
+		nResult = CompareVersions(szVerA, szVerB);
+	}
+	
+	if (nResult == 0 && tA != tB) {
+		nResult = (tA < tB) ? -1 : 1;
+	}
+	
+	return(nResult);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Look in the package cache for an older version of the same package 
+// 		(same name, arch and compression).  If there is more than one, we 
+// 		use the newest of them, by version the way pacman orders them, 
+// 		which is most likely the one that was installed.  szOlder needs to 
+// 		be nMax long.
+bool FileList::FindOlder(char *szFilename, char *szOlder, int nMax)
+{
+	DIR *pDir;
+	struct dirent *pEntry;
+	struct stat st;
+	char szPath[2048];
+	char *szTail, *szEntryTail;
+	int nName, nEntryName;
+	time_t tNewest = 0;
+	bool bFound = false;
+	
+	ASSERT(szFilename != NULL && szOlder != NULL && nMax > 0);
+	ASSERT(_szPath != NULL);
+	
+	if (SplitPackage(szFilename, &nName, &szTail) == true) {
+		pDir = opendir(_szPath);
+		if (pDir != NULL) {
+			while ((pEntry = readdir(pDir)) != NULL) {
+				if (pEntry->d_name[0] != '.' && strcmp(pEntry->d_name, szFilename) != 0 && (int) strlen(pEntry->d_name) < nMax) {
+					if (SplitPackage(pEntry->d_name, &nEntryName, &szEntryTail) == true) {
+						if (nEntryName == nName && strncmp(pEntry->d_name, szFilename, nName) == 0 && strcmp(szEntryTail, szTail) == 0) {
+							if ((strlen(_szPath) + strlen(pEntry->d_name) + 2) < sizeof(szPath)) {
+								sprintf(szPath, "%s/%s", _szPath, pEntry->d_name);
+								// we dont have the file yet, so only its 
+								// version can be compared.
+								if (stat(szPath, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && ComparePackages(pEntry->d_name, 0, szFilename, 0) < 0) {
+									if (bFound == false || ComparePackages(pEntry->d_name, st.st_mtime, szOlder, tNewest) > 0) {
+										strcpy(szOlder, pEntry->d_name);
+										tNewest = st.st_mtime;
+										bFound = true;
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+			closedir(pDir);
+		}
+	}
+	
+	return(bFound);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Check that the base is the version of the package that came just 
+// 		before the target in the package cache, ordering them the same way 
+// 		FindOlder does.  We only make deltas between versions like this, 
+// 		otherwise any node could have us make one between any two files we 
+// 		have.
+bool FileList::IsAdjacent(char *szTarget, char *szBase)
+{
+	DIR *pDir;
+	struct dirent *pEntry;
+	struct stat st, stTarget, stBase;
+	char szPath[2048];
+	char *szTail, *szBaseTail, *szEntryTail;
+	int nName, nBaseName, nEntryName;
+	bool bAdjacent = false;
+	
+	ASSERT(szTarget != NULL && szBase != NULL);
+	ASSERT(_szPath != NULL);
+	
+	if (strcmp(szTarget, szBase) != 0 && SplitPackage(szTarget, &nName, &szTail) == true && SplitPackage(szBase, &nBaseName, &szBaseTail) == true) {
+		if (nName == nBaseName && strncmp(szTarget, szBase, nName) == 0 && strcmp(szTail, szBaseTail) == 0 && (strlen(_szPath) + strlen(szTarget) + strlen(szBase) + 2) < sizeof(szPath)) {
+			sprintf(szPath, "%s/%s", _szPath, szTarget);
+			if (stat(szPath, &stTarget) == 0 && S_ISREG(stTarget.st_mode) && stTarget.st_size > 0) {
+				sprintf(szPath, "%s/%s", _szPath, szBase);
+				if (stat(szPath, &stBase) == 0 && S_ISREG(stBase.st_mode) && stBase.st_size > 0 && ComparePackages(szBase, stBase.st_mtime, szTarget, stTarget.st_mtime) < 0) {
+					bAdjacent = true;
+				}
+			}
+		}
+	}
+	
+	// there cant be another version between them.
+	if (bAdjacent == true) {
+		pDir = opendir(_szPath);
+		if (pDir == NULL) {
+			bAdjacent = false;
+		}
+		else {
+			while (bAdjacent == true && (pEntry = readdir(pDir)) != NULL) {
+				if (pEntry->d_name[0] != '.' && strcmp(pEntry->d_name, szTarget) != 0 && strcmp(pEntry->d_name, szBase) != 0) {
+					if (SplitPackage(pEntry->d_name, &nEntryName, &szEntryTail) == true) {
+						if (nEntryName == nName && strncmp(pEntry->d_name, szTarget, nName) == 0 && strcmp(szEntryTail, szTail) == 0) {
+							if ((strlen(_szPath) + strlen(pEntry->d_name) + 2) < sizeof(szPath)) {
+								sprintf(szPath, "%s/%s", _szPath, pEntry->d_name);
+								if (stat(szPath, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && ComparePackages(pEntry->d_name, st.st_mtime, szBase, stBase.st_mtime) > 0 && ComparePackages(pEntry->d_name, st.st_mtime, szTarget, stTarget.st_mtime) < 0) {
+									bAdjacent = false;
+								}
+							}
+						}
+					}
+				}
+			}
+			closedir(pDir);
+		}
+	}
+	
+	return(bAdjacent);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the first file in the list, so that the whole list can 
+// 		be gone thru with FileInfo::GetNext().
+FileInfo * FileList::GetFirst(void)
+{
+	return(_pList);
+}
+
+
 //---------------------------------------------------------------------
 // CJW: Look in our list to find the first remote file that is 
-// 		incomplete.  
+// 		incomplete.  Files that we are not searching the network for 
+// 		(yet) are skipped, and so are files that we are trying to get a 
+// 		delta for.
 FileInfo * FileList::GetNextFile(void)
+{
+	return(GetNextFile(_pList));
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Same as above, but start looking from this file in the list (which 
+// 		can be NULL if we are at the end).
+FileInfo * FileList::GetNextFile(FileInfo *pFrom)
 {
 	FileInfo *pInfo = NULL;
 	FileInfo *pTmp;
 	
-	pTmp = _pList;
+	pTmp = pFrom;
 	while (pTmp != NULL && pInfo == NULL) {
 		
-		if (pTmp->IsLocal() == false) {
+		if (pTmp->IsLocal() == false && pTmp->GetSearch() != FILE_SEARCH_PENDING && pTmp->GetSearch() != FILE_SEARCH_BYPASS && pTmp->GetDeltaName() == NULL) {
 			if (pTmp->IsComplete() == false) {
 				pInfo = pTmp;
 			}
@@ -39,6 +39,7 @@ class FileList
 {
     private:
         FileInfo *_pList;
+        char *_szPath;      // the package cache that local files are in.
     
     public:
         FileList();
@@ -48,13 +49,26 @@ class FileList
         FileInfo * LoadFile(char *szFilename);
         FileInfo * GetFileInfo(char *szFilename);
 		FileInfo * GetNextFile(void);
+		FileInfo * GetNextFile(FileInfo *pFrom);
+		FileInfo * GetFirst(void);
+		FileInfo * LoadFile(char *szFilename, char *szPath);
+		bool FindOlder(char *szFilename, char *szOlder, int nMax);
+		bool IsAdjacent(char *szTarget, char *szBase);
+		static int CompareVersions(char *szA, char *szB);
 		void Process(void);
 		
 		void RemoveNode(int nNode);
 		
+		void SetPath(char *szPath);
+		char * GetPath(void);
+		
     
     protected:
 		void AddFile(FileInfo *pInfo);
+		static bool SplitPackage(char *szFilename, int *nName, char **szTail);
+		static int CompareSegments(char *szA, char *szB);
+		static bool GetVersion(char *szFilename, char *szVersion, int nMax);
+		static int ComparePackages(char *szA, time_t tA, char *szB, time_t tB);
 };
 
 
@@ -38,6 +38,7 @@
 #include <string.h>
 
 #include "logger.h"
+#include "metrics.h"
 
 //---------------------------------------------------------------------------
 // CJW: 
@@ -48,41 +49,52 @@ DpLock Logger::_xLock;
 char *Logger::_pFileStr = NULL;
 int Logger::_nMax = 0;
 
+strLogRing * volatile Logger::_pRings = NULL;
+pthread_key_t Logger::_xRingKey;
+pthread_once_t Logger::_xRingOnce = PTHREAD_ONCE_INIT;
+pthread_t Logger::_xWriter;
+volatile bool Logger::_bRunning = false;
+volatile bool Logger::_bStop = false;
+volatile unsigned int Logger::_nSeq = 0;
+volatile int Logger::_nLevel = LOG_LEVEL_SYSTEM;
+volatile int Logger::_nCategories = LOG_ALL;
+
+
+//---------------------------------------------------------------------------
+// CJW: Constructor.  There are a lot of these made (one for every function 
+//      that logs anything), so we dont lock to count them.
 Logger::Logger()
 {
-    _xLock.Lock();
     ASSERT(_nInstances >= 0);
-
-    if (_nInstances == 0) {
-        ASSERT(_pFileStr == NULL);
-        ASSERT(_pFile == NULL);
-    }
-
-    _nInstances ++;
-    ASSERT(_nInstances > 0);
-
-    _xLock.Unlock();
+    __sync_add_and_fetch(&_nInstances, 1);
 }
 
 
+//---------------------------------------------------------------------------
+// CJW: Deconstructor.  When the last one goes, we let the writer thread 
+//      finish writing what is in the rings, and close the file.
 Logger::~Logger()
 {
-    _xLock.Lock();
     ASSERT(_nInstances > 0);
 
-    _nInstances --;
-    ASSERT(_nInstances >= 0);
-
-    if (_nInstances == 0) {
+    if (__sync_sub_and_fetch(&_nInstances, 1) == 0) {
+        Stop();
+        
+        _xLock.Lock();
         if(_pFile != NULL) {
+            WriteRings();
             fclose(_pFile);
+            _pFile = NULL;
         }
+        _xLock.Unlock();
     }
-
-    _xLock.Unlock();
 }
 
 
+//---------------------------------------------------------------------------
+// CJW: Open the log file, and start the thread that writes to it.  If the 
+//      thread cant be started, the lines are written by the thread that logs 
+//      them instead.
 void Logger::Init(char *file, int max)
 {
     ASSERT(file != NULL);
@@ -92,6 +104,7 @@ void Logger::Init(char *file, int max)
     ASSERT(_pFile == NULL);
     ASSERT(_pFileStr == NULL);
     ASSERT(_nMax == 0);
+    ASSERT(_bRunning == false);
     
     _pFileStr = (char *) malloc(strlen(file) + 1);
     strcpy(_pFileStr, file);
@@ -102,6 +115,11 @@ void Logger::Init(char *file, int max)
     _pFile = fopen(file, "a");
     ASSERT(_pFile);
     
+    _bStop = false;
+    if (pthread_create(&_xWriter, NULL, WriterThread, NULL) == 0) {
+        _bRunning = true;
+    }
+    
     _xLock.Unlock();
 }
 
@@ -132,72 +150,514 @@ void Logger::CycleLogs(void)
     rename(str1, str2);
 }
 
-void Logger::WriteOut(char sub, char *log)
+
+//---------------------------------------------------------------------------
+// CJW: The key for each thread's ring is only made once, by whichever 
+//      thread logs first.
+void Logger::MakeKey(void)
+{
+    pthread_key_create(&_xRingKey, FreeRing);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Return the ring for the calling thread, making it the first time the 
+//      thread logs anything.  The new ring is put on the front of the list, 
+//      and the writer only ever reads the list, so the lock is only needed 
+//      against other threads adding rings (or the writer removing them).
+strLogRing * Logger::GetRing(void)
+{
+    strLogRing *pRing;
+    
+    pthread_once(&_xRingOnce, MakeKey);
+    pRing = (strLogRing *) pthread_getspecific(_xRingKey);
+    if (pRing == NULL) {
+        pRing = (strLogRing *) malloc(sizeof(strLogRing));
+        if (pRing != NULL) {
+            pRing->nHead = 0;
+            pRing->nTail = 0;
+            pRing->nDropped = 0;
+            pRing->nReported = 0;
+            pRing->bDead = false;
+            
+            _xLock.Lock();
+            pRing->pNext = _pRings;
+            __sync_synchronize();
+            _pRings = pRing;
+            _xLock.Unlock();
+            
+            pthread_setspecific(_xRingKey, pRing);
+        }
+    }
+    
+    return(pRing);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: The thread that owned the ring has ended.  The writer will free it 
+//      once it has written out what is left in it.
+void Logger::FreeRing(void *pRing)
+{
+    ASSERT(pRing != NULL);
+    __sync_synchronize();
+    ((strLogRing *) pRing)->bDead = true;
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Put a line into the ring of the calling thread.  This is the only 
+//      part of logging that the thread waits for.  There is no lock and no 
+//      malloc.  The arguments are copied into the next free record as they 
+//      are, and the writer formats them.  If the format has something in it 
+//      that we cant copy, it is formatted here instead.  If the ring is 
+//      full, the line is dropped and counted.
+void Logger::WriteOut(char sub, const char *str, va_list ap)
+{
+    strLogRing *pRing;
+    strLogRecord *pRecord;
+    va_list aq;
+    
+    pRing = GetRing();
+    if (pRing != NULL) {
+        if ((pRing->nHead - pRing->nTail) >= LOG_RING_SIZE) {
+            pRing->nDropped++;
+        }
+        else {
+            pRecord = &pRing->pRecords[pRing->nHead & (LOG_RING_SIZE - 1)];
+            va_copy(aq, ap);
+            if (Pack(str, aq, pRecord->szLine) == true) {
+                pRecord->szFormat = str;
+            }
+            else {
+                vsnprintf(pRecord->szLine, LOG_RECORD_SIZE, str, ap);
+                pRecord->szFormat = NULL;
+            }
+            va_end(aq);
+            pRecord->cSub = sub;
+            pRecord->tTime = time(NULL);
+            pRecord->nSeq = __sync_fetch_and_add(&_nSeq, 1);
+            
+            // the record has to be there before the writer can see it.
+            __sync_synchronize();
+            pRing->nHead++;
+        }
+        
+        if (_bRunning == false && _pFile != NULL) {
+            _xLock.Lock();
+            if (_pFile != NULL) {
+                WriteRings();
+            }
+            _xLock.Unlock();
+        }
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Write out everything that is in the rings, oldest first, so the lines 
+//      from the different threads are in the order they were logged.  Then 
+//      note any lines that were dropped, and free the rings of any threads 
+//      that have ended.  Returns true if anything was written.  Needs to be 
+//      called while locked.
+bool Logger::WriteRings(void)
 {
-    char ldate[32]; 
-    time_t currtime;
+    strLogRing *pRing, *pOldest, *pPrev, *pNext;
+    strLogRecord *pRecord;
+    char szLine[MAX_LOG_LINE];
+    char ldate[32];
+    time_t tLast = 0;
     struct tm vtime;
+    unsigned int nDropped;
+    bool bWritten = false;
+    
+    ASSERT(_pFile != NULL);
+    
+    ldate[0] = '\0';
+    do {
+        pOldest = NULL;
+        pRing = _pRings;
+        while (pRing != NULL) {
+            if (pRing->nTail != pRing->nHead) {
+                __sync_synchronize();
+                if (pOldest == NULL || (int) (pRing->pRecords[pRing->nTail & (LOG_RING_SIZE - 1)].nSeq - pOldest->pRecords[pOldest->nTail & (LOG_RING_SIZE - 1)].nSeq) < 0) {
+                    pOldest = pRing;
+                }
+            }
+            pRing = pRing->pNext;
+        }
+        
+        if (pOldest != NULL) {
+            pRecord = &pOldest->pRecords[pOldest->nTail & (LOG_RING_SIZE - 1)];
+            if (pRecord->tTime != tLast || ldate[0] == '\0') {
+                tLast = pRecord->tTime;
+                localtime_r(&tLast, &vtime);
+                sprintf(ldate, "%04d%02d%02d-%02d%02d%02d", vtime.tm_year+1900, vtime.tm_mon+1, vtime.tm_mday, vtime.tm_hour, vtime.tm_min, vtime.tm_sec);
+            }
+            if (pRecord->szFormat != NULL) {
+                Unpack(pRecord, szLine, sizeof(szLine));
+                fprintf(_pFile, "%s,%c,%s\n", ldate, pRecord->cSub, szLine);
+            }
+            else {
+                fprintf(_pFile, "%s,%c,%s\n", ldate, pRecord->cSub, pRecord->szLine);
+            }
+            
+            // the thread can have the record back once we are done with it.
+            __sync_synchronize();
+            pOldest->nTail++;
+            bWritten = true;
+        }
+    } while (pOldest != NULL);
     
-    time(&currtime);
-    localtime_r(&currtime, &vtime);
-    sprintf(ldate, "%04d%02d%02d-%02d%02d%02d", vtime.tm_year+1900, vtime.tm_mon+1, vtime.tm_mday, vtime.tm_hour, vtime.tm_min, vtime.tm_sec);
+    pPrev = NULL;
+    pRing = _pRings;
+    while (pRing != NULL) {
+        pNext = pRing->pNext;
+        nDropped = pRing->nDropped;
+        if (nDropped != pRing->nReported) {
+            fprintf(_pFile, "%s,E,Log ring full, %u lines dropped.\n", ldate[0] != '\0' ? ldate : "-", nDropped - pRing->nReported);
+            Metrics::Add(Metrics::Counter("pacsrv_log_dropped_total", "Log lines dropped because the ring was full."), nDropped - pRing->nReported);
+            pRing->nReported = nDropped;
+            bWritten = true;
+        }
+        
+        if (pRing->bDead == true && pRing->nTail == pRing->nHead) {
+            if (pPrev == NULL) {
+                _pRings = pNext;
+            }
+            else {
+                pPrev->pNext = pNext;
+            }
+            free(pRing);
+        }
+        else {
+            pPrev = pRing;
+        }
+        pRing = pNext;
+    }
+    
+    if (bWritten == true) {
+        fflush(_pFile);
+    }
+    
+    return(bWritten);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: The writer thread.  It writes whatever is in the rings, and sleeps 
+//      for a bit when there is nothing.  When it is told to stop, it writes 
+//      out what is left first.
+void * Logger::WriterThread(void *pParam)
+{
+    bool bWritten;
+    
+    while (_bStop == false) {
+        _xLock.Lock();
+        bWritten = WriteRings();
+        _xLock.Unlock();
+        
+        if (bWritten == false) {
+            usleep(LOG_SLEEP * 1000);
+        }
+    }
     
     _xLock.Lock();
-    ASSERT(_pFile != NULL);
-    fprintf(_pFile, "%s,%c,%s\n", ldate, sub, log);
-    fflush(_pFile);
+    WriteRings();
     _xLock.Unlock();
+    
+    return(NULL);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Stop the writer thread, and wait for it to finish.  Must not be 
+//      called while locked, because the writer needs the lock to finish.
+void Logger::Stop(void)
+{
+    if (_bRunning == true) {
+        _bStop = true;
+        pthread_join(_xWriter, NULL);
+        _bRunning = false;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Go thru the format, and copy each of the arguments into pArgs (which 
+//      is LOG_RECORD_SIZE long) with its type.  Strings are copied, because 
+//      they might not be there by the time the writer gets to them, and are 
+//      cut short if there isnt room.  Returns false if there is something in 
+//      the format that we dont know how to copy.
+bool Logger::Pack(const char *str, va_list ap, char *pArgs)
+{
+    const char *p;
+    char *s;
+    int nPos = 0;
+    int nLong, nLen;
+    int i;
+    long l;
+    long long q;
+    double f;
+    void *v;
+    bool bOK = true;
+    
+    ASSERT(str != NULL && pArgs != NULL);
+    
+    p = str;
+    while (*p != '\0' && bOK == true) {
+        if (*p != '%') {
+            p++;
+        }
+        else if (p[1] == '%') {
+            p += 2;
+        }
+        else {
+            p++;
+            while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL) {
+                p++;
+            }
+            nLong = 0;
+            while (*p == 'l' || *p == 'h' || *p == 'z') {
+                if (*p != 'h') { nLong++; }
+                p++;
+            }
+            
+            // the biggest argument is a pointer or long long, plus its type.
+            if ((nPos + 1 + (int) sizeof(long long)) > LOG_RECORD_SIZE) {
+                bOK = false;
+            }
+            else {
+                switch (*p) {
+                    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+                        if (nLong == 0) {
+                            i = va_arg(ap, int);
+                            pArgs[nPos++] = LOG_ARG_INT;
+                            memcpy(&pArgs[nPos], &i, sizeof(i));
+                            nPos += sizeof(i);
+                        }
+                        else if (nLong == 1) {
+                            l = va_arg(ap, long);
+                            pArgs[nPos++] = LOG_ARG_LONG;
+                            memcpy(&pArgs[nPos], &l, sizeof(l));
+                            nPos += sizeof(l);
+                        }
+                        else {
+                            q = va_arg(ap, long long);
+                            pArgs[nPos++] = LOG_ARG_LONGLONG;
+                            memcpy(&pArgs[nPos], &q, sizeof(q));
+                            nPos += sizeof(q);
+                        }
+                        break;
+                        
+                    case 'e': case 'E': case 'f': case 'g': case 'G':
+                        f = va_arg(ap, double);
+                        pArgs[nPos++] = LOG_ARG_DOUBLE;
+                        memcpy(&pArgs[nPos], &f, sizeof(f));
+                        nPos += sizeof(f);
+                        break;
+                        
+                    case 'p':
+                        v = va_arg(ap, void *);
+                        pArgs[nPos++] = LOG_ARG_POINTER;
+                        memcpy(&pArgs[nPos], &v, sizeof(v));
+                        nPos += sizeof(v);
+                        break;
+                        
+                    case 's':
+                        s = va_arg(ap, char *);
+                        if (s == NULL) { s = (char *) "(null)"; }
+                        pArgs[nPos++] = LOG_ARG_STRING;
+                        nLen = strlen(s);
+                        if (nLen > (LOG_RECORD_SIZE - nPos - 1)) {
+                            nLen = LOG_RECORD_SIZE - nPos - 1;
+                        }
+                        memcpy(&pArgs[nPos], s, nLen);
+                        nPos += nLen;
+                        pArgs[nPos++] = '\0';
+                        break;
+                        
+                    default:
+                        // '*' widths, %n, and anything else.
+                        bOK = false;
+                        break;
+                }
+                if (*p != '\0') { p++; }
+            }
+        }
+    }
+    
+    return(bOK);
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Format a line from the arguments that Pack() copied.  Each part of the 
+//      format is given to snprintf with its own argument.
+void Logger::Unpack(strLogRecord *pRecord, char *szLine, int nMax)
+{
+    const char *p, *pStart;
+    char szSpec[32];
+    char *pArgs;
+    int nOut = 0;
+    int nSpec, n;
+    int i;
+    long l;
+    long long q;
+    double f;
+    void *v;
+    
+    ASSERT(pRecord != NULL && pRecord->szFormat != NULL);
+    ASSERT(szLine != NULL && nMax > 0);
+    
+    pArgs = pRecord->szLine;
+    p = pRecord->szFormat;
+    while (*p != '\0' && nOut < nMax - 1) {
+        if (*p != '%') {
+            szLine[nOut++] = *p++;
+        }
+        else if (p[1] == '%') {
+            szLine[nOut++] = '%';
+            p += 2;
+        }
+        else {
+            // the spec goes up to and including the conversion.
+            pStart = p;
+            p++;
+            while (*p != '\0' && strchr("-+ #0123456789.lhz", *p) != NULL) {
+                p++;
+            }
+            if (*p != '\0') { p++; }
+            nSpec = p - pStart;
+            if (nSpec >= (int) sizeof(szSpec)) { nSpec = sizeof(szSpec) - 1; }
+            memcpy(szSpec, pStart, nSpec);
+            szSpec[nSpec] = '\0';
+            
+            n = 0;
+            switch (*pArgs++) {
+                case LOG_ARG_INT:
+                    memcpy(&i, pArgs, sizeof(i));
+                    pArgs += sizeof(i);
+                    n = snprintf(&szLine[nOut], nMax - nOut, szSpec, i);
+                    break;
+                case LOG_ARG_LONG:
+                    memcpy(&l, pArgs, sizeof(l));
+                    pArgs += sizeof(l);
+                    n = snprintf(&szLine[nOut], nMax - nOut, szSpec, l);
+                    break;
+                case LOG_ARG_LONGLONG:
+                    memcpy(&q, pArgs, sizeof(q));
+                    pArgs += sizeof(q);
+                    n = snprintf(&szLine[nOut], nMax - nOut, szSpec, q);
+                    break;
+                case LOG_ARG_DOUBLE:
+                    memcpy(&f, pArgs, sizeof(f));
+                    pArgs += sizeof(f);
+                    n = snprintf(&szLine[nOut], nMax - nOut, szSpec, f);
+                    break;
+                case LOG_ARG_POINTER:
+                    memcpy(&v, pArgs, sizeof(v));
+                    pArgs += sizeof(v);
+                    n = snprintf(&szLine[nOut], nMax - nOut, szSpec, v);
+                    break;
+                case LOG_ARG_STRING:
+                    n = snprintf(&szLine[nOut], nMax - nOut, szSpec, pArgs);
+                    pArgs += strlen(pArgs) + 1;
+                    break;
+                default:
+                    ASSERT(0);
+                    break;
+            }
+            if (n > 0) {
+                nOut += n;
+                if (nOut > nMax - 1) { nOut = nMax - 1; }
+            }
+        }
+    }
+    szLine[nOut] = '\0';
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Set the level and categories to log, from the [log] part of the 
+//      config.  The level is error, system or test, and the categories are 
+//      all, or a list of main, server, client, network, node and cache.  
+//      Either one can be NULL to leave it how it is.
+void Logger::SetLevel(char *szLevel, char *szCategories)
+{
+    int nCategories;
+    
+    if (szLevel != NULL) {
+        if (strcmp(szLevel, "none") == 0)        { _nLevel = LOG_LEVEL_NONE; }
+        else if (strcmp(szLevel, "error") == 0)  { _nLevel = LOG_LEVEL_ERROR; }
+        else if (strcmp(szLevel, "system") == 0) { _nLevel = LOG_LEVEL_SYSTEM; }
+        else if (strcmp(szLevel, "test") == 0)   { _nLevel = LOG_LEVEL_TEST; }
+    }
+    
+    if (szCategories != NULL) {
+        nCategories = 0;
+        if (strstr(szCategories, "all") != NULL)     { nCategories |= LOG_ALL; }
+        if (strstr(szCategories, "main") != NULL)    { nCategories |= LOG_MAIN; }
+        if (strstr(szCategories, "server") != NULL)  { nCategories |= LOG_SERVER; }
+        if (strstr(szCategories, "client") != NULL)  { nCategories |= LOG_CLIENT; }
+        if (strstr(szCategories, "network") != NULL) { nCategories |= LOG_NETWORK; }
+        if (strstr(szCategories, "node") != NULL)    { nCategories |= LOG_NODE; }
+        if (strstr(szCategories, "cache") != NULL)   { nCategories |= LOG_CACHE; }
+        _nCategories = nCategories;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// CJW: Log a line.  Used by the LOG_ macros, which have already checked the 
+//      level and category.
+void Logger::Log(char sub, const char *str, ...)
+{
+    va_list ap;
+
+    ASSERT(str != NULL);
+
+    va_start(ap, str);
+    WriteOut(sub, str, ap);
+    va_end(ap);
 }
 
 
 void Logger::Test(char *str, ...)
 {
     va_list ap;
-    char *buffer;
 
     ASSERT(str != NULL);
 
-    buffer = (char *) malloc(MAX_LOG_LINE);
-    if (buffer) {
+    if (IsOn(LOG_LEVEL_TEST, LOG_MAIN) == true) {
         va_start(ap, str);
-        vsprintf(buffer, str, ap);
+        WriteOut('T', str, ap);
         va_end(ap);
-        WriteOut('T', buffer);
-        free(buffer);
     }
 }
 
 void Logger::System(char *str, ...)
 {
     va_list ap;
-    char *buffer;
 
     ASSERT(str != NULL);
 
-    buffer = (char *) malloc(MAX_LOG_LINE);
-    if (buffer) {
+    if (IsOn(LOG_LEVEL_SYSTEM, LOG_MAIN) == true) {
         va_start(ap, str);
-        vsprintf(buffer, str, ap);
+        WriteOut('S', str, ap);
         va_end(ap);
-        WriteOut('S', buffer);
-        free(buffer);
     }
 }
 
 void Logger::Error(char *str, ...)
 {
     va_list ap;
-    char *buffer;
 
     ASSERT(str != NULL);
 
-    buffer = (char *) malloc(MAX_LOG_LINE);
-    if (buffer) {
+    if (IsOn(LOG_LEVEL_ERROR, LOG_MAIN) == true) {
         va_start(ap, str);
-        vsprintf(buffer, str, ap);
+        WriteOut('E', str, ap);
         va_end(ap);
-        WriteOut('E', buffer);
-        free(buffer);
     }
 }
-
@@ -6,6 +6,10 @@
 // 
 //		This class is used to log information to the log file.  
 //
+//		Logging shouldnt hold up the threads that are moving data, so each 
+//		thread puts its lines into a ring of its own, without a lock, and a 
+//		background thread formats them and writes them out to the file.
+//
 //-----------------------------------------------------------------------------
 
 /***************************************************************************
@@ -34,12 +38,100 @@
 #define __LOGGER_H
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 #include <DpLock.h>
 
 #define TODO(st)		printf("%s (%d): %s\n", __FILE__, __LINE__, st);
 
 #define MAX_LOG_LINE	4096
 
+//-----------------------------------------------------------------------------
+// Each thread that logs gets its own ring of LOG_RING_SIZE records (a power 
+// of 2), and each record holds a line of up to LOG_RECORD_SIZE-1 characters.  
+// The lines are written to the file by a background thread, which looks at 
+// the rings every LOG_SLEEP ms.  If a ring is full, the line is dropped and 
+// counted, rather than holding up the thread.
+#define LOG_RING_SIZE	256
+#define LOG_RECORD_SIZE	512
+#define LOG_SLEEP		20
+
+//-----------------------------------------------------------------------------
+// Levels.  Anything above LOG_COMPILE_LEVEL isnt compiled in at all, and 
+// anything above the level in the config (level in [log]) is skipped at run 
+// time, before any of its arguments are looked at.
+#define LOG_LEVEL_NONE		0
+#define LOG_LEVEL_ERROR		1
+#define LOG_LEVEL_SYSTEM	2
+#define LOG_LEVEL_TEST		3
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL	LOG_LEVEL_TEST
+#endif
+
+// Categories, so that one part of the daemon can be logged without the rest 
+// (categories in [log]).
+#define LOG_MAIN			0x0001
+#define LOG_SERVER			0x0002
+#define LOG_CLIENT			0x0004
+#define LOG_NETWORK			0x0008
+#define LOG_NODE			0x0010
+#define LOG_CACHE			0x0020
+#define LOG_ALL				0xffff
+
+// The macros that the code logs with.  The format has to be a string 
+// literal, because it isnt used until the writer thread gets to the line.
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(cat, ...)		do { if (Logger::IsOn(LOG_LEVEL_ERROR, cat)) { Logger::Log('E', __VA_ARGS__); } } while (0)
+#else
+#define LOG_ERROR(cat, ...)		do { } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_SYSTEM
+#define LOG_SYSTEM(cat, ...)	do { if (Logger::IsOn(LOG_LEVEL_SYSTEM, cat)) { Logger::Log('S', __VA_ARGS__); } } while (0)
+#else
+#define LOG_SYSTEM(cat, ...)	do { } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_TEST
+#define LOG_TEST(cat, ...)		do { if (Logger::IsOn(LOG_LEVEL_TEST, cat)) { Logger::Log('T', __VA_ARGS__); } } while (0)
+#else
+#define LOG_TEST(cat, ...)		do { } while (0)
+#endif
+
+
+// If szFormat is NULL, szLine is the line.  Otherwise szLine has the 
+// arguments for the format, each one a type (LOG_ARG_*) and its value.
+struct strLogRecord {
+	unsigned int nSeq;			// so the lines from each thread go out in order.
+	time_t tTime;
+	char cSub;
+	const char *szFormat;
+	char szLine[LOG_RECORD_SIZE];
+};
+
+#define LOG_ARG_INT			'i'
+#define LOG_ARG_LONG		'l'
+#define LOG_ARG_LONGLONG	'q'
+#define LOG_ARG_DOUBLE		'f'
+#define LOG_ARG_STRING		's'
+#define LOG_ARG_POINTER		'p'
+
+
+// Only the thread that owns the ring moves the head, and only the writer 
+// moves the tail.
+struct strLogRing {
+	strLogRecord pRecords[LOG_RING_SIZE];
+	volatile unsigned int nHead;
+	volatile unsigned int nTail;
+	volatile unsigned int nDropped;
+	unsigned int nReported;		// drops that the writer has logged.
+	volatile bool bDead;		// the thread has gone, free it once it is empty.
+	strLogRing *pNext;
+};
+
+
 class Logger
 {
 	public:
@@ -52,18 +144,43 @@ class Logger
 		
 		void Init(char *file, int max=30);
 		
+		static void Log(char sub, const char *str, ...);
+		static void SetLevel(char *szLevel, char *szCategories);
+		static inline bool IsOn(int nLevel, int nCategory) {
+			return(nLevel <= _nLevel && (nCategory & _nCategories) != 0);
+		}
+		
 	protected:
 	private:
 		void CycleLogs(void);
-		void WriteOut(char sub, char *log);
+		static void WriteOut(char sub, const char *str, va_list ap);
+		static bool Pack(const char *str, va_list ap, char *pArgs);
+		static void Unpack(strLogRecord *pRecord, char *szLine, int nMax);
+		
+		static strLogRing * GetRing(void);
+		static void FreeRing(void *pRing);
+		static void * WriterThread(void *pParam);
+		static bool WriteRings(void);
+		static void Stop(void);
 		
 		static FILE *_pFile;
 		static int   _nInstances;
 		static DpLock _xLock;
 		static char *_pFileStr;
 		static int   _nMax;
+		
+		static strLogRing * volatile _pRings;
+		static pthread_key_t _xRingKey;
+		static pthread_once_t _xRingOnce;
+		static pthread_t _xWriter;
+		static volatile bool _bRunning;
+		static volatile bool _bStop;
+		static volatile unsigned int _nSeq;
+		static volatile int _nLevel;
+		static volatile int _nCategories;
+		
+		static void MakeKey(void);
 };
 
 
 #endif
-
@@ -0,0 +1,265 @@
+//-----------------------------------------------------------------------------
+// metrics.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See "metrics.h" for more information about this class.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <DevPlus.h>
+
+#include "metrics.h"
+#include "logger.h"
+
+
+strMetric *Metrics::_pList = NULL;
+DpLock Metrics::_xLock;
+
+
+//---------------------------------------------------------------------
+// CJW: Find the metric with this name, or add it if it isnt there.  The 
+// 		list is only ever added to, and new metrics go on the end, so it can 
+// 		be gone thru without the lock.
+strMetric * Metrics::Register(char *szName, char *szHelp, int nType)
+{
+	strMetric *pMetric, *pLast;
+	int i;
+	
+	ASSERT(szName != NULL && szHelp != NULL);
+	ASSERT(nType == METRIC_COUNTER || nType == METRIC_GAUGE || nType == METRIC_HISTOGRAM);
+	
+	_xLock.Lock();
+	
+	pLast = NULL;
+	pMetric = _pList;
+	while (pMetric != NULL && strcmp(pMetric->szName, szName) != 0) {
+		pLast = pMetric;
+		pMetric = pMetric->pNext;
+	}
+	
+	if (pMetric == NULL) {
+		pMetric = (strMetric *) malloc(sizeof(strMetric));
+		ASSERT(pMetric != NULL);
+		pMetric->szName = strdup(szName);
+		pMetric->szHelp = strdup(szHelp);
+		ASSERT(pMetric->szName != NULL && pMetric->szHelp != NULL);
+		pMetric->nType = nType;
+		pMetric->nValue = 0;
+		pMetric->nSum = 0;
+		pMetric->pBuckets = NULL;
+		if (nType == METRIC_HISTOGRAM) {
+			pMetric->pBuckets = (volatile long long *) malloc(sizeof(long long) * METRIC_BUCKETS);
+			ASSERT(pMetric->pBuckets != NULL);
+			for (i=0; i<METRIC_BUCKETS; i++) {
+				pMetric->pBuckets[i] = 0;
+			}
+		}
+		pMetric->pNext = NULL;
+		
+		__sync_synchronize();
+		if (pLast == NULL) {
+			_pList = pMetric;
+		}
+		else {
+			pLast->pNext = pMetric;
+		}
+	}
+	ASSERT(pMetric->nType == nType);
+	
+	_xLock.Unlock();
+	
+	return(pMetric);
+}
+
+
+//---------------------------------------------------------------------
+strMetric * Metrics::Counter(char *szName, char *szHelp)
+{
+	return(Register(szName, szHelp, METRIC_COUNTER));
+}
+
+
+//---------------------------------------------------------------------
+strMetric * Metrics::Gauge(char *szName, char *szHelp)
+{
+	return(Register(szName, szHelp, METRIC_GAUGE));
+}
+
+
+//---------------------------------------------------------------------
+strMetric * Metrics::Histogram(char *szName, char *szHelp)
+{
+	return(Register(szName, szHelp, METRIC_HISTOGRAM));
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the bucket that a value goes in.  Values below 8 have a 
+// 		bucket each.  Above that, the top bit picks the power of 2, and the 
+// 		next METRIC_SUB_BITS bits pick the bucket within it.
+int Metrics::GetBucket(long long nValue)
+{
+	int nBit;
+	int nBucket;
+	
+	if (nValue < 0) {
+		nValue = 0;
+	}
+	
+	if (nValue < (1 << METRIC_SUB_BITS)) {
+		nBucket = (int) nValue;
+	}
+	else {
+		nBit = 63 - __builtin_clzll((unsigned long long) nValue);
+		nBucket = (1 << METRIC_SUB_BITS) + ((nBit - METRIC_SUB_BITS) << METRIC_SUB_BITS) + (int) ((nValue >> (nBit - METRIC_SUB_BITS)) & ((1 << METRIC_SUB_BITS) - 1));
+	}
+	
+	ASSERT(nBucket >= 0 && nBucket < METRIC_BUCKETS);
+	return(nBucket);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the biggest value that goes in a bucket.
+long long Metrics::GetBucketTop(int nBucket)
+{
+	long long nTop;
+	int nShift, nSub;
+	
+	ASSERT(nBucket >= 0 && nBucket < METRIC_BUCKETS);
+	
+	if (nBucket < (1 << METRIC_SUB_BITS)) {
+		nTop = nBucket;
+	}
+	else {
+		nShift = (nBucket - (1 << METRIC_SUB_BITS)) >> METRIC_SUB_BITS;
+		nSub = (nBucket - (1 << METRIC_SUB_BITS)) & ((1 << METRIC_SUB_BITS) - 1);
+		nTop = (long long) ((((unsigned long long) ((1 << METRIC_SUB_BITS) + nSub + 1)) << nShift) - 1);
+	}
+	
+	return(nTop);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Add a value to a histogram.
+void Metrics::Record(strMetric *pMetric, long long nValue)
+{
+	ASSERT(pMetric != NULL);
+	ASSERT(pMetric->nType == METRIC_HISTOGRAM && pMetric->pBuckets != NULL);
+	
+	__sync_fetch_and_add(&pMetric->pBuckets[GetBucket(nValue)], 1);
+	__sync_fetch_and_add(&pMetric->nValue, 1);
+	__sync_fetch_and_add(&pMetric->nSum, nValue);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the value that nPercent of the values in a histogram are at 
+// 		or below (the top of the bucket it is in).  Returns 0 if the 
+// 		histogram is empty.
+long long Metrics::GetPercentile(strMetric *pMetric, int nPercent)
+{
+	long long nCount, nTotal, nWant;
+	long long nValue = 0;
+	int i;
+	
+	ASSERT(pMetric != NULL && pMetric->pBuckets != NULL);
+	ASSERT(nPercent >= 0 && nPercent <= 100);
+	
+	// the count can move while we look, so we add the buckets up ourselves.
+	nTotal = 0;
+	for (i=0; i<METRIC_BUCKETS; i++) {
+		nTotal += pMetric->pBuckets[i];
+	}
+	
+	if (nTotal > 0) {
+		nWant = ((nTotal * nPercent) + 99) / 100;
+		if (nWant < 1) { nWant = 1; }
+		nCount = 0;
+		for (i=0; i<METRIC_BUCKETS && nCount < nWant; i++) {
+			nCount += pMetric->pBuckets[i];
+			nValue = GetBucketTop(i);
+		}
+	}
+	
+	return(nValue);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the first metric in the list.  The rest are got with pNext.
+strMetric * Metrics::GetFirst(void)
+{
+	return(_pList);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the metric with this name, or NULL if nothing has registered 
+// 		it.  Like GetFirst, the list can be walked without the lock.
+strMetric * Metrics::Find(char *szName)
+{
+	strMetric *pMetric;
+	
+	ASSERT(szName != NULL);
+	
+	pMetric = _pList;
+	while (pMetric != NULL && strcmp(pMetric->szName, szName) != 0) {
+		pMetric = pMetric->pNext;
+	}
+	
+	return(pMetric);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Write all the metrics to the log.  Histograms are written as the 
+// 		count, mean and some percentiles.
+void Metrics::Log(void)
+{
+	strMetric *pMetric;
+	long long nCount;
+	
+	pMetric = _pList;
+	while (pMetric != NULL) {
+		if (pMetric->nType == METRIC_HISTOGRAM) {
+			nCount = pMetric->nValue;
+			if (nCount > 0) {
+				LOG_SYSTEM(LOG_MAIN, "[Metrics] %s count=%lld mean=%lld p50=%lld p90=%lld p99=%lld", pMetric->szName, nCount, pMetric->nSum / nCount, GetPercentile(pMetric, 50), GetPercentile(pMetric, 90), GetPercentile(pMetric, 99));
+			}
+		}
+		else {
+			LOG_SYSTEM(LOG_MAIN, "[Metrics] %s %lld", pMetric->szName, pMetric->nValue);
+		}
+		pMetric = pMetric->pNext;
+	}
+}
@@ -0,0 +1,103 @@
+//-----------------------------------------------------------------------------
+// metrics.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      A registry of counters, gauges and latency histograms, so that we can
+//      see what the daemon is doing without reading the logs.  Each metric
+//      is registered by name the first time it is asked for, and the code
+//      that updates it keeps the pointer.  Updates are a single atomic add
+//      (three for a histogram), with no lock, so they are left on all the
+//      time.
+//
+//      The histograms have a bucket for every value below 8, and then 8
+//      buckets for every power of 2, so a value is never more than 12.5% out
+//      wherever it is in the range (the same idea as an HDR histogram).
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <DpLock.h>
+
+//-----------------------------------------------------------------------------
+#define METRIC_COUNTER      1
+#define METRIC_GAUGE        2
+#define METRIC_HISTOGRAM    3
+
+// Number of sub-buckets for each power of 2 (as bits), and the number of 
+// buckets that covers every positive long long.
+#define METRIC_SUB_BITS     3
+#define METRIC_BUCKETS      (8 + ((63 - METRIC_SUB_BITS) << METRIC_SUB_BITS))
+
+// How often (seconds) the metrics are written to the log.
+#define METRICS_LOG_TIME    300
+
+
+struct strMetric {
+	char *szName;
+	char *szHelp;
+	int nType;
+	volatile long long nValue;      // the counter or gauge, or the number of values in a histogram.
+	volatile long long nSum;        // sum of the values in a histogram.
+	volatile long long *pBuckets;   // histogram only.
+	strMetric *pNext;
+};
+
+
+class Metrics 
+{
+    private:
+        static strMetric *_pList;
+        static DpLock _xLock;
+        
+        static strMetric * Register(char *szName, char *szHelp, int nType);
+    
+    public:
+        static strMetric * Counter(char *szName, char *szHelp);
+        static strMetric * Gauge(char *szName, char *szHelp);
+        static strMetric * Histogram(char *szName, char *szHelp);
+        
+        static inline void Add(strMetric *pMetric, long long nValue) {
+            __sync_fetch_and_add(&pMetric->nValue, nValue);
+        }
+        static inline void Set(strMetric *pMetric, long long nValue) {
+            pMetric->nValue = nValue;
+        }
+        static void Record(strMetric *pMetric, long long nValue);
+        
+        static int GetBucket(long long nValue);
+        static long long GetBucketTop(int nBucket);
+        static long long GetPercentile(strMetric *pMetric, int nPercent);
+        static strMetric * GetFirst(void);
+        static strMetric * Find(char *szName);
+        static void Log(void);
+};
+
+
+#endif
+
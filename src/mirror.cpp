@@ -0,0 +1,738 @@
+//-----------------------------------------------------------------------------
+// mirror.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+// 
+//      See "mirror.h" for more information about this class.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <DevPlus.h>
+
+#include "mirror.h"
+#include "resolver.h"
+#include "common.h"
+
+
+
+//-----------------------------------------------------------------------------
+// CJW: Constructor.  Nothing is started until Start() is called.
+Mirror::Mirror()
+{
+	_pNext = NULL;
+	_nID = 0;
+	_szFilename = NULL;
+	
+	_Url.szHost = NULL;
+	_Url.szPath = NULL;
+	_Url.nPort = 80;
+	
+	_nSocket = -1;
+	_tLastActivity = 0;
+	
+	_Status.bResolving = false;
+	_Status.bConnecting = false;
+	_Status.bSending = false;
+	_Status.bHeader = false;
+	_Status.bBody = false;
+	_Status.bDone = false;
+	_Status.bFailed = false;
+	
+	_Request.pData = NULL;
+	_Request.nLength = 0;
+	_Request.nSent = 0;
+	
+	_Header.pData = NULL;
+	_Header.nLength = 0;
+	_Header.nUsed = 0;
+	
+	_Range.nFirst = 0;
+	_Range.nCount = 0;
+	_Range.nStart = 0;
+	_Range.nEnd = 0;
+	_Range.nOffset = 0;
+	_Range.nLength = 0;
+	
+	_Current.pData = NULL;
+	_Current.nChunk = 0;
+	_Current.nSize = 0;
+	
+	_Ready.pData = NULL;
+	_Ready.nChunk = 0;
+	_Ready.nSize = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Deconstructor.  Close the socket if it is still open, and free 
+// 		anything we have allocated.  Any chunk that wasnt collected is lost.
+Mirror::~Mirror()
+{
+	ASSERT(_pNext == NULL);
+	
+	if (_nSocket >= 0) {
+		close(_nSocket);
+		_nSocket = -1;
+	}
+	
+	if (_szFilename != NULL)    { free(_szFilename);    _szFilename = NULL; }
+	if (_Url.szHost != NULL)    { free(_Url.szHost);    _Url.szHost = NULL; }
+	if (_Url.szPath != NULL)    { free(_Url.szPath);    _Url.szPath = NULL; }
+	if (_Request.pData != NULL) { free(_Request.pData); _Request.pData = NULL; }
+	if (_Header.pData != NULL)  { free(_Header.pData);  _Header.pData = NULL; }
+	if (_Current.pData != NULL) { free(_Current.pData); _Current.pData = NULL; }
+	if (_Ready.pData != NULL)   { free(_Ready.pData);   _Ready.pData = NULL; }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Split the url into the host, port and path.  We can only talk plain 
+// 		HTTP, so if it is anything else, then we return false and the file 
+// 		will only be got from the network.
+//
+//		http://host[:port][/path]
+bool Mirror::ParseUrl(char *szUrl)
+{
+	bool bValid = false;
+	char *szHost;
+	char *szPath;
+	char *szPort;
+	int nLength;
+	
+	ASSERT(szUrl != NULL);
+	ASSERT(_Url.szHost == NULL && _Url.szPath == NULL);
+	
+	if (strncasecmp(szUrl, "http://", 7) == 0) {
+		szHost = &szUrl[7];
+		szPath = strchr(szHost, '/');
+		if (szPath == NULL) {
+			nLength = strlen(szHost);
+			_Url.szPath = strdup("/");
+		}
+		else {
+			nLength = szPath - szHost;
+			_Url.szPath = strdup(szPath);
+		}
+		ASSERT(_Url.szPath != NULL);
+		
+		if (nLength > 0) {
+			_Url.szHost = (char *) malloc(nLength + 1);
+			ASSERT(_Url.szHost != NULL);
+			strncpy(_Url.szHost, szHost, nLength);
+			_Url.szHost[nLength] = '\0';
+			
+			_Url.nPort = 80;
+			szPort = strchr(_Url.szHost, ':');
+			if (szPort != NULL) {
+				*szPort = '\0';
+				_Url.nPort = atoi(&szPort[1]);
+			}
+			
+			if (_Url.szHost[0] != '\0' && _Url.nPort > 0 && _Url.nPort < 65536) {
+				bValid = true;
+			}
+		}
+	}
+	
+	return(bValid);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Start getting nCount chunks of the file, starting at chunk nFirst.  
+// 		The host is looked up and the connection is made in the background, 
+// 		and the request is sent when it is established.  If we dont know how 
+// 		long the file is yet, then the mirror might give us less than we 
+// 		asked for.  Returns false if we couldnt even start.
+bool Mirror::Start(char *szUrl, char *szFilename, int nFirst, int nCount)
+{
+	bool bStarted = false;
+	struct in_addr addr;
+	int nState;
+	
+	ASSERT(szUrl != NULL && szFilename != NULL);
+	ASSERT(nFirst > 0 && nCount > 0);
+	ASSERT(_nSocket < 0);
+	ASSERT(_szFilename == NULL);
+	
+	_szFilename = strdup(szFilename);
+	ASSERT(_szFilename != NULL);
+	
+	_Range.nFirst = nFirst;
+	_Range.nCount = nCount;
+	_Range.nStart = (nFirst - 1) * MAX_CHUNK_SIZE;
+	_Range.nEnd = _Range.nStart + (nCount * MAX_CHUNK_SIZE);
+	_Range.nOffset = _Range.nStart;
+	
+	if (ParseUrl(szUrl) == true) {
+		if (inet_aton(_Url.szHost, &addr) != 0) {
+			bStarted = StartConnect(&addr);
+		}
+		else {
+			nState = Resolver::Lookup(_Url.szHost, &addr);
+			if (nState == RESOLVE_OK) {
+				bStarted = StartConnect(&addr);
+			}
+			else if (nState == RESOLVE_PENDING) {
+				// Process() will connect when the lookup has finished.
+				_Status.bResolving = true;
+				_tLastActivity = time(NULL);
+				bStarted = true;
+			}
+		}
+	}
+	
+	if (bStarted == false) {
+		_Status.bFailed = true;
+	}
+	
+	return(bStarted);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Start the connection to the webserver, and get the request ready to 
+// 		send when it is established.
+bool Mirror::StartConnect(struct in_addr *pAddr)
+{
+	bool bStarted = false;
+	struct sockaddr_in sin;
+	int nFlags;
+	
+	ASSERT(pAddr != NULL);
+	ASSERT(_nSocket < 0);
+	ASSERT(_Url.szHost != NULL && _Url.szPath != NULL);
+	
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(_Url.nPort);
+	sin.sin_addr = *pAddr;
+	
+	_nSocket = socket(AF_INET, SOCK_STREAM, 0);
+	if (_nSocket >= 0) {
+		nFlags = fcntl(_nSocket, F_GETFL, 0);
+		fcntl(_nSocket, F_SETFL, nFlags | O_NONBLOCK);
+		
+		if (connect(_nSocket, (struct sockaddr *) &sin, sizeof(sin)) == 0 || errno == EINPROGRESS) {
+			_Status.bConnecting = true;
+			_tLastActivity = time(NULL);
+			
+			_Request.pData = (char *) malloc(strlen(_Url.szPath) + strlen(_Url.szHost) + 160);
+			ASSERT(_Request.pData != NULL);
+			_Request.nLength = sprintf(_Request.pData, 
+				"GET %s HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"Range: bytes=%d-%d\r\n"
+				"User-Agent: pacsrv\r\n"
+				"Connection: close\r\n\r\n", 
+				_Url.szPath, _Url.szHost, _Range.nStart, _Range.nEnd - 1);
+			_Request.nSent = 0;
+			
+			bStarted = true;
+		}
+		else {
+			close(_nSocket);
+			_nSocket = -1;
+		}
+	}
+	
+	return(bStarted);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We are waiting for the host to be looked up.  Once it has been, we 
+// 		can start the connection.
+bool Mirror::ProcessResolve(void)
+{
+	bool bActivity = false;
+	struct in_addr addr;
+	int nState;
+	
+	ASSERT(_Status.bResolving == true);
+	ASSERT(_Url.szHost != NULL);
+	
+	nState = Resolver::Lookup(_Url.szHost, &addr);
+	if (nState != RESOLVE_PENDING) {
+		_Status.bResolving = false;
+		bActivity = true;
+		if (nState != RESOLVE_OK || StartConnect(&addr) == false) {
+			Fail();
+		}
+	}
+	
+	return(bActivity);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Do whatever needs to be done next, without waiting.  This should be 
+// 		called regularly until it returns MIRROR_DONE or MIRROR_FAILED.  It 
+// 		returns MIRROR_BUSY if something was done, so it can be called again 
+// 		straight away, or MIRROR_IDLE if we are waiting on the webserver.  Any 
+// 		chunk that is ready must be collected with GetChunk(), because we 
+// 		wont read any more from the socket until it is.
+int Mirror::Process(void)
+{
+	int nResult = MIRROR_IDLE;
+	bool bActivity = false;
+	
+	if (_Status.bFailed == false && _Status.bDone == false) {
+		if (_Status.bResolving == true) {
+			bActivity = ProcessResolve();
+		}
+		else if (_Status.bConnecting == true) {
+			bActivity = ProcessConnect();
+		}
+		else if (_Status.bSending == true) {
+			bActivity = ProcessSend();
+		}
+		else if (_Status.bHeader == true) {
+			bActivity = ProcessHeader();
+		}
+		else if (_Status.bBody == true && _Ready.pData == NULL) {
+			bActivity = ProcessBody();
+		}
+		
+		if (bActivity == true || _Ready.pData != NULL) {
+			_tLastActivity = time(NULL);
+		}
+		else if ((time(NULL) - _tLastActivity) > MIRROR_TIMEOUT) {
+			Fail();
+		}
+	}
+	
+	if (_Status.bFailed == true) {
+		nResult = MIRROR_FAILED;
+	}
+	else if (_Status.bDone == true && _Ready.pData == NULL) {
+		nResult = MIRROR_DONE;
+	}
+	else if (bActivity == true) {
+		nResult = MIRROR_BUSY;
+	}
+	
+	return(nResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Check to see if the connection has been established yet.  If it has, 
+// 		then we can start sending the request.
+bool Mirror::ProcessConnect(void)
+{
+	bool bActivity = false;
+	struct pollfd fds;
+	int nError;
+	socklen_t nLen;
+	
+	ASSERT(_nSocket >= 0);
+	
+	fds.fd = _nSocket;
+	fds.events = POLLOUT;
+	fds.revents = 0;
+	
+	if (poll(&fds, 1, 0) > 0) {
+		nError = 0;
+		nLen = sizeof(nError);
+		if (getsockopt(_nSocket, SOL_SOCKET, SO_ERROR, &nError, &nLen) == 0 && nError == 0) {
+			_Status.bConnecting = false;
+			_Status.bSending = true;
+			bActivity = true;
+		}
+		else {
+			Fail();
+		}
+	}
+	
+	return(bActivity);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Send as much of the request as the socket will take.  When it has all 
+// 		been sent, we wait for the response header.
+bool Mirror::ProcessSend(void)
+{
+	bool bActivity = false;
+	int nSent;
+	
+	ASSERT(_nSocket >= 0);
+	ASSERT(_Request.pData != NULL && _Request.nSent < _Request.nLength);
+	
+	nSent = send(_nSocket, &_Request.pData[_Request.nSent], _Request.nLength - _Request.nSent, MSG_NOSIGNAL);
+	if (nSent > 0) {
+		_Request.nSent += nSent;
+		if (_Request.nSent >= _Request.nLength) {
+			_Status.bSending = false;
+			_Status.bHeader = true;
+		}
+		bActivity = true;
+	}
+	else if (nSent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		Fail();
+	}
+	
+	return(bActivity);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Receive the response header.  We might get some of the body at the 
+// 		same time, which is left in the header buffer to be used first.  
+bool Mirror::ProcessHeader(void)
+{
+	bool bActivity = false;
+	char *szEnd;
+	int nRecv;
+	
+	ASSERT(_nSocket >= 0);
+	
+	if (_Header.pData == NULL) {
+		_Header.pData = (char *) malloc(MIRROR_HEADER_MAX + 1);
+		ASSERT(_Header.pData != NULL);
+		_Header.nLength = 0;
+	}
+	
+	nRecv = recv(_nSocket, &_Header.pData[_Header.nLength], MIRROR_HEADER_MAX - _Header.nLength, MSG_DONTWAIT);
+	if (nRecv > 0) {
+		bActivity = true;
+		_Header.nLength += nRecv;
+		_Header.pData[_Header.nLength] = '\0';
+		
+		szEnd = strstr(_Header.pData, "\r\n\r\n");
+		if (szEnd != NULL) {
+			*szEnd = '\0';
+			_Header.nUsed = (szEnd - _Header.pData) + 4;
+			
+			if (ParseHeader() == true) {
+				_Status.bHeader = false;
+				_Status.bBody = true;
+			}
+			else {
+				Fail();
+			}
+		}
+		else if (_Header.nLength >= MIRROR_HEADER_MAX) {
+			Fail();
+		}
+	}
+	else if (nRecv == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		Fail();
+	}
+	
+	return(bActivity);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Look at the response header.  If the webserver understood our range 
+// 		request, then it will reply with a 206 and tell us the full length of 
+// 		the file in the Content-Range.  A simple webserver might ignore the 
+// 		range and send the whole file with a 200, in which case we skip over 
+// 		the part we dont want.  Anything else is a failure.  Returns false if 
+// 		we cant use the response.
+bool Mirror::ParseHeader(void)
+{
+	bool bValid = false;
+	int nStatus = 0;
+	int nFirst = -1;
+	int nLength = 0;
+	char *szLine;
+	
+	ASSERT(_Header.pData != NULL);
+	
+	if (sscanf(_Header.pData, "HTTP/%*d.%*d %d", &nStatus) == 1) {
+		szLine = strstr(_Header.pData, "\r\n");
+		while (szLine != NULL) {
+			szLine += 2;
+			if (nStatus == 206 && strncasecmp(szLine, "Content-Range:", 14) == 0) {
+				if (sscanf(&szLine[14], " bytes %d-%*d/%d", &nFirst, &nLength) != 2) {
+					nLength = 0;
+				}
+			}
+			else if (nStatus == 200 && strncasecmp(szLine, "Content-Length:", 15) == 0) {
+				nFirst = 0;
+				nLength = atoi(&szLine[15]);
+			}
+			szLine = strstr(szLine, "\r\n");
+		}
+	}
+	
+	if (nLength > 0) {
+		if ((nStatus == 206 && nFirst == _Range.nStart) || (nStatus == 200 && nFirst == 0)) {
+			_Range.nLength = nLength;
+			_Range.nOffset = nFirst;
+			if (_Range.nEnd > nLength) {
+				_Range.nEnd = nLength;
+			}
+			
+			if (_Range.nStart >= _Range.nEnd) {
+				// there is nothing in the range we asked for.
+				_Status.bDone = true;
+				close(_nSocket);
+				_nSocket = -1;
+			}
+			bValid = true;
+		}
+	}
+	
+	return(bValid);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Receive some of the body.  We use what was left over from the header 
+// 		first, and then read from the socket straight into the chunk we are 
+// 		filling.  We never take more than is needed to finish the current 
+// 		chunk, so that when a chunk is finished it can be moved to the ready 
+// 		slot and we wait for it to be collected.
+bool Mirror::ProcessBody(void)
+{
+	bool bActivity = false;
+	char buffer[4096];
+	char *pData;
+	int nChunkStart, nChunkEnd;
+	int nWant, nRecv, nSkip;
+	bool bCopy;
+	
+	ASSERT(_Ready.pData == NULL);
+	ASSERT(_Range.nLength > 0);
+	ASSERT(_Range.nOffset < _Range.nEnd);
+	
+	// work out which chunk the next byte belongs to, and where it ends.
+	if (_Range.nOffset < _Range.nStart) {
+		nChunkStart = _Range.nStart;
+	}
+	else {
+		nChunkStart = _Range.nOffset - (_Range.nOffset % MAX_CHUNK_SIZE);
+	}
+	nChunkEnd = nChunkStart + MAX_CHUNK_SIZE;
+	if (nChunkEnd > _Range.nEnd) {
+		nChunkEnd = _Range.nEnd;
+	}
+	nWant = nChunkEnd - _Range.nOffset;
+	ASSERT(nWant > 0);
+	
+	if (_Range.nOffset >= _Range.nStart && _Current.pData == NULL) {
+		_Current.pData = (char *) malloc(MAX_CHUNK_SIZE);
+		ASSERT(_Current.pData != NULL);
+		_Current.nChunk = (_Range.nOffset / MAX_CHUNK_SIZE) + 1;
+		_Current.nSize = 0;
+	}
+	
+	if (_Header.nUsed < _Header.nLength) {
+		nRecv = _Header.nLength - _Header.nUsed;
+		if (nRecv > nWant) { nRecv = nWant; }
+		pData = &_Header.pData[_Header.nUsed];
+		_Header.nUsed += nRecv;
+		bCopy = true;
+	}
+	else {
+		if (_Range.nOffset < _Range.nStart) {
+			// the webserver ignored the range, so we read what we dont want 
+			// into a scratch buffer.
+			if (nWant > (int) sizeof(buffer)) { nWant = sizeof(buffer); }
+			pData = buffer;
+			bCopy = true;
+		}
+		else {
+			ASSERT(_Current.nSize + nWant <= MAX_CHUNK_SIZE);
+			pData = &_Current.pData[_Current.nSize];
+			bCopy = false;
+		}
+		
+		nRecv = recv(_nSocket, pData, nWant, MSG_DONTWAIT);
+		if (nRecv == 0 || (nRecv < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			// the webserver closed the connection before we got everything.
+			Fail();
+		}
+	}
+	
+	if (nRecv > 0 && _Status.bFailed == false) {
+		bActivity = true;
+		
+		// skip over anything before the range we asked for.
+		nSkip = 0;
+		if (_Range.nOffset < _Range.nStart) {
+			nSkip = _Range.nStart - _Range.nOffset;
+			if (nSkip > nRecv) { nSkip = nRecv; }
+			_Range.nOffset += nSkip;
+		}
+		
+		if (nRecv > nSkip) {
+			if (_Current.pData == NULL) {
+				// we skipped up to the start of the range in this read.
+				_Current.pData = (char *) malloc(MAX_CHUNK_SIZE);
+				ASSERT(_Current.pData != NULL);
+				_Current.nChunk = (_Range.nOffset / MAX_CHUNK_SIZE) + 1;
+				_Current.nSize = 0;
+			}
+			ASSERT(_Current.nSize + (nRecv - nSkip) <= MAX_CHUNK_SIZE);
+			if (bCopy == true) {
+				memcpy(&_Current.pData[_Current.nSize], &pData[nSkip], nRecv - nSkip);
+			}
+			_Current.nSize += (nRecv - nSkip);
+			_Range.nOffset += (nRecv - nSkip);
+			
+			if (_Range.nOffset >= nChunkEnd) {
+				_Ready.pData = _Current.pData;
+				_Ready.nChunk = _Current.nChunk;
+				_Ready.nSize = _Current.nSize;
+				_Current.pData = NULL;
+				_Current.nChunk = 0;
+				_Current.nSize = 0;
+			}
+		}
+		
+		if (_Range.nOffset >= _Range.nEnd) {
+			_Status.bBody = false;
+			_Status.bDone = true;
+			close(_nSocket);
+			_nSocket = -1;
+		}
+	}
+	
+	return(bActivity);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Something went wrong, so we close the socket.  Chunks that were 
+// 		already collected are still good.
+void Mirror::Fail(void)
+{
+	if (_nSocket >= 0) {
+		close(_nSocket);
+		_nSocket = -1;
+	}
+	_Status.bFailed = true;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if we know how long the file is.  We know this as soon 
+// 		as we have the response header.
+bool Mirror::GetLength(int *nLength)
+{
+	bool bKnown = false;
+	
+	ASSERT(nLength != NULL);
+	
+	if (_Range.nLength > 0) {
+		*nLength = _Range.nLength;
+		bKnown = true;
+	}
+	
+	return(bKnown);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If we have a complete chunk, we hand it over and return true.  The 
+// 		caller is now responsible for the memory.  Chunks are numbered from 1, 
+// 		the same as in the FileInfo.
+bool Mirror::GetChunk(int *nChunk, char **pData, int *nSize)
+{
+	bool bGotIt = false;
+	
+	ASSERT(nChunk != NULL && pData != NULL && nSize != NULL);
+	
+	if (_Ready.pData != NULL) {
+		ASSERT(_Ready.nChunk > 0 && _Ready.nSize > 0);
+		*nChunk = _Ready.nChunk;
+		*pData = _Ready.pData;
+		*nSize = _Ready.nSize;
+		
+		_Ready.pData = NULL;
+		_Ready.nChunk = 0;
+		_Ready.nSize = 0;
+		bGotIt = true;
+	}
+	
+	return(bGotIt);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the name of the file we are getting.
+char * Mirror::GetFilename(void)
+{
+	ASSERT(_szFilename != NULL);
+	return(_szFilename);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the first chunk that we asked for.
+int Mirror::GetFirst(void)
+{
+	return(_Range.nFirst);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The mirror gets an ID from the same counter as the nodes, so that the 
+// 		FileInfo can tell which chunks it was asked for.
+void Mirror::SetID(int nID)
+{
+	ASSERT(nID > 0);
+	ASSERT(_nID == 0);
+	_nID = nID;
+}
+
+int Mirror::GetID(void)
+{
+	ASSERT(_nID > 0);
+	return(_nID);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The Network keeps its mirrors in a linked list.
+Mirror * Mirror::GetNext(void)
+{
+	return(_pNext);
+}
+
+void Mirror::SetNext(Mirror *pMirror)
+{
+	_pNext = pMirror;
+}
+
@@ -0,0 +1,152 @@
+//-----------------------------------------------------------------------------
+// mirror.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//		A mirror object gets a run of chunks of a file from the package 
+//		mirror, using an HTTP range request.  While the network is being 
+//		searched for a new package, the daemon will get parts of it straight 
+//		from the mirror, and the chunks are put in the same FileInfo as the 
+//		chunks that come from the nodes.  The socket is non-blocking and is 
+//		polled by the Network object, so it doesnt need its own thread.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __MIRROR_H
+#define __MIRROR_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+//-----------------------------------------------------------------------------
+// The states that Process() returns.
+#define MIRROR_IDLE     0
+#define MIRROR_BUSY     1
+#define MIRROR_DONE     2
+#define MIRROR_FAILED   3
+
+//-----------------------------------------------------------------------------
+// Maximum size of the HTTP response header we will accept.
+#define MIRROR_HEADER_MAX   4096
+
+//-----------------------------------------------------------------------------
+// Number of seconds that a mirror connection can go without receiving 
+// anything before we give up on it.
+#define MIRROR_TIMEOUT      30
+
+class Mirror
+{
+	public:
+		Mirror();
+		virtual ~Mirror();
+		
+		bool Start(char *szUrl, char *szFilename, int nFirst, int nCount);
+		int Process(void);
+		
+		bool GetLength(int *nLength);
+		bool GetChunk(int *nChunk, char **pData, int *nSize);
+		
+		char *GetFilename(void);
+		int GetFirst(void);
+		
+		void SetID(int nID);
+		int GetID(void);
+		
+		Mirror * GetNext(void);
+		void SetNext(Mirror *pMirror);
+		
+	protected:
+		bool ParseUrl(char *szUrl);
+		bool StartConnect(struct in_addr *pAddr);
+		bool ProcessResolve(void);
+		bool ProcessConnect(void);
+		bool ProcessSend(void);
+		bool ProcessHeader(void);
+		bool ProcessBody(void);
+		bool ParseHeader(void);
+		void Fail(void);
+		
+	private:
+		Mirror *_pNext;
+		int _nID;
+		char *_szFilename;
+		
+		struct {
+			char *szHost;
+			char *szPath;
+			int nPort;
+		} _Url;
+		
+		int _nSocket;
+		time_t _tLastActivity;
+		
+		// the state of the request.
+		struct {
+			bool bResolving;	// waiting for the host to be looked up.
+			bool bConnecting;
+			bool bSending;
+			bool bHeader;
+			bool bBody;
+			bool bDone;
+			bool bFailed;
+		} _Status;
+		
+		// the request we are sending to the webserver.
+		struct {
+			char *pData;
+			int nLength;
+			int nSent;
+		} _Request;
+		
+		// the response header, until we have all of it.
+		struct {
+			char *pData;
+			int nLength;
+			int nUsed;			// bytes of the header buffer we have processed.
+		} _Header;
+		
+		// the range of the file that we asked for, and where we are up to.
+		struct {
+			int nFirst;			// first chunk we asked for (chunks start at 1).
+			int nCount;			// number of chunks we asked for.
+			int nStart;			// offset in the file of the first byte.
+			int nEnd;			// offset in the file after the last byte we want.
+			int nOffset;		// offset in the file of the next byte we will receive.
+			int nLength;		// full length of the file, 0 if we dont know it yet.
+		} _Range;
+		
+		// the chunk that we are filling, and the one that is ready to be 
+		// collected.
+		struct {
+			char *pData;
+			int nChunk;
+			int nSize;
+		} _Current, _Ready;
+};
+
+
+#endif
+
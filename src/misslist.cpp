@@ -0,0 +1,201 @@
+//-----------------------------------------------------------------------------
+// misslist.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+// 
+//      See "misslist.h" for more information about this class.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#include <DevPlus.h>
+
+#include "misslist.h"
+
+
+//---------------------------------------------------------------------
+// CJW: Constructor.   Start with an empty list.
+MissList::MissList()
+{
+    _pList = NULL;
+    _nCount = 0;
+}
+    
+//---------------------------------------------------------------------
+// CJW: Deconstructor.  Clean up the linked-list.
+MissList::~MissList()
+{
+    strMiss *pTmp;
+
+    while(_pList != NULL) {
+        pTmp = _pList;
+        _pList = pTmp->pNext;
+        ASSERT(pTmp->szFile != NULL);
+        free(pTmp->szFile);
+        free(pTmp);
+    }
+    _nCount = 0;
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Find the entry for this file, if we have one.  It might have 
+// 		expired already.
+strMiss * MissList::Find(char *szFile)
+{
+	strMiss *pMiss;
+	
+	ASSERT(szFile != NULL);
+	
+	pMiss = _pList;
+	while (pMiss != NULL && strcmp(pMiss->szFile, szFile) != 0) {
+		pMiss = pMiss->pNext;
+	}
+	
+	return(pMiss);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: The network didnt have this file, so remember it for nTime 
+// 		seconds.  If it is already in the list, then it just lasts longer.
+void MissList::Add(char *szFile, int nTime)
+{
+	strMiss *pMiss;
+	
+	ASSERT(szFile != NULL && nTime > 0);
+	
+	pMiss = Find(szFile);
+	if (pMiss == NULL) {
+		pMiss = (strMiss *) malloc(sizeof(strMiss));
+		ASSERT(pMiss != NULL);
+		pMiss->szFile = strdup(szFile);
+		ASSERT(pMiss->szFile != NULL);
+		pMiss->pNext = _pList;
+		_pList = pMiss;
+		_nCount++;
+	}
+	
+	pMiss->tExpire = time(NULL) + nTime;
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return true if the network didnt have this file the last time we 
+// 		looked, and that wasnt too long ago.
+bool MissList::Check(char *szFile)
+{
+	bool bMiss = false;
+	strMiss *pMiss;
+	
+	ASSERT(szFile != NULL);
+	
+	pMiss = Find(szFile);
+	if (pMiss != NULL) {
+		if (pMiss->tExpire > time(NULL)) {
+			bMiss = true;
+		}
+	}
+	
+	return(bMiss);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Some node has told us that it has the file, so we forget that we 
+// 		couldnt find it.
+void MissList::Remove(char *szFile)
+{
+	strMiss *pMiss;
+	strMiss *pPrev = NULL;
+	
+	ASSERT(szFile != NULL);
+	
+	pMiss = _pList;
+	while (pMiss != NULL) {
+		if (strcmp(pMiss->szFile, szFile) == 0) {
+			if (pPrev == NULL)	{ _pList = pMiss->pNext; }
+			else 				{ pPrev->pNext = pMiss->pNext; }
+			free(pMiss->szFile);
+			free(pMiss);
+			_nCount--;
+			pMiss = NULL;
+		}
+		else {
+			pPrev = pMiss;
+			pMiss = pMiss->pNext;
+		}
+	}
+	
+	ASSERT(_nCount >= 0);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Go thru the list and remove the entries that have expired.
+void MissList::Process(void)
+{
+	strMiss *pMiss;
+	strMiss *pPrev = NULL;
+	strMiss *pTmp;
+	time_t tNow;
+	
+	tNow = time(NULL);
+	pMiss = _pList;
+	while (pMiss != NULL) {
+		if (pMiss->tExpire <= tNow) {
+			pTmp = pMiss->pNext;
+			if (pPrev == NULL)	{ _pList = pTmp; }
+			else 				{ pPrev->pNext = pTmp; }
+			free(pMiss->szFile);
+			free(pMiss);
+			_nCount--;
+			pMiss = pTmp;
+		}
+		else {
+			pPrev = pMiss;
+			pMiss = pMiss->pNext;
+		}
+	}
+	
+	ASSERT(_nCount >= 0);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the number of files in the list.
+int MissList::GetCount(void)
+{
+	ASSERT(_nCount >= 0);
+	return(_nCount);
+}
+
+
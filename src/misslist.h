@@ -0,0 +1,74 @@
+//-----------------------------------------------------------------------------
+// misslist.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      This object keeps a list of the files that the network didnt have when
+//      we last searched for them, so that we dont search again for a while.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __MISSLIST_H
+#define __MISSLIST_H
+
+#include <time.h>
+
+//-----------------------------------------------------------------------------
+// Number of seconds that we remember that a file wasnt found on the network.  
+// Can be changed with miss-time in the config.
+#define MISS_TIME   120
+
+
+struct strMiss {
+	char *szFile;
+	time_t tExpire;
+	strMiss *pNext;
+};
+
+
+class MissList 
+{
+    private:
+        strMiss *_pList;
+        int _nCount;
+    
+    public:
+        MissList();
+        virtual ~MissList();
+
+        void Add(char *szFile, int nTime);
+        bool Check(char *szFile);
+        void Remove(char *szFile);
+        void Process(void);
+        int GetCount(void);
+    
+    protected:
+        strMiss * Find(char *szFile);
+};
+
+
+#endif
+
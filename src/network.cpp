@@ -34,11 +34,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "network.h"
+#include "common.h"
 #include "config.h"
 #include "logger.h"
 #include "address.h"
+#include "sha256.h"
+#include "metrics.h"
+#include "trace.h"
+#include "resolver.h"
 
 
 //-----------------------------------------------------------------------------
@@ -46,15 +56,17 @@
 //      class, and then set our listener, listening on the correct port.
 Network::Network()
 {
-    Logger logger;
     Config config;
     char *str;
     int nPort;
+    int i;
+    char szName[100];
 //     char *szServer;
 
     Lock();
     _nNextNodeID = 1;
     _pNodes = NULL;
+    _pMirrors = NULL;
     
     _pServerList = new ServerList;
     ASSERT(_pServerList != NULL);
@@ -62,37 +74,161 @@ Network::Network()
     _pFileList = new FileList;
     ASSERT(_pFileList != NULL);
     
-    if (config.Get("network", "min-connections", &_Connections.nMin) == false) {
-        _Connections.nMin = 3;
-    }
+    _Misses.pList = new MissList;
+    ASSERT(_Misses.pList != NULL);
     
-    if (config.Get("network", "max-connections", &_Connections.nMax) == false) {
-        _Connections.nMax = 30;
+    // the package cache, which files are served from and saved to.
+    str = NULL;
+    if (config.Get("network", "cache-path", &str) == true) {
+        ASSERT(str != NULL);
+        if (str[0] != '\0') {
+            _pFileList->SetPath(str);
+        }
+        free(str);
+        str = NULL;
+    }
+    _Cache.bSave = true;
+    if (config.Get("network", "save-files", &str) == true) {
+        ASSERT(str != NULL);
+        if (strcmp(str, "no") == 0) {
+            _Cache.bSave = false;
+        }
+        free(str);
+        str = NULL;
     }
+    _Cache.nSaved = 0;
     
-    // We cant really function with a value less than 1.  We will choose the
-    // default if that is so.
-    if (_Connections.nMin < 1) {
-        _Connections.nMin = 3;
+    _Delta.bEnabled = false;
+    if (config.Get("network", "delta", &str) == true) {
+        ASSERT(str != NULL);
+        if (strcmp(str, "yes") == 0) {
+            _Delta.bEnabled = true;
+        }
+        free(str);
+        str = NULL;
     }
-    if (_Connections.nMax <= _Connections.nMin) {
-        if (_Connections.nMin >= 30) {
-            _Connections.nMax = _Connections.nMin + 5;
+    _Delta.nUpgrades = 0;
+    _Delta.nSaved = 0;
+    _Delta.nMade = 0;
+    
+    _pBackground = new Background;
+    ASSERT(_pBackground != NULL);
+    
+    // content defined chunking, which needs an index of the chunks in the 
+    // files we have.
+    _Cdc.bEnabled = false;
+    if (config.Get("network", "chunking", &str) == true) {
+        ASSERT(str != NULL);
+        if (strcmp(str, "cdc") == 0) {
+            _Cdc.bEnabled = true;
         }
-        else {
-            _Connections.nMax = 30;
+        free(str);
+        str = NULL;
+    }
+    _Cdc.pStore = new ChunkStore;
+    ASSERT(_Cdc.pStore != NULL);
+    _Cdc.pStore->SetPath(_pFileList->GetPath());
+    _Cdc.pDir = NULL;
+    _Cdc.tNextIndex = 0;
+    _Cdc.pFetches = NULL;
+    _Cdc.nFiles = 0;
+    _Cdc.nReused = 0;
+    _Cdc.nFetched = 0;
+    _Cdc.nServed = 0;
+    
+    _pPkgIndex = new PkgIndex;
+    ASSERT(_pPkgIndex != NULL);
+    if (config.Get("network", "sync-path", &str) == true) {
+        ASSERT(str != NULL);
+        if (str[0] != '\0') {
+            _pPkgIndex->SetPath(str);
         }
+        free(str);
+        str = NULL;
     }
+    _pPkgIndex->Load();
     
     // Check our config to see if we are allowed to query the webserver for an
     // ip address of a node we can connect to.
     _Connections.szQueryHost = NULL;
-    config.Get("network", "queryhost", &_Connections.szQueryHost);
+    _Connections.nQueryPort = 0;
+    _Connections.tQueryTime = 0;
+    if (config.Get("network", "queryhost", &_Connections.szQueryHost) == false) {
+        config.Get("network", "queryaddr", &_Connections.szQueryHost);
+    }
 	config.Get("network", "queryport", &_Connections.nQueryPort);
+	
+	// a relay takes a lot more connections than a normal node.
+	_Relay.bEnabled = false;
+	str = NULL;
+	if (config.Get("network", "relay", &str) == true) {
+		ASSERT(str != NULL);
+		if (strcmp(str, "yes") == 0) {
+			_Relay.bEnabled = true;
+		}
+		free(str);
+		str = NULL;
+	}
+	
+	// the limits that can be changed while we are running.
+	ApplyConfig();
+	_SmallFile.nBypassed = 0;
+	
+	_Relay.pIndex = new Dht;
+	ASSERT(_Relay.pIndex != NULL);
+	_Relay.nAnswered = 0;
+	_Relay.bLeaf = false;
+	
+	_Proxy.pList   = NULL;
+	_Proxy.nAsked  = 0;
+	_Proxy.nServed = 0;
+	
+	_Misses.nSaved = 0;
+	
+	_Ring.nStart = RING_START_TTL;
+	for (i=0; i<=DEFAULT_TTL; i++) { _Ring.pHits[i] = 0; }
+	for (i=0; i<RING_HISTORY; i++) { _Ring.pRecent[i] = 0; }
+	_Ring.nRecent = 0;
+	
+	// our DHT id is normally made up from things that will be different 
+	// for every daemon, but it can be set so that tests can be repeated.
+	_Dht.pStore = new Dht;
+	ASSERT(_Dht.pStore != NULL);
+	_Dht.pDir = NULL;
+	_Dht.tNextPublish = time(NULL);
+	_Dht.nPublished = 0;
+	_Dht.nLookups = 0;
+	_Dht.nId = 0;
+	str = NULL;
+	if (config.Get("network", "dht", &str) == true) {
+		ASSERT(str != NULL);
+		if (strcmp(str, "no") != 0) {
+			_Dht.nId = 1;
+		}
+		free(str);
+		str = NULL;
+	}
+	else {
+		_Dht.nId = 1;
+	}
+	if (_Dht.nId != 0) {
+		if (config.Get("network", "dht-id", &nPort) == false || nPort == 0) {
+			szName[0] = '\0';
+			gethostname(szName, 64);
+			szName[64] = '\0';
+			sprintf(&szName[strlen(szName)], ":%d:%d", (int) getpid(), (int) time(NULL));
+			nPort = (int) Dht::Hash(szName);
+			if (nPort == 0) { nPort = 1; }
+		}
+		_Dht.nId = (unsigned int) nPort;
+	}
+	_Dht.pTable = new DhtTable(_Dht.nId);
+	ASSERT(_Dht.pTable != NULL);
+	_Dht.tRefresh = 0;
     
     _nPort = 0;
     if (config.Get("network", "port", &nPort) == false) {
-        logger.Error("Unable to find network port information in /etc/pacsrv.conf\n");
+        LOG_ERROR(LOG_NETWORK, "Unable to find network port information in /etc/pacsrv.conf\n");
     }
     else {
         ASSERT(nPort > 0);
@@ -100,13 +236,32 @@ Network::Network()
             _nPort = nPort;
             SetListening();
         } else {
-            logger.Error("Cannot listen on port %d for Network.", nPort);
+            LOG_ERROR(LOG_NETWORK, "Cannot listen on port %d for Network.", nPort);
         }
-        logger.System("Network listening on port %d", nPort);
+        LOG_SYSTEM(LOG_NETWORK, "Network listening on port %d", nPort);
     }
 
     // every 5 seconds, we need to go through our filelist.  This variable will be used to trigger it.
     _tLastFileListCheck = time(NULL);
+    _tLastMetricsLog = time(NULL);
+    
+    _Loop.nLastEnd = 0;
+    _Loop.tLastWarn = 0;
+    _Loop.nSuppressed = 0;
+    _Loop.nPasses = 0;
+    
+    _Bootstrap.nStart = GetTimeMs();
+    _Bootstrap.nFirst = 0;
+    _Bootstrap.nMin   = 0;
+    _Bootstrap.nLastCheck = 0;
+    
+    _szPeerFile = NULL;
+    if (config.Get("network", "peer-file", &_szPeerFile) == false) {
+        _szPeerFile = strdup(PEER_FILE);
+    }
+    _tLastPeerSave = time(NULL);
+    
+    SeedServers();
     
     Unlock();
 }
@@ -117,28 +272,120 @@ Network::Network()
 Network::~Network()
 {
     Node *pTmp;
+    Mirror *pMirror;
+    strProxy *pProxy;
+    strCdcFetch *pFetch;
+    FileInfo *pInfo, *pDelta;
     
     Lock();
     
+    // waits for the job the worker is doing, if there is one.
+    ASSERT(_pBackground != NULL);
+    delete _pBackground;
+    _pBackground = NULL;
+    
     ASSERT(_pServerList != NULL);
+    ASSERT(_szPeerFile != NULL);
+    if (_pServerList->Save(_szPeerFile) == false) {
+        LOG_ERROR(LOG_NETWORK, "[Network] Unable to save the servers to %s", _szPeerFile);
+    }
     delete _pServerList;
     _pServerList = NULL;
     
-    ASSERT(_pFileList != NULL);
-    delete _pFileList;
-    _pFileList = NULL;
+    free(_szPeerFile);
+    _szPeerFile = NULL;
     
     if (_Connections.szQueryHost != NULL) {
     	free(_Connections.szQueryHost);
     	_Connections.szQueryHost = NULL;
     }
     
+    // the nodes need to release any files they are using before we can 
+    // delete the file list.
     while(_pNodes != NULL) {
         pTmp = _pNodes->GetNext();
+        ReleaseFiles(_pNodes);
         delete _pNodes;
         _pNodes = pTmp;
     }
     
+    while(_pMirrors != NULL) {
+        pMirror = _pMirrors;
+        _pMirrors = pMirror->GetNext();
+        pMirror->SetNext(NULL);
+        pInfo = _pFileList->GetFileInfo(pMirror->GetFilename());
+        ASSERT(pInfo != NULL);
+        pInfo->FileComplete();
+        delete pMirror;
+    }
+    
+    // let go of the deltas we were getting.
+    pInfo = _pFileList->GetFirst();
+    while (pInfo != NULL) {
+        if (pInfo->GetDeltaName() != NULL) {
+            pDelta = _pFileList->GetFileInfo(pInfo->GetDeltaName());
+            if (pDelta != NULL) {
+                pDelta->FileComplete();
+            }
+            pInfo->ClearDelta();
+        }
+        pInfo = pInfo->GetNext();
+    }
+    
+    while (_Proxy.pList != NULL) {
+        pProxy = _Proxy.pList;
+        _Proxy.pList = pProxy->pNext;
+        if (pProxy->nVia == 0) {
+            pInfo = _pFileList->GetFileInfo(pProxy->szFile);
+            if (pInfo != NULL) {
+                pInfo->FileComplete();
+            }
+        }
+        free(pProxy->szFile);
+        free(pProxy);
+    }
+    
+    while (_Cdc.pFetches != NULL) {
+        pFetch = _Cdc.pFetches;
+        _Cdc.pFetches = pFetch->pNext;
+        FreeFetch(pFetch);
+    }
+    
+    ASSERT(_pFileList != NULL);
+    delete _pFileList;
+    _pFileList = NULL;
+    
+    ASSERT(_pPkgIndex != NULL);
+    delete _pPkgIndex;
+    _pPkgIndex = NULL;
+    
+    ASSERT(_Misses.pList != NULL);
+    delete _Misses.pList;
+    _Misses.pList = NULL;
+    
+    if (_Dht.pDir != NULL) {
+        closedir(_Dht.pDir);
+        _Dht.pDir = NULL;
+    }
+    ASSERT(_Dht.pStore != NULL);
+    delete _Dht.pStore;
+    _Dht.pStore = NULL;
+    ASSERT(_Dht.pTable != NULL);
+    delete _Dht.pTable;
+    _Dht.pTable = NULL;
+    
+    ASSERT(_Relay.pIndex != NULL);
+    delete _Relay.pIndex;
+    _Relay.pIndex = NULL;
+    
+    if (_Cdc.pDir != NULL) {
+        closedir(_Cdc.pDir);
+        _Cdc.pDir = NULL;
+    }
+    ASSERT(_Cdc.pStore != NULL);
+    delete _Cdc.pStore;
+    _Cdc.pStore = NULL;
+    
     Unlock();
 }
 
@@ -172,7 +419,49 @@ int Network::GetConnectionCount(void)
 
     pTmp = _pNodes;
     while(pTmp != NULL) {
-        if (pTmp->IsClosed() == false) {
+        if (pTmp->IsConnecting() == false && pTmp->IsClosed() == false) {
+            nCount++;
+        }
+        pTmp = pTmp->GetNext();
+    }
+
+    return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go through the list of nodes and count how many have completed the 
+//      init handshake, which means they are actually usable.
+int Network::GetValidCount(void)
+{
+    Node *pTmp;
+    int nCount = 0;
+
+    pTmp = _pNodes;
+    while(pTmp != NULL) {
+        if (pTmp->IsConnecting() == false && pTmp->IsClosed() == false) {
+            if (pTmp->IsValid() == true) {
+                nCount++;
+            }
+        }
+        pTmp = pTmp->GetNext();
+    }
+
+    return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go through the list of nodes and count how many outgoing connections 
+//      we are still waiting on.
+int Network::GetConnectingCount(void)
+{
+    Node *pTmp;
+    int nCount = 0;
+
+    pTmp = _pNodes;
+    while(pTmp != NULL) {
+        if (pTmp->IsConnecting() == true) {
             nCount++;
         }
         pTmp = pTmp->GetNext();
@@ -183,27 +472,129 @@ int Network::GetConnectionCount(void)
 
 
 
+//-----------------------------------------------------------------------------
+// CJW: Get the limits out of the config.  This is done when we start, and 
+//      again whenever the config is reloaded, so that the limits can be 
+//      changed without dropping the transfers we have going.  The things that 
+//      are set up once (ports, paths, the dht and relay) still need a restart.
+//      Must be called with the lock held.
+void Network::ApplyConfig(void)
+{
+    Config config;
+    int nRelay;
+    
+    _nConfigGeneration = Config::GetGeneration();
+    
+    if (config.Get("network", "min-connections", &_Connections.nMin) == false) {
+        _Connections.nMin = 3;
+    }
+    
+    if (config.Get("network", "max-connections", &_Connections.nMax) == false) {
+        _Connections.nMax = 30;
+    }
+    
+    // We cant really function with a value less than 1.  We will choose the
+    // default if that is so.
+    if (_Connections.nMin < 1) {
+        _Connections.nMin = 3;
+    }
+    if (_Connections.nMax <= _Connections.nMin) {
+        if (_Connections.nMin >= 30) {
+            _Connections.nMax = _Connections.nMin + 5;
+        }
+        else {
+            _Connections.nMax = 30;
+        }
+    }
+    
+    // a relay takes a lot more connections than a normal node.
+    if (_Relay.bEnabled == true) {
+        if (config.Get("network", "relay-connections", &nRelay) == false || nRelay <= _Connections.nMin) {
+            nRelay = RELAY_CONNECTIONS;
+        }
+        if (nRelay > _Connections.nMax) {
+            _Connections.nMax = nRelay;
+        }
+    }
+    
+	if (config.Get("network", "connect-timeout", &_Connections.nTimeout) == false || _Connections.nTimeout < 1) {
+		_Connections.nTimeout = CONNECT_TIMEOUT;
+	}
+	_Connections.nTimeout *= 1000;
+	
+	if (config.Get("network", "connect-parallel", &_Connections.nParallel) == false || _Connections.nParallel < 1) {
+		_Connections.nParallel = CONNECT_PARALLEL;
+	}
+	
+	if (config.Get("network", "mirror-parallel", &_Mirror.nParallel) == false || _Mirror.nParallel < 0) {
+		_Mirror.nParallel = MIRROR_PARALLEL;
+	}
+	if (config.Get("network", "mirror-chunks", &_Mirror.nChunks) == false || _Mirror.nChunks < 1) {
+		_Mirror.nChunks = MIRROR_CHUNKS;
+	}
+	
+	// small files can only go straight to the mirror if we are using it.
+	if (config.Get("network", "small-file", &_SmallFile.nSize) == false || _SmallFile.nSize < 0) {
+		_SmallFile.nSize = SMALL_FILE_SIZE;
+	}
+	if (_Mirror.nParallel == 0) {
+		_SmallFile.nSize = 0;
+	}
+	
+	if (config.Get("network", "relay-links", &_Relay.nLinks) == false || _Relay.nLinks < 0) {
+		_Relay.nLinks = RELAY_LINKS;
+	}
+	
+	if (config.Get("network", "miss-time", &_Misses.nTime) == false || _Misses.nTime < 0) {
+		_Misses.nTime = MISS_TIME;
+	}
+    
+    if (config.Get("network", "loop-budget", &_Loop.nBudget) == false || _Loop.nBudget < 0) {
+        _Loop.nBudget = LOOP_BUDGET;
+    }
+    _Loop.nBudget *= 1000;
+}
+
 //-----------------------------------------------------------------------------
 // CJW: An incoming connection was established, we need to pass it to an object
-//      that can handle it.
+//      that can handle it.  Nodes that arent allowed by the [network] 
+//      allow= and deny= lines (or that we cant get the address of) are closed 
+//      straight away.
 void Network::OnAccept(int nSocket)
 {
+    static strMetric *pRefused = Metrics::Counter("pacsrv_network_refused_total", "Node connections refused by the [network] allow and deny lines.");
     Node *pTmp;
-    Logger log;
     char szName[32];
     int nID;
+    struct sockaddr_in sin;
+    socklen_t nLen;
     
     ASSERT(nSocket >= 0);
     
-    pTmp = new Node;
-    pTmp->Accept(nSocket);
-
-    nID = AddNode(pTmp);
+    nLen = sizeof(sin);
+    if (getpeername(nSocket, (struct sockaddr *) &sin, &nLen) != 0 || sin.sin_family != AF_INET) {
+        LOG_SYSTEM(LOG_NODE, "Refused Node connection, unable to get its address.");
+        Metrics::Add(pRefused, 1);
+        close(nSocket);
+    }
+    else if (Config::IsAllowed("network", ntohl(sin.sin_addr.s_addr)) == false) {
+        LOG_SYSTEM(LOG_NODE, "Refused Node connection from %s.", inet_ntoa(sin.sin_addr));
+        Metrics::Add(pRefused, 1);
+        close(nSocket);
+    }
+    else {
+        pTmp = new Node;
+        pTmp->SetLocalPort(_nPort);
+        pTmp->SetDhtId(_Dht.nId);
+        pTmp->SetRelay(_Relay.bEnabled);
+        pTmp->Accept(nSocket);
     
-    szName[0] = '\0';
-    pTmp->GetPeerName(szName, 32);
-    log.System("[Node:%d] New Node connection received from %s.", nID, szName);
-
+        nID = AddNode(pTmp);
+        
+        szName[0] = '\0';
+        pTmp->GetPeerName(szName, 32);
+        LOG_SYSTEM(LOG_NODE, "[Node:%d] New Node connection received from %s.", nID, szName);
+    }
 }
 
 //-----------------------------------------------------------------------------
@@ -214,9 +605,100 @@ void Network::OnAccept(int nSocket)
 //      queries that we are currently processing locally.
 void Network::OnIdle(void)
 {
+    static strMetric *pLoop = Metrics::Histogram("pacsrv_network_loop_us", "Time taken by each pass of the network loop.");
+    static strMetric *pLag = Metrics::Histogram("pacsrv_network_loop_lag_us", "Time between the end of one pass of the network loop and the start of the next.");
+    static strMetric *pCheck = Metrics::Histogram("pacsrv_network_check_connections_us", "Time taken by CheckConnections().");
+    static strMetric *pConnects = Metrics::Histogram("pacsrv_network_process_connects_us", "Time taken by ProcessConnects().");
+    static strMetric *pNodes = Metrics::Histogram("pacsrv_network_process_nodes_us", "Time taken by ProcessNodes().");
+    static strMetric *pSearches = Metrics::Histogram("pacsrv_network_process_searches_us", "Time taken by ProcessSearches().");
+    static strMetric *pDeltas = Metrics::Histogram("pacsrv_network_process_deltas_us", "Time taken by ProcessDeltas().");
+    static strMetric *pCdc = Metrics::Histogram("pacsrv_network_process_cdc_us", "Time taken by ProcessCdc().");
+    static strMetric *pMirrors = Metrics::Histogram("pacsrv_network_process_mirrors_us", "Time taken by ProcessMirrors().");
+    static strMetric *pPublish = Metrics::Histogram("pacsrv_network_process_publish_us", "Time taken by ProcessPublish().");
+    static strMetric *pIndex = Metrics::Histogram("pacsrv_network_process_chunk_index_us", "Time taken by ProcessChunkIndex().");
+    static strMetric *pProxies = Metrics::Histogram("pacsrv_network_process_proxies_us", "Time taken by ProcessProxies().");
+    static strMetric *pBootstrap = Metrics::Histogram("pacsrv_network_check_bootstrap_us", "Time taken by CheckBootstrap().");
+    static strMetric *pFileList = Metrics::Histogram("pacsrv_network_process_file_list_us", "Time taken by ProcessFileList().");
+    long long nStart, nTime;
+    
+    // if the config has been reloaded, pick up the new limits.
+    if (Config::GetGeneration() != _nConfigGeneration) {
+        Lock();
+        ApplyConfig();
+        Unlock();
+        LOG_SYSTEM(LOG_NETWORK, "[Network] Config reloaded.  Connections %d-%d, %d connecting at a time, %d mirror downloads.", _Connections.nMin, _Connections.nMax, _Connections.nParallel, _Mirror.nParallel);
+    }
+    
+    nStart = GetTimeUs();
+    if (_Loop.nLastEnd > 0) {
+        Metrics::Record(pLag, nStart - _Loop.nLastEnd);
+    }
+    
+    nTime = nStart;
     CheckConnections();
+    nTime = TimePhase(pCheck, "CheckConnections", nTime);
+    ProcessConnects();
+    nTime = TimePhase(pConnects, "ProcessConnects", nTime);
     ProcessNodes();
+    nTime = TimePhase(pNodes, "ProcessNodes", nTime);
+    ProcessSearches();
+    nTime = TimePhase(pSearches, "ProcessSearches", nTime);
+    ProcessDeltas();
+    nTime = TimePhase(pDeltas, "ProcessDeltas", nTime);
+    ProcessCdc();
+    nTime = TimePhase(pCdc, "ProcessCdc", nTime);
+    ProcessMirrors();
+    nTime = TimePhase(pMirrors, "ProcessMirrors", nTime);
+    ProcessPublish();
+    nTime = TimePhase(pPublish, "ProcessPublish", nTime);
+    ProcessChunkIndex();
+    nTime = TimePhase(pIndex, "ProcessChunkIndex", nTime);
+    ProcessProxies();
+    nTime = TimePhase(pProxies, "ProcessProxies", nTime);
+    CheckBootstrap();
+    nTime = TimePhase(pBootstrap, "CheckBootstrap", nTime);
     ProcessFileList();
+    nTime = TimePhase(pFileList, "ProcessFileList", nTime);
+    
+    Metrics::Record(pLoop, nTime - nStart);
+    _Loop.nLastEnd = nTime;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A phase of OnIdle() has finished.  Record how long it took (since 
+//      nStart) and if it was over the budget, log it with enough of what we 
+//      were doing to work out why.  Only one is logged each LOOP_WARN_TIME 
+//      seconds, the rest are counted and the count is logged with the next 
+//      one.  Returns the time now, which is the start of the next phase.
+long long Network::TimePhase(strMetric *pMetric, char *szPhase, long long nStart)
+{
+    static strMetric *pSlow = Metrics::Counter("pacsrv_slow_phases_total", "Loop phases that took longer than the loop budget.");
+    long long nNow, nTime;
+    time_t tNow;
+    
+    ASSERT(pMetric != NULL && szPhase != NULL);
+    
+    nNow = GetTimeUs();
+    nTime = nNow - nStart;
+    Metrics::Record(pMetric, nTime);
+    
+    if (_Loop.nBudget > 0 && nTime > _Loop.nBudget) {
+        Metrics::Add(pSlow, 1);
+        tNow = time(NULL);
+        if ((tNow - _Loop.tLastWarn) >= LOOP_WARN_TIME) {
+            Lock();
+            LOG_SYSTEM(LOG_NETWORK, "[Network] Slow phase: %s took %lld ms (budget %d ms). %d nodes, %d connecting, %d passes of the nodes, %d other slow phases since the last warning.", szPhase, nTime / 1000, _Loop.nBudget / 1000, GetNodeCount(), GetConnectingCount(), _Loop.nPasses, _Loop.nSuppressed);
+            Unlock();
+            _Loop.tLastWarn = tNow;
+            _Loop.nSuppressed = 0;
+        }
+        else {
+            _Loop.nSuppressed++;
+        }
+    }
+    
+    return(nNow);
 }
 
 
@@ -232,24 +714,60 @@ void Network::OnIdle(void)
 void Network::CheckConnections(void)
 {
     time_t nCurrent;
-    int count;
+    int count, pending, nStart;
+    ServerInfo *pInfo;
     
     Lock();
     
     ASSERT(_Connections.nMin > 0);
     ASSERT(_Connections.nMax > _Connections.nMin);
     
+    // we only check once a second.  The connections we start are all made in 
+    // parallel, and ProcessConnects() picks them up as soon as they are 
+    // established, so this doesnt slow down getting connected.
     nCurrent = time(NULL);
     if (nCurrent > _nLastCheck) {
     
-        // go thru the list and count the number of current connections.
+        // go thru the list and count the number of current connections, 
+        // and the ones that we are still trying to establish.
         count = GetConnectionCount();
+        pending = GetConnectingCount();
     
-        // if we dont have ANY clients, then we need to connect to the starter connection in our config.
+        // if we dont have enough, then we start connecting to the servers in 
+        // our list.  The connections are done in the background, so we can 
+        // have several going at once.  We try more servers than we actually 
+        // need, because some of them will be slow or wont answer at all, and 
+        // we use whichever ones connect first.  If we run out of servers to 
+        // try, then we use the starter connection from our config.
         if (count < _Connections.nMin) {
-            ConnectStarter();
+            nStart = _Connections.nParallel - pending;
+            if (nStart > _Connections.nMax - count - pending) {
+                nStart = _Connections.nMax - count - pending;
+            }
+            
+            while (nStart > 0) {
+                pInfo = _pServerList->GetNextServer(false);
+                if (pInfo == NULL) {
+                    pInfo = ConnectStarter();
+                }
+                
+                if (pInfo == NULL) {
+                    nStart = 0;
+                }
+                else {
+                    if (ConnectNode(pInfo) == true) {
+                        nStart--;
+                    }
+                }
+            }
         }
         else {
+            // We have enough connections now, so we dont need any of the 
+            // ones that are still trying to connect.
+            if (pending > 0) {
+                CancelConnects();
+            }
+            
             // Now we need to check the number of clients that we have.  If we
             // have too many, then we need to choose the lowest performers
             // that are not actually transfering a file, and close that
@@ -259,6 +777,28 @@ void Network::CheckConnections(void)
                 CloseSlowConnection();
             }
         }
+        
+        // if we arent a relay, we want a few connections to relays, so that 
+        // they can do our searching for us.  We only start one at a time.
+        if (_Relay.bEnabled == false && _Relay.nLinks > 0 && pending == 0) {
+            if (GetRelayCount() < _Relay.nLinks && (count + pending) < _Connections.nMax) {
+                pInfo = _pServerList->GetNextServer(true);
+                if (pInfo != NULL) {
+                    ConnectNode(pInfo);
+                }
+            }
+        }
+        CheckLeaf();
+        
+        // every so often we save our server list so that we have somewhere 
+        // to start from if we are restarted.
+        if ((nCurrent - _tLastPeerSave) >= PEER_SAVE_TIME) {
+            ASSERT(_szPeerFile != NULL);
+            if (_pServerList->Save(_szPeerFile) == false) {
+                LOG_ERROR(LOG_NETWORK, "[Network] Unable to save the servers to %s", _szPeerFile);
+            }
+            _tLastPeerSave = nCurrent;
+        }
     
         _nLastCheck = time(NULL);
     }
@@ -268,27 +808,72 @@ void Network::CheckConnections(void)
 
 
 //-----------------------------------------------------------------------------
-// CJW: This function will be called when we dont have our minimum number of 
-// 		connections.  We will need to go thru the list of servers that we have 
-// 		an try to connect to any that we can.  If there isnt any in the list 
-// 		we can use, then we will have to wait till we get told about some new 
-// 		connections.
-bool Network::ConnectStarter(void)
+// CJW: When we start up, we want to have as many servers in our list as we 
+// 		can, so that we can connect to several of them at once.  We add the 
+// 		servers that we saved the last time we were running, the direct 
+// 		server from our config, and the query host.
+void Network::SeedServers(void)
 {
-	Node *pNode;
-	Logger log;
-	char *str;
+	Config config;
+	char *szServer = NULL;
+	int nPort = 0;
+	
+	ASSERT(_pServerList != NULL);
+	ASSERT(_szPeerFile != NULL);
 	
-	ASSERT(_Connections.szQueryHost != NULL);	
-	ASSERT(_Connections.szQueryPort > 0);
+	if (_pServerList->Load(_szPeerFile) == true) {
+		LOG_SYSTEM(LOG_NETWORK, "[Network] Loaded saved servers from %s", _szPeerFile);
+	}
+	
+	if (config.Get("direct", "server", &szServer) == true) {
+		if (config.Get("direct", "port", &nPort) == true && nPort > 0) {
+			_pServerList->AddServer(szServer, nPort);
+		}
+		free(szServer);
+	}
 	
-	log.System("Network: Creating Starter Connection to %s:%d", _Connections.szQueryHost, _Connections.szQueryPort);
+	ConnectStarter();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: This function will be called when we dont have our minimum number of 
+// 		connections, and there are no servers in our list that we can try.  
+// 		We will look up the query host from our config and add it to the 
+// 		server list so that it is handled like any other server.  The name 
+// 		is looked up in the background, so until that has finished we just 
+// 		return NULL and are asked again next time round.  Once we have an 
+// 		answer we only use it every so often.  Returns the server entry if 
+// 		there is one we can connect to.
+ServerInfo * Network::ConnectStarter(void)
+{
+	ServerInfo *pInfo = NULL;
+	struct in_addr addr;
+	time_t nTime;
+	int nState;
 	
-	pNode = new Node;
-	pNode->Connect(_Connections.szQueryHost, _Connections.szQueryPort);
-	nID = AddNode(pNode);
+	nTime = time(NULL);
+	if (_Connections.szQueryHost != NULL && _Connections.nQueryPort > 0) {
+		if (_Connections.tQueryTime == 0 || (nTime - _Connections.tQueryTime) >= NODE_WAIT_TIME) {
+			nState = Resolver::Lookup(_Connections.szQueryHost, &addr);
+			if (nState == RESOLVE_FAILED) {
+				_Connections.tQueryTime = nTime;
+				LOG_ERROR(LOG_NETWORK, "[Network] Unable to resolve starter host %s", _Connections.szQueryHost);
+			}
+			else if (nState == RESOLVE_OK) {
+				_Connections.tQueryTime = nTime;
+				LOG_SYSTEM(LOG_NETWORK, "[Network] Using starter host %s (%s:%d)", _Connections.szQueryHost, inet_ntoa(addr), _Connections.nQueryPort);
+				
+				pInfo = _pServerList->AddServer(inet_ntoa(addr), _Connections.nQueryPort);
+				ASSERT(pInfo != NULL);
+				if (pInfo->_bConnected == true) {
+					pInfo = NULL;
+				}
+			}
+		}
+	}
 	
-	return false;
+	return(pInfo);
 }
 
 
@@ -305,29 +890,29 @@ bool Network::ConnectStarter(void)
 //      maintained.
 void Network::CloseSlowConnection(void)
 {
-    Node *pTmp, *pPrev;
-    Logger *pLogger;
+    Node *pTmp, *pIdle;
     
-    pPrev = NULL;
+    pIdle = NULL;
     pTmp = _pNodes;
     while (pTmp != NULL) {
-        pPrev = pTmp;
+        if (pTmp->IsConnecting() == false && pTmp->IsClosed() == false) {
+            if (pTmp->ReadyForFile() == true && pTmp->GetUploadFile() == NULL && IsOnlyDhtLink(pTmp) == false) {
+                if (pTmp->GetIdleSeconds() > MAX_IDLE_TIME) {
+                    if (pIdle == NULL || pTmp->GetIdleSeconds() > pIdle->GetIdleSeconds()) {
+                        pIdle = pTmp;
+                    }
+                }
+            }
+        }
         pTmp = pTmp->GetNext();
     }
     
-    if (pPrev != NULL) {
-        pTmp = pPrev->GetNext();
-        ASSERT(pTmp->GetNext() == NULL);
-        if (pTmp->GetIdleSeconds() > MAX_IDLE_TIME) {
-            pLogger = new Logger;
-            pLogger->System("[Network] Deleting idle node %d.", pTmp->GetID());
-            delete pLogger;
-    
-            pPrev->SetNext(NULL);
-    
-            ProcessFinal(pTmp);
-            delete pTmp;
-        }
+    // the node will be removed from the list the next time we process the 
+    // nodes, the same as if the other side had closed it.
+    if (pIdle != NULL) {
+        LOG_SYSTEM(LOG_NETWORK, "[Network] Closing idle node %d.", pIdle->GetID());
+        
+        pIdle->Close();
     }
 }
 
@@ -369,13 +954,26 @@ void Network::ProcessNodes(void)
     char *szFilename;
     int nChunk;
     int nSize;
+    int nLength;
     char *pData;
     bool bClosed = false;
 	FileInfo *pInfo;
 	Address *pServerInfo;
 	strFileRequest *pReq;
 	strFileReply *pReply;
+	strDhtStore *pStore;
+	strProxyRequest *pProxyReq;
 	char *szLocalFile;
+	bool bBusy;
+	char *szHave;
+	unsigned char pHash[CDC_HASH_SIZE];
+	ServerInfo *pInfo2;
+	Address *pAddr;
+	unsigned char pRaw[6];
+	strDhtContact *pContact, *pContacts;
+	unsigned int pDhtIds[DHT_BUCKET_SIZE];
+	unsigned char pDhtAddrs[DHT_BUCKET_SIZE * 6];
+	int nContacts;
     
     Lock();
     
@@ -384,7 +982,11 @@ void Network::ProcessNodes(void)
 
         pTmp = _pNodes;
         while (pTmp != NULL) {
-            if (pTmp->IsClosed() == false) {
+            if (pTmp->IsConnecting() == true) {
+                // still waiting for the connection, ProcessConnects() will 
+                // look after it.
+            }
+            else if (pTmp->IsClosed() == false) {
     
                 // Has node received any chunks?  Save them all if so.
                 szFilename = NULL;
@@ -404,27 +1006,61 @@ void Network::ProcessNodes(void)
 					ASSERT(_pFileList != NULL);
 					pInfo = _pFileList->GetFileInfo(szFilename);
 					ASSERT(pInfo != NULL);
-
-                    if (GetNextChunk(szFilename, &nChunk) == true) {
-                        // If file has chunks needed, ask node for the next chunk.
-                        pTmp->RequestChunk(nChunk);
-						pInfo->ChunkRequested(nChunk, pTmp->GetID());
-                        bIdle = false;
-                    }
-                    else {
-                        // If file does not have chunks needed, tell node that 
-                        // file is complete.
+					
+					if (pTmp->IsFileRefused() == true) {
+						// The node doesnt have the file, so we release it.  
+						// szFilename is no longer valid after this.
 						pInfo->FileComplete();
-                        pTmp->FileComplete();
-                    }
+						bIdle = false;
+					}
+					else if (pTmp->GetFileLength(&nLength) == true) {
+						// the node has the file.  If this is the first node to 
+						// tell us how big it is, then we can setup the chunks.
+						if (pInfo->HasLength() == false) {
+							pInfo->SetLength(nLength);
+						}
+						
+						if (pInfo->GetLength() != nLength) {
+							// the node has a different file with the same name 
+							// (or the sync database has told us a different 
+							// size), so we cant use its chunks.
+							LOG_SYSTEM(LOG_NODE, "[Node:%d] Length of %s (%d) doesnt match (%d), not using this node for it.", pTmp->GetID(), szFilename, nLength, pInfo->GetLength());
+							pInfo->FileComplete();
+							pTmp->RejectFile();
+							bIdle = false;
+						}
+						// we only have one chunk at a time outstanding with a 
+						// node, so if we are still waiting, we do nothing.  If 
+						// we are only passing the file on, we also wait while 
+						// we have as many of its chunks as we can keep.
+						else if (pTmp->IsChunkPending() == false && pInfo->IsWindowFull() == false) {
+							if (GetNextChunk(szFilename, &nChunk) == true) {
+								// If file has chunks needed, ask node for the next chunk.
+								pTmp->RequestChunk(nChunk);
+								pInfo->ChunkRequested(nChunk, pTmp->GetID());
+								bIdle = false;
+							}
+							else {
+								// If file does not have chunks needed, tell node that 
+								// file is complete.
+								pInfo->FileComplete();
+								pTmp->FileComplete();
+							}
+						}
+					}
                 }
                 else {
                     // If node is not processing any file, ask the node to 
-                    // request the next file in the list to be downloaded.
+                    // request the next file in the list to be downloaded.  
+                    // The file will be in use by the node until it either 
+                    // refuses it, or we have asked it for all the chunks.
                     if (pTmp->ReadyForFile() == true) {
-                        if (GetNextFile(&szFilename) == true) {
-                            pTmp->RequestFile(szFilename);
-                            bIdle = false;
+                        if (GetNextFile(pTmp, &szFilename) == true) {
+							pInfo = _pFileList->GetFileInfo(szFilename);
+							ASSERT(pInfo != NULL);
+							pInfo->FileStart();
+							pTmp->RequestFile(szFilename);
+							bIdle = false;
                         }
                     }
                 }
@@ -434,12 +1070,46 @@ void Network::ProcessNodes(void)
                 if (pServerInfo != NULL) {
                     _pServerList->AddServer(pServerInfo);
                 }
+                
+                // If the node has just told us it is a relay, we remember 
+                // that for next time, and tell it what files we have.
+                if (pTmp->IsNewRelay() == true) {
+                    pInfo2 = pTmp->GetServerEntry();
+                    if (pInfo2 != NULL) {
+                        pInfo2->_nType = SERVER_TYPE_RELAY;
+                    }
+                    if (_Relay.bEnabled == false && _Dht.pDir == NULL) {
+                        _Dht.tNextPublish = 0;
+                    }
+                }
+                
+                // A node has told us that it has a file.  That means the 
+                // network has it, even if we couldnt find it before.
+                szHave = pTmp->GetHave();
+                if (szHave != NULL) {
+                    pAddr = pTmp->GetRemoteAddress();
+                    if (_Relay.bEnabled == true && pTmp->IsRelay() == false && pAddr != NULL) {
+                        pAddr->Get(pRaw);
+                        _Relay.pIndex->Store(szHave, pRaw);
+                        _Misses.pList->Remove(szHave);
+                    }
+                    free(szHave);
+                    bIdle = false;
+                }
 				
 				// Ask the node if it has received a remote file request that 
 				// needs to be passed on to the other nodes
 				pReq = pTmp->GetFileRequest();
 				if (pReq != NULL) {
-					RelayFileRequest(pReq);
+					if (pReq->bDht == true) {
+						RouteDhtLookup(pTmp, pReq);
+					}
+					else {
+						RelayFileRequest(pReq);
+						if (_Relay.bEnabled == true) {
+							RelayAnswer(pTmp, pReq);
+						}
+					}
 					
 					ASSERT(_pFileList != NULL);
 					pInfo = _pFileList->GetFileInfo(pReq->szFile);
@@ -454,32 +1124,173 @@ void Network::ProcessNodes(void)
 					delete pReq;
 				}
 				
+				// Ask the node if it has been given a DHT record to keep or 
+				// pass on.
+				pStore = pTmp->GetDhtStore();
+				if (pStore != NULL) {
+					RouteDhtStore(pStore);
+					delete pStore;
+					bIdle = false;
+				}
+				
+				// A node that has just told us its DHT id goes in our routing 
+				// table, and we tell it about the nodes we know of that are 
+				// closest to it, so that it can fill in its own.  It does the 
+				// same for us.
+				if (pTmp->IsNewDht() == true && _Dht.nId != 0) {
+					nContacts = _Dht.pTable->Closest(pTmp->GetDhtId(), pDhtIds, pDhtAddrs, DHT_BUCKET_SIZE);
+					if (nContacts > 0) {
+						pTmp->SendDhtContacts(pDhtIds, pDhtAddrs, nContacts);
+					}
+					pAddr = pTmp->GetRemoteAddress();
+					if (pAddr != NULL) {
+						pAddr->Get(pRaw);
+						_Dht.pTable->Add(pTmp->GetDhtId(), pRaw);
+					}
+				}
+				
+				pContacts = pTmp->GetDhtContacts();
+				if (pContacts != NULL) {
+					while (pContacts != NULL) {
+						pContact = pContacts;
+						pContacts = pContact->pNext;
+						if (_Dht.nId != 0) {
+							_Dht.pTable->Add(pContact->nId, pContact->pAddress);
+						}
+						free(pContact);
+					}
+					bIdle = false;
+				}
+				
+				// Ask the node if it wants us to get a file for it, from a 
+				// holder that it couldnt connect to.
+				pProxyReq = pTmp->GetProxyRequest();
+				if (pProxyReq != NULL) {
+					ServeProxy(pTmp->GetID(), pProxyReq);
+					delete pProxyReq;
+					bIdle = false;
+				}
+				
+				// Has the node sent us a chunk that we asked for by hash, or 
+				// asked us for one?
+				if (pTmp->GetHashData(pHash, &pData, &nSize) == true) {
+					CdcReceived(pTmp, pHash, pData, nSize);
+					if (pData != NULL) {
+						free(pData);
+					}
+					bIdle = false;
+				}
+				if (pTmp->GetHashRequest(pHash) == true) {
+					CdcRequested(pTmp, pHash);
+					bIdle = false;
+				}
+				
 				// Ask the node if it has received a reply for a file request.  
 				// If it did, then we got some information back, that we need 
-				// to pass back to the node that we originally got it from.
+				// to pass back to the node that we originally got it from.  If 
+				// we are the last host in the list, then it was our request, 
+				// and we need to connect to the node that has the file.
 				pReply = pTmp->GetFileReply();
 				if (pReply != NULL) {
-					RelayFileReply(pReply);
+					// someone has the file, even if it wasnt us that asked.  If 
+					// we had given up on it, we can look again.
+					ASSERT(_Misses.pList != NULL);
+					_Misses.pList->Remove(pReply->szFile);
+					pInfo = _pFileList->GetFileInfo(pReply->szFile);
+					if (pInfo != NULL && pReply->nHops <= 1) {
+						pInfo->TraceReply(pTmp->GetID());
+					}
+					if (pInfo != NULL && pReply->nHops > 1) {
+						if (pInfo->GetSearch() == FILE_SEARCH_NOTFOUND) {
+							SearchNetwork(pInfo, _Ring.nStart);
+						}
+					}
+					
+					if (pReply->nHops <= 1) {
+						ASSERT(pReply->pTarget != NULL);
+						if (pInfo != NULL) {
+							SearchHit(pInfo);
+						}
+						
+						// if we cant connect to the holder, the node that 
+						// told us about it might be able to get it for us.
+						if (FindNode(pReply->pTarget) == NULL) {
+							AddProxy(pReply->szFile, pReply->pTarget, pTmp->GetID());
+							if (ConnectHolder(pReply->pTarget) == false) {
+								ProxyConnected(pReply->pTarget, false);
+							}
+						}
+					}
+					else {
+						RelayFileReply(pReply);
+					}
 					delete pReply;
+					bIdle = false;
 				}
 				
 				
+				// Ask the node if the remote node has asked us for a file.  
+				// We can serve it if we have it locally, or if we are getting 
+				// it from the network ourselves (and know how big it is).
 				szLocalFile = pTmp->GetLocalFile();
 				if (szLocalFile != NULL) {
 					ASSERT(_pFileList != NULL);
 					pInfo = _pFileList->GetFileInfo(szLocalFile);
 					if (pInfo == NULL) {
-						pInfo = _pFileList->LoadFile(pReq->szFile);
+						pInfo = _pFileList->LoadFile(szLocalFile);
+					}
+					bBusy = false;
+					if (pInfo == NULL && _Delta.bEnabled == true && Delta::IsDeltaName(szLocalFile) == true) {
+						pInfo = LoadDelta(szLocalFile, &bBusy);
+					}
+					if (pInfo == NULL && _Cdc.bEnabled == true && ChunkStore::IsRecipeName(szLocalFile) == true) {
+						pInfo = LoadRecipe(szLocalFile, &bBusy);
 					}
 					
-					if (pInfo != NULL) {
-						pTmp->SendFile(szLocalFile, pInfo);
+					// if the delta (or recipe) is still being made, the node 
+					// is answered on a later pass.
+					if (bBusy == true) {
+						pTmp->HoldLocalFile(szLocalFile);
 					}
 					else {
-						pTmp->LocalFileFail(szLocalFile);
+						if (pInfo != NULL && pInfo->HasLength() == true && pInfo->IsReadFailed() == false) {
+							pInfo->EndWindow(pTmp->GetID());
+							pTmp->SendFile(szLocalFile, pInfo);
+						}
+						else {
+							pTmp->LocalFileFail(szLocalFile);
+						}
+						
+						free(szLocalFile);
+						bIdle = false;
+					}
+				}
+				
+				// If we are serving a file to the node, send the next chunk 
+				// it is waiting for.  If we dont have that chunk yet (because 
+				// we are still getting it from the network ourselves) then we 
+				// will try again on the next pass.  If our copy of the file 
+				// couldnt be read, the chunk will never come, so we close the 
+				// node and let it get the file from someone else.
+				pInfo = pTmp->GetUploadFile();
+				if (pInfo != NULL) {
+					if (pTmp->GetChunkRequest(&nChunk) == true) {
+						if (pInfo->GetChunk(nChunk, &pData, &nSize, &nLength) == true) {
+							pTmp->SendChunk(nChunk, pData, nSize);
+							pInfo->ChunkSent(nChunk, pTmp->GetID());
+							bIdle = false;
+						}
+						else if (pInfo->IsReadFailed() == true) {
+							LOG_ERROR(LOG_NETWORK, "[Node:%d] Unable to read chunk %d of %s, closing the node.", pTmp->GetID(), nChunk, pInfo->GetFilename());
+							pTmp->Close();
+						}
 					}
 					
-					free(szLocalFile);
+					// If the node has finished with the file, we release it.
+					pInfo = pTmp->GetUploadDone();
+					if (pInfo != NULL) {
+						pInfo->FileComplete();
+					}
 				}
             }
             else {
@@ -494,6 +1305,7 @@ void Network::ProcessNodes(void)
             bIdle = true;
         }
     }
+    _Loop.nPasses = max;
     
     // Now we will delete any closed nodes if we noticed any while we were processing.
     if (bClosed == true) {
@@ -511,22 +1323,13 @@ void Network::ProcessNodes(void)
 //      chance at communicating, so all should be ok.
 int Network::AddNode(Node *pNode)
 {
-    Logger *pLog;
     int nID;
     
     ASSERT(pNode != NULL);
     
     Lock();
     
-    nID = _nNextNodeID;
-    _nNextNodeID ++;
-    if (_nNextNodeID > MAX_NODE_ID) {
-        _nNextNodeID = 1;
-        pLog = new Logger;
-        pLog->System("NodeID counter reached maximum.  Restarting counter at 1.");
-        delete pLog;
-    }
-    
+    nID = NewID();
     pNode->SetID(nID);
     
     if (_pNodes != NULL) {
@@ -542,6 +1345,26 @@ int Network::AddNode(Node *pNode)
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: Get the next ID to give to a node or a mirror.  They share the same 
+//      counter, because the FileInfo uses the ID to know who each chunk was 
+//      asked of.  We assume that the object is already locked.
+int Network::NewID(void)
+{
+    int nID;
+    
+    nID = _nNextNodeID;
+    _nNextNodeID ++;
+    if (_nNextNodeID > MAX_NODE_ID) {
+        _nNextNodeID = 1;
+        LOG_SYSTEM(LOG_NETWORK, "NodeID counter reached maximum.  Restarting counter at 1.");
+    }
+    
+    ASSERT(nID > 0 && nID <= MAX_NODE_ID);
+    return(nID);
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: Here we need to go thru the list of nodes and remove any that have been 
 //      closed.  We are going to assume that the object is locked while we are
@@ -550,17 +1373,27 @@ void Network::RemoveClosedNodes(void)
 {
     Node *pTmp, *pPrev;
     
+    Node *pNext;
+    
     pPrev = NULL;
     pTmp = _pNodes;
     while (pTmp != NULL) {
-        if (pTmp->IsClosed() == true) {
+        if (pTmp->IsConnecting() == false && pTmp->IsClosed() == true) {
+        	pNext = pTmp->GetNext();
             if (pPrev == NULL) {
-                _pNodes = pTmp->GetNext();
-    
-                ProcessFinal(pTmp);
-                delete pTmp;
-                pTmp = _pNodes;
+                _pNodes = pNext;
+            }
+            else {
+            	pPrev->SetNext(NULL);
+            	if (pNext != NULL) {
+            		pPrev->SetNext(pNext);
+            	}
             }
+            pTmp->SetNext(NULL);
+    
+			ProcessFinal(pTmp);
+			delete pTmp;
+			pTmp = pNext;
         }
         else {
 			pPrev = pTmp;
@@ -571,21 +1404,23 @@ void Network::RemoveClosedNodes(void)
 
 
 //-----------------------------------------------------------------------------
-// CJW: This function is called by the Server object to ask for a particular 
-//      file chunk.  We will look in our files list, if it isnt in the list
-//      then we will add it, and ask the network for the file.  If we have the
-//      file in the list, but we dont have that particular chunk we will
-//      return a false.  If we do have it, we will return with that information.
-//      Since this function is called from outside the scope of this thread,
-//      we have to make sure that we are thread-safe.
-bool Network::RunQuery(char *szQuery, int nChunk, char **pData, int *nSize, int *nLength)
+// CJW: A client has asked for a file.  We look in our files list, if it isnt 
+//      in the list then we will see if we have it locally, and if not, we 
+//      will add it and ask the network for the file.  The client holds on to 
+//      the file until EndQuery() is called, so that it doesnt get removed 
+//      from the list while the client is still getting it.  Since this 
+//      function is called from outside the scope of this thread, we have to 
+//      make sure that we are thread-safe.
+//
+//      If small files are being got straight from the mirror, then the search 
+//      is held back until ProcessSearches() knows how big the file is.
+void Network::StartQuery(char *szQuery)
 {
-    bool bGotChunk = false;
+    static strMetric *pSkipped = Metrics::Counter("pacsrv_searches_skipped_total", "Searches not sent because the file was missing recently.");
     FileInfo *pInfo;
-    Node *pNode;
+    int nLength;
     
-    ASSERT(szQuery != NULL && nChunk >= 0 &&  pData != NULL);
-    ASSERT(nSize != NULL && nLength != NULL);
+    ASSERT(szQuery != NULL);
     
     Lock();
 	
@@ -595,37 +1430,110 @@ bool Network::RunQuery(char *szQuery, int nChunk, char **pData, int *nSize, int
     pInfo = _pFileList->GetFileInfo(szQuery);
     if (pInfo == NULL) {
         // If it isn't, check to see if we have it locally.
-        ASSERT(nChunk == 0);
         pInfo = _pFileList->LoadFile(szQuery);
     }
     
+    if (pInfo == NULL) {
+    	// If we still havent found it, query all the nodes for it.  Unless 
+    	// we have only just looked and nobody had it.  If the file is in the 
+    	// sync databases, we already know how big it is.
+        pInfo = _pFileList->AddFile(szQuery);
+        pInfo->TraceStart();
+        ASSERT(_pPkgIndex != NULL);
+        if (_pPkgIndex->Find(szQuery, &nLength, NULL) == true) {
+            pInfo->SetLength(nLength);
+        }
+        ASSERT(_Cdc.pStore != NULL);
+        if (_Cdc.bEnabled == true && _Cdc.pStore->GetCount() > 0) {
+            StartRecipe(pInfo);
+        }
+        if (_Delta.bEnabled == true && pInfo->GetDeltaName() == NULL) {
+            StartDelta(pInfo);
+        }
+        ASSERT(_Misses.pList != NULL);
+        if (_Misses.pList->Check(szQuery) == true) {
+            pInfo->SetSearch(FILE_SEARCH_NOTFOUND);
+            _Misses.nSaved++;
+            Metrics::Add(pSkipped, 1);
+            LOG_SYSTEM(LOG_NETWORK, "[Network] %s wasnt found recently, not searching again (%d searches saved).", szQuery, _Misses.nSaved);
+        }
+        else if (_SmallFile.nSize > 0) {
+            pInfo->SetSearch(FILE_SEARCH_PENDING);
+        }
+        else {
+            SearchNetwork(pInfo, _Ring.nStart);
+        }
+    }
+    
+    ASSERT(pInfo != NULL);
+    pInfo->EndWindow(0);
+    pInfo->FileStart();
+    
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The client that was getting this file has finished with it (or has 
+//      gone away), so we release it.  If nothing else is using the file then 
+//      it will be removed from the list.
+void Network::EndQuery(char *szQuery)
+{
+    FileInfo *pInfo;
+    
+    ASSERT(szQuery != NULL);
+    
+    Lock();
+    ASSERT(_pFileList != NULL);
+    pInfo = _pFileList->GetFileInfo(szQuery);
+    ASSERT(pInfo != NULL);
+    if (pInfo != NULL) {
+        pInfo->FileComplete();
+    }
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: This function is called by the Server object to ask for a particular 
+//      file chunk.  StartQuery() must have been called first, so the file 
+//      should be in our list.  If we dont have that particular chunk we will 
+//      return a false, but if we know how big the file is, then we will still 
+//      return the length so that the client can be told.  If we do have it, 
+//      we will return with that information.  The chunks that the client 
+//      asks for start at 0, but the file list starts at 1.  Since this 
+//      function is called from outside the scope of this thread, we have to 
+//      make sure that we are thread-safe.
+bool Network::RunQuery(char *szQuery, int nChunk, char **pData, int *nSize, int *nLength)
+{
+    bool bGotChunk = false;
+    FileInfo *pInfo;
+    
+    ASSERT(szQuery != NULL && nChunk >= 0 &&  pData != NULL);
+    ASSERT(nSize != NULL && nLength != NULL);
+    
+    Lock();
+	
+	ASSERT(_pFileList != NULL);
+	*nLength = 0;
+    
+    pInfo = _pFileList->GetFileInfo(szQuery);
     if (pInfo != NULL) {
         // If we have the file in our list, check to see if we have this chunk.
-        if (pInfo->GetChunk(nChunk, pData, nSize, nLength) == true) {
+        if (pInfo->GetChunk(nChunk + 1, pData, nSize, nLength) == true) {
             // if we do, create the memory chunk to be used.  return true.
             bGotChunk = true;
             ASSERT(*pData != NULL);
             ASSERT(*nSize > 0);
             ASSERT(*nLength > 0);
         }
-    }
-    else {
-    	// If we still havent found it, query all the nodes for it.
-		ASSERT(nChunk == 0);
-    
-        _pFileList->AddFile(szQuery);
-    
-        pNode = _pNodes;
-        while(pNode != NULL) {
-            if (pNode->IsClosed() == false) {
-                pNode->RequestFileFromNetwork(szQuery);
-            }
-            pNode = pNode->GetNext();
+        else if (pInfo->HasLength() == true) {
+            *nLength = pInfo->GetLength();
+        }
+        
+        if (bGotChunk == false) {
+            pInfo->TraceMiss();
         }
-    
-        // We will return false because it is highly unlikely that we have 
-        // already received parts of this file.
-		ASSERT(bGotChunk == false);
     }
     
     Unlock();
@@ -635,303 +1543,3081 @@ bool Network::RunQuery(char *szQuery, int nChunk, char **pData, int *nSize, int
 
 
 //-----------------------------------------------------------------------------
-// CJW: We have some details of a server we can try and connect to.  If we are 
-//      able to connect (and create a node, then we will add it to the list
-//      and then return true.  If we were unable to connect, then we will
-//      return false.
-bool Network::ConnectNode(ServerInfo *pInfo)
+// CJW: The client has told us the url that the file can be got from.  We 
+//      keep it with the file, and ProcessMirrors() will get parts of the file 
+//      from there while the network is searched.  StartQuery() must have 
+//      been called first.  Since this function is called from outside the 
+//      scope of this thread, we have to make sure that we are thread-safe.
+void Network::SetMirror(char *szQuery, char *szUrl)
+{
+    FileInfo *pInfo;
+    
+    ASSERT(szQuery != NULL && szUrl != NULL);
+    
+    Lock();
+    ASSERT(_pFileList != NULL);
+    pInfo = _pFileList->GetFileInfo(szQuery);
+    if (pInfo != NULL) {
+        if (pInfo->IsLocal() == false) {
+            pInfo->SetUrl(szUrl);
+        }
+    }
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Send a file request for this file to all the nodes we are connected 
+//      to.  We assume that the object is already locked.
+void Network::SearchNetwork(FileInfo *pInfo, int nTtl)
 {
-    bool bConnected = false;
+    static strMetric *pSearches = Metrics::Counter("pacsrv_searches_total", "Search rounds sent to the network.");
     Node *pNode;
-    char *szServer;
-    int nPort;
-    Logger log;
+    bool bRelays;
+    int nSent = 0;
     
     ASSERT(pInfo != NULL);
+    ASSERT(pInfo->IsLocal() == false);
+    ASSERT(nTtl > 0 && nTtl <= DEFAULT_TTL);
     
-    szServer = pInfo->_pAddress->GetServer();
-    nPort = pInfo->_pAddress->GetPort();
+    // a new search (rather than one going further out) is also looked up 
+    // in the DHT, which will usually find it without the flood going far.
+    if (pInfo->GetSearch() != FILE_SEARCH_SENT) {
+        DhtLookup(pInfo->GetFilename());
+    }
     
-    ASSERT(szServer != NULL && szServer[0] != '\0' && nPort > 0);
+    pInfo->SetSearch(FILE_SEARCH_SENT);
+    pInfo->TraceSearch(nTtl);
+    pInfo->SetSearchTtl(nTtl);
+    pInfo->SetSearchWait(GetSearchWait(nTtl));
+    Metrics::Add(pSearches, 1);
     
-    pNode = new Node;
-    ASSERT(pNode != NULL);
+    // if we are a leaf of some relays, then they will search for us.
+    bRelays = _Relay.bLeaf;
     
-    log.System("[Network] Attempting to connect to %s:%d", szServer, nPort);
-    if (pNode->Connect(szServer, nPort) == false) {
-        log.System("[Network] Unable to connect to %s:%d", szServer, nPort);
-        delete pNode;
-        pInfo->ServerFailed();
-    }
-    else {
-        log.System("[Network] Connected to %s:%d", szServer, nPort);
-        pNode->SetNext(_pNodes);
-        _pNodes = pNode;
-        pInfo->ServerConnected();
-        bConnected = true;
+    pNode = _pNodes;
+    while(pNode != NULL) {
+        if (pNode->IsConnecting() == false && pNode->IsClosed() == false) {
+            if (bRelays == false || pNode->IsRelay() == true) {
+                pNode->RequestFileFromNetwork(pInfo->GetFilename(), nTtl);
+                nSent++;
+            }
+        }
+        pNode = pNode->GetNext();
     }
-    
-    return(bConnected);
+    pInfo->AddSearchNodes(nSent);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: We have a list of files that are being received over the network (or
-//      locally being supplied to a client).  Every 5 seconds, we should go
-//      through the file list and remove any that have been completed and dont
-//      have any pending connections receiving the information.
-void Network::ProcessFileList(void)
+// CJW: Work out how long to wait for a reply to a search.  The request can go 
+//      out nTtl hops, and the reply has to come back the same way, so we 
+//      allow a round trip for each hop.  We dont know the round trip times 
+//      past our own nodes, so we use the average of the ones we have.  Only 
+//      the last round, which goes all the way out, has to wait the minimum, 
+//      the closer rounds give up sooner.  We assume the object is already 
+//      locked.
+int Network::GetSearchWait(int nTtl)
 {
-    time_t tNow;
+    Node *pNode;
+    int nTotal = 0;
+    int nCount = 0;
+    int nRtt, nWait;
     
-    Lock();
-
-    ASSERT(_pFileList != NULL);
-    tNow = time(NULL);
-    if ((tNow - _tLastFileListCheck) >= FILE_LIST_CHECK) {
-        _pFileList->Process();
-        _tLastFileListCheck = tNow;
+    pNode = _pNodes;
+    while (pNode != NULL) {
+        if (pNode->IsValid() == true && pNode->IsClosed() == false) {
+            nRtt = pNode->GetRtt();
+            if (nRtt > 0) {
+                nTotal += nRtt;
+                nCount++;
+            }
+        }
+        pNode = pNode->GetNext();
     }
-
-    Unlock();
+    
+    if (nCount > 0) { nRtt = nTotal / nCount; }
+    else            { nRtt = SEARCH_DEFAULT_RTT; }
+    
+    ASSERT(nTtl > 0 && nTtl <= DEFAULT_TTL);
+    nWait = (nRtt * nTtl) + SEARCH_SLACK;
+    if (nTtl >= DEFAULT_TTL && nWait < SEARCH_MIN_WAIT) { nWait = SEARCH_MIN_WAIT; }
+    if (nWait > SEARCH_MAX_WAIT) { nWait = SEARCH_MAX_WAIT; }
+    
+    return(nWait);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: If we are about to close a slow connection, or if it has already been 
-// 		closed by the other side, we need to process the information it has, 
-// 		before we destroy the object.  There may be chunks of data, or 
-// 		Serverlist information that was sent before the connection was closed.  
-// 		We dont really care about any messages that require a response.  
-// 		Additionally we need to let the file-list know that this node is being 
-// 		removed, so that it can remove any outstanding chunks that were 
-// 		allocated to this node, so that it can be allocated again.
-void Network::ProcessFinal(Node *pNode)
+// CJW: A node has replied to our search for this file.  The reply doesnt say 
+//      how far away the node is, but it is no further than the TTL that the 
+//      search was sent with, so we count that.  Then we work out what TTL 
+//      the next searches should start with from the recent ones.  We assume 
+//      the object is already locked.
+void Network::SearchHit(FileInfo *pInfo)
 {
-	char *szFilename;
-	char *pData;
-	int nChunk;
-	int nSize;
-	bool bDone;
-	Address *pServerInfo;
-	int nID;
-	
-	ASSERT(pNode != NULL);
-	
-	bDone = false;
-	while (bDone == false) {
-		bDone = true;
-	
-		szFilename = NULL;
-		if (pNode->GetChunks(&szFilename, &pData, &nChunk, &nSize) == true) {
-			SaveChunk(szFilename, pData, nChunk, nSize);
-			bDone = false;
-		}
-		
-		pServerInfo = pNode->GetServerInfo();
-		if (pServerInfo != NULL) {
-			_pServerList->AddServer(pServerInfo);
-			bDone = false;
-		}
-	}
-	
-	nID = pNode->GetID();
-	_pFileList->RemoveNode(nID);
+    static strMetric *pHits = Metrics::Counter("pacsrv_search_hits_total", "Searches that found the file.");
+    int pCounts[DEFAULT_TTL+1];
+    int nTtl, nCount, nTotal, i;
+    
+    ASSERT(pInfo != NULL);
+    
+    if (pInfo->IsFound() == false && pInfo->GetSearchTtl() > 0) {
+        nTtl = pInfo->GetSearchTtl();
+        ASSERT(nTtl <= DEFAULT_TTL);
+        _Ring.pHits[nTtl]++;
+        Metrics::Add(pHits, 1);
+        _Ring.pRecent[_Ring.nRecent % RING_HISTORY] = nTtl;
+        _Ring.nRecent++;
+        
+        nTotal = _Ring.nRecent;
+        if (nTotal > RING_HISTORY) { nTotal = RING_HISTORY; }
+        for (i=0; i<=DEFAULT_TTL; i++) { pCounts[i] = 0; }
+        for (i=0; i<nTotal; i++) { pCounts[_Ring.pRecent[i]]++; }
+        
+        nCount = 0;
+        for (i=1; i<=DEFAULT_TTL && (nCount * 2) < nTotal; i++) {
+            nCount += pCounts[i];
+            _Ring.nStart = i;
+        }
+        
+        LOG_SYSTEM(LOG_NETWORK, "[Network] %s found within %d hops, searches now start at %d.", pInfo->GetFilename(), nTtl, _Ring.nStart);
+    }
+    
+    pInfo->TraceSearchEnd(true);
+    pInfo->SearchFound();
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: We have retrieved a chunk from a node, so we need to save it to our 
-// 		file list.  If the file doesnt exist in our internal file list, then we 
-// 		will add it.  The data should not be free'd, because the FileInfo 
-// 		object will now control that block of memory (rather than creating a 
-// 		new block and copying the data over, etc).
-void Network::SaveChunk(char *szFilename, char *pData, int nChunk, int nSize)
+// CJW: Fill in how many of the files we have found were found at each TTL, 
+//      so that it can be reported.  pCounts[0] is never used, because a 
+//      search always goes at least one hop.  Returns the number of entries 
+//      filled in.  Since this function is called from outside the scope of 
+//      this thread, we have to make sure that we are thread-safe.
+int Network::GetHitHistogram(int *pCounts, int nMax)
 {
-	FileInfo *pInfo;
-	
-	ASSERT(szFilename != NULL);
-	ASSERT(pData != NULL);
-	ASSERT(nChunk >= 0);
-	ASSERT(nSize > 0);
-	
-	ASSERT(_pFileList != NULL);
-	
-	pInfo = _pFileList->GetFileInfo(szFilename);
-	if (pInfo == NULL) {
-		pInfo = _pFileList->AddFile(szFilename);
-	}
-	ASSERT(pInfo != NULL);
-	
-	pInfo->SaveChunk(pData, nChunk, nSize);
+    int i;
+    
+    ASSERT(pCounts != NULL && nMax > 0);
+    
+    if (nMax > DEFAULT_TTL+1) { nMax = DEFAULT_TTL+1; }
+    
+    Lock();
+    for (i=0; i<nMax; i++) {
+        pCounts[i] = _Ring.pHits[i];
+    }
+    Unlock();
+    
+    return(nMax);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: This function is being asked for the next chunk that needs to be asked 
-// 		for.  We will return true if there is another chunk for this file.  
-// 		Return false if there are no more chunks needed for the file.
-bool Network::GetNextChunk(char *szFilename, int *nChunk)
+// CJW: Return a copy of the state of each of our nodes, in a list that the 
+//      caller needs to free.  We only hold the lock long enough to copy the 
+//      values, so that the stats page can be written without holding up the 
+//      network.  Returns NULL if there are no nodes that are connected.
+strNodeStats * Network::GetNodeStats(int *nCount)
 {
-	bool bMore = false;
-	FileInfo *pInfo;
-	
-	ASSERT(szFilename != NULL);
-	ASSERT(nChunk != NULL);
-	ASSERT(_pFileList != NULL);
-	
-	pInfo = _pFileList->GetFileInfo(szFilename);
-	if (pInfo != NULL) {
-		if (pInfo->GetNextChunk(nChunk) == true) {
-			ASSERT(*nChunk >= 0);
-			bMore = true;
-		}
-	}
-	
-	return(bMore);
+    strNodeStats *pList = NULL;
+    Node *pTmp;
+    int nNodes;
+    
+    ASSERT(nCount != NULL);
+    
+    Lock();
+    *nCount = 0;
+    nNodes = GetNodeCount();
+    if (nNodes > 0) {
+        pList = (strNodeStats *) malloc(sizeof(strNodeStats) * nNodes);
+        ASSERT(pList != NULL);
+        
+        pTmp = _pNodes;
+        while (pTmp != NULL && *nCount < nNodes) {
+            if (pTmp->IsConnecting() == false && pTmp->IsClosed() == false) {
+                pTmp->GetStats(&pList[*nCount]);
+                (*nCount)++;
+            }
+            pTmp = pTmp->GetNext();
+        }
+        
+        // the nodes might all still be connecting.
+        if (*nCount == 0) {
+            free(pList);
+            pList = NULL;
+        }
+    }
+    Unlock();
+    
+    return(pList);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: Return the filename of the next file that we need to download.   To do 
-// 		this we look at our File list for the next file in the list that is 
+// CJW: Same as above, but for the files in our list.
+strFileStats * Network::GetFileStats(int *nCount)
+{
+    strFileStats *pList = NULL;
+    FileInfo *pInfo;
+    int nFiles;
+    
+    ASSERT(nCount != NULL);
+    
+    Lock();
+    ASSERT(_pFileList != NULL);
+    
+    *nCount = 0;
+    nFiles = 0;
+    pInfo = _pFileList->GetFirst();
+    while (pInfo != NULL) {
+        nFiles++;
+        pInfo = pInfo->GetNext();
+    }
+    
+    if (nFiles > 0) {
+        pList = (strFileStats *) malloc(sizeof(strFileStats) * nFiles);
+        ASSERT(pList != NULL);
+        
+        pInfo = _pFileList->GetFirst();
+        while (pInfo != NULL) {
+            ASSERT(*nCount < nFiles);
+            strncpy(pList[*nCount].szFile, pInfo->GetFilename(), 255);
+            pList[*nCount].szFile[255] = '\0';
+            pList[*nCount].bLocal = pInfo->IsLocal();
+            pList[*nCount].nLength = 0;
+            pList[*nCount].nChunks = 0;
+            if (pInfo->HasLength() == true) {
+                pList[*nCount].nLength = pInfo->GetLength();
+                pList[*nCount].nChunks = pInfo->GetChunkCount();
+            }
+            pInfo->GetProgress(&pList[*nCount].nReceived, &pList[*nCount].nRequested);
+            pList[*nCount].nUsers = pInfo->GetUseCount();
+            (*nCount)++;
+            pInfo = pInfo->GetNext();
+        }
+    }
+    Unlock();
+    
+    return(pList);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the search of the network for this file has finished, 
+//      and nobody had it, or if the copy we got was bad.  The server will 
+//      tell the client, so that it can get the file from somewhere else.  
+//      Since this function is called from outside the scope of this 
+//      thread, we have to make sure that we are thread-safe.
+bool Network::IsNotFound(char *szQuery)
+{
+    bool bNotFound = false;
+    FileInfo *pInfo;
+    
+    ASSERT(szQuery != NULL);
+    
+    Lock();
+    ASSERT(_pFileList != NULL);
+    pInfo = _pFileList->GetFileInfo(szQuery);
+    if (pInfo != NULL) {
+        if (pInfo->IsLocal() == false && pInfo->GetSearch() == FILE_SEARCH_NOTFOUND && CanMirror(pInfo) == false) {
+            bNotFound = true;
+        }
+        else if (pInfo->IsLocal() == false && pInfo->GetBadSums() > 0) {
+            // what we got didnt match its checksum, so the client is 
+            // better off getting it from the mirror.
+            bNotFound = true;
+        }
+    }
+    Unlock();
+    
+    return(bNotFound);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the mirror could still get this file for us.  It cant 
+//      if we dont have a url for it, or it has failed too often, or we arent 
+//      using the mirror at all.
+bool Network::CanMirror(FileInfo *pInfo)
+{
+    bool bCan = false;
+    
+    ASSERT(pInfo != NULL);
+    
+    if (_Mirror.nParallel > 0 && pInfo->GetUrl() != NULL) {
+        bCan = true;
+    }
+    
+    return(bCan);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go thru the files that we havent searched the network for yet.  If we 
+//      know the url, the mirror will tell us how big the file is.  If it is 
+//      small enough, then we dont search at all and the mirror gets all of 
+//      it.  Otherwise, or if we dont find out in time, we search the network 
+//      as usual.  If the mirror fails for a file that we didnt search for, 
+//      then we need to search for it after all.
+void Network::ProcessSearches(void)
+{
+    FileInfo *pInfo;
+    long long nWait;
+    int nTtl;
+    
+    Lock();
+    
+    ASSERT(_pFileList != NULL);
+    
+    pInfo = _pFileList->GetFirst();
+    while (pInfo != NULL) {
+        if (pInfo->GetSearch() == FILE_SEARCH_PENDING) {
+            nWait = GetTimeMs() - pInfo->GetSearchTime();
+            if (pInfo->HasLength() == true) {
+                if (pInfo->GetLength() <= _SmallFile.nSize) {
+                    pInfo->SetSearch(FILE_SEARCH_BYPASS);
+                    _SmallFile.nBypassed++;
+                    LOG_SYSTEM(LOG_NETWORK, "[Network] %s is %d bytes, getting it from the mirror without a search (%d searches bypassed).", pInfo->GetFilename(), pInfo->GetLength(), _SmallFile.nBypassed);
+                }
+                else {
+                    SearchNetwork(pInfo, _Ring.nStart);
+                }
+            }
+            else if (pInfo->GetUrl() == NULL) {
+                if (nWait > SEARCH_URL_WAIT) {
+                    SearchNetwork(pInfo, _Ring.nStart);
+                }
+            }
+            else if (nWait > SEARCH_SIZE_WAIT) {
+                SearchNetwork(pInfo, _Ring.nStart);
+            }
+        }
+        else if (pInfo->GetSearch() == FILE_SEARCH_BYPASS && pInfo->GetUrl() == NULL) {
+            // the mirror has failed too many times for this file.
+            SearchNetwork(pInfo, _Ring.nStart);
+        }
+        else if (pInfo->GetSearch() == FILE_SEARCH_SENT && pInfo->IsFound() == false) {
+            // if nobody has replied in time, we send the search further out.  
+            // Once it has been to the edge of the network and back, it isnt 
+            // there, and if the mirror cant get it for us either, the 
+            // client needs to know.  The sync databases might have told us 
+            // how big it is, but that doesnt mean anyone has it.
+            nWait = GetTimeMs() - pInfo->GetSearchTime();
+            if (nWait > pInfo->GetSearchWait()) {
+                nTtl = pInfo->GetSearchTtl();
+                if (nTtl < DEFAULT_TTL) {
+                    nTtl *= 2;
+                    if (nTtl > DEFAULT_TTL) { nTtl = DEFAULT_TTL; }
+                    SearchNetwork(pInfo, nTtl);
+                }
+                else if (CanMirror(pInfo) == false) {
+                    pInfo->SetSearch(FILE_SEARCH_NOTFOUND);
+                    pInfo->TraceSearchEnd(false);
+                    LOG_SYSTEM(LOG_NETWORK, "[Network] %s not found on the network (ttl %d, %d nodes asked).", pInfo->GetFilename(), nTtl, pInfo->GetSearchNodes());
+                    
+                    // if we werent connected to anyone, we dont know that 
+                    // the network doesnt have it, so it isnt a miss.
+                    if (_Misses.nTime > 0 && pInfo->GetSearchNodes() > 0) {
+                        ASSERT(_Misses.pList != NULL);
+                        _Misses.pList->Add(pInfo->GetFilename(), _Misses.nTime);
+                    }
+                }
+            }
+        }
+        
+        pInfo = pInfo->GetNext();
+    }
+    
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go thru the mirror connections, and put any chunks that they have 
+//      received into the file list, the same as the chunks we get from the 
+//      nodes.  If the mirror is the first to know how big the file is, then 
+//      we set that up too.  When a mirror connection is finished (or has 
+//      failed), any chunks that were asked of it and not received are 
+//      released so that they will be asked for again.  Then we start any new 
+//      mirror connections that are needed.
+void Network::ProcessMirrors(void)
+{
+    Mirror *pMirror, *pPrev, *pNext;
+    FileInfo *pInfo;
+    int nResult, nLoops;
+    int nLength, nChunk, nSize;
+    char *pData;
+    bool bValid;
+    
+    Lock();
+    
+    ASSERT(_pFileList != NULL);
+    
+    pPrev = NULL;
+    pMirror = _pMirrors;
+    while (pMirror != NULL) {
+        pNext = pMirror->GetNext();
+        
+        // the mirror holds the file, so it must still be in the list.
+        pInfo = _pFileList->GetFileInfo(pMirror->GetFilename());
+        ASSERT(pInfo != NULL);
+        
+        bValid = true;
+        nLoops = 0;
+        nResult = MIRROR_BUSY;
+        while (nResult == MIRROR_BUSY && bValid == true && nLoops < MIRROR_LOOPS) {
+            nResult = pMirror->Process();
+            nLoops++;
+            
+            if (pMirror->GetLength(&nLength) == true) {
+                if (pInfo->HasLength() == false) {
+                    pInfo->SetLength(nLength);
+                }
+                else if (pInfo->GetLength() != nLength) {
+                    // the mirror doesnt have the same file as the network.
+                    LOG_ERROR(LOG_NETWORK, "Mirror length for %s does not match the network.", pMirror->GetFilename());
+                    bValid = false;
+                }
+            }
+            
+            while (pMirror->GetChunk(&nChunk, &pData, &nSize) == true) {
+                if (bValid == true && nChunk <= pInfo->GetChunkCount()) {
+                    pInfo->SaveChunk(pData, nChunk, nSize);
+                }
+                else {
+                    free(pData);
+                }
+            }
+        }
+        
+        if (nResult == MIRROR_DONE || nResult == MIRROR_FAILED || bValid == false) {
+            if (nResult != MIRROR_DONE) {
+                LOG_SYSTEM(LOG_NETWORK, "Mirror request for %s failed.", pMirror->GetFilename());
+                pInfo->MirrorFailed();
+            }
+            
+            if (pPrev == NULL) { _pMirrors = pNext; }
+            else               { pPrev->SetNext(pNext); }
+            pMirror->SetNext(NULL);
+            
+            pInfo->RemoveNode(pMirror->GetID());
+            pInfo->FileComplete();
+            delete pMirror;
+        }
+        else {
+            pPrev = pMirror;
+        }
+        
+        pMirror = pNext;
+    }
+    
+    StartMirrors();
+    
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go thru the file list, and for each file that a client is waiting 
+//      for, that we have a url for, and that still has chunks that havent 
+//      been asked for, we start more mirror connections (up to the limit for 
+//      each file).  If we dont know how big the file is yet, then we only ask 
+//      for the first chunk, and the response will tell us how big it is.  
+//      Otherwise we ask for a run of chunks from the end of the file, since 
+//      the nodes work from the start.  We assume the object is already 
+//      locked.
+void Network::StartMirrors(void)
+{
+    FileInfo *pInfo;
+    int nActive, nFirst, nCount;
+    bool bMore;
+    
+    ASSERT(_pFileList != NULL);
+    
+    if (_Mirror.nParallel > 0) {
+        pInfo = _pFileList->GetFirst();
+        while (pInfo != NULL) {
+            if (pInfo->IsLocal() == false && pInfo->GetUrl() != NULL) {
+                nActive = GetMirrorCount(pInfo->GetFilename());
+                
+                // if the only things using the file are our own mirror 
+                // connections, then nobody is waiting for it anymore.
+                if (pInfo->GetUseCount() > nActive) {
+                    if (pInfo->HasLength() == false) {
+                        if (nActive == 0) {
+                            StartMirror(pInfo, 1, 1);
+                        }
+                    }
+                    else {
+                        bMore = true;
+                        while (bMore == true && nActive < _Mirror.nParallel) {
+                            bMore = pInfo->GetLastChunks(_Mirror.nChunks, &nFirst, &nCount);
+                            if (bMore == true) {
+                                bMore = StartMirror(pInfo, nFirst, nCount);
+                                nActive++;
+                            }
+                        }
+                    }
+                }
+            }
+            pInfo = pInfo->GetNext();
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Start a mirror connection for these chunks of the file, and add it to 
+//      our list.  If we know how long the file is, the chunks are marked as 
+//      asked for, so that the nodes wont ask for them too.  The mirror holds 
+//      the file until it is finished.  Returns false if the connection 
+//      couldnt be started.
+bool Network::StartMirror(FileInfo *pInfo, int nFirst, int nCount)
+{
+    bool bStarted = false;
+    Mirror *pMirror;
+    int i;
+    
+    ASSERT(pInfo != NULL && pInfo->GetUrl() != NULL);
+    ASSERT(nFirst > 0 && nCount > 0);
+    
+    pMirror = new Mirror;
+    if (pMirror->Start(pInfo->GetUrl(), pInfo->GetFilename(), nFirst, nCount) == false) {
+        delete pMirror;
+        pInfo->MirrorFailed();
+    }
+    else {
+        pMirror->SetID(NewID());
+        pMirror->SetNext(_pMirrors);
+        _pMirrors = pMirror;
+        
+        pInfo->FileStart();
+        if (pInfo->HasLength() == true) {
+            for (i=nFirst; i<nFirst+nCount; i++) {
+                pInfo->ChunkRequested(i, pMirror->GetID());
+            }
+        }
+        bStarted = true;
+    }
+    
+    return(bStarted);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Count how many mirror connections we have going for this file.
+int Network::GetMirrorCount(char *szFilename)
+{
+    Mirror *pMirror;
+    int nCount = 0;
+    
+    ASSERT(szFilename != NULL);
+    
+    pMirror = _pMirrors;
+    while (pMirror != NULL) {
+        if (strcmp(pMirror->GetFilename(), szFilename) == 0) {
+            nCount++;
+        }
+        pMirror = pMirror->GetNext();
+    }
+    
+    return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have some details of a server we can try and connect to.  The 
+//      connection is made in the background, so if we are able to start 
+//      connecting, then we will add the node to the list and then return 
+//      true.  ProcessConnects() will let the server list know if the 
+//      connection worked or not.  If we couldnt even start the connection, 
+//      or we are already connected to that server, then we return false.
+bool Network::ConnectNode(ServerInfo *pInfo)
+{
+    bool bStarted = false;
+    Node *pNode;
+    struct in_addr addr;
+    char *szServer;
+    int nPort, nID;
+    
+    ASSERT(pInfo != NULL);
+    ASSERT(pInfo->_pAddress != NULL);
+    ASSERT(pInfo->_bConnected == false);
+    
+    szServer = pInfo->_pAddress->GetServer();
+    nPort = pInfo->_pAddress->GetPort();
+    
+    ASSERT(szServer != NULL && szServer[0] != '\0' && nPort > 0);
+    
+    pInfo->_nLastTime = time(NULL);
+    
+    // if the server has already connected to us, or we are already 
+    // connecting to it, then there's no need to do it again.  If it is a 
+    // name that is still being looked up, we leave it until the next time 
+    // round rather than counting it as a failure.
+    if (FindNode(pInfo->_pAddress) == NULL) {
+        if (inet_aton(szServer, &addr) == 0 && Resolver::Lookup(szServer, &addr) == RESOLVE_PENDING) {
+            LOG_TEST(LOG_NETWORK, "[Network] Waiting for %s to be looked up", szServer);
+        }
+        else {
+            pNode = new Node;
+            ASSERT(pNode != NULL);
+            pNode->SetLocalPort(_nPort);
+            pNode->SetDhtId(_Dht.nId);
+            pNode->SetRelay(_Relay.bEnabled);
+        
+            if (pNode->Connect(szServer, nPort) == false) {
+                LOG_SYSTEM(LOG_NETWORK, "[Network] Unable to connect to %s:%d", szServer, nPort);
+                delete pNode;
+                pInfo->ServerFailed();
+            }
+            else {
+                pNode->SetServerEntry(pInfo);
+                nID = AddNode(pNode);
+                LOG_SYSTEM(LOG_NODE, "[Node:%d] Connecting to %s:%d", nID, szServer, nPort);
+                bStarted = true;
+            }
+        }
+    }
+    
+    return(bStarted);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We've received a reply to one of our file requests, which tells us the 
+// 		address of a node that has the file.  If we are not already connected 
+// 		to it, then we will add it to our server list and start connecting.  
+// 		Once it is connected, it will be asked for the files we need just like 
+// 		any other node.
+//
+// 		Returns false if we arent connected and couldnt start connecting.
+bool Network::ConnectHolder(Address *pTarget)
+{
+	ServerInfo *pInfo;
+	Address *pAddress;
+	bool bConnecting = true;
+	
+	ASSERT(pTarget != NULL);
+	ASSERT(_pServerList != NULL);
+	
+	if (FindNode(pTarget) == NULL) {
+		bConnecting = false;
+		if ((GetConnectionCount() + GetConnectingCount()) < _Connections.nMax) {
+			pAddress = new Address;
+			pAddress->Set(pTarget);
+			pInfo = _pServerList->AddServer(pAddress);
+			ASSERT(pInfo != NULL);
+			
+			if (pInfo->_bConnected == false) {
+				bConnecting = ConnectNode(pInfo);
+			}
+		}
+	}
+	
+	return(bConnecting);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Find the node that is connected (or connecting) to this address.  
+// 		Return NULL if we dont have one.
+Node * Network::FindNode(Address *pAddress)
+{
+	Node *pNode, *pFound = NULL;
+	Address *pRemote;
+	
+	ASSERT(pAddress != NULL);
+	
+	pNode = _pNodes;
+	while (pNode != NULL && pFound == NULL) {
+		if (pNode->IsConnecting() == true || pNode->IsClosed() == false) {
+			pRemote = pNode->GetRemoteAddress();
+			if (pRemote != NULL) {
+				if (pRemote->IsSame(pAddress) == true) {
+					pFound = pNode;
+				}
+			}
+		}
+		pNode = pNode->GetNext();
+	}
+	
+	return(pFound);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have enough connections, so any that are still trying to connect 
+// 		can be dropped.  They havent failed, so we dont count it against the 
+// 		server, and we clear the time we tried it so that it can be used 
+// 		straight away if we need it again.
+void Network::CancelConnects(void)
+{
+	Node *pNode;
+	ServerInfo *pInfo;
+	
+	pNode = _pNodes;
+	while (pNode != NULL) {
+		if (pNode->IsConnecting() == true) {
+			pInfo = pNode->GetServerEntry();
+			if (pInfo != NULL) {
+				pInfo->_nLastTime = 0;
+			}
+			pNode->CancelConnect();
+		}
+		pNode = pNode->GetNext();
+	}
+	
+	RemoveClosedNodes();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: While we are starting up, we keep an eye on how many connections have 
+// 		completed the handshake, and log how long it took to get the first 
+// 		one, and to get to our minimum.  Once we have reached the minimum, 
+// 		there is nothing else to do here.
+void Network::CheckBootstrap(void)
+{
+	long long nNow;
+	int nValid;
+	
+	Lock();
+	
+	// counting the nodes means going thru the whole list, so we only do it 
+	// once a second.
+	nNow = GetTimeMs();
+	if (_Bootstrap.nMin == 0 && (nNow - _Bootstrap.nLastCheck) >= 1000) {
+		_Bootstrap.nLastCheck = nNow;
+		nValid = GetValidCount();
+		
+		if (nValid > 0 && _Bootstrap.nFirst == 0) {
+			_Bootstrap.nFirst = nNow;
+			LOG_SYSTEM(LOG_NETWORK, "[Network] First node connection after %d ms.", (int) (nNow - _Bootstrap.nStart));
+		}
+		
+		if (nValid >= _Connections.nMin) {
+			_Bootstrap.nMin = nNow;
+			LOG_SYSTEM(LOG_NETWORK, "[Network] Reached %d node connections after %d ms.", nValid, (int) (nNow - _Bootstrap.nStart));
+		}
+	}
+	
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go thru the list of nodes and check on any that are still trying to 
+// 		connect.  None of this will block, we are only checking to see if the 
+// 		connection has finished.  Once connected, we send the init message to 
+// 		the other side.  We let the server list know how it went so that it 
+// 		knows which servers are worth trying again.
+void Network::ProcessConnects(void)
+{
+	Node *pNode;
+	ServerInfo *pInfo;
+	Address *pAddress;
+	unsigned char pRaw[6];
+	bool bFailed = false;
+	
+	Lock();
+	
+	pNode = _pNodes;
+	while (pNode != NULL) {
+		if (pNode->IsConnecting() == true) {
+			pInfo = pNode->GetServerEntry();
+			pAddress = pNode->GetRemoteAddress();
+			ASSERT(pAddress != NULL);
+			
+			switch (pNode->CheckConnect(_Connections.nTimeout)) {
+				case NODE_CONNECT_OK:
+					LOG_SYSTEM(LOG_NODE, "[Node:%d] Connected to %s:%d", pNode->GetID(), pAddress->GetServer(), pAddress->GetPort());
+					pNode->SendInit();
+					if (pInfo != NULL) {
+						pInfo->ServerConnected();
+					}
+					ProxyConnected(pAddress, true);
+					break;
+					
+				case NODE_CONNECT_FAILED:
+					LOG_SYSTEM(LOG_NODE, "[Node:%d] Unable to connect to %s:%d", pNode->GetID(), pAddress->GetServer(), pAddress->GetPort());
+					if (pInfo != NULL) {
+						pInfo->ServerFailed();
+					}
+					
+					// a DHT node we cant connect to is no use in the routing table.
+					pAddress->Get(pRaw);
+					_Dht.pTable->Remove(pRaw);
+					ProxyConnected(pAddress, false);
+					bFailed = true;
+					break;
+					
+				default:
+					break;
+			}
+		}
+		pNode = pNode->GetNext();
+	}
+	
+	if (bFailed == true) {
+		RemoveClosedNodes();
+	}
+	
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have a list of files that are being received over the network (or
+//      locally being supplied to a client).  Every 5 seconds, we should go
+//      through the file list and remove any that have been completed and dont
+//      have any pending connections receiving the information.
+void Network::ProcessFileList(void)
+{
+    time_t tNow;
+    
+    Lock();
+
+    ASSERT(_pFileList != NULL);
+    tNow = time(NULL);
+    if ((tNow - _tLastFileListCheck) >= FILE_LIST_CHECK) {
+        if (_Cache.bSave == true) {
+            SaveFiles();
+        }
+        _pFileList->Process();
+        ProcessPkgIndex();
+        ASSERT(_Misses.pList != NULL);
+        _Misses.pList->Process();
+        ASSERT(_Dht.pStore != NULL);
+        _Dht.pStore->Process();
+        ASSERT(_Relay.pIndex != NULL);
+        _Relay.pIndex->Process();
+        _tLastFileListCheck = tNow;
+        
+        Metrics::Set(Metrics::Gauge("pacsrv_nodes", "Nodes that we are connected to."), GetValidCount());
+        Metrics::Set(Metrics::Gauge("pacsrv_nodes_connecting", "Connections to nodes that are still being made."), GetConnectingCount());
+        Metrics::Set(Metrics::Gauge("pacsrv_misses", "Files that werent found recently."), _Misses.pList->GetCount());
+        Metrics::Set(Metrics::Gauge("pacsrv_chunks_cached_bytes", "Chunks that were passed on to a node, and are kept in case they are asked for again."), FileInfo::GetCachedBytes());
+        Tracer::Flush();
+    }
+    
+    if ((tNow - _tLastMetricsLog) >= METRICS_LOG_TIME) {
+        Metrics::Log();
+        _tLastMetricsLog = tNow;
+    }
+
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: When the sync databases have changed, they are loaded into a new index 
+// 		in the background, since reading them all takes a while.  Once that 
+// 		is done, the new index is swapped in.  Find() hands out checksums 
+// 		that belong to the index, so the old one can only be deleted here, 
+// 		while we are locked and nobody is still using them.  Needs to be 
+// 		called while locked.
+void Network::ProcessPkgIndex(void)
+{
+    PkgIndex *pIndex;
+    int nState;
+    
+    ASSERT(_pPkgIndex != NULL);
+    ASSERT(_pBackground != NULL);
+    
+    nState = _pBackground->GetState((char *) JOB_PKGINDEX);
+    if (nState == JOB_DONE || nState == JOB_FAILED) {
+        pIndex = (PkgIndex *) _pBackground->Take((char *) JOB_PKGINDEX);
+        ASSERT(pIndex != NULL);
+        delete _pPkgIndex;
+        _pPkgIndex = pIndex;
+    }
+    else if (nState == JOB_NONE && _pPkgIndex->IsChanged() == true) {
+        pIndex = new PkgIndex;
+        ASSERT(pIndex != NULL);
+        pIndex->SetPath(_pPkgIndex->GetPath());
+        
+        // if the worker cant be started, it is tried again at the next 
+        // check, since the databases will still be newer than the index.
+        if (_pBackground->Add((char *) JOB_PKGINDEX, LoadPkgIndex, FreePkgIndex, pIndex) == false) {
+            delete pIndex;
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Load the sync databases into a new index, in the background worker.
+bool Network::LoadPkgIndex(void *pArg)
+{
+    ASSERT(pArg != NULL);
+    ((PkgIndex *) pArg)->Load();
+    return(true);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Free an index that was loaded but never swapped in.
+void Network::FreePkgIndex(void *pArg)
+{
+    ASSERT(pArg != NULL);
+    delete (PkgIndex *) pArg;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If we are about to close a slow connection, or if it has already been 
+// 		closed by the other side, we need to process the information it has, 
+// 		before we destroy the object.  There may be chunks of data, or 
+// 		Serverlist information that was sent before the connection was closed.  
+// 		We dont really care about any messages that require a response.  
+// 		Additionally we need to let the file-list know that this node is being 
+// 		removed, so that it can remove any outstanding chunks that were 
+// 		allocated to this node, so that it can be allocated again.
+void Network::ProcessFinal(Node *pNode)
+{
+	char *szFilename;
+	char *pData;
+	int nChunk;
+	int nSize;
+	bool bDone;
+	Address *pServerInfo;
+	ServerInfo *pInfo;
+	int nID;
+	int i;
+	strCdcFetch *pFetch;
+	unsigned char pRaw[6];
+	
+	ASSERT(pNode != NULL);
+	
+	bDone = false;
+	while (bDone == false) {
+		bDone = true;
+	
+		szFilename = NULL;
+		if (pNode->GetChunks(&szFilename, &pData, &nChunk, &nSize) == true) {
+			SaveChunk(szFilename, pData, nChunk, nSize);
+			bDone = false;
+		}
+		
+		pServerInfo = pNode->GetServerInfo();
+		if (pServerInfo != NULL) {
+			_pServerList->AddServer(pServerInfo);
+			bDone = false;
+		}
+	}
+	
+	nID = pNode->GetID();
+	_pFileList->RemoveNode(nID);
+	
+	// any chunks we had asked the node for by hash need to be asked again.
+	pFetch = _Cdc.pFetches;
+	while (pFetch != NULL) {
+		for (i=0; i<pFetch->nEntries; i++) {
+			if (pFetch->pEntries[i].nNode == nID) {
+				pFetch->pEntries[i].nNode = 0;
+			}
+		}
+		pFetch = pFetch->pNext;
+	}
+	
+	// a leaf that has gone cant give anyone its files.
+	if (_Relay.bEnabled == true && pNode->GetRemoteAddress() != NULL) {
+		pNode->GetRemoteAddress()->Get(pRaw);
+		_Relay.pIndex->RemoveHolder(pRaw);
+	}
+	
+	ReleaseFiles(pNode);
+	
+	// if this was a connection we made to a server in our list, then let the 
+	// list know that it is no longer connected.
+	pInfo = pNode->GetServerEntry();
+	if (pInfo != NULL) {
+		if (pInfo->_bConnected == true) {
+			pInfo->ServerClosed();
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The node is going away, so any files that it was using (either getting 
+// 		from the remote node, or serving to it) need to be released so that the 
+// 		file list can clean them up when nothing else is using them.
+void Network::ReleaseFiles(Node *pNode)
+{
+	char *szFilename;
+	FileInfo *pInfo;
+	
+	ASSERT(pNode != NULL);
+	ASSERT(_pFileList != NULL);
+	
+	szFilename = NULL;
+	pNode->GetCurrentFile(&szFilename);
+	if (szFilename != NULL) {
+		pInfo = _pFileList->GetFileInfo(szFilename);
+		if (pInfo != NULL) {
+			pInfo->FileComplete();
+		}
+	}
+	
+	pInfo = pNode->ReleaseUpload();
+	if (pInfo != NULL) {
+		pInfo->FileComplete();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have retrieved a chunk from a node, so we need to save it to our 
+// 		file list.  If the file doesnt exist in our internal file list, then we 
+// 		will add it.  The data should not be free'd, because the FileInfo 
+// 		object will now control that block of memory (rather than creating a 
+// 		new block and copying the data over, etc).
+void Network::SaveChunk(char *szFilename, char *pData, int nChunk, int nSize)
+{
+	FileInfo *pInfo;
+	
+	ASSERT(szFilename != NULL);
+	ASSERT(pData != NULL);
+	ASSERT(nChunk >= 0);
+	ASSERT(nSize > 0);
+	
+	ASSERT(_pFileList != NULL);
+	
+	pInfo = _pFileList->GetFileInfo(szFilename);
+	if (pInfo == NULL) {
+		pInfo = _pFileList->AddFile(szFilename);
+	}
+	ASSERT(pInfo != NULL);
+	
+	pInfo->SaveChunk(pData, nChunk, nSize);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: This function is being asked for the next chunk that needs to be asked 
+// 		for.  We will return true if there is another chunk for this file.  
+// 		Return false if there are no more chunks needed for the file.
+bool Network::GetNextChunk(char *szFilename, int *nChunk)
+{
+	bool bMore = false;
+	FileInfo *pInfo;
+	
+	ASSERT(szFilename != NULL);
+	ASSERT(nChunk != NULL);
+	ASSERT(_pFileList != NULL);
+	
+	pInfo = _pFileList->GetFileInfo(szFilename);
+	if (pInfo != NULL) {
+		if (pInfo->GetNextChunk(nChunk) == true) {
+			ASSERT(*nChunk >= 0);
+			bMore = true;
+		}
+	}
+	
+	return(bMore);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the filename of the next file that we need to download.   To do 
+// 		this we look at our File list for the next file in the list that is 
 // 		incomplete and not local.  Return true if we found a file to request, 
-// 		return false if we didnt.
-bool Network::GetNextFile(char **szFilename)
+// 		return false if we didnt.  We skip the file that this node last told 
+// 		us it didnt have, otherwise a file the node doesnt have (such as a 
+// 		delta it cant make) would stop it being asked for the files after it.
+bool Network::GetNextFile(Node *pNode, char **szFilename)
+{
+	bool bFound = false;
+	FileInfo *pInfo;
+	
+	ASSERT(pNode != NULL);
+	ASSERT(szFilename != NULL);
+	ASSERT(_pFileList != NULL);
+	
+	pInfo = _pFileList->GetNextFile();
+	while (pInfo != NULL && pNode->HasRefused(pInfo->GetFilename()) == true) {
+		pInfo = _pFileList->GetNextFile(pInfo->GetNext());
+	}
+	
+	if (pInfo != NULL) {
+		*szFilename = pInfo->GetFilename();
+		ASSERT(*szFilename != NULL);
+		ASSERT(pInfo->IsLocal() == false);
+		bFound = true;
+	}
+	
+	return(bFound);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We've received a file request from a node.  We need to relay this info 
+// 		on to our other nodes (if our ttl is greater than zero).  However, we 
+// 		dont want to send it back to the node that we just got it from, so we 
+// 		send it to everything except that one.  We also dont want to send it to 
+// 		any server that is already on the list of hosts that is inside this 
+// 		message packet.
+//
+//		F<hops><ttl><flen><file*flen><host*6>...<host*6>
+void Network::RelayFileRequest(strFileRequest *pReq)
+{
+	static strMetric *pRelayed = Metrics::Counter("pacsrv_requests_relayed_total", "File requests passed on to other nodes.");
+	static strMetric *pLooped = Metrics::Counter("pacsrv_requests_duplicate_total", "File requests not passed back to a node they had been thru.");
+	Node *pNode;
+	int i, j;
+	unsigned char buffer[2048];
+	Address *pAddr;
+	bool bSend;
+	unsigned char tmp[6];
+
+	ASSERT(pReq != NULL);
+	ASSERT(_pNodes != NULL);	// must have at least one, because we got this message from somewhere.
+	
+	// First we build our message because it is going to be the same for each node.
+	i=0;
+	buffer[i++] = 'F';
+	buffer[i++] = pReq->nHops;
+	buffer[i++] = pReq->nTtl;
+	buffer[i++] = pReq->nFlen;
+	for (j=0; j<pReq->nFlen; j++) {
+		buffer[i++] =  pReq->szFile[j];
+	}
+	for (j=0; j<pReq->nHops; j++) {
+		pReq->pHosts[j]->Get(&buffer[i]);
+		i += 6;
+	}
+	
+	// Then we go thru the nodes and tell each one to send the message.  If 
+	// the request has run out of hops, then it goes no further.
+	pNode = _pNodes;
+	if (pReq->nTtl == 0) {
+		pNode = NULL;
+	}
+	while(pNode != NULL) {
+		if (pNode->IsClosed() == false) {
+			
+			// check that it is not from a node that has already got this message
+			pAddr = pNode->GetRemoteAddress();
+			if (pAddr != NULL) {
+				
+				bSend = true;
+				for (j=0; j<pReq->nHops && bSend == true; j++) {
+					pReq->pHosts[j]->Get(tmp);			
+					if (pAddr->IsSame(tmp) == true) {
+						bSend = false;
+						Metrics::Add(pLooped, 1);
+					}
+				}
+				
+				// a relay answers for its leaves, so they dont need it.
+				if (_Relay.bEnabled == true && pNode->IsLeaf() == true) {
+					bSend = false;
+				}
+				
+				if (bSend == true) {
+					pNode->SendMsg((char *)buffer, i);
+					Metrics::Add(pRelayed, 1);
+				}
+			}
+		}
+		pNode = pNode->GetNext();
+	}
+}
+
+
+
+//-----------------------------------------------------------------------------
+// CJW: We've received a file reply from a node.  The last host in the list is 
+// 		us (it was added by the node we passed the request on to), so we 
+// 		remove it, and then pass the reply on to the host that is now last in 
+// 		the list, which is the node that gave us the request in the first 
+// 		place.
+//
+//		G<hops><flen><file*flen><target*6><host*6>...<host*6>
+void Network::RelayFileReply(strFileReply *pReply)
+{
+	static strMetric *pRelayed = Metrics::Counter("pacsrv_replies_relayed_total", "File replies passed back towards the node that asked.");
+	Node *pNode;
+	unsigned char pNextAddress[6];
+	Address *pAddr;
+	int i, j;
+	unsigned char buffer[2048];
+	
+	ASSERT(pReply != NULL);
+	ASSERT(_pNodes != NULL);
+	
+	ASSERT(pReply->nHops > 1);
+	ASSERT(pReply->pTarget != NULL);
+	pReply->pHosts[pReply->nHops-2]->Get(pNextAddress);
+	
+	
+	// First we build our message because it is going to be the same for each node.
+	i=0;
+	buffer[i++] = 'G';
+	buffer[i++] = pReply->nHops-1;
+	buffer[i++] = pReply->nFlen;
+	for (j=0; j<pReply->nFlen; j++) {
+		buffer[i++] =  pReply->szFile[j];
+	}
+	pReply->pTarget->Get(&buffer[i]);
+	i += 6;
+	for (j=0; j<pReply->nHops-1; j++) {
+		pReply->pHosts[j]->Get(&buffer[i]);
+		i += 6;
+	}
+	
+	ASSERT(i < 2048);
+	
+	// Go thru the nodes and find the one we need to send the message to.
+	pNode = _pNodes;
+	while(pNode != NULL) {
+		if (pNode->IsClosed() == false) {
+			pAddr = pNode->GetRemoteAddress();
+			if (pAddr != NULL) {
+				if (pAddr->IsSame(pNextAddress) == true) {
+					pNode->SendMsg((char *)buffer, i);
+					Metrics::Add(pRelayed, 1);
+				}
+			}
+		}
+		pNode = pNode->GetNext();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Find the node that is closest to the key in the DHT, as long as it is 
+//      closer than we are.  If we are closer than all of them, then we are 
+//      the node that keeps the records for the key, and we return NULL.  If 
+//      it is for a lookup, we dont go back to a node that it has already 
+//      been thru.  Since we keep a connection in each bucket of the routing 
+//      table, the node we return is at least one bit closer than we are.
+Node * Network::ClosestDhtNode(unsigned int nKey, strFileRequest *pReq)
+{
+    Node *pClosest = NULL;
+    
+    ASSERT(_Dht.nId != 0);
+    
+    if (ClosestDhtNodes(nKey, pReq, &pClosest, 1) == 0) {
+        pClosest = NULL;
+    }
+    else if (Dht::Distance(pClosest->GetDhtId(), nKey) >= Dht::Distance(_Dht.nId, nKey)) {
+        pClosest = NULL;
+    }
+    
+    return(pClosest);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Put the nMax DHT nodes that we are connected to that are closest to 
+//      the key into pList, the closest first, whether they are closer than 
+//      we are or not.  If it is for a lookup, the nodes it has already been 
+//      thru are left out.  Returns how many there were.
+int Network::ClosestDhtNodes(unsigned int nKey, strFileRequest *pReq, Node **pList, int nMax)
+{
+    Node *pNode;
+    unsigned int nDistance;
+    Address *pAddr;
+    unsigned char tmp[6];
+    bool bUsed;
+    int nCount = 0;
+    int i, j;
+    
+    ASSERT(_Dht.nId != 0);
+    ASSERT(pList != NULL && nMax > 0);
+    
+    pNode = _pNodes;
+    while (pNode != NULL) {
+        if (pNode->HasDht() == true) {
+            bUsed = false;
+            if (pReq != NULL) {
+                pAddr = pNode->GetRemoteAddress();
+                for (j=0; j<pReq->nHops && pAddr != NULL && bUsed == false; j++) {
+                    pReq->pHosts[j]->Get(tmp);
+                    if (pAddr->IsSame(tmp) == true) {
+                        bUsed = true;
+                    }
+                }
+            }
+            
+            if (bUsed == false) {
+                // find where it goes, and move the further ones down.
+                nDistance = Dht::Distance(pNode->GetDhtId(), nKey);
+                i = nCount;
+                while (i > 0 && Dht::Distance(pList[i-1]->GetDhtId(), nKey) > nDistance) {
+                    if (i < nMax) {
+                        pList[i] = pList[i-1];
+                    }
+                    i--;
+                }
+                
+                if (i < nMax) {
+                    pList[i] = pNode;
+                    if (nCount < nMax) {
+                        nCount++;
+                    }
+                }
+            }
+        }
+        pNode = pNode->GetNext();
+    }
+    
+    ASSERT(nCount >= 0 && nCount <= nMax);
+    return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Look the file up in the DHT.  If we keep records for it ourselves, we 
+//      can connect to the holders straight away.  Otherwise we send the 
+//      lookup to the node closest to the file, and the holders come back as 
+//      'G' replies the same as for a flooded request.  If none of our nodes 
+//      are closer than we are, we ask the next closest ones, since they 
+//      keep copies of our records.
+void Network::DhtLookup(char *szFilename)
+{
+    unsigned char pHolders[DHT_MAX_HOLDERS * 6];
+    Node *pList[DHT_REPLICAS - 1];
+    Address addr;
+    Node *pNode;
+    unsigned int nKey;
+    int nCount, i;
+    
+    ASSERT(szFilename != NULL);
+    ASSERT(_Dht.pStore != NULL);
+    
+    if (_Dht.nId != 0) {
+        nCount = _Dht.pStore->Find(szFilename, pHolders, DHT_MAX_HOLDERS);
+        for (i=0; i<nCount; i++) {
+            addr.Set(&pHolders[i * 6]);
+            ConnectHolder(&addr);
+        }
+        
+        nKey = Dht::Hash(szFilename);
+        pNode = ClosestDhtNode(nKey, NULL);
+        if (pNode != NULL) {
+            pNode->RequestFileFromDht(szFilename, DEFAULT_TTL);
+            _Dht.nLookups++;
+        }
+        else {
+            nCount = ClosestDhtNodes(nKey, NULL, pList, DHT_REPLICAS - 1);
+            for (i=0; i<nCount; i++) {
+                pList[i]->RequestFileFromDht(szFilename, 1);
+            }
+            if (nCount > 0) {
+                _Dht.nLookups++;
+            }
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A node has passed us a DHT lookup.  If we have records for the file, 
+//      the holders are sent back along the path.  Then we pass it on to the 
+//      node that is closer to the file than we are, if there is one.  If 
+//      there isnt, we are the node that keeps the records, and we pass it 
+//      on to the next closest nodes with a TTL of 1, because they keep the 
+//      copies.  If we have the file ourselves, the caller will reply for 
+//      that.
+void Network::RouteDhtLookup(Node *pNode, strFileRequest *pReq)
+{
+    unsigned char pHolders[DHT_MAX_HOLDERS * 6];
+    Node *pList[DHT_REPLICAS - 1];
+    Node *pNext;
+    unsigned int nKey;
+    int nCount, i;
+    
+    ASSERT(pNode != NULL && pReq != NULL);
+    ASSERT(pReq->bDht == true);
+    ASSERT(_Dht.pStore != NULL);
+    
+    if (_Dht.nId != 0) {
+        nCount = _Dht.pStore->Find(pReq->szFile, pHolders, DHT_MAX_HOLDERS);
+        for (i=0; i<nCount; i++) {
+            pNode->ReplyFileHolder(pReq, &pHolders[i * 6]);
+        }
+        
+        if (pReq->nTtl > 0) {
+            nKey = Dht::Hash(pReq->szFile);
+            pNext = ClosestDhtNode(nKey, pReq);
+            if (pNext != NULL) {
+                RelayDhtLookup(pNext, pReq, pReq->nTtl);
+            }
+            else {
+                nCount = ClosestDhtNodes(nKey, pReq, pList, DHT_REPLICAS - 1);
+                for (i=0; i<nCount; i++) {
+                    RelayDhtLookup(pList[i], pReq, 1);
+                }
+            }
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Pass a DHT lookup on to the next node.  It is the same message as 
+//      the flooded request, but it only goes to one node.
+void Network::RelayDhtLookup(Node *pNode, strFileRequest *pReq, int nTtl)
+{
+    unsigned char buffer[2048];
+    int i, j;
+    
+    ASSERT(pNode != NULL && pReq != NULL);
+    ASSERT(nTtl > 0 && nTtl <= pReq->nTtl);
+    
+    i=0;
+    buffer[i++] = 'U';
+    buffer[i++] = pReq->nHops;
+    buffer[i++] = nTtl;
+    buffer[i++] = pReq->nFlen;
+    for (j=0; j<pReq->nFlen; j++) {
+        buffer[i++] =  pReq->szFile[j];
+    }
+    for (j=0; j<pReq->nHops; j++) {
+        pReq->pHosts[j]->Get(&buffer[i]);
+        i += 6;
+    }
+    
+    ASSERT(i < 2048);
+    pNode->SendMsg((char *)buffer, i);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A node has published that it has a file.  If one of our nodes is 
+//      closer to the file than we are, we pass it on, otherwise we keep the 
+//      record, and pass copies to the next closest nodes with a TTL of 1, 
+//      which keep them without passing them on.  Since each step gets 
+//      closer, it cant go round in circles, but the TTL stops it anyway.
+//
+//      <-- T<ttl><flen><file*flen><holder*6>
+void Network::RouteDhtStore(strDhtStore *pStore)
+{
+    unsigned char buffer[265];
+    unsigned char pHolder[6];
+    Node *pList[DHT_REPLICAS - 1];
+    Node *pNext;
+    unsigned int nKey;
+    int nCount;
+    int i, j;
+    
+    ASSERT(pStore != NULL);
+    ASSERT(pStore->pHolder != NULL);
+    ASSERT(_Dht.pStore != NULL);
+    
+    if (_Dht.nId != 0) {
+        pStore->pHolder->Get(pHolder);
+        nKey = Dht::Hash(pStore->szFile);
+        
+        i=0;
+        buffer[i++] = 'T';
+        buffer[i++] = pStore->nTtl - 1;
+        buffer[i++] = pStore->nFlen;
+        for (j=0; j<pStore->nFlen; j++) {
+            buffer[i++] = pStore->szFile[j];
+        }
+        for (j=0; j<6; j++) {
+            buffer[i++] = pHolder[j];
+        }
+        
+        pNext = NULL;
+        if (pStore->nTtl > 1) {
+            pNext = ClosestDhtNode(nKey, NULL);
+        }
+        
+        if (pNext != NULL) {
+            pNext->SendMsg((char *)buffer, i);
+        }
+        else {
+            _Dht.pStore->Store(pStore->szFile, pHolder);
+            
+            if (pStore->nTtl > 1) {
+                buffer[1] = 1;
+                nCount = ClosestDhtNodes(nKey, NULL, pList, DHT_REPLICAS - 1);
+                for (j=0; j<nCount; j++) {
+                    pList[j]->SendMsg((char *)buffer, i);
+                }
+            }
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Every so often we make sure that we are connected to a node in each 
+//      bucket of the routing table that has any nodes in it.  That way, 
+//      there is always a connected node that is at least one bit closer to 
+//      any key that isnt ours, so DHT telegrams take at most one hop for 
+//      each bit.  The nodes we are connected to are also marked as seen, so 
+//      that they stay in the table.  Needs to be called while locked.
+void Network::RefreshDhtTable(void)
+{
+    bool pLinked[DHT_BUCKETS];
+    unsigned char pRaw[6];
+    Address addr;
+    Address *pAddr;
+    Node *pNode;
+    int nBucket, i;
+    
+    ASSERT(_Dht.pTable != NULL);
+    
+    if (_Dht.nId != 0 && time(NULL) >= _Dht.tRefresh) {
+        _Dht.tRefresh = time(NULL) + DHT_REFRESH_TIME;
+        
+        for (i=0; i<DHT_BUCKETS; i++) {
+            pLinked[i] = false;
+        }
+        
+        pNode = _pNodes;
+        while (pNode != NULL) {
+            if (pNode->HasDht() == true) {
+                pAddr = pNode->GetRemoteAddress();
+                if (pAddr != NULL) {
+                    pAddr->Get(pRaw);
+                    _Dht.pTable->Add(pNode->GetDhtId(), pRaw);
+                }
+                nBucket = DhtTable::GetBucket(_Dht.nId, pNode->GetDhtId());
+                if (nBucket >= 0) {
+                    pLinked[nBucket] = true;
+                }
+            }
+            pNode = pNode->GetNext();
+        }
+        
+        // ConnectHolder wont go over our maximum connections, or connect to 
+        // a node that we are already connecting to.
+        for (i=0; i<DHT_BUCKETS; i++) {
+            if (pLinked[i] == false && _Dht.pTable->GetContact(i, pRaw) == true) {
+                addr.Set(pRaw);
+                ConnectHolder(&addr);
+            }
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the node is the only one we are connected to in its 
+//      bucket of the routing table, so that we dont close it for being 
+//      idle.
+bool Network::IsOnlyDhtLink(Node *pNode)
+{
+    Node *pTmp;
+    bool bOnly = false;
+    int nBucket;
+    
+    ASSERT(pNode != NULL);
+    
+    if (_Dht.nId != 0 && pNode->HasDht() == true) {
+        nBucket = DhtTable::GetBucket(_Dht.nId, pNode->GetDhtId());
+        bOnly = true;
+        pTmp = _pNodes;
+        while (pTmp != NULL && bOnly == true) {
+            if (pTmp != pNode && pTmp->HasDht() == true && DhtTable::GetBucket(_Dht.nId, pTmp->GetDhtId()) == nBucket) {
+                bOnly = false;
+            }
+            pTmp = pTmp->GetNext();
+        }
+    }
+    
+    return(bOnly);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Every so often we publish all the files in our package cache to the 
+//      DHT, and tell the relays that we are a leaf of.  There could be a lot 
+//      of them, so we only do a few each time thru.  A file that is closer 
+//      to us than to any of our nodes is only copied to the next closest 
+//      nodes, because a lookup for it will end up with us.  The routing 
+//      table is checked here as well.
+void Network::ProcessPublish(void)
+{
+    struct dirent *pEntry;
+    Node *pNode;
+    int nCount = 0;
+    int nLen;
+    
+    Lock();
+    
+    RefreshDhtTable();
+    
+    // there is no point starting until we have a node to publish to.
+    pNode = NULL;
+    if (_Dht.pDir == NULL && time(NULL) >= _Dht.tNextPublish) {
+        pNode = _pNodes;
+        while (pNode != NULL && (_Dht.nId == 0 || pNode->HasDht() == false) && (_Relay.bEnabled == true || pNode->IsRelay() == false)) {
+            pNode = pNode->GetNext();
+        }
+    }
+    
+    if (pNode != NULL) {
+        _Dht.pDir = opendir(_pFileList->GetPath());
+        if (_Dht.pDir == NULL) {
+            _Dht.tNextPublish = time(NULL) + DHT_PUBLISH_TIME;
+        }
+    }
+    
+    while (_Dht.pDir != NULL && nCount < DHT_PUBLISH_BATCH) {
+        pEntry = readdir(_Dht.pDir);
+        if (pEntry == NULL) {
+            closedir(_Dht.pDir);
+            _Dht.pDir = NULL;
+            _Dht.tNextPublish = time(NULL) + DHT_PUBLISH_TIME;
+            LOG_SYSTEM(LOG_NETWORK, "[Network] DHT: %d records published, %d kept, %d lookups, %d nodes known.  Relay: %d files indexed, %d requests answered.", _Dht.nPublished, _Dht.pStore->GetCount(), _Dht.nLookups, _Dht.pTable->GetCount(), _Relay.pIndex->GetCount(), _Relay.nAnswered);
+        }
+        else {
+            nLen = strlen(pEntry->d_name);
+            if (pEntry->d_name[0] != '.' && nLen < 255 && (nLen < 5 || strcmp(&pEntry->d_name[nLen-5], ".part") != 0)) {
+                AnnounceFile(pEntry->d_name);
+            }
+            nCount++;
+        }
+    }
+    
+    Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We are a relay, and have been sent a flooded request.  We dont pass 
+//      those on to our leaves, so we answer for any leaves that have the 
+//      file.  We dont tell a node about itself, or any of the nodes that the 
+//      request has already been thru.
+void Network::RelayAnswer(Node *pNode, strFileRequest *pReq)
+{
+    unsigned char pHolders[DHT_MAX_HOLDERS * 6];
+    int nCount, i, j;
+    bool bUsed;
+    
+    ASSERT(pNode != NULL && pReq != NULL);
+    ASSERT(_Relay.bEnabled == true);
+    ASSERT(_Relay.pIndex != NULL);
+    
+    nCount = _Relay.pIndex->Find(pReq->szFile, pHolders, DHT_MAX_HOLDERS);
+    for (i=0; i<nCount; i++) {
+        bUsed = false;
+        for (j=0; j<pReq->nHops && bUsed == false; j++) {
+            if (pReq->pHosts[j]->IsSame(&pHolders[i * 6]) == true) {
+                bUsed = true;
+            }
+        }
+        
+        if (bUsed == false) {
+            pNode->ReplyFileHolder(pReq, &pHolders[i * 6]);
+            _Relay.nAnswered++;
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We are only a leaf if all of our connections are to relays.  If we 
+// 		have any other nodes, then the relays have to keep sending searches 
+// 		to us, or those nodes couldnt be found from the rest of the network.
+void Network::CheckLeaf(void)
+{
+    Node *pNode;
+    int nRelays = 0, nOthers = 0;
+    bool bLeaf = false;
+    
+    if (_Relay.bEnabled == false) {
+        pNode = _pNodes;
+        while (pNode != NULL) {
+            if (pNode->IsValid() == true && pNode->IsClosed() == false) {
+                if (pNode->IsRelay() == true)   { nRelays++; }
+                else                            { nOthers++; }
+            }
+            pNode = pNode->GetNext();
+        }
+        
+        if (nRelays > 0 && nOthers == 0) {
+            bLeaf = true;
+        }
+    }
+    
+    if (bLeaf != _Relay.bLeaf) {
+        LOG_SYSTEM(LOG_NETWORK, "[Network] We are %s a leaf (%d relays, %d other nodes).", bLeaf == true ? "now" : "no longer", nRelays, nOthers);
+        _Relay.bLeaf = bLeaf;
+    }
+    
+    // new nodes start off thinking we arent a leaf, so we check them all.
+    pNode = _pNodes;
+    while (pNode != NULL) {
+        pNode->SetLeaf(_Relay.bLeaf);
+        pNode = pNode->GetNext();
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Count the relays that we are connected to.
+int Network::GetRelayCount(void)
+{
+    Node *pNode;
+    int nCount = 0;
+    
+    pNode = _pNodes;
+    while (pNode != NULL) {
+        if (pNode->IsRelay() == true) {
+            nCount++;
+        }
+        pNode = pNode->GetNext();
+    }
+    
+    return(nCount);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We are trying to connect to a node that has a file we want, so we 
+// 		remember which node told us about it.  If the connection fails, we can 
+// 		ask that node to get the file for us instead.
+void Network::AddProxy(char *szFilename, Address *pHolder, int nVia)
+{
+	strProxy *pProxy;
+	
+	ASSERT(szFilename != NULL && pHolder != NULL);
+	ASSERT(nVia > 0);
+	
+	pProxy = (strProxy *) malloc(sizeof(strProxy));
+	ASSERT(pProxy != NULL);
+	pProxy->szFile = strdup(szFilename);
+	ASSERT(pProxy->szFile != NULL);
+	pHolder->Get(pProxy->pHolder);
+	pProxy->nVia = nVia;
+	pProxy->bAsked = false;
+	pProxy->tStart = time(NULL);
+	pProxy->tRetry = 0;
+	pProxy->pNext = _Proxy.pList;
+	_Proxy.pList = pProxy;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Ask the node to get the file for us from the holder.  We then ask the 
+// 		node for the file like normal, and it will serve us the chunks as it 
+// 		gets them.  It wont know how big the file is until the holder tells 
+// 		it, so we need to forget that it refused the file the first time.
+void Network::AskProxy(Node *pNode, strProxy *pProxy)
+{
+	
+	ASSERT(pNode != NULL && pProxy != NULL);
+	ASSERT(pProxy->bAsked == false);
+	
+	pNode->RequestProxy(pProxy->szFile, pProxy->pHolder);
+	pNode->ClearRefused(pProxy->szFile);
+	pProxy->bAsked = true;
+	pProxy->tRetry = time(NULL);
+	_Proxy.nAsked++;
+	
+	LOG_SYSTEM(LOG_NODE, "[Node:%d] Asked to get %s for us (%d files so far).", pNode->GetID(), pProxy->szFile, _Proxy.nAsked);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A connection to a node has finished.  If we were waiting on it to get 
+// 		a file, and it worked, then we dont need the other node to help.  If 
+// 		it didnt work, we ask the node that told us about the file to get it 
+// 		for us, if it knows how.
+void Network::ProxyConnected(Address *pAddress, bool bConnected)
+{
+	strProxy *pProxy, *pLast, *pNext;
+	Node *pNode;
+	bool bRemove;
+	
+	ASSERT(pAddress != NULL);
+	
+	pLast = NULL;
+	pProxy = _Proxy.pList;
+	while (pProxy != NULL) {
+		pNext = pProxy->pNext;
+		bRemove = false;
+		
+		if (pProxy->nVia > 0 && pProxy->bAsked == false && pAddress->IsSame(pProxy->pHolder) == true) {
+			if (bConnected == true) {
+				bRemove = true;
+			}
+			else {
+				pNode = _pNodes;
+				while (pNode != NULL && pNode->GetID() != pProxy->nVia) {
+					pNode = pNode->GetNext();
+				}
+				
+				if (pNode != NULL && pNode->IsValid() == true && pNode->GetVersion() >= 2) {
+					AskProxy(pNode, pProxy);
+				}
+				else {
+					bRemove = true;
+				}
+			}
+		}
+		
+		if (bRemove == true) {
+			if (pLast == NULL) { _Proxy.pList = pNext; }
+			else { pLast->pNext = pNext; }
+			free(pProxy->szFile);
+			free(pProxy);
+		}
+		else {
+			pLast = pProxy;
+		}
+		pProxy = pNext;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A node has asked us to get a file for it, because it cant connect to 
+// 		the holder.  If we have the file already, then there's nothing to do, 
+// 		the node will get it from us when it asks.  Otherwise we put it in our 
+// 		file list and connect to the holder, and the node asks us for the 
+// 		chunks as we get them.  Since the holder has the file, there is no 
+// 		need to search for it.  The node gets each chunk as soon as we have 
+// 		it.  If nothing else wants the file, we only get PROXY_WINDOW chunks 
+// 		ahead of the node, and the ones it has are only kept while there is 
+// 		room, so we dont end up holding every file we pass on.  We hold on to 
+// 		the file for a while so that it isnt removed before the node has 
+// 		finished with it.
+void Network::ServeProxy(int nNode, strProxyRequest *pReq)
+{
+	FileInfo *pInfo;
+	strProxy *pProxy;
+	
+	ASSERT(nNode > 0);
+	ASSERT(pReq != NULL);
+	ASSERT(pReq->pHolder != NULL);
+	ASSERT(_pFileList != NULL);
+	
+	pInfo = _pFileList->GetFileInfo(pReq->szFile);
+	if (pInfo == NULL) {
+		pInfo = _pFileList->LoadFile(pReq->szFile);
+	}
+	if (pInfo == NULL) {
+		pInfo = _pFileList->AddFile(pReq->szFile);
+		pInfo->SearchFound();
+		pInfo->SetWindow(nNode, PROXY_WINDOW);
+	}
+	else if (pInfo->IsLocal() == false) {
+		pInfo->EndWindow(nNode);
+	}
+	ASSERT(pInfo != NULL);
+	
+	if (pInfo->IsLocal() == false) {
+		// if we are already holding it for someone, that will do.
+		pProxy = _Proxy.pList;
+		while (pProxy != NULL && (pProxy->nVia != 0 || strcmp(pProxy->szFile, pReq->szFile) != 0)) {
+			pProxy = pProxy->pNext;
+		}
+		
+		if (pProxy == NULL) {
+			pInfo->FileStart();
+			pProxy = (strProxy *) malloc(sizeof(strProxy));
+			ASSERT(pProxy != NULL);
+			pProxy->szFile = strdup(pReq->szFile);
+			ASSERT(pProxy->szFile != NULL);
+			pReq->pHolder->Get(pProxy->pHolder);
+			pProxy->nVia = 0;
+			pProxy->bAsked = false;
+			pProxy->pNext = _Proxy.pList;
+			_Proxy.pList = pProxy;
+			_Proxy.nServed++;
+		}
+		pProxy->tStart = time(NULL);
+		pProxy->tRetry = 0;
+		
+		LOG_SYSTEM(LOG_NETWORK, "[Network] Getting %s from %s:%d for another node (%d files so far).", pReq->szFile, pReq->pHolder->GetServer(), pReq->pHolder->GetPort(), _Proxy.nServed);
+		ConnectHolder(pReq->pHolder);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go thru the files we are getting through other nodes.  Until the node 
+// 		knows how big the file is, it will refuse it when we ask, so every few 
+// 		seconds we forget that so that we ask again.  The files we are getting 
+// 		for other nodes are released once they have had enough time.
+void Network::ProcessProxies(void)
+{
+	strProxy *pProxy, *pLast, *pNext;
+	FileInfo *pInfo;
+	Node *pNode;
+	time_t tNow;
+	bool bRemove;
+	
+	Lock();
+	
+	ASSERT(_pFileList != NULL);
+	tNow = time(NULL);
+	
+	pLast = NULL;
+	pProxy = _Proxy.pList;
+	while (pProxy != NULL) {
+		pNext = pProxy->pNext;
+		bRemove = false;
+		pInfo = _pFileList->GetFileInfo(pProxy->szFile);
+		
+		if (pProxy->nVia == 0) {
+			if ((tNow - pProxy->tStart) >= PROXY_HOLD) {
+				if (pInfo != NULL) {
+					// if the node stopped taking the chunks, our nodes would 
+					// wait forever for room in the window, so we finish 
+					// getting the file like any other.
+					if (pInfo->IsLocal() == false && pInfo->IsComplete() == false) {
+						pInfo->EndWindow(0);
+					}
+					pInfo->FileComplete();
+				}
+				bRemove = true;
+			}
+		}
+		else if ((tNow - pProxy->tStart) >= PROXY_TIME || pInfo == NULL || pInfo->IsLocal() == true || pInfo->IsComplete() == true) {
+			bRemove = true;
+		}
+		else if (pProxy->bAsked == true && (tNow - pProxy->tRetry) >= PROXY_RETRY) {
+			pNode = _pNodes;
+			while (pNode != NULL && pNode->GetID() != pProxy->nVia) {
+				pNode = pNode->GetNext();
+			}
+			
+			if (pNode == NULL || pNode->IsValid() == false) {
+				bRemove = true;
+			}
+			else {
+				pNode->ClearRefused(pProxy->szFile);
+				pProxy->tRetry = tNow;
+			}
+		}
+		
+		if (bRemove == true) {
+			if (pLast == NULL) { _Proxy.pList = pNext; }
+			else { pLast->pNext = pNext; }
+			free(pProxy->szFile);
+			free(pProxy);
+		}
+		else {
+			pLast = pProxy;
+		}
+		pProxy = pNext;
+	}
+	
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Tell the network that we have this file.  It is published to the DHT, 
+// 		and if we are a leaf, our relays are told about it.  Needs to be 
+// 		called while locked.
+void Network::AnnounceFile(char *szFilename)
+{
+	Node *pList[DHT_REPLICAS - 1];
+	Node *pNode;
+	unsigned int nKey;
+	int nCount, i;
+	
+	ASSERT(szFilename != NULL);
+	
+	if (_Dht.nId != 0) {
+		nKey = Dht::Hash(szFilename);
+		pNode = ClosestDhtNode(nKey, NULL);
+		if (pNode != NULL) {
+			pNode->PublishFile(szFilename, DEFAULT_TTL);
+			_Dht.nPublished++;
+		}
+		else {
+			// we are the closest, so a lookup will end up with us, but the 
+			// next closest nodes keep copies in case we go away.
+			nCount = ClosestDhtNodes(nKey, NULL, pList, DHT_REPLICAS - 1);
+			for (i=0; i<nCount; i++) {
+				pList[i]->PublishFile(szFilename, 1);
+				_Dht.nPublished++;
+			}
+		}
+	}
+	
+	if (_Relay.bEnabled == false) {
+		pNode = _pNodes;
+		while (pNode != NULL) {
+			if (pNode->IsRelay() == true) {
+				pNode->SendHave(szFilename);
+			}
+			pNode = pNode->GetNext();
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go thru the file list, and write any remote files that we have got all 
+// 		of into the package cache.  This needs to be done before the file list 
+// 		is processed, otherwise a file that has finished would be removed 
+// 		before it was saved.  The file is copied and then checked and written 
+// 		in the background, and we deal with the ones that have been done the 
+// 		next time we are here.  Needs to be called while locked.
+void Network::SaveFiles(void)
+{
+	FileInfo *pInfo;
+	strSaveJob *pJob;
+	char szKey[512];
+	char *szFilename;
+	char *szSha256;
+	bool bVerify;
+	
+	ASSERT(_pFileList != NULL);
+	ASSERT(_pPkgIndex != NULL);
+	ASSERT(_pBackground != NULL);
+	
+	// the files that have been written since last time.
+	while ((pJob = (strSaveJob *) _pBackground->TakeFinished((char *) JOB_SAVE_PREFIX)) != NULL) {
+		SavedFile(pJob->szFile, pJob->nResult);
+		FreeSaveJob(pJob);
+	}
+	
+	// if we have the sync databases, then a file that isnt in them (or 
+	// doesnt have a checksum in them) cant be checked, so we dont trust it 
+	// enough to put it in the cache.  Without any databases we have nothing 
+	// to check against, so everything is saved.
+	bVerify = (_pPkgIndex->GetCount() > 0);
+	
+	pInfo = _pFileList->GetFirst();
+	while (pInfo != NULL) {
+		szFilename = pInfo->GetFilename();
+		if (pInfo->IsLocal() == false && pInfo->IsSaved() == false && Delta::IsDeltaName(szFilename) == false && ChunkStore::IsRecipeName(szFilename) == false && pInfo->IsReceived() == true && strlen(szFilename) < (sizeof(szKey) - strlen(JOB_SAVE_PREFIX))) {
+			
+			// an earlier copy of the file might still be being written.
+			sprintf(szKey, "%s%s", JOB_SAVE_PREFIX, szFilename);
+			if (_pBackground->GetState(szKey) == JOB_NONE) {
+				szSha256 = NULL;
+				_pPkgIndex->Find(szFilename, NULL, &szSha256);
+				
+				pJob = (strSaveJob *) malloc(sizeof(strSaveJob));
+				ASSERT(pJob != NULL);
+				pJob->szPath = strdup(_pFileList->GetPath());
+				pJob->szFile = strdup(szFilename);
+				pJob->pData = pInfo->StartSave(&pJob->nLength);
+				pJob->szSha256 = (szSha256 != NULL) ? strdup(szSha256) : NULL;
+				pJob->bVerify = bVerify;
+				pJob->pStore = (_Cdc.bEnabled == true) ? _Cdc.pStore : NULL;
+				pJob->nResult = FILE_SAVE_FAILED;
+				
+				// if the worker cant be started, we do it ourselves.
+				if (_pBackground->Add(szKey, SaveJob, FreeSaveJob, pJob) == false) {
+					SaveJob(pJob);
+					SavedFile(pJob->szFile, pJob->nResult);
+					FreeSaveJob(pJob);
+				}
+			}
+		}
+		pInfo = pInfo->GetNext();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A file has been written to the package cache (or not).  If it worked, 
+// 		we tell the network that we have it.  The file might not be in the 
+// 		file list any more.  Needs to be called while locked.
+void Network::SavedFile(char *szFilename, int nResult)
+{
+	FileInfo *pInfo;
+	
+	ASSERT(szFilename != NULL);
+	ASSERT(_pFileList != NULL);
+	
+	pInfo = _pFileList->GetFileInfo(szFilename);
+	if (pInfo != NULL && pInfo->IsLocal() == false && pInfo->IsSaved() == true) {
+		pInfo->EndSave(nResult);
+	}
+	
+	switch (nResult) {
+		case FILE_SAVE_OK:
+			_Cache.nSaved++;
+			LOG_SYSTEM(LOG_CACHE, "[Network] Saved %s to %s (%d files so far).", szFilename, _pFileList->GetPath(), _Cache.nSaved);
+			if (strlen(szFilename) < 255) {
+				AnnounceFile(szFilename);
+			}
+			break;
+			
+		case FILE_SAVE_BADSUM:
+			// we dont want to put a bad file where pacman will find it.  
+			// Some of the chunks are bad, so we get it again.
+			if (pInfo != NULL && pInfo->IsLocal() == false && pInfo->IsSaved() == true && pInfo->GetBadSums() < FILE_MAX_BADSUMS) {
+				LOG_ERROR(LOG_CACHE, "Checksum of %s doesnt match the sync database, getting it again.", szFilename);
+				pInfo->DropChunks();
+			}
+			else {
+				LOG_ERROR(LOG_CACHE, "Checksum of %s doesnt match the sync database, not saving it.", szFilename);
+			}
+			break;
+			
+		case FILE_SAVE_UNVERIFIED:
+			LOG_SYSTEM(LOG_CACHE, "[Network] %s isnt in the sync databases, so it cant be checked, not saving it.", szFilename);
+			break;
+			
+		case FILE_SAVE_FAILED:
+			LOG_SYSTEM(LOG_NETWORK, "[Network] Unable to save %s to %s.", szFilename, _pFileList->GetPath());
+			break;
+			
+		default:
+			break;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Check and write a file to the package cache, in the background 
+// 		worker.  Once it is there, its chunks are indexed from the copy we 
+// 		already have.  The result is left in the job.
+bool Network::SaveJob(void *pArg)
+{
+	strSaveJob *pJob = (strSaveJob *) pArg;
+	
+	ASSERT(pJob != NULL);
+	ASSERT(pJob->pData != NULL && pJob->nLength > 0);
+	
+	pJob->nResult = FileInfo::WriteFile(pJob->szPath, pJob->szFile, pJob->pData, pJob->nLength, pJob->szSha256, pJob->bVerify);
+	if (pJob->nResult == FILE_SAVE_OK && pJob->pStore != NULL && pJob->nLength <= CDC_MAX_FILE) {
+		pJob->pStore->IndexData(pJob->szFile, pJob->pData, pJob->nLength);
+	}
+	
+	return(true);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Free a save job.
+void Network::FreeSaveJob(void *pArg)
+{
+	strSaveJob *pJob = (strSaveJob *) pArg;
+	
+	ASSERT(pJob != NULL);
+	free(pJob->szPath);
+	free(pJob->szFile);
+	free(pJob->pData);
+	if (pJob->szSha256 != NULL) { free(pJob->szSha256); }
+	free(pJob);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A file has been asked for that we dont have.  If we have an older 
+// 		version of it, then we try to get a delta instead.  The delta is put 
+// 		in the file list like any other file and the nodes are asked for it, 
+// 		and the file itself isnt asked for until we have given up on the 
+// 		delta.  The file is still searched for, because the nodes that have 
+// 		it are the ones that can make the delta.
+void Network::StartDelta(FileInfo *pInfo)
+{
+	char szBase[256];
+	char szDelta[256];
+	FileInfo *pDelta;
+	
+	ASSERT(pInfo != NULL);
+	ASSERT(pInfo->IsLocal() == false);
+	ASSERT(_pFileList != NULL);
+	
+	if (_pFileList->FindOlder(pInfo->GetFilename(), szBase, sizeof(szBase)) == true) {
+		if (Delta::MakeName(pInfo->GetFilename(), szBase, szDelta, sizeof(szDelta)) == true) {
+			pDelta = _pFileList->GetFileInfo(szDelta);
+			if (pDelta == NULL) {
+				pDelta = _pFileList->AddFile(szDelta);
+			}
+			ASSERT(pDelta != NULL);
+			pDelta->FileStart();
+			pInfo->SetDelta(szBase, szDelta);
+			LOG_SYSTEM(LOG_CACHE, "[Network] Trying to get %s as a delta from %s.", pInfo->GetFilename(), szBase);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go thru the files that we are trying to get a delta for.  Once we 
+// 		have all of a delta, the file is rebuilt from the older version and 
+// 		the delta (see ProcessRebuild), and the file is complete without any 
+// 		of it being got from the nodes.  If we cant get the delta, or it doesnt work, we go back to 
+// 		getting the whole file.
+void Network::ProcessDeltas(void)
+{
+	FileInfo *pInfo, *pDelta;
+	long long nWait;
+	bool bDone;
+	
+	Lock();
+	
+	ASSERT(_pFileList != NULL);
+	
+	pInfo = _pFileList->GetFirst();
+	while (pInfo != NULL) {
+		if (pInfo->GetDeltaName() != NULL) {
+			bDone = false;
+			nWait = GetTimeMs() - pInfo->GetDeltaTime();
+			pDelta = _pFileList->GetFileInfo(pInfo->GetDeltaName());
+			
+			if (pDelta == NULL) {
+				bDone = true;
+			}
+			else if (pInfo->GetDeltaBase() == NULL) {
+				// it is a recipe rather than a delta.
+				if (pDelta->HasLength() == true && pDelta->IsReceived() == true) {
+					bDone = ProcessRecipe(pInfo, pDelta);
+				}
+				else if (nWait >= DELTA_TIME || (nWait >= DELTA_WAIT && pDelta->HasLength() == false) || pInfo->GetSearch() == FILE_SEARCH_NOTFOUND) {
+					LOG_SYSTEM(LOG_CACHE, "[Network] Couldnt get the recipe for %s, getting all of it.", pInfo->GetFilename());
+					bDone = true;
+				}
+			}
+			else if (pDelta->HasLength() == true && pDelta->IsReceived() == true) {
+				bDone = ProcessRebuild(pInfo, pDelta);
+			}
+			else if (nWait >= DELTA_TIME || (nWait >= DELTA_WAIT && pDelta->HasLength() == false) || pInfo->GetSearch() == FILE_SEARCH_NOTFOUND) {
+				LOG_SYSTEM(LOG_CACHE, "[Network] Couldnt get a delta for %s, getting all of it.", pInfo->GetFilename());
+				bDone = true;
+			}
+			
+			if (bDone == true) {
+				if (pDelta != NULL) {
+					pDelta->FileComplete();
+				}
+				pInfo->ClearDelta();
+			}
+		}
+		pInfo = pInfo->GetNext();
+	}
+	
+	// the deltas we made for nodes that went away, and the ones that 
+	// couldnt be made.
+	ASSERT(_pBackground != NULL);
+	_pBackground->Expire(DELTA_RETRY);
+	
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have all of the delta for a file.  Reading the older version and 
+// 		applying the delta to it takes a while, so it is done in the 
+// 		background, and we keep waiting until it is.  Returns true when we 
+// 		have finished with the delta, whether the file was rebuilt or not.  
+// 		Needs to be called while locked.
+bool Network::ProcessRebuild(FileInfo *pInfo, FileInfo *pDelta)
+{
+	strRebuildJob *pJob;
+	char szKey[256 + sizeof(JOB_REBUILD_PREFIX)];
+	int nState;
+	bool bDone = false;
+	
+	ASSERT(pInfo != NULL && pDelta != NULL);
+	ASSERT(pInfo->GetDeltaBase() != NULL);
+	ASSERT(_pFileList != NULL);
+	ASSERT(_pBackground != NULL);
+	ASSERT(strlen(pInfo->GetFilename()) < 256);
+	
+	sprintf(szKey, "%s%s", JOB_REBUILD_PREFIX, pInfo->GetFilename());
+	nState = _pBackground->GetState(szKey);
+	if (nState == JOB_DONE || nState == JOB_FAILED) {
+		bDone = true;
+		pJob = (strRebuildJob *) _pBackground->Take(szKey);
+		ASSERT(pJob != NULL);
+		
+		if (nState == JOB_DONE) {
+			ASSERT(pJob->pTarget != NULL);
+			if (pInfo->HasLength() == false) {
+				pInfo->SetLength(pJob->nTarget);
+			}
+			
+			if (pInfo->GetLength() == pJob->nTarget) {
+				pInfo->SaveData(pJob->pTarget, pJob->nTarget);
+				_Delta.nUpgrades++;
+				_Delta.nSaved += pJob->nTarget - pJob->nData;
+				LOG_SYSTEM(LOG_CACHE, "[Network] Rebuilt %s from %s with a %d byte delta, saved %d bytes (%lld bytes over %d upgrades).", pInfo->GetFilename(), pInfo->GetDeltaBase(), pJob->nData, pJob->nTarget - pJob->nData, _Delta.nSaved, _Delta.nUpgrades);
+			}
+		}
+		else {
+			LOG_SYSTEM(LOG_CACHE, "[Network] Delta %s didnt work, getting all of %s.", pDelta->GetFilename(), pInfo->GetFilename());
+		}
+		FreeRebuildJob(pJob);
+	}
+	else if (nState == JOB_NONE) {
+		pJob = (strRebuildJob *) malloc(sizeof(strRebuildJob));
+		ASSERT(pJob != NULL);
+		pJob->szBase = (char *) malloc(strlen(_pFileList->GetPath()) + strlen(pInfo->GetDeltaBase()) + 2);
+		ASSERT(pJob->szBase != NULL);
+		sprintf(pJob->szBase, "%s/%s", _pFileList->GetPath(), pInfo->GetDeltaBase());
+		pJob->pData = pDelta->CopyData(&pJob->nData);
+		pJob->pTarget = NULL;
+		pJob->nTarget = 0;
+		
+		if (_pBackground->Add(szKey, RebuildFile, FreeRebuildJob, pJob) == false) {
+			LOG_SYSTEM(LOG_CACHE, "[Network] Couldnt rebuild %s from its delta, getting all of it.", pInfo->GetFilename());
+			FreeRebuildJob(pJob);
+			bDone = true;
+		}
+	}
+	
+	return(bDone);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Rebuild a file from the older version and a delta, in the background 
+// 		worker.  Returns false if the older version couldnt be read, or the 
+// 		delta didnt work.
+bool Network::RebuildFile(void *pArg)
+{
+	strRebuildJob *pJob = (strRebuildJob *) pArg;
+	char *pBase;
+	int nBase;
+	bool bOk = false;
+	
+	ASSERT(pJob != NULL);
+	ASSERT(pJob->szBase != NULL && pJob->pTarget == NULL);
+	
+	pBase = Delta::ReadFile(pJob->szBase, &nBase);
+	if (pBase != NULL) {
+		if (pJob->pData != NULL) {
+			bOk = Delta::Apply(pBase, nBase, pJob->pData, pJob->nData, &pJob->pTarget, &pJob->nTarget);
+		}
+		free(pBase);
+	}
+	
+	return(bOk);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Free a rebuild job, once it has been taken or has expired.
+void Network::FreeRebuildJob(void *pArg)
+{
+	strRebuildJob *pJob = (strRebuildJob *) pArg;
+	
+	ASSERT(pJob != NULL);
+	free(pJob->szBase);
+	if (pJob->pData != NULL) { free(pJob->pData); }
+	if (pJob->pTarget != NULL) { free(pJob->pTarget); }
+	free(pJob);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A node has asked us for a delta.  We only make deltas between a file 
+// 		and the version that came just before it, so a node cant have us 
+// 		make deltas between any two files we have.  If we have already made 
+// 		it, it will be in the delta directory.  Otherwise it is made in the 
+// 		background (it means reading both files), and bBusy is set so that 
+// 		the node is answered once it is done.  A delta that is nearly as big 
+// 		as the file isnt worth sending, so the node gets the whole file.  
+// 		Returns NULL if we cant give the node the delta.
+FileInfo * Network::LoadDelta(char *szName, bool *bBusy)
+{
+	FileInfo *pInfo = NULL;
+	strDeltaJob *pJob;
+	char szTarget[256], szBase[256];
+	char szDir[2048], szPath[2048];
+	struct stat st;
+	int nState;
+	
+	ASSERT(szName != NULL && bBusy != NULL);
+	ASSERT(_pFileList != NULL);
+	ASSERT(_pBackground != NULL);
+	
+	*bBusy = false;
+	if (Delta::SplitName(szName, szTarget, szBase, sizeof(szTarget)) == true && (strlen(_pFileList->GetPath()) + strlen(szName) + strlen(DELTA_DIR) + 16) < sizeof(szDir)) {
+		sprintf(szDir, "%s/%s", _pFileList->GetPath(), DELTA_DIR);
+		
+		// a delta that couldnt be made is left in the list until it 
+		// expires, so that we dont keep trying to make it.
+		nState = _pBackground->GetState(szName);
+		if (nState == JOB_PENDING || nState == JOB_BUSY) {
+			*bBusy = true;
+		}
+		else if (nState != JOB_FAILED) {
+			if (nState == JOB_DONE) {
+				pJob = (strDeltaJob *) _pBackground->Take(szName);
+				ASSERT(pJob != NULL);
+				_Delta.nMade++;
+				LOG_SYSTEM(LOG_CACHE, "[Network] Made a %d byte delta for %s from %s (%d deltas made).", pJob->nLength, szTarget, szBase, _Delta.nMade);
+				FreeDeltaJob(pJob);
+			}
+			
+			if (_pFileList->IsAdjacent(szTarget, szBase) == true) {
+				pInfo = _pFileList->LoadFile(szName, szDir);
+				if (pInfo == NULL && nState == JOB_NONE && _pBackground->GetCount() < DELTA_JOBS_MAX) {
+					pJob = (strDeltaJob *) malloc(sizeof(strDeltaJob));
+					ASSERT(pJob != NULL);
+					pJob->szDir = strdup(szDir);
+					pJob->szName = strdup(szName);
+					sprintf(szPath, "%s/%s", _pFileList->GetPath(), szTarget);
+					pJob->szTarget = strdup(szPath);
+					sprintf(szPath, "%s/%s", _pFileList->GetPath(), szBase);
+					pJob->szBase = strdup(szPath);
+					pJob->nLength = 0;
+					pJob->nTarget = 0;
+					
+					if (_pBackground->Add(szName, BuildDelta, FreeDeltaJob, pJob) == true) {
+						*bBusy = true;
+					}
+					else {
+						FreeDeltaJob(pJob);
+					}
+				}
+			}
+			
+			// a delta that is nearly as big as the file isnt worth it.
+			if (pInfo != NULL) {
+				sprintf(szPath, "%s/%s", _pFileList->GetPath(), szTarget);
+				if (stat(szPath, &st) != 0 || ((long long) pInfo->GetLength() * 100) > ((long long) st.st_size * DELTA_MAX_PERCENT)) {
+					pInfo = NULL;
+				}
+			}
+		}
+	}
+	
+	return(pInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Make a delta, in the background worker.  It is only written to the 
+// 		delta directory if it is small enough to be served, and then the 
+// 		oldest deltas are removed so that the directory doesnt keep growing.  
+// 		This can only use what is in the job, it cant touch the network.
+bool Network::BuildDelta(void *pArg)
 {
-	bool bFound = false;
-	FileInfo *pInfo;
+	strDeltaJob *pJob = (strDeltaJob *) pArg;
+	char *pBase, *pTarget, *pData = NULL;
+	int nBase, nTarget, nData = 0;
+	bool bMade = false;
 	
-	ASSERT(szFilename != NULL);
-	ASSERT(_pFileList != NULL);
+	ASSERT(pJob != NULL);
 	
-	pInfo = _pFileList->GetNextFile();
-	if (pInfo != NULL) {
-		*szFilename = pInfo->GetFilename();
-		ASSERT(*szFilename != NULL);
-		ASSERT(pInfo->IsLocal() == false);
-		bFound = true;
+	pTarget = Delta::ReadFile(pJob->szTarget, &nTarget);
+	pBase = Delta::ReadFile(pJob->szBase, &nBase);
+	
+	if (pTarget != NULL && pBase != NULL && Delta::Create(pBase, nBase, pTarget, nTarget, &pData, &nData) == true) {
+		pJob->nLength = nData;
+		pJob->nTarget = nTarget;
+		if (((long long) nData * 100) <= ((long long) nTarget * DELTA_MAX_PERCENT)) {
+			if (Delta::WriteFile(pJob->szDir, pJob->szName, pData, nData) == true) {
+				Delta::Prune(pJob->szDir, DELTA_CACHE_MAX);
+				bMade = true;
+			}
+		}
 	}
 	
-	return(bFound);
+	if (pTarget != NULL) { free(pTarget); }
+	if (pBase != NULL) { free(pBase); }
+	if (pData != NULL) { free(pData); }
+	
+	return(bMade);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: We've received a file request from a node.  We need to relay this info 
-// 		on to our other nodes (if our ttl is greater than zero).  However, we 
-// 		dont want to send it back to the node that we just got it from, so we 
-// 		send it to everything except that one.  We also dont want to send it to 
-// 		any server that is already on the list of hosts that is inside this 
-// 		message packet.
-//
-//		F<hops><ttl><flen><file*flen><host*6>...<host*6>
-void Network::RelayFileRequest(strFileRequest *pReq)
+// CJW: Free a delta job, once it has been taken or has expired.
+void Network::FreeDeltaJob(void *pArg)
 {
-	Node *pNode;
-	int i, j;
-	unsigned char buffer[2048];
-	Address *pAddr;
-	bool bSend;
-	unsigned char tmp[6];
+	strDeltaJob *pJob = (strDeltaJob *) pArg;
+	
+	ASSERT(pJob != NULL);
+	free(pJob->szDir);
+	free(pJob->szName);
+	free(pJob->szTarget);
+	free(pJob->szBase);
+	free(pJob);
+}
 
-	ASSERT(pReq != NULL);
-	ASSERT(_pNodes != NULL);	// must have at least one, because we got this message from somewhere.
+
+//-----------------------------------------------------------------------------
+// CJW: A file has been asked for that we dont have, and we have chunks from 
+// 		other files.  We get the recipe of the file first (it is put in the 
+// 		file list like any other file), so that we can see which of its 
+// 		chunks we already have.  Like a delta, the file itself isnt asked for 
+// 		until we have given up on the recipe.
+void Network::StartRecipe(FileInfo *pInfo)
+{
+	char szRecipe[256];
+	FileInfo *pRecipe;
 	
-	// First we build our message because it is going to be the same for each node.
-	i=0;
-	buffer[i++] = 'F';
-	buffer[i++] = pReq->nHops;
-	buffer[i++] = pReq->nTtl;
-	buffer[i++] = pReq->nFlen;
-	for (j=0; j<pReq->nFlen; j++) {
-		buffer[i++] =  pReq->szFile[j];
+	ASSERT(pInfo != NULL);
+	ASSERT(pInfo->IsLocal() == false);
+	ASSERT(pInfo->GetDeltaName() == NULL);
+	ASSERT(_pFileList != NULL);
+	
+	if (ChunkStore::MakeRecipeName(pInfo->GetFilename(), szRecipe, sizeof(szRecipe)) == true) {
+		pRecipe = _pFileList->GetFileInfo(szRecipe);
+		if (pRecipe == NULL) {
+			pRecipe = _pFileList->AddFile(szRecipe);
+		}
+		ASSERT(pRecipe != NULL);
+		pRecipe->FileStart();
+		pInfo->SetDelta(NULL, szRecipe);
+		LOG_SYSTEM(LOG_CACHE, "[Network] Trying to build %s from its recipe.", pInfo->GetFilename());
 	}
-	for (j=0; j<pReq->nHops; j++) {
-		pReq->pHosts[j]->Get(&buffer[i]);
-		i += 6;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have all of the recipe for a file.  The first time we see it, the 
+// 		chunks that are in our index are looked up in the background, since 
+// 		that means reading each of them from the files they are in.  Once 
+// 		that is done, those chunks are filled in, and the rest are asked for 
+// 		by hash in ProcessCdc().  The file is filled in as the chunks arrive, 
+// 		so if we give up on the recipe, only the parts we still dont have 
+// 		are got from the nodes.  Returns true when we have finished with the 
+// 		recipe, whether the file was built or not.  Needs to be called while 
+// 		locked.
+bool Network::ProcessRecipe(FileInfo *pInfo, FileInfo *pRecipe)
+{
+	strCdcFetch *pFetch, *pPrev;
+	strFillJob *pJob;
+	char szKey[256 + sizeof(JOB_FILL_PREFIX)];
+	char *pData;
+	int nData, nState;
+	bool bDone = false;
+	bool bWait = false;
+	
+	ASSERT(pInfo != NULL && pRecipe != NULL);
+	ASSERT(_Cdc.pStore != NULL);
+	ASSERT(_pBackground != NULL);
+	
+	pPrev = NULL;
+	pFetch = _Cdc.pFetches;
+	while (pFetch != NULL && strcmp(pFetch->szFile, pInfo->GetFilename()) != 0) {
+		pPrev = pFetch;
+		pFetch = pFetch->pNext;
 	}
 	
-	// Then we go thru the nodes and tell each one to send the message.
-	pNode = _pNodes;
-	while(pNode != NULL) {
-		if (pNode->IsClosed() == false) {
+	if (pFetch == NULL) {
+		ASSERT(strlen(pInfo->GetFilename()) < 256);
+		sprintf(szKey, "%s%s", JOB_FILL_PREFIX, pInfo->GetFilename());
+		nState = _pBackground->GetState(szKey);
+		if (nState == JOB_PENDING || nState == JOB_BUSY) {
+			bWait = true;
+		}
+		else if (nState == JOB_DONE || nState == JOB_FAILED) {
+			pJob = (strFillJob *) _pBackground->Take(szKey);
+			ASSERT(pJob != NULL && pJob->pFetch != NULL);
+			pFetch = pJob->pFetch;
+			pJob->pFetch = NULL;
 			
-			// check that it is not from a node that has already got this message
-			pAddr = pNode->GetServerInfo();
-			if (pAddr != NULL) {
+			if (pInfo->HasLength() == false || pInfo->GetLength() != pFetch->nLength) {
+				FreeFetch(pFetch);
+				pFetch = NULL;
+				bDone = true;
+			}
+			else {
+				_Cdc.nReused += pJob->nReused;
+				LOG_SYSTEM(LOG_CACHE, "[Network] Recipe for %s has %d chunks, %d already here (%lld of %d bytes).", pInfo->GetFilename(), pFetch->nEntries, pFetch->nEntries - pFetch->nMissing, pJob->nReused, pFetch->nLength);
+				CdcFill(pInfo, pFetch);
+			}
+			FreeFillJob(pJob);
+		}
+		else {
+			pFetch = (strCdcFetch *) malloc(sizeof(strCdcFetch));
+			ASSERT(pFetch != NULL);
+			pFetch->szFile = strdup(pInfo->GetFilename());
+			ASSERT(pFetch->szFile != NULL);
+			pFetch->nEntries = 0;
+			pFetch->nLength = 0;
+			pFetch->nMissing = 0;
+			pFetch->pData = NULL;
+			pFetch->pFilled = NULL;
+			pFetch->nChunks = 0;
+			pFetch->pNext = NULL;
+			
+			pData = pRecipe->CopyData(&nData);
+			pFetch->pEntries = ChunkStore::ParseRecipe(pData, nData, &pFetch->nEntries, &pFetch->nLength);
+			free(pData);
+			
+			if (pFetch->pEntries == NULL || (pInfo->HasLength() == true && pInfo->GetLength() != pFetch->nLength)) {
+				LOG_SYSTEM(LOG_CACHE, "[Network] Recipe for %s is no good, getting all of it.", pInfo->GetFilename());
+				FreeFetch(pFetch);
+				pFetch = NULL;
+				bDone = true;
+			}
+			else {
+				if (pInfo->HasLength() == false) {
+					pInfo->SetLength(pFetch->nLength);
+				}
+				pFetch->pData = (char *) malloc(pFetch->nLength);
+				ASSERT(pFetch->pData != NULL);
+				pFetch->nChunks = (pFetch->nLength + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE;
+				pFetch->pFilled = (bool *) calloc(pFetch->nChunks, sizeof(bool));
+				ASSERT(pFetch->pFilled != NULL);
+				pFetch->nMissing = pFetch->nEntries;
 				
-				bSend = true;
-				for (j=0; j<pReq->nHops && bSend == true; j++) {
-					pReq->pHosts[j]->Get(tmp);			
-					if (pAddr->IsSame(tmp) == false) {
-						bSend = false;
+				pJob = (strFillJob *) malloc(sizeof(strFillJob));
+				ASSERT(pJob != NULL);
+				pJob->pStore = _Cdc.pStore;
+				pJob->pFetch = pFetch;
+				pJob->nReused = 0;
+				
+				// if the worker cant be started, we get all of the chunks 
+				// by hash instead.
+				if (_pBackground->Add(szKey, FillJob, FreeFillJob, pJob) == true) {
+					pFetch = NULL;
+					bWait = true;
+				}
+				else {
+					pJob->pFetch = NULL;
+					FreeFillJob(pJob);
+				}
+			}
+		}
+		
+		if (pFetch != NULL) {
+			if (pPrev == NULL) {
+				_Cdc.pFetches = pFetch;
+			}
+			else {
+				pPrev->pNext = pFetch;
+			}
+		}
+	}
+	
+	// while the chunks are being looked up, the fetch belongs to the job.
+	if (bDone == false && bWait == false) {
+		ASSERT(pFetch != NULL);
+		if (pFetch->nMissing == 0) {
+			_Cdc.nFiles++;
+			LOG_SYSTEM(LOG_CACHE, "[Network] Built %s from its recipe (%d files, %lld bytes reused, %lld bytes by hash).", pInfo->GetFilename(), _Cdc.nFiles, _Cdc.nReused, _Cdc.nFetched);
+			bDone = true;
+		}
+		else if ((GetTimeMs() - pInfo->GetDeltaTime()) >= DELTA_TIME) {
+			LOG_SYSTEM(LOG_CACHE, "[Network] Couldnt get %d chunks of %s by hash, getting the rest of it.", pFetch->nMissing, pInfo->GetFilename());
+			bDone = true;
+		}
+		
+		if (bDone == true) {
+			if (pPrev == NULL) {
+				_Cdc.pFetches = pFetch->pNext;
+			}
+			else {
+				pPrev->pNext = pFetch->pNext;
+			}
+			FreeFetch(pFetch);
+		}
+	}
+	
+	return(bDone);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Fill in the chunks of a recipe that are in our index, in the 
+// 		background worker.  The fetch isnt in the network's list yet, so 
+// 		nothing else is using it.
+bool Network::FillJob(void *pArg)
+{
+	strFillJob *pJob = (strFillJob *) pArg;
+	strCdcFetch *pFetch;
+	char *pBuffer;
+	int nSize, i;
+	
+	ASSERT(pJob != NULL);
+	ASSERT(pJob->pStore != NULL && pJob->pFetch != NULL);
+	
+	pFetch = pJob->pFetch;
+	pBuffer = (char *) malloc(CDC_MAX_CHUNK);
+	ASSERT(pBuffer != NULL);
+	
+	for (i=0; i<pFetch->nEntries; i++) {
+		if (pJob->pStore->Find(pFetch->pEntries[i].pHash, pBuffer, &nSize) == true && nSize == pFetch->pEntries[i].nLength) {
+			memcpy(&pFetch->pData[pFetch->pEntries[i].nOffset], pBuffer, nSize);
+			pFetch->pEntries[i].bHave = true;
+			pFetch->nMissing--;
+			pJob->nReused += nSize;
+		}
+	}
+	free(pBuffer);
+	
+	return(true);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Free a fill job, and its fetch if it still has it.
+void Network::FreeFillJob(void *pArg)
+{
+	strFillJob *pJob = (strFillJob *) pArg;
+	
+	ASSERT(pJob != NULL);
+	if (pJob->pFetch != NULL) {
+		FreeFetch(pJob->pFetch);
+	}
+	free(pJob);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Free a file that we were building from its recipe.
+void Network::FreeFetch(strCdcFetch *pFetch)
+{
+	ASSERT(pFetch != NULL);
+	free(pFetch->szFile);
+	if (pFetch->pEntries != NULL) { free(pFetch->pEntries); }
+	if (pFetch->pData != NULL) { free(pFetch->pData); }
+	if (pFetch->pFilled != NULL) { free(pFetch->pFilled); }
+	free(pFetch);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Put each chunk of the FileInfo that we now have all of the data for 
+// 		into it.  The entries of the recipe are in the order they are in the 
+// 		file, so we only need to go thru them once.  Needs to be called while 
+// 		locked.
+void Network::CdcFill(FileInfo *pInfo, strCdcFetch *pFetch)
+{
+	strCdcEntry *pEntry;
+	char *pChunk;
+	int nChunk, nStart, nSize, i, j;
+	bool bAll;
+	
+	ASSERT(pInfo != NULL && pFetch != NULL);
+	ASSERT(pFetch->pData != NULL && pFetch->pFilled != NULL);
+	ASSERT(pInfo->HasLength() == true && pInfo->GetLength() == pFetch->nLength);
+	
+	i = 0;
+	for (nChunk=1; nChunk <= pFetch->nChunks; nChunk++) {
+		nStart = (nChunk - 1) * MAX_CHUNK_SIZE;
+		nSize = pFetch->nLength - nStart;
+		if (nSize > MAX_CHUNK_SIZE) { nSize = MAX_CHUNK_SIZE; }
+		
+		// skip the entries that end before this chunk.
+		while (i < pFetch->nEntries && (pFetch->pEntries[i].nOffset + pFetch->pEntries[i].nLength) <= nStart) {
+			i++;
+		}
+		
+		if (pFetch->pFilled[nChunk - 1] == false) {
+			bAll = true;
+			for (j=i; j < pFetch->nEntries && pFetch->pEntries[j].nOffset < (nStart + nSize) && bAll == true; j++) {
+				pEntry = &pFetch->pEntries[j];
+				if (pEntry->bHave == false) {
+					bAll = false;
+				}
+			}
+			
+			if (bAll == true) {
+				pChunk = (char *) malloc(nSize);
+				ASSERT(pChunk != NULL);
+				memcpy(pChunk, &pFetch->pData[nStart], nSize);
+				pInfo->SaveChunk(pChunk, nChunk, nSize);
+				pFetch->pFilled[nChunk - 1] = true;
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Ask each node that understands the request for the next chunks that 
+// 		we are missing, up to NODE_HASH_PIPELINE at a time, so that we arent 
+// 		waiting for each one to come back before asking for the next.  We dont 
+// 		ask a node again for a chunk that it has just told us it doesnt have.
+void Network::ProcessCdc(void)
+{
+	Node *pNode;
+	strCdcFetch *pFetch;
+	strCdcEntry *pEntry;
+	int i;
+	
+	Lock();
+	
+	pNode = _pNodes;
+	while (pNode != NULL && _Cdc.pFetches != NULL) {
+		if (pNode->IsConnecting() == false && pNode->IsClosed() == false && pNode->GetVersion() >= 2) {
+			pEntry = NULL;
+			pFetch = _Cdc.pFetches;
+			i = 0;
+			while (pFetch != NULL && pNode->GetHashPending() < NODE_HASH_PIPELINE) {
+				pEntry = NULL;
+				for (; i<pFetch->nEntries && pEntry == NULL; i++) {
+					if (pFetch->pEntries[i].bHave == false && pFetch->pEntries[i].nNode == 0 && pFetch->pEntries[i].nRefused != pNode->GetID()) {
+						pEntry = &pFetch->pEntries[i];
 					}
 				}
 				
-				if (bSend == true) {
-					pNode->SendMsg((char *)buffer, i);
+				if (pEntry != NULL) {
+					pNode->RequestHash(pEntry->pHash);
+					pEntry->nNode = pNode->GetID();
+				}
+				else {
+					pFetch = pFetch->pNext;
+					i = 0;
 				}
 			}
 		}
 		pNode = pNode->GetNext();
 	}
+	
+	Unlock();
 }
 
 
-
 //-----------------------------------------------------------------------------
-// CJW: We've received a file reply from a node.  We need to relay this info 
-// 		on to the last host in the list.  our other nodes (if our ttl is greater than zero).  However, we 
-// 		dont want to send it back to the node that we just got it from, so we 
-// 		send it to everything except that one.
-//
-//		G<hops><flen><file*flen><target*6><host*6>...<host*6>
-void Network::RelayFileReply(strFileReply *pReply)
+// CJW: A node has replied to a chunk that we asked it for by hash.  If it 
+// 		sent it, and it matches the hash, then it goes in every place it is 
+// 		needed, and into the file itself.  Otherwise the chunk can be asked 
+// 		of another node.  Needs to be called while locked.
+void Network::CdcReceived(Node *pNode, unsigned char *pHash, char *pData, int nSize)
 {
-	Node *pNode;
-	unsigned char pNextAddress[6];
-	Address *pAddr;
-	int i, j;
-	unsigned char buffer[2048];
+	FileInfo *pInfo;
+	strCdcFetch *pFetch;
+	strCdcEntry *pEntry;
+	unsigned char pCheck[CDC_HASH_SIZE];
+	bool bGood = false;
+	bool bFilled;
+	int i;
 	
-	ASSERT(pReply != NULL);
-	ASSERT(_pNodes != NULL);
+	ASSERT(pNode != NULL && pHash != NULL);
 	
-	ASSERT(pReply->nHops > 0);
-	pReply->pHosts[pReply->nHops-1]->Get(pNextAddress);
+	if (pData != NULL && nSize > 0) {
+		Sha256 sha;
+		sha.Update(pData, nSize);
+		sha.Final(pCheck);
+		if (memcmp(pCheck, pHash, CDC_HASH_SIZE) == 0) {
+			bGood = true;
+		}
+	}
+	
+	pFetch = _Cdc.pFetches;
+	while (pFetch != NULL) {
+		bFilled = false;
+		for (i=0; i<pFetch->nEntries; i++) {
+			pEntry = &pFetch->pEntries[i];
+			if (pEntry->bHave == false && memcmp(pEntry->pHash, pHash, CDC_HASH_SIZE) == 0) {
+				if (bGood == true && pEntry->nLength == nSize) {
+					memcpy(&pFetch->pData[pEntry->nOffset], pData, nSize);
+					pEntry->bHave = true;
+					pEntry->nNode = 0;
+					pFetch->nMissing--;
+					_Cdc.nFetched += nSize;
+					bFilled = true;
+				}
+				else if (pEntry->nNode == pNode->GetID()) {
+					pEntry->nNode = 0;
+					pEntry->nRefused = pNode->GetID();
+				}
+			}
+		}
+		
+		if (bFilled == true) {
+			pInfo = _pFileList->GetFileInfo(pFetch->szFile);
+			if (pInfo != NULL && pInfo->HasLength() == true && pInfo->GetLength() == pFetch->nLength) {
+				CdcFill(pInfo, pFetch);
+			}
+		}
+		pFetch = pFetch->pNext;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A node has asked us for a chunk by hash.  We send it if it is in our 
+// 		index, otherwise we tell the node we dont have it.  Needs to be 
+// 		called while locked.
+void Network::CdcRequested(Node *pNode, unsigned char *pHash)
+{
+	char *pBuffer;
+	int nSize;
 	
+	ASSERT(pNode != NULL && pHash != NULL);
+	ASSERT(_Cdc.pStore != NULL);
 	
-	// First we build our message because it is going to be the same for each node.
-	i=0;
-	buffer[i++] = 'G';
-	buffer[i++] = pReply->nHops-1;
-	buffer[i++] = pReply->nFlen;
-	for (j=0; j<pReply->nFlen; j++) {
-		buffer[i++] =  pReply->szFile[j];
+	pBuffer = (char *) malloc(CDC_MAX_CHUNK);
+	ASSERT(pBuffer != NULL);
+	
+	if (_Cdc.bEnabled == true && _Cdc.pStore->Find(pHash, pBuffer, &nSize) == true) {
+		pNode->SendHashData(pHash, pBuffer, nSize);
+		_Cdc.nServed += nSize;
 	}
-	for (j=0; j<pReply->nHops-1; j++) {
-		pReply->pHosts[j]->Get(&buffer[i]);
-		i += 6;
+	else {
+		pNode->SendHashData(pHash, NULL, 0);
 	}
 	
-	ASSERT(i < 2048);
+	free(pBuffer);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A node has asked us for the recipe of a file.  If we have already 
+// 		made it, it will be in the recipe directory.  Otherwise, if we have 
+// 		the file, it is made in the background (and the file is indexed 
+// 		while it is in memory), and bBusy is set so that the node is answered 
+// 		once it is done.  Returns NULL if we cant give the node the recipe.
+FileInfo * Network::LoadRecipe(char *szName, bool *bBusy)
+{
+	FileInfo *pInfo = NULL;
+	strCdcJob *pJob;
+	char szFile[256];
+	char szDir[2048], szPath[2048];
+	int nState;
 	
-	// Go thru the nodes and find the one we need to send the message to.
-	pNode = _pNodes;
-	while(pNode != NULL) {
-		if (pNode->IsClosed() == false) {
-			pAddr = pNode->GetServerInfo();
-			if (pAddr != NULL) {
-				if (pAddr->IsSame(pNextAddress) == true) {
-					pNode->SendMsg((char *)buffer, i);
+	ASSERT(szName != NULL && bBusy != NULL);
+	ASSERT(_pFileList != NULL);
+	ASSERT(_Cdc.pStore != NULL);
+	ASSERT(_pBackground != NULL);
+	
+	*bBusy = false;
+	if (ChunkStore::SplitRecipeName(szName, szFile, sizeof(szFile)) == true && (strlen(_pFileList->GetPath()) + strlen(szName) + strlen(CDC_DIR) + 16) < sizeof(szDir)) {
+		sprintf(szDir, "%s/%s", _pFileList->GetPath(), CDC_DIR);
+		
+		// like a delta, a recipe that couldnt be made isnt tried again 
+		// until it expires.
+		nState = _pBackground->GetState(szName);
+		if (nState == JOB_PENDING || nState == JOB_BUSY) {
+			*bBusy = true;
+		}
+		else if (nState != JOB_FAILED) {
+			if (nState == JOB_DONE) {
+				FreeCdcJob(_pBackground->Take(szName));
+				LOG_SYSTEM(LOG_CACHE, "[Network] Made the recipe for %s.", szFile);
+			}
+			
+			pInfo = _pFileList->LoadFile(szName, szDir);
+			if (pInfo == NULL && nState == JOB_NONE && _pBackground->GetCount() < DELTA_JOBS_MAX) {
+				sprintf(szPath, "%s/%s", _pFileList->GetPath(), szFile);
+				if (access(szPath, R_OK) == 0) {
+					pJob = (strCdcJob *) malloc(sizeof(strCdcJob));
+					ASSERT(pJob != NULL);
+					pJob->pStore = _Cdc.pStore;
+					pJob->szFile = strdup(szFile);
+					pJob->szPath = strdup(szPath);
+					pJob->szDir = strdup(szDir);
+					pJob->szName = strdup(szName);
+					
+					if (_pBackground->Add(szName, CdcJob, FreeCdcJob, pJob) == true) {
+						*bBusy = true;
+					}
+					else {
+						FreeCdcJob(pJob);
+					}
 				}
 			}
 		}
-		pNode = pNode->GetNext();
 	}
+	
+	return(pInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Make the recipe of a file, or just index it, in the background 
+// 		worker.  Returns false if the file couldnt be read, or the recipe 
+// 		couldnt be written.
+bool Network::CdcJob(void *pArg)
+{
+	strCdcJob *pJob = (strCdcJob *) pArg;
+	char *pData, *pRecipe;
+	int nData, nRecipe;
+	bool bOk = false;
+	
+	ASSERT(pJob != NULL);
+	ASSERT(pJob->pStore != NULL);
+	
+	if (pJob->szDir == NULL) {
+		bOk = pJob->pStore->IndexFile(pJob->szFile);
+	}
+	else {
+		pData = Delta::ReadFile(pJob->szPath, &nData);
+		if (pData != NULL) {
+			pRecipe = ChunkStore::MakeRecipe(pData, nData, &nRecipe);
+			bOk = Delta::WriteFile(pJob->szDir, pJob->szName, pRecipe, nRecipe);
+			free(pRecipe);
+			if (nData <= CDC_MAX_FILE) {
+				pJob->pStore->IndexData(pJob->szFile, pData, nData);
+			}
+			free(pData);
+		}
+	}
+	
+	return(bOk);
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: Free a recipe or index job.
+void Network::FreeCdcJob(void *pArg)
+{
+	strCdcJob *pJob = (strCdcJob *) pArg;
+	
+	ASSERT(pJob != NULL);
+	free(pJob->szFile);
+	free(pJob->szPath);
+	if (pJob->szDir != NULL) { free(pJob->szDir); }
+	if (pJob->szName != NULL) { free(pJob->szName); }
+	free(pJob);
+}
 
 
+//-----------------------------------------------------------------------------
+// CJW: Every CDC_INDEX_TIME seconds we go thru the package cache and index 
+// 		the chunks of any files we havent already done.  Reading and hashing 
+// 		a file takes a while, so it is done in the background, one file at a 
+// 		time.  We only look for the next one once the last one is done.
+void Network::ProcessChunkIndex(void)
+{
+	struct dirent *pEntry;
+	strCdcJob *pJob;
+	char szPath[2048];
+	bool bQueued = false;
+	int nState, nLen;
+	
+	Lock();
+	
+	ASSERT(_Cdc.pStore != NULL);
+	ASSERT(_pBackground != NULL);
+	
+	nState = _pBackground->GetState((char *) JOB_INDEX);
+	if (nState == JOB_DONE || nState == JOB_FAILED) {
+		FreeCdcJob(_pBackground->Take((char *) JOB_INDEX));
+	}
+	
+	if (nState != JOB_PENDING && nState != JOB_BUSY) {
+		if (_Cdc.bEnabled == true && _Cdc.pDir == NULL && time(NULL) >= _Cdc.tNextIndex) {
+			_Cdc.pDir = opendir(_pFileList->GetPath());
+			if (_Cdc.pDir == NULL) {
+				_Cdc.tNextIndex = time(NULL) + CDC_INDEX_TIME;
+			}
+		}
+		
+		while (_Cdc.pDir != NULL && bQueued == false) {
+			pEntry = readdir(_Cdc.pDir);
+			if (pEntry == NULL) {
+				closedir(_Cdc.pDir);
+				_Cdc.pDir = NULL;
+				_Cdc.tNextIndex = time(NULL) + CDC_INDEX_TIME;
+				LOG_SYSTEM(LOG_CACHE, "[Network] CDC: %d chunks indexed, %d files built, %lld bytes reused, %lld by hash, %lld served.", _Cdc.pStore->GetCount(), _Cdc.nFiles, _Cdc.nReused, _Cdc.nFetched, _Cdc.nServed);
+			}
+			else {
+				nLen = strlen(pEntry->d_name);
+				if (pEntry->d_name[0] != '.' && nLen < 255 && (nLen < 5 || strcmp(&pEntry->d_name[nLen-5], ".part") != 0) && _Cdc.pStore->IsIndexed(pEntry->d_name) == false && (strlen(_pFileList->GetPath()) + nLen + 2) < sizeof(szPath)) {
+					sprintf(szPath, "%s/%s", _pFileList->GetPath(), pEntry->d_name);
+					pJob = (strCdcJob *) malloc(sizeof(strCdcJob));
+					ASSERT(pJob != NULL);
+					pJob->pStore = _Cdc.pStore;
+					pJob->szFile = strdup(pEntry->d_name);
+					pJob->szPath = strdup(szPath);
+					pJob->szDir = NULL;
+					pJob->szName = NULL;
+					
+					// if the worker cant be started, we try again next time.
+					bQueued = true;
+					if (_pBackground->Add((char *) JOB_INDEX, CdcJob, FreeCdcJob, pJob) == false) {
+						FreeCdcJob(pJob);
+					}
+				}
+			}
+		}
+	}
+	
+	Unlock();
+}
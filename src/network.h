@@ -70,6 +70,16 @@
 #include "node.h"
 #include "serverlist.h"
 #include "filelist.h"
+#include "mirror.h"
+#include "misslist.h"
+#include "dht.h"
+#include "pkgindex.h"
+#include "delta.h"
+#include "cdc.h"
+#include "metrics.h"
+#include "background.h"
+
+#include <dirent.h>
 
 
 //-----------------------------------------------------------------------------
@@ -86,6 +96,200 @@
 // 
 #define FILE_LIST_CHECK     5
 
+//-----------------------------------------------------------------------------
+// Defaults for the outgoing connections.  The timeout is the number of 
+// seconds we will wait for a connection to be established, and the parallel 
+// value is the number of connection attempts we will have going at once.  
+// Both can be changed in the config.
+#define CONNECT_TIMEOUT     10
+#define CONNECT_PARALLEL    4
+
+//-----------------------------------------------------------------------------
+// Number of seconds between saving our server list to the peer file.
+#define PEER_SAVE_TIME      300
+
+//-----------------------------------------------------------------------------
+// Defaults for getting parts of files from the package mirror while the 
+// network is being searched.  The parallel value is the number of range 
+// requests we will have going at once for each file (0 turns it off), and 
+// the chunks value is the number of chunks we ask for in each request.  The 
+// loops value is how many times we will poll each mirror connection in one 
+// pass, so that a fast mirror isnt held back by our idle loop.
+#define MIRROR_PARALLEL     2
+#define MIRROR_CHUNKS       8
+#define MIRROR_LOOPS        64
+
+//-----------------------------------------------------------------------------
+// Files that are this size or smaller are got straight from the mirror, 
+// without searching the network, since the search would take longer than 
+// getting the file.  Can be changed with small-file in the config (0 turns it 
+// off).  The network search is held back while we find out how big the file 
+// is.  If we dont get a url from the client within SEARCH_URL_WAIT ms, or 
+// dont find out the size within SEARCH_SIZE_WAIT ms, then we search anyway.
+#define SMALL_FILE_SIZE     65536
+#define SEARCH_URL_WAIT     200
+#define SEARCH_SIZE_WAIT    2000
+
+//-----------------------------------------------------------------------------
+// When we search the network for a file, we wait long enough for the request 
+// to go out to the TTL and the reply to come back, based on the round trip 
+// times we have measured to our nodes (SEARCH_DEFAULT_RTT if we havent 
+// measured any yet), plus some slack.  The wait is kept between the min and 
+// max.  If nobody has replied by then, the client is told that the file is 
+// not on the network, so that it can get it from the mirror straight away.
+#define SEARCH_DEFAULT_RTT  100
+#define SEARCH_SLACK        500
+#define SEARCH_MIN_WAIT     1000
+#define SEARCH_MAX_WAIT     10000
+
+//-----------------------------------------------------------------------------
+// Searches start close and go further out each round that nobody replies, 
+// doubling the TTL until it gets to DEFAULT_TTL.  The starting TTL is the one 
+// that would have found half of the last RING_HISTORY files that were found.
+// Until we have found some, we start at RING_START_TTL.
+#define RING_START_TTL      2
+#define RING_HISTORY        32
+
+//-----------------------------------------------------------------------------
+// A relay takes up to RELAY_CONNECTIONS connections (relay-connections in the 
+// config).  Other nodes try to keep RELAY_LINKS connections to relays 
+// (relay-links), and once they have one, they only send their searches to 
+// the relays.
+#define RELAY_CONNECTIONS   200
+#define RELAY_LINKS         2
+
+//-----------------------------------------------------------------------------
+// When we cant connect to a node that has a file, we ask the node that told 
+// us about it to get the file for us, and get the chunks from it as they 
+// arrive.  We keep asking it for the file every PROXY_RETRY seconds until it 
+// knows how big it is, and give up after PROXY_TIME seconds.  The node in the 
+// middle keeps the file in its list for PROXY_HOLD seconds, so that the 
+// chunks are there for us to get, but only gets PROXY_WINDOW chunks ahead of 
+// what it has sent us.  The chunks it has sent are kept until the file 
+// expires, unless that would take them over CHUNK_CACHE_MAX.
+#define PROXY_TIME          60
+#define PROXY_RETRY         2
+#define PROXY_HOLD          60
+#define PROXY_WINDOW        16
+
+
+//-----------------------------------------------------------------------------
+// When delta=yes and we have an older version of a file that is asked for, 
+// we try to get a delta from a node that has both versions.  If no node has 
+// told us how big the delta is within DELTA_WAIT ms, or we havent got all of 
+// it within DELTA_TIME ms, we get the whole file instead.  The deltas we make 
+// are kept in DELTA_DIR in the package cache, and arent kept (or served) if 
+// they are more than DELTA_MAX_PERCENT of the size of the file.  Only the 
+// newest DELTA_CACHE_MAX deltas are kept.  Deltas are made in the background, 
+// no more than DELTA_JOBS_MAX at a time, and one that couldnt be made isnt 
+// tried again for DELTA_RETRY seconds.  When chunking=cdc, the recipes that 
+// nodes ask for are made the same way, with the same limits.
+#define DELTA_WAIT          10000
+#define DELTA_TIME          120000
+#define DELTA_DIR           ".pacsrv-delta"
+#define DELTA_MAX_PERCENT   80
+#define DELTA_CACHE_MAX     64
+#define DELTA_JOBS_MAX      4
+#define DELTA_RETRY         300
+
+// A delta that is being made in the background.
+struct strDeltaJob {
+    char *szDir;            // DELTA_DIR, where it is written.
+    char *szName;
+    char *szTarget;         // the files it is made from, in the package cache.
+    char *szBase;
+    int nLength;            // of the delta, once it has been made.
+    int nTarget;            // of the target.
+};
+
+
+// A file that is being rebuilt from the older version and a delta, in the 
+// background.
+struct strRebuildJob {
+    char *szBase;           // the older version, in the package cache.
+    char *pData;            // the delta.
+    int nData;
+    char *pTarget;          // the file, once it has been rebuilt.
+    int nTarget;
+};
+
+
+// A file that we are building from a recipe.  Each chunk of the file is put 
+// in its FileInfo as soon as we have all of the data for it.
+struct strCdcFetch {
+    char *szFile;
+    strCdcEntry *pEntries;
+    int nEntries;
+    int nLength;
+    int nMissing;           // chunks that we still need.
+    char *pData;            // the file, as it is filled in.
+    bool *pFilled;          // the chunks of the FileInfo that are filled in.
+    int nChunks;
+    strCdcFetch *pNext;
+};
+
+// A recipe being made, or a file being indexed, in the background.
+struct strCdcJob {
+    ChunkStore *pStore;
+    char *szFile;           // in the package cache.
+    char *szPath;           // of the file.
+    char *szDir;            // CDC_DIR, NULL if we are only indexing.
+    char *szName;           // of the recipe.
+};
+
+// The chunks of a recipe that are in our index, being filled in in the 
+// background.
+struct strFillJob {
+    ChunkStore *pStore;
+    strCdcFetch *pFetch;    // NULL once it has been taken.
+    long long nReused;      // bytes that were filled in.
+};
+
+// A file being written to the package cache in the background.
+struct strSaveJob {
+    char *szPath;           // the package cache.
+    char *szFile;
+    char *pData;            // all of the file.
+    int nLength;
+    char *szSha256;         // NULL if we dont know it.
+    bool bVerify;
+    ChunkStore *pStore;     // to index it once it is saved, NULL if we arent.
+    int nResult;            // FILE_SAVE_
+};
+
+// The keys of the jobs other than deltas and recipes, which use their names.  
+// A name cant have a '/' in it, so these cant be mixed up with them.
+#define JOB_SAVE_PREFIX     "/save/"
+#define JOB_INDEX           "/index"
+#define JOB_FILL_PREFIX     "/fill/"
+#define JOB_PKGINDEX        "/pkgindex"
+#define JOB_REBUILD_PREFIX  "/rebuild/"
+
+
+// A file that we are getting through another node, or getting for another 
+// node, because the holder couldnt be connected to directly.
+struct strProxy {
+    char *szFile;
+    unsigned char pHolder[6];
+    int nVia;               // node we asked, 0 if we are getting it for someone else.
+    bool bAsked;            // we have sent the 'O' to the node.
+    time_t tStart;
+    time_t tRetry;
+    strProxy *pNext;
+};
+
+
+// A copy of a file in our list, for the stats page.
+struct strFileStats {
+    char szFile[256];
+    bool bLocal;
+    int nLength;            // 0 if we dont know it yet.
+    int nChunks;
+    int nReceived;          // chunks we have got.
+    int nRequested;         // chunks asked of a node that havent arrived.
+    int nUsers;             // clients and nodes that are using the file.
+};
+
 
 class Network : public BaseServer
 {
@@ -93,44 +297,225 @@ class Network : public BaseServer
         Network();
         virtual ~Network();
     
+        void StartQuery(char *szQuery);
+        void EndQuery(char *szQuery);
         bool RunQuery(char *szQuery, int nChunk, char **pData, int *nSize, int *nLength);
+        void SetMirror(char *szQuery, char *szUrl);
+        bool IsNotFound(char *szQuery);
+        int GetHitHistogram(int *pCounts, int nMax);
+        strNodeStats * GetNodeStats(int *nCount);
+        strFileStats * GetFileStats(int *nCount);
     
     protected:
         virtual void OnAccept(int);
         virtual void OnIdle(void);
     
     private:
+        void ApplyConfig(void);
         void CheckConnections(void);
         void ProcessFileList(void);
-        bool ConnectStarter(void);
+        void ProcessPkgIndex(void);
+        static bool LoadPkgIndex(void *pArg);
+        static void FreePkgIndex(void *pArg);
+        ServerInfo * ConnectStarter(void);
         bool ConnectNode(ServerInfo *pInfo);
+        bool ConnectHolder(Address *pTarget);
+        void ProcessConnects(void);
+        void CancelConnects(void);
+        void SeedServers(void);
+        void CheckBootstrap(void);
+        int GetValidCount(void);
+        Node * FindNode(Address *pAddress);
         void CloseSlowConnection(void);
         void ProcessNodes(void);
         void ProcessFinal(Node *pNode);
+        void ReleaseFiles(Node *pNode);
         void RemoveClosedNodes(void);
         int AddNode(Node *pNode);
+        int NewID(void);
+        void ProcessMirrors(void);
+        void StartMirrors(void);
+        bool StartMirror(FileInfo *pInfo, int nFirst, int nCount);
+        int GetMirrorCount(char *szFilename);
+        bool CanMirror(FileInfo *pInfo);
+        void ProcessSearches(void);
+        void SearchNetwork(FileInfo *pInfo, int nTtl);
+        int GetSearchWait(int nTtl);
+        void SearchHit(FileInfo *pInfo);
+        Node * ClosestDhtNode(unsigned int nKey, strFileRequest *pReq);
+        int ClosestDhtNodes(unsigned int nKey, strFileRequest *pReq, Node **pList, int nMax);
+        void DhtLookup(char *szFilename);
+        void RouteDhtLookup(Node *pNode, strFileRequest *pReq);
+        void RouteDhtStore(strDhtStore *pStore);
+        void RelayDhtLookup(Node *pNode, strFileRequest *pReq, int nTtl);
+        void RefreshDhtTable(void);
+        bool IsOnlyDhtLink(Node *pNode);
+        void ProcessPublish(void);
+        void AnnounceFile(char *szFilename);
+        void SaveFiles(void);
+        void SavedFile(char *szFilename, int nResult);
+        static bool SaveJob(void *pArg);
+        static void FreeSaveJob(void *pArg);
+        void StartDelta(FileInfo *pInfo);
+        void ProcessDeltas(void);
+        bool ProcessRebuild(FileInfo *pInfo, FileInfo *pDelta);
+        static bool RebuildFile(void *pArg);
+        static void FreeRebuildJob(void *pArg);
+        FileInfo * LoadDelta(char *szName, bool *bBusy);
+        static bool BuildDelta(void *pArg);
+        static void FreeDeltaJob(void *pArg);
+        void StartRecipe(FileInfo *pInfo);
+        bool ProcessRecipe(FileInfo *pInfo, FileInfo *pRecipe);
+        static bool FillJob(void *pArg);
+        static void FreeFillJob(void *pArg);
+        static void FreeFetch(strCdcFetch *pFetch);
+        FileInfo * LoadRecipe(char *szName, bool *bBusy);
+        static bool CdcJob(void *pArg);
+        static void FreeCdcJob(void *pArg);
+        void CdcFill(FileInfo *pInfo, strCdcFetch *pFetch);
+        void ProcessCdc(void);
+        void CdcReceived(Node *pNode, unsigned char *pHash, char *pData, int nSize);
+        void CdcRequested(Node *pNode, unsigned char *pHash);
+        void ProcessChunkIndex(void);
+        void RelayAnswer(Node *pNode, strFileRequest *pReq);
+        int GetRelayCount(void);
+        void CheckLeaf(void);
+        void AddProxy(char *szFilename, Address *pHolder, int nVia);
+        void AskProxy(Node *pNode, strProxy *pProxy);
+        void ProxyConnected(Address *pAddress, bool bConnected);
+        void ServeProxy(int nNode, strProxyRequest *pReq);
+        void ProcessProxies(void);
         int GetNodeCount(void);
         int GetConnectionCount(void);
+        int GetConnectingCount(void);
+        long long TimePhase(strMetric *pMetric, char *szPhase, long long nStart);
     
         void SaveChunk(char *szFilename, char *pData, int nChunk, int nSize);
         bool GetNextChunk(char *szFilename, int *nChunk);
-        bool GetNextFile(char **szFilename);
+        bool GetNextFile(Node *pNode, char **szFilename);
 		
 		void RelayFileRequest(strFileRequest *pReq);
 		void RelayFileReply(strFileReply *pReply);
     
         struct {
-            char szQueryHost;
+            char *szQueryHost;
             int  nQueryPort;
+            time_t tQueryTime;      // last time we looked up the query host.
             int  nMin, nMax;
+            int  nTimeout;          // milliseconds to wait for a connection.
+            int  nParallel;         // max connection attempts at once.
         } _Connections;
         
         ServerList *_pServerList;
         FileList *_pFileList;
+        PkgIndex *_pPkgIndex;       // sizes and checksums from the sync databases.
+        // When we start up, we keep track of how long it takes to get our 
+        // first working connection, and to reach our minimum connections.
+        struct {
+            long long nStart;
+            long long nFirst;
+            long long nMin;
+            long long nLastCheck;   // when we last counted the nodes (ms).
+        } _Bootstrap;
+        
+        char *_szPeerFile;
+        time_t _tLastPeerSave;
+        
         Node *_pNodes;
+        Mirror *_pMirrors;
+        struct {
+            int nParallel;
+            int nChunks;
+        } _Mirror;
+        struct {
+            int nSize;              // threshold, 0 if turned off.
+            int nBypassed;          // number of searches we didnt need to do.
+        } _SmallFile;
+        
+        // files that the network didnt have the last time we searched.
+        struct {
+            MissList *pList;
+            int nTime;          // seconds to remember them for, 0 for never.
+            int nSaved;         // searches that we didnt need to send.
+        } _Misses;
+        
+        // how far out our searches had to go before the file was found.
+        struct {
+            int nStart;                     // TTL that searches start with.
+            int pHits[DEFAULT_TTL+1];       // number of files found at each TTL.
+            int pRecent[RING_HISTORY];      // TTLs of the last files found.
+            int nRecent;                    // total files found.
+        } _Ring;
+        
+        // We publish the files that we have to the DHT, and keep the 
+        // records that other nodes publish that are closest to our id.
+        struct {
+            Dht *pStore;
+            DhtTable *pTable;       // the DHT nodes that we know of.
+            time_t tRefresh;        // when to check our links to the buckets.
+            unsigned int nId;       // our id, 0 if the DHT is turned off.
+            DIR *pDir;              // package cache, while we are publishing.
+            time_t tNextPublish;
+            int nPublished;         // records we have sent.
+            int nLookups;           // lookups we have started.
+        } _Dht;
+        
+        struct {
+            bool bEnabled;          // we are a relay.
+            int nLinks;             // relays we want to be connected to, if we arent one.
+            Dht *pIndex;            // files that our leaves have.
+            int nAnswered;          // requests that we answered for our leaves.
+            bool bLeaf;             // we are only connected to relays.
+        } _Relay;
+        
+        // completed network files are written to the package cache.
+        struct {
+            bool bSave;             // save-files in the config.
+            int nSaved;             // files we have written.
+        } _Cache;
+        
+        struct {
+            bool bEnabled;          // delta in the config.
+            int nUpgrades;          // files we have rebuilt from a delta.
+            long long nSaved;       // bytes we didnt have to get because of them.
+            int nMade;              // deltas we have made for other nodes.
+        } _Delta;
+        
+        // work that is too slow to do on the network thread.
+        Background *_pBackground;
+        
+        struct {
+            bool bEnabled;          // chunking=cdc in the config.
+            ChunkStore *pStore;     // chunks of the files in the cache.
+            DIR *pDir;              // package cache, while we are indexing it.
+            time_t tNextIndex;
+            strCdcFetch *pFetches;
+            int nFiles;             // files we have built from a recipe.
+            long long nReused;      // bytes we already had.
+            long long nFetched;     // bytes we had to ask for by hash.
+            long long nServed;      // bytes we have sent by hash.
+        } _Cdc;
+        
+        struct {
+            strProxy *pList;
+            int nAsked;             // files we have asked other nodes to get for us.
+            int nServed;            // files we have got for other nodes.
+        } _Proxy;
+        // Each phase of OnIdle() is timed, and if one takes longer than the 
+        // budget, it is logged along with what we were doing at the time.
+        struct {
+            int nBudget;            // us, 0 if slow phases arent logged.
+            long long nLastEnd;     // when the last pass finished (us).
+            time_t tLastWarn;
+            int nSuppressed;        // slow phases not logged since the last warning.
+            int nPasses;            // times ProcessNodes() went thru the nodes.
+        } _Loop;
+        
         int _nNextNodeID;
         int _nPort;
+        int _nConfigGeneration;     // the config snapshot our limits came from.
         time_t _tLastFileListCheck;
+        time_t _tLastMetricsLog;
 };
 
 
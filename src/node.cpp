@@ -33,12 +33,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <DevPlus.h>
 
 #include "node.h"
+#include "common.h"
 #include "config.h"
 #include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+#include "resolver.h"
 
 
 #define NODE_HEARTBEAT_DELAY		15
@@ -67,17 +79,58 @@ Node::Node()
 	_Data.pData		 = NULL;
 	_Data.nChunk	 = 0;
 	_Data.nSize		 = 0;
-	_Data.pFileInfo  = NULL;
+	_Data.nLength	 = 0;
+	_Data.bRefused	 = false;
+	_Data.szRefused	 = NULL;
+	_Data.nTraceTime = 0;
+	
+	_Upload.szFilename = NULL;
+	_Upload.pFileInfo  = NULL;
+	_Upload.pChunks    = NULL;
+	_Upload.nChunks    = 0;
+	_Upload.bComplete  = false;
+	_Upload.nStart     = 0;
+	_Upload.nBytes     = 0;
+	
+	_Stats.nBytesOut = 0;
+	_Stats.nUploadMs = 0;
 	
 	_Heartbeat.nBeats	  = 0;
 	_Heartbeat.nDelay	  = 0;
 	_Heartbeat.nLastCheck = time(NULL);
+	
+	_Ping.nSent = 0;
+	_Ping.nRtt  = 0;
+
+	_Connect.nSocket = -1;
+	_Connect.nStart  = 0;
+	
+	_pServerEntry = NULL;
+	_nLocalPort   = 0;
 
 	_pFileRequest = NULL;
 	_pFileReply   = NULL;
+	_pDhtStore    = NULL;
+	_pProxyRequest = NULL;
 	_pServerInfo  = NULL;
 	_pRemoteNode  = NULL;
 	
+	_Dht.nLocal   = 0;
+	_Dht.nRemote  = 0;
+	_Dht.bRemote  = false;
+	_Dht.bNew     = false;
+	_Dht.pContacts = NULL;
+	_Dht.nVersion = NODE_PROTOCOL_VER;
+	
+	_Relay.bLocal  = false;
+	_Relay.bLeaf   = false;
+	_Relay.nRemote = 0;
+	_Relay.bNew    = false;
+	_Relay.szHave  = NULL;
+	
+	_Hash.nPending  = 0;
+	_Hash.bRequest  = false;
+	
 }
 
 
@@ -87,6 +140,8 @@ Node::Node()
 //      also make sure that everything looks ok.
 Node::~Node()
 {
+	strDhtContact *pContact;
+	
     ASSERT(_pNext == NULL);
     
     WaitForThread();
@@ -103,9 +158,46 @@ Node::~Node()
 		_Data.pData = NULL;
 	}
 	
+	if (_Data.szRefused != NULL) {
+		free(_Data.szRefused);
+		_Data.szRefused = NULL;
+	}
+	
+	// the Network object should have released the file we were serving 
+	// before deleting us, because it is the one that controls the file list.
+	ASSERT(_Upload.pFileInfo == NULL);
+	if (_Upload.szFilename != NULL) {
+		free(_Upload.szFilename);
+		_Upload.szFilename = NULL;
+	}
+	if (_Upload.pChunks != NULL) {
+		free(_Upload.pChunks);
+		_Upload.pChunks = NULL;
+		_Upload.nChunks = 0;
+	}
+	
+	// if we were deleted while still trying to connect, then the socket 
+	// hasnt been handed over yet, so we need to close it ourselves.
+	if (_Connect.nSocket >= 0) {
+		close(_Connect.nSocket);
+		_Connect.nSocket = -1;
+	}
+	
 	if (_pServerInfo != NULL)	{ delete _pServerInfo;	_pServerInfo = NULL; }
 	if (_pFileRequest != NULL)	{ delete _pFileRequest;	_pFileRequest = NULL; }
 	if (_pFileReply != NULL)	{ delete _pFileReply;	_pFileReply = NULL; }
+	if (_pDhtStore != NULL)		{ delete _pDhtStore;	_pDhtStore = NULL; }
+	if (_pProxyRequest != NULL)	{ delete _pProxyRequest;	_pProxyRequest = NULL; }
+	if (_Relay.szHave != NULL)	{ free(_Relay.szHave);	_Relay.szHave = NULL; }
+	while (_Dht.pContacts != NULL) {
+		pContact = _Dht.pContacts;
+		_Dht.pContacts = pContact->pNext;
+		free(pContact);
+	}
+	while (_Hash.nPending > 0) {
+		_Hash.nPending--;
+		if (_Hash.pAsked[_Hash.nPending].pData != NULL) { free(_Hash.pAsked[_Hash.nPending].pData); }
+	}
 	if (_pRemoteNode != NULL)	{ delete _pRemoteNode;	_pRemoteNode = NULL; }
 }
 
@@ -138,11 +230,11 @@ Node * Node::GetNext(void)
 // CJW: Since all the nodes are part of a linked list, we need to be able to 
 //      link another object to this one.   Since this function should only ever
 //      get called if this node is not already linked, then we will check that
-//      we arent already linked (programmer error).
+//      we arent already linked (programmer error).  A NULL can be supplied to 
+//      unlink the node.
 void Node::SetNext(Node *ptr)
 {
-    ASSERT(ptr != NULL);
-    ASSERT(_pNext == NULL);
+    ASSERT(_pNext == NULL || ptr == NULL);
     
     _pNext = ptr;
 }
@@ -173,8 +265,8 @@ void Node::SetID(int nID)
 //      node.
 int Node::OnReceive(char *pData, int nLength)
 {
+    static strMetric *pBytesIn = Metrics::Counter("pacsrv_node_bytes_in_total", "Bytes of telegrams received from nodes.");
     int nProcessed = 0;
-    Logger *pLogger;
     
     ASSERT(pData != NULL && nLength > 0);
     
@@ -196,11 +288,18 @@ int Node::OnReceive(char *pData, int nLength)
 		case 'C':   nProcessed = ProcessChunkRequest(pData, nLength);  break;
 		case 'D':   nProcessed = ProcessChunkData(pData, nLength);     break;
 		case 'K':   nProcessed = ProcessFileComplete(pData, nLength);  break;
+		case 'Y':   nProcessed = ProcessDhtId(pData, nLength);         break;
+		case 'T':   nProcessed = ProcessDhtStore(pData, nLength);      break;
+		case 'Z':   nProcessed = ProcessDhtContacts(pData, nLength);   break;
+		case 'U':   nProcessed = ProcessFileRequest(pData, nLength);   break;
+		case 'M':   nProcessed = ProcessMode(pData, nLength);          break;
+		case 'H':   nProcessed = ProcessHave(pData, nLength);          break;
+		case 'O':   nProcessed = ProcessProxy(pData, nLength);         break;
+		case 'B':   nProcessed = ProcessHashRequest(pData, nLength);   break;
+		case 'E':   nProcessed = ProcessHashData(pData, nLength);      break;
 
 		default:
-			pLogger = new Logger;
-			pLogger->System("[Node:%d] Unexpected command.  '%c'", _nID, pData[0]);
-			delete pLogger;
+			LOG_SYSTEM(LOG_NODE, "[Node:%d] Unexpected command.  '%c'", _nID, pData[0]);
 			nProcessed = 1;
 			// TODO: Should we close the connection?
 			break;
@@ -208,9 +307,13 @@ int Node::OnReceive(char *pData, int nLength)
 		
 	if (nProcessed > 0) {
 		_Heartbeat.nBeats = 0;
+		_nLastActivity = time(NULL);
+		Metrics::Add(pBytesIn, nProcessed);
 	}
 
 	ProcessHeartbeat();
+	
+	Unlock();
 
     return(nProcessed);
 }
@@ -250,10 +353,9 @@ int Node::GetID(void)
 // CJW: As we process the data coming from the node, any chunks received will 
 //		be kept until this function is called from the Network object.  
 //		Therefore, if we have any chunks available for the client, then we will 
-//		return pointers to it.  We will still retain control of the memory that 
-//		this data is in.  When we get the command to request another chunk, or 
-//		get the command that the file is complete, then we will clear out the 
-//		values.
+//		return pointers to it.  The caller takes control of the memory that the 
+//		chunk is in (it will end up in the FileInfo object), so we forget about 
+//		it once it has been handed over.
 bool Node::GetChunks(char **szFilename, char **pData, int *nChunk, int *nSize)
 {
 	bool bGotChunks = false;
@@ -276,6 +378,10 @@ bool Node::GetChunks(char **szFilename, char **pData, int *nChunk, int *nSize)
 		*nChunk = _Data.nChunk;
 		*nSize  = _Data.nSize;
 		
+		_Data.pData  = NULL;
+		_Data.nChunk = 0;
+		_Data.nSize  = 0;
+		
 		bGotChunks = true;
 	}
 	
@@ -283,6 +389,98 @@ bool Node::GetChunks(char **szFilename, char **pData, int *nChunk, int *nSize)
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: If the node has replied to our 'L' request with an 'A', then we know 
+// 		how big the file is.  We return true and the length if we have it.  
+// 		Until then, we cant ask for any chunks.
+bool Node::GetFileLength(int *nLength)
+{
+	bool bGotIt = false;
+	
+	ASSERT(nLength != NULL);
+	
+	if (_Data.szFilename != NULL && _Data.nLength > 0) {
+		*nLength = _Data.nLength;
+		bGotIt = true;
+	}
+	
+	return(bGotIt);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if we have asked the node for a chunk and it hasnt arrived 
+// 		yet.  We dont want to tell the node that we are finished with the file 
+// 		while there is still a chunk on its way.
+bool Node::IsChunkPending(void)
+{
+	return(_Data.nChunk > 0 && _Data.pData == NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If the node replied with an 'N' to our file request, then we return 
+// 		true, and forget about the file.  The Network object will need to 
+// 		release the file since it will no longer be processed by this node.
+bool Node::IsFileRefused(void)
+{
+	bool bRefused = false;
+	
+	if (_Data.bRefused == true) {
+		ASSERT(_Data.szFilename != NULL);
+		ASSERT(_Data.pData == NULL);
+		
+		// keep the name so that we dont keep asking for the same file.
+		if (_Data.szRefused != NULL) {
+			free(_Data.szRefused);
+		}
+		_Data.szRefused = _Data.szFilename;
+		_Data.szFilename = NULL;
+		_Data.bRefused = false;
+		_Data.nLength = 0;
+		bRefused = true;
+	}
+	
+	return(bRefused);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Forget that the node didnt have this file, so that we ask it again.  
+// 		This is used when the node is getting the file for us from somewhere 
+// 		else, and didnt know how big it was the last time we asked.
+void Node::ClearRefused(char *szFilename)
+{
+	ASSERT(szFilename != NULL);
+	
+	if (_Data.szRefused != NULL) {
+		if (strcmp(_Data.szRefused, szFilename) == 0) {
+			free(_Data.szRefused);
+			_Data.szRefused = NULL;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if this is the last file the node told us it didnt have.  
+// 		There is no point in asking for it again straight away.
+bool Node::HasRefused(char *szFilename)
+{
+	bool bRefused = false;
+	
+	ASSERT(szFilename != NULL);
+	
+	if (_Data.szRefused != NULL) {
+		if (strcmp(_Data.szRefused, szFilename) == 0) {
+			bRefused = true;
+		}
+	}
+	
+	return(bRefused);
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: Assumming that the node is currently sending a file, we want to know 
 //		what it is.  If we are not processing a file, then dont change the 
@@ -312,21 +510,60 @@ void Node::RequestChunk(int nChunk)
 	ASSERT(sizeof(tele) == 3);
 	Send((char *)tele, sizeof(tele));
 	
-	if (_Data.pData != NULL) {
-		ASSERT(_Data.nSize > 0);
-		ASSERT(_Data.nChunk >= 0);
-		ASSERT(nChunk > _Data.nChunk);
-		free(_Data.pData);
-		_Data.pData = NULL;
-		_Data.nSize  = 0;
-	}
+	// any chunk we had previously received would have been collected by the 
+	// Network object before we get asked for another.
 	ASSERT(_Data.pData == NULL);
 	ASSERT(_Data.nSize == 0);
 	
 	_Data.nChunk = nChunk;
+	TraceSent();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If we are tracing, keep the time that we asked the node for the file 
+// 		or a chunk, so that the span can be written when it replies.  The 
+// 		node's track is named each time it is asked for a file.
+void Node::TraceSent(void)
+{
+	char szName[32];
+	
+	_Data.nTraceTime = 0;
+	if (Tracer::IsOn() == true && _nID > 0) {
+		if (_Data.nChunk == 0) {
+			snprintf(szName, sizeof(szName), "node %d", _nID);
+			Tracer::NameTrack(Tracer::NodeTrack(_nID), szName);
+		}
+		_Data.nTraceTime = Tracer::Now();
+	}
 }	
 
 
+//-----------------------------------------------------------------------------
+// CJW: The node has a different file to the one we want (it isnt the size 
+// 		we expected).  We finish with it like it was complete, but remember 
+// 		it like it was refused, so that we dont ask this node for it again.
+void Node::RejectFile(void)
+{
+	ASSERT(_Data.szFilename != NULL);
+	
+	Send("K", 1);
+	if (_Data.szRefused != NULL) {
+		free(_Data.szRefused);
+	}
+	_Data.szRefused = _Data.szFilename;
+	_Data.szFilename = NULL;
+	_Data.nLength = 0;
+	
+	if (_Data.pData != NULL) {
+		free(_Data.pData);
+		_Data.pData = NULL;
+	}
+	_Data.nChunk = 0;
+	_Data.nSize = 0;
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: We have finished receiving all the different chunks for the node.  So 
 // 		we need to send a message to the node to tell it we have finished, and 
@@ -338,12 +575,14 @@ void Node::FileComplete(void)
 	Send("K", 1);
 	free(_Data.szFilename);
 	_Data.szFilename = NULL;
+	_Data.nLength = 0;
 	
 	if (_Data.pData != NULL) {
 		free(_Data.pData);
-		_Data.nChunk = 0;
-		_Data.nSize = 0;
+		_Data.pData = NULL;
 	}
+	_Data.nChunk = 0;
+	_Data.nSize = 0;
 }
 
 
@@ -382,6 +621,8 @@ void Node::RequestFile(char *szFilename)
 	ASSERT(_Data.pData == NULL);
 	ASSERT(_Data.nChunk == 0);
 	ASSERT(_Data.nSize == 0);
+	ASSERT(_Data.nLength == 0);
+	ASSERT(_Data.bRefused == false);
 	
 	nLength = strlen(szFilename);
 	ASSERT(nLength < 256);
@@ -394,6 +635,7 @@ void Node::RequestFile(char *szFilename)
 	_Data.szFilename = (char *) malloc(nLength + 1);
 	strncpy(_Data.szFilename, szFilename, nLength);
 	_Data.szFilename[nLength] = '\0';
+	TraceSent();
 }
 
 
@@ -411,7 +653,7 @@ Address * Node::GetServerInfo(void)
 		_pServerInfo = NULL;
 	}
 	
-	return(_pServerInfo);
+	return(pInfo);
 }
 
 
@@ -420,10 +662,11 @@ Address * Node::GetServerInfo(void)
 // 		already downloading a file, because in this case, we are telling the 
 // 		node to pass the request on.  We are not actually asking the node to start 
 // 		downloading this file.  We only want to let the nodes know that we are 
-// 		looking for it.
+// 		looking for it.  The TTL is how many hops the request can go, so a 
+// 		TTL of 1 only asks the node itself.
 //	
 // 		Msg... F<hops><ttl><flen><file*flen><host*6>...<host*6>
-void Node::RequestFileFromNetwork(char *szFilename)
+void Node::RequestFileFromNetwork(char *szFilename, int nTtl)
 {
 	struct {
 		unsigned char nHops, nTtl, nFlen;
@@ -432,9 +675,10 @@ void Node::RequestFileFromNetwork(char *szFilename)
 	int nTmp;
 	
 	ASSERT(szFilename != NULL);
+	ASSERT(nTtl > 0 && nTtl <= DEFAULT_TTL);
 	
 	data.nHops = 0;
-	data.nTtl = DEFAULT_TTL;
+	data.nTtl = nTtl;
 	nTmp = strlen(szFilename);
 	ASSERT(nTmp < 255);
 	data.nFlen = nTmp;
@@ -451,6 +695,7 @@ void Node::RequestFileFromNetwork(char *szFilename)
 	nTmp += data.nFlen;
 	
 	Send((char *)data.buffer, nTmp);
+	free(data.buffer);
 }
 
 
@@ -476,13 +721,19 @@ int Node::ProcessInit(char *pData, int nLength)
 	ASSERT(_Status.bAccepted == true);
 	ASSERT(_pRemoteNode == NULL);
 	
-	if (nLength >= 3) {
+	if (nLength >= 4) {
 		
 		// Need to actually check the version number, if it is acceptable, 
-		// then we send a "V", otherwise we send a "Q"
-		if (pData[1] == 0x01)	{ 
+		// then we send a "V", otherwise we send a "Q".  A version 2 node 
+		// also gets our DHT id.
+		if (pData[1] >= 0x01 && pData[1] <= NODE_PROTOCOL_VER)	{ 
 			Send("V", 1); 
 			_Status.bValid = true;
+			_Dht.nVersion = pData[1];
+			if (_Dht.nVersion >= 2) {
+				SendDhtId();
+				SendMode();
+			}
 			
 			pTmp = (unsigned char *) pData;
 			nPort = (pTmp[2] << 8) + pTmp[3];
@@ -497,7 +748,7 @@ int Node::ProcessInit(char *pData, int nLength)
 			Send("Q", 1); 
 		}
 		
-		nProcessed = 3;
+		nProcessed = 4;
 	}
 	
 	return(nProcessed);
@@ -518,6 +769,10 @@ int Node::ProcessValid(char *pData, int nLength)
 	ASSERT(pData[0] == 'V');
 	
 	_Status.bValid = true;
+	if (_Dht.nVersion >= 2) {
+		SendDhtId();
+		SendMode();
+	}
 	
 	return(1);
 }
@@ -529,14 +784,28 @@ int Node::ProcessValid(char *pData, int nLength)
 // 		instruction.
 int Node::ProcessQuit(char *pData, int nLength)
 {
+	unsigned char buffer[4];
+	
 	ASSERT(_Status.bClosed == false);
 	ASSERT(_Status.bAccepted == false);
 	
 	ASSERT(pData != NULL && nLength > 0);
 	ASSERT(pData[0] == 'Q');
 	
-	Close();
-	_Status.bClosed = true;
+	if (_Status.bValid == false && _Dht.nVersion > 1) {
+		// an older node doesnt know our version, so we try again with 
+		// version 1, and wont be able to use the DHT with it.
+		_Dht.nVersion = 1;
+		buffer[0] = 'I';
+		buffer[1] = 1;
+		buffer[2] = (_nLocalPort >> 8) & 0xff;
+		buffer[3] = _nLocalPort & 0xff;
+		Send((char *) buffer, 4);
+	}
+	else {
+		Close();
+		_Status.bClosed = true;
+	}
 	
 	return(1);	
 }
@@ -586,9 +855,15 @@ void Node::ProcessHeartbeat(void)
 				_Status.bClosed = true;
 			}
 			else {
+				// if the reply to the last ping never came, then we time 
+				// this one instead, otherwise the next reply would look like 
+				// it took the whole time since the first one.
 				Send("P", 1);
+				_Ping.nSent = GetTimeMs();
 			}
 		}
+		
+		_Heartbeat.nLastCheck = nTime;
 	}
 }
 
@@ -606,172 +881,748 @@ void Node::ProcessPing()
 
 
 //-----------------------------------------------------------------------------
-// CJW: We should receive ping messages from the node every so many seconds.  
-// 		If we do, we simply reply with a ping reply.
+// CJW: We've got a reply to the ping we sent, so we know how long the round 
+// 		trip took.
 void Node::ProcessPingReply(void)
 {
+	static strMetric *pRtt = Metrics::Histogram("pacsrv_node_rtt_ms", "Round trip time of pings to nodes.");
+	int nSample;
+	
 	ASSERT(_Status.bClosed == false);
 	ASSERT(_Status.bValid == true);
 	
-	// we could add some logic to determine the latency time for a connection, but we will leave that for a later version because it can be a bit complicated to implement.
+	// we time each ping, and smooth the result so that one slow reply 
+	// doesnt throw it out too much.
+	if (_Ping.nSent > 0) {
+		nSample = (int) (GetTimeMs() - _Ping.nSent);
+		if (_Ping.nRtt == 0) {
+			_Ping.nRtt = nSample;
+		}
+		else {
+			_Ping.nRtt = ((_Ping.nRtt * 7) + nSample) / 8;
+		}
+		if (_Ping.nRtt < 1) { _Ping.nRtt = 1; }
+		_Ping.nSent = 0;
+		Metrics::Record(pRtt, nSample);
+	}
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: The node is asking, or passing on, a request for a particular file.  
-// 		This is one of the more complicated messages we will receive, because 
-// 		it contains a lot of dynamic information.   We dont actually reply to 
-// 		anything here, we just take down all the information.  The network 
-// 		object will check for this information on each cycle, because it needs 
-// 		to pass it to the other nodes.  If we already have file request in our 
-// 		buffer, we will not do anything at this stage until that one has been 
-// 		processed, it will stay in our incoming queue.
-//
-//		-->  F<hops><ttl><flen><file*flen><host*6>...<host*6>
-int Node::ProcessFileRequest(char *pData, int nLength)
+// CJW: Return the smoothed round trip time to this node in milliseconds, or 
+// 		0 if we havent measured it yet.
+int Node::GetRtt(void)
 {
-	int nProcessed = 0;
-	unsigned char *pTmp = NULL;
-	int i;
+	return(_Ping.nRtt);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Set our own DHT id, which we give to the node if it understands it.  
+// 		If it is 0, then we arent taking part in the DHT.
+void Node::SetDhtId(unsigned int nId)
+{
+	_Dht.nLocal = nId;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the node has told us its DHT id, so that DHT telegrams 
+// 		can be sent to it.
+bool Node::HasDht(void)
+{
+	bool bDht = false;
 	
-	ASSERT(pData != NULL && nLength > 0);
-	ASSERT(pData[0] == 'F');
+	if (_Status.bClosed == false && _Status.bValid == true && _Dht.bRemote == true) {
+		bDht = true;
+	}
 	
-	ASSERT(_Status.bClosed == false);
-	ASSERT(_Status.bValid == true);
+	return(bDht);
+}
+
+unsigned int Node::GetDhtId(void)
+{
+	ASSERT(_Dht.bRemote == true);
+	return(_Dht.nRemote);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Tell the node what our DHT id is.  Only sent once we know that the 
+// 		node is a version 2 node.
+//
+// 		Msg... Y<id*4>
+void Node::SendDhtId(void)
+{
+	unsigned char buffer[5];
 	
-	if (nLength > 3 && _pFileRequest == NULL) {
-		pTmp = (unsigned char *) &pData[1];
-		
-		_pFileRequest = new strFileRequest;
-		_pFileRequest->nHops = pTmp[0];
-		_pFileRequest->nTtl  = pTmp[1];
-		_pFileRequest->nFlen = pTmp[2];
-		ASSERT(_pFileRequest->nTtl > 0);
-		ASSERT(_pFileRequest->nFlen > 0);
-		
-		nProcessed = 4;
-		if (nLength >= 4+_pFileRequest->nFlen+(_pFileRequest->nHops * 6)) {
-			
-			memcpy(_pFileRequest->szFile, &pTmp[3], _pFileRequest->nFlen);
-			_pFileRequest->szFile[_pFileRequest->nFlen] = '\0';
-			nProcessed += _pFileRequest->nFlen;
-			
-			_pFileRequest->pHosts = (Address **) malloc(sizeof(Address*) * (_pFileRequest->nHops + 1));
-			
-			for (i=0; i < _pFileRequest->nHops; i++) {
-				_pFileRequest->pHosts[i] = new Address;
-				_pFileRequest->pHosts[i]->Set(&pTmp[_pFileRequest->nFlen + (i*6)]);
-				nProcessed += 6;
-			}
-			
-			ASSERT(_pServerInfo != NULL);
-			_pFileRequest->pHosts[_pFileRequest->nHops] = new Address;
-			_pFileRequest->pHosts[_pFileRequest->nHops]->Set(_pServerInfo);
-			_pFileRequest->nHops++;
-			_pFileRequest->nTtl--;
-		}
-		else {
-			nProcessed = 0;
-		}
-	}
+	ASSERT(_Dht.nVersion >= 2);
 	
-	ASSERT(nProcessed == 0 || nProcessed > 5);
-	return (nProcessed);
+	if (_Dht.nLocal != 0) {
+		buffer[0] = 'Y';
+		buffer[1] = (_Dht.nLocal >> 24) & 0xff;
+		buffer[2] = (_Dht.nLocal >> 16) & 0xff;
+		buffer[3] = (_Dht.nLocal >> 8) & 0xff;
+		buffer[4] = _Dht.nLocal & 0xff;
+		Send((char *) buffer, 5);
+	}
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: We have asked the other node for a particular file, and it has returned 
-// 		an answer.  We need to save the message so that the Network object can 
-// 		retrieve it, and pass it to the appropriate node.
-int Node::ProcessFileGot(char *pData, int nLength)
+// CJW: The node has told us its DHT id.
+//
+//		-->  Y<id*4>
+int Node::ProcessDhtId(char *pData, int nLength)
 {
 	int nProcessed = 0;
-	unsigned char *pTmp = NULL;
-	int i;
+	unsigned char *pTmp;
 	
 	ASSERT(pData != NULL && nLength > 0);
-	ASSERT(pData[0] == 'G');
+	ASSERT(pData[0] == 'Y');
 	ASSERT(_Status.bClosed == false);
 	ASSERT(_Status.bValid == true);
 	
-	if (nLength > 3 && _pFileReply == NULL) {
+	if (nLength >= 5) {
 		pTmp = (unsigned char *) &pData[1];
-		_pFileReply = new strFileReply;
-		
-		_pFileReply->nHops = *(pTmp++);
-		_pFileReply->nFlen = *(pTmp++);
-		nProcessed = 3;
-		
-		if (nLength >= 3+_pFileReply->nFlen+(_pFileReply->nHops * 6)) {
-			
-			memcpy(_pFileReply->szFile, &pTmp[2], _pFileReply->nFlen);
-			_pFileReply->szFile[_pFileReply->nFlen] = '\0';
-			nProcessed += _pFileReply->nFlen;
-			pTmp += _pFileReply->nFlen;
-			
-			_pFileReply->pTarget = new Address;
-			_pFileReply->pTarget->Set(pTmp);
-			nProcessed += 6;
-			pTmp += 6;
-			
-			_pFileReply->pHosts = (Address **) malloc(sizeof(Address*) * (_pFileReply->nHops));
-			for (i=0; i < _pFileReply->nHops; i++) {
-				_pFileReply->pHosts[i] = new Address;
-				_pFileReply->pHosts[i]->Set(pTmp);
-				nProcessed += 6;
-				pTmp += 6;
-			}
-		}
-		else {
-			nProcessed = 0;
-		}
-	}
-	else {
-		ASSERT(nProcessed == 0);
+		_Dht.nRemote = (pTmp[0] << 24) | (pTmp[1] << 16) | (pTmp[2] << 8) | pTmp[3];
+		_Dht.bRemote = true;
+		_Dht.bNew = true;
+		nProcessed = 5;
 	}
 	
-	ASSERT(nProcessed == 0 || nProcessed > 4);
-	return (nProcessed);
+	return(nProcessed);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: If we received a file request from the node, we would have stored it.  
-// 		We will return control of this file request to the caller.  
-strFileRequest * Node::GetFileRequest(void)
+// CJW: Return true if the node has just told us its DHT id, so that the 
+// 		Network object can add it to the routing table.  Only returns true 
+// 		once.
+bool Node::IsNewDht(void)
 {
-	strFileRequest *pReq;
+	bool bNew;
 	
-	pReq = _pFileRequest;
-	_pFileRequest = NULL;
+	bNew = _Dht.bNew;
+	_Dht.bNew = false;
 	
-	return(pReq);
+	return(bNew);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: If we received a file reply from the node, we would have stored it.  
-// 		We will return control of this file reply to the caller.  
-strFileReply * Node::GetFileReply(void)
+// CJW: Tell the node about other DHT nodes that we know of, so that it can 
+// 		fill in its routing table.  These are the nodes we know that are 
+// 		closest to its own id.
+//
+// 		Msg... Z<count><id*4><addr*6>...<id*4><addr*6>
+void Node::SendDhtContacts(unsigned int *pIds, unsigned char *pAddresses, int nCount)
 {
-	strFileReply *pReply;
+	unsigned char buffer[2 + (DHT_BUCKET_SIZE * 10)];
+	int i, j;
 	
-	pReply = _pFileReply;
-	_pFileReply = NULL;
+	ASSERT(pIds != NULL && pAddresses != NULL);
+	ASSERT(nCount > 0 && nCount <= DHT_BUCKET_SIZE);
+	ASSERT(_Dht.nVersion >= 2);
+	
+	i = 0;
+	buffer[i++] = 'Z';
+	buffer[i++] = nCount;
+	for (j=0; j<nCount; j++) {
+		buffer[i++] = (pIds[j] >> 24) & 0xff;
+		buffer[i++] = (pIds[j] >> 16) & 0xff;
+		buffer[i++] = (pIds[j] >> 8) & 0xff;
+		buffer[i++] = pIds[j] & 0xff;
+		memcpy(&buffer[i], &pAddresses[j * 6], 6);
+		i += 6;
+	}
 	
-	return(pReply);
+	ASSERT(i <= (int) sizeof(buffer));
+	Send((char *) buffer, i);
 }
 
 
-
-
 //-----------------------------------------------------------------------------
-// CJW: A message has been formed.  We just add it to the outgoing data queue.
-void Node::SendMsg(char *ptr, int len)
+// CJW: The node has told us about some other DHT nodes.  We keep them until 
+// 		the Network object gets them, and leave any more in the queue until 
+// 		then.
+//
+//		-->  Z<count><id*4><addr*6>...<id*4><addr*6>
+int Node::ProcessDhtContacts(char *pData, int nLength)
 {
-	ASSERT(ptr != NULL);
+	int nProcessed = 0;
+	unsigned char *pTmp;
+	strDhtContact *pContact;
+	int nCount, i;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'Z');
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength >= 2 && _Dht.pContacts == NULL) {
+		nCount = (unsigned char) pData[1];
+		if (nLength >= 2 + (nCount * 10)) {
+			pTmp = (unsigned char *) &pData[2];
+			for (i=0; i<nCount; i++) {
+				pContact = (strDhtContact *) malloc(sizeof(strDhtContact));
+				ASSERT(pContact != NULL);
+				pContact->nId = (pTmp[0] << 24) | (pTmp[1] << 16) | (pTmp[2] << 8) | pTmp[3];
+				memcpy(pContact->pAddress, &pTmp[4], 6);
+				pContact->tSeen = time(NULL);
+				pContact->pNext = _Dht.pContacts;
+				_Dht.pContacts = pContact;
+				pTmp += 10;
+			}
+			nProcessed = 2 + (nCount * 10);
+		}
+	}
+	
+	return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the nodes that this node has told us about, if there are any.  
+// 		The caller needs to free each of them.
+strDhtContact * Node::GetDhtContacts(void)
+{
+	strDhtContact *pContacts;
+	
+	pContacts = _Dht.pContacts;
+	_Dht.pContacts = NULL;
+	
+	return(pContacts);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Ask the node to look up a file in the DHT.  The lookup is passed on 
+// 		towards the node whose id is closest to the file, and any node on 
+// 		the way that knows who has the file replies with a 'G', the same as 
+// 		for a flooded request.
+//
+// 		Msg... U<hops><ttl><flen><file*flen>
+void Node::RequestFileFromDht(char *szFilename, int nTtl)
+{
+	unsigned char buffer[260];
+	int nLen, i;
+	
+	ASSERT(szFilename != NULL);
+	ASSERT(nTtl > 0 && nTtl < 256);
+	ASSERT(_Dht.bRemote == true);
+	
+	nLen = strlen(szFilename);
+	ASSERT(nLen > 0 && nLen < 255);
+	
+	i = 0;
+	buffer[i++] = 'U';
+	buffer[i++] = 0;
+	buffer[i++] = nTtl;
+	buffer[i++] = nLen;
+	memcpy(&buffer[i], szFilename, nLen);
+	i += nLen;
+	
+	Send((char *) buffer, i);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Publish that we have this file.  The node that gets it fills in our 
+// 		ip address, and passes it on towards the node that should keep the 
+// 		record.
+//
+// 		Msg... T<ttl><flen><file*flen><holder*6>
+void Node::PublishFile(char *szFilename, int nTtl)
+{
+	unsigned char buffer[265];
+	int nLen, i;
+	
+	ASSERT(szFilename != NULL);
+	ASSERT(nTtl > 0 && nTtl < 256);
+	ASSERT(_Dht.bRemote == true);
+	ASSERT(_nLocalPort > 0);
+	
+	nLen = strlen(szFilename);
+	ASSERT(nLen > 0 && nLen < 255);
+	
+	i = 0;
+	buffer[i++] = 'T';
+	buffer[i++] = nTtl;
+	buffer[i++] = nLen;
+	memcpy(&buffer[i], szFilename, nLen);
+	i += nLen;
+	buffer[i++] = 0;
+	buffer[i++] = 0;
+	buffer[i++] = 0;
+	buffer[i++] = 0;
+	buffer[i++] = (_nLocalPort >> 8) & 0xff;
+	buffer[i++] = _nLocalPort & 0xff;
+	
+	Send((char *) buffer, i);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A DHT record is being passed to us.  We save it so that the Network 
+// 		object can either keep it or pass it on.  Like the file requests, if 
+// 		we already have one waiting, this one stays in the queue.
+//
+//		-->  T<ttl><flen><file*flen><holder*6>
+int Node::ProcessDhtStore(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	unsigned char *pTmp;
+	char szBuffer[32];
+	int nFlen;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'T');
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength >= 3 && _pDhtStore == NULL) {
+		pTmp = (unsigned char *) &pData[1];
+		nFlen = pTmp[1];
+		
+		if (nLength >= 3 + nFlen + 6) {
+			_pDhtStore = new strDhtStore;
+			_pDhtStore->nTtl = pTmp[0];
+			_pDhtStore->nFlen = nFlen;
+			memcpy(_pDhtStore->szFile, &pTmp[2], nFlen);
+			_pDhtStore->szFile[nFlen] = '\0';
+			pTmp += 2 + nFlen;
+			
+			// the holder doesnt know its own ip, so the first node fills it in.
+			_pDhtStore->pHolder = new Address;
+			if (pTmp[0] == 0 && pTmp[1] == 0 && pTmp[2] == 0 && pTmp[3] == 0) {
+				szBuffer[0] = '\0';
+				GetPeerName(szBuffer, 32);
+				_pDhtStore->pHolder->Set(szBuffer, (pTmp[4] << 8) + pTmp[5]);
+			}
+			else {
+				_pDhtStore->pHolder->Set(pTmp);
+			}
+			
+			nProcessed = 3 + nFlen + 6;
+			
+			// a record without a filename is no use to anyone.
+			if (nFlen == 0) {
+				delete _pDhtStore;
+				_pDhtStore = NULL;
+			}
+		}
+	}
+	
+	return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Set whether we are a relay, so that we can tell the node.  Needs to 
+// 		be done before the connection is made.
+void Node::SetRelay(bool bRelay)
+{
+	_Relay.bLocal = bRelay;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Set whether we are a leaf.  That changes while we are connected, so 
+// 		if the node already knows our mode, we tell it again.
+void Node::SetLeaf(bool bLeaf)
+{
+	Lock();
+	if (bLeaf != _Relay.bLeaf) {
+		_Relay.bLeaf = bLeaf;
+		if (_Status.bValid == true && _Status.bClosed == false && _Dht.nVersion >= 2) {
+			SendMode();
+		}
+	}
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Tell the node if we are a relay or a leaf, or neither.  Only sent to 
+// 		version 2 nodes.
+//
+// 		Msg... M<mode>
+void Node::SendMode(void)
+{
+	char buffer[2];
+	
+	ASSERT(_Dht.nVersion >= 2);
+	
+	buffer[0] = 'M';
+	if (_Relay.bLocal == true)		{ buffer[1] = NODE_MODE_RELAY; }
+	else if (_Relay.bLeaf == true)	{ buffer[1] = NODE_MODE_LEAF; }
+	else 							{ buffer[1] = 0; }
+	Send(buffer, 2);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The node has told us if it is a relay or a leaf.
+//
+//		-->  M<mode>
+int Node::ProcessMode(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'M');
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength >= 2) {
+		_Relay.nRemote = (unsigned char) pData[1];
+		if (_Relay.nRemote & NODE_MODE_RELAY) {
+			_Relay.bNew = true;
+		}
+		nProcessed = 2;
+	}
+	
+	return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the node is a relay.
+bool Node::IsRelay(void)
+{
+	bool bRelay = false;
+	
+	if (_Status.bClosed == false && _Status.bValid == true && (_Relay.nRemote & NODE_MODE_RELAY)) {
+		bRelay = true;
+	}
+	
+	return(bRelay);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the node is a leaf.  If we are a relay, then we dont 
+// 		flood requests to our leaves, we answer for them.
+bool Node::IsLeaf(void)
+{
+	bool bLeaf = false;
+	
+	if (_Status.bClosed == false && _Status.bValid == true && (_Relay.nRemote & NODE_MODE_LEAF)) {
+		bLeaf = true;
+	}
+	
+	return(bLeaf);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true once, after the node has told us that it is a relay, so 
+// 		that we can tell it what files we have straight away.
+bool Node::IsNewRelay(void)
+{
+	bool bNew;
+	
+	bNew = _Relay.bNew;
+	_Relay.bNew = false;
+	
+	return(bNew);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Tell a relay that we have this file, so that it can answer for us.
+//
+// 		Msg... H<flen><file*flen>
+void Node::SendHave(char *szFilename)
+{
+	unsigned char buffer[257];
+	int nLen;
+	
+	ASSERT(szFilename != NULL);
+	ASSERT(IsRelay() == true);
+	
+	nLen = strlen(szFilename);
+	ASSERT(nLen > 0 && nLen < 255);
+	
+	buffer[0] = 'H';
+	buffer[1] = nLen;
+	memcpy(&buffer[2], szFilename, nLen);
+	Send((char *) buffer, nLen + 2);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A leaf has told us that it has a file.  We keep it until the Network 
+// 		object gets it, and leave any more in the queue until then.
+//
+//		-->  H<flen><file*flen>
+int Node::ProcessHave(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	int nFlen;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'H');
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength >= 2 && _Relay.szHave == NULL) {
+		nFlen = (unsigned char) pData[1];
+		if (nLength >= 2 + nFlen) {
+			if (nFlen > 0) {
+				_Relay.szHave = (char *) malloc(nFlen + 1);
+				ASSERT(_Relay.szHave != NULL);
+				memcpy(_Relay.szHave, &pData[2], nFlen);
+				_Relay.szHave[nFlen] = '\0';
+			}
+			nProcessed = 2 + nFlen;
+		}
+	}
+	
+	return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the file that a leaf has told us it has, if there is one.  The 
+// 		caller needs to free it.
+char * Node::GetHave(void)
+{
+	char *szHave;
+	
+	szHave = _Relay.szHave;
+	_Relay.szHave = NULL;
+	
+	return(szHave);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If we received a DHT record from the node, we would have stored it.  
+// 		We will return control of it to the caller.
+strDhtStore * Node::GetDhtStore(void)
+{
+	strDhtStore *pStore;
+	
+	pStore = _pDhtStore;
+	_pDhtStore = NULL;
+	
+	return(pStore);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have a DHT record for the file that the lookup is for, so we reply 
+// 		with the holder as the target, back along the path of the lookup.
+//
+// 		Msg... G<hops><flen><file*flen><target*6><host*6>...<host*6>
+void Node::ReplyFileHolder(strFileRequest *pReq, unsigned char *pHolder)
+{
+	int i, j;
+	unsigned char buffer[2048];
+	
+	ASSERT(pReq != NULL && pHolder != NULL);
+	ASSERT(pReq->nFlen > 0);
+	
+	i=0;
+	buffer[i++] = 'G';
+	buffer[i++] = pReq->nHops;
+	buffer[i++] = pReq->nFlen;
+	for (j=0; j< pReq->nFlen; j++) {
+		buffer[i++] =  pReq->szFile[j];
+	}
+	for (j=0; j<6; j++) {
+		buffer[i++] = pHolder[j];
+	}
+	for (j=0; j<pReq->nHops; j++) {
+		pReq->pHosts[j]->Get(&buffer[i]);
+		i += 6;
+	}
+	
+	ASSERT(i < 2048);
+	SendMsg((char *)buffer, i);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The node is asking, or passing on, a request for a particular file.  
+// 		This is one of the more complicated messages we will receive, because 
+// 		it contains a lot of dynamic information.   We dont actually reply to 
+// 		anything here, we just take down all the information.  The network 
+// 		object will check for this information on each cycle, because it needs 
+// 		to pass it to the other nodes.  If we already have file request in our 
+// 		buffer, we will not do anything at this stage until that one has been 
+// 		processed, it will stay in our incoming queue.
+//
+//		A DHT lookup has the same format, but it is only passed on to the 
+//		node closest to the file.
+//
+//		-->  F<hops><ttl><flen><file*flen><host*6>...<host*6>
+//		-->  U<hops><ttl><flen><file*flen><host*6>...<host*6>
+int Node::ProcessFileRequest(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	unsigned char *pTmp = NULL;
+	int i;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'F' || pData[0] == 'U');
+	
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength > 3 && _pFileRequest == NULL) {
+		pTmp = (unsigned char *) &pData[1];
+		
+		_pFileRequest = new strFileRequest;
+		_pFileRequest->bDht = (pData[0] == 'U');
+		_pFileRequest->nHops = pTmp[0];
+		_pFileRequest->nTtl  = pTmp[1];
+		_pFileRequest->nFlen = pTmp[2];
+		ASSERT(_pFileRequest->nTtl > 0);
+		ASSERT(_pFileRequest->nFlen > 0);
+		
+		nProcessed = 4;
+		if (nLength >= 4+_pFileRequest->nFlen+(_pFileRequest->nHops * 6)) {
+			
+			memcpy(_pFileRequest->szFile, &pTmp[3], _pFileRequest->nFlen);
+			_pFileRequest->szFile[_pFileRequest->nFlen] = '\0';
+			nProcessed += _pFileRequest->nFlen;
+			
+			_pFileRequest->pHosts = (Address **) malloc(sizeof(Address*) * (_pFileRequest->nHops + 1));
+			
+			for (i=0; i < _pFileRequest->nHops; i++) {
+				_pFileRequest->pHosts[i] = new Address;
+				_pFileRequest->pHosts[i]->Set(&pTmp[3 + _pFileRequest->nFlen + (i*6)]);
+				nProcessed += 6;
+			}
+			
+			// we add the address of the node that sent us the request, so 
+			// that any reply can be routed back along the same path.
+			ASSERT(_pRemoteNode != NULL);
+			_pFileRequest->pHosts[_pFileRequest->nHops] = new Address;
+			_pFileRequest->pHosts[_pFileRequest->nHops]->Set(_pRemoteNode);
+			_pFileRequest->nHops++;
+			_pFileRequest->nTtl--;
+		}
+		else {
+			// we dont have the whole message yet, so we leave it in the queue.
+			delete _pFileRequest;
+			_pFileRequest = NULL;
+			nProcessed = 0;
+		}
+	}
+	
+	ASSERT(nProcessed == 0 || nProcessed > 4);
+	return (nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We have asked the other node for a particular file, and it has returned 
+// 		an answer.  We need to save the message so that the Network object can 
+// 		retrieve it, and pass it to the appropriate node.
+int Node::ProcessFileGot(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	unsigned char *pTmp = NULL;
+	char szBuffer[32];
+	int i;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'G');
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength > 3 && _pFileReply == NULL) {
+		pTmp = (unsigned char *) &pData[1];
+		_pFileReply = new strFileReply;
+		
+		_pFileReply->nHops = *(pTmp++);
+		_pFileReply->nFlen = *(pTmp++);
+		nProcessed = 3;
+		
+		if (nLength >= 3+_pFileReply->nFlen+6+(_pFileReply->nHops * 6)) {
+			
+			memcpy(_pFileReply->szFile, pTmp, _pFileReply->nFlen);
+			_pFileReply->szFile[_pFileReply->nFlen] = '\0';
+			nProcessed += _pFileReply->nFlen;
+			pTmp += _pFileReply->nFlen;
+			
+			// The node that has the file doesnt know what address the rest 
+			// of the network sees it as, so it leaves the ip blank and we 
+			// fill it in with the address that it is connected to us from.
+			_pFileReply->pTarget = new Address;
+			if (pTmp[0] == 0 && pTmp[1] == 0 && pTmp[2] == 0 && pTmp[3] == 0) {
+				szBuffer[0] = '\0';
+				GetPeerName(szBuffer, 32);
+				_pFileReply->pTarget->Set(szBuffer, (pTmp[4] << 8) + pTmp[5]);
+			}
+			else {
+				_pFileReply->pTarget->Set(pTmp);
+			}
+			nProcessed += 6;
+			pTmp += 6;
+			
+			_pFileReply->pHosts = (Address **) malloc(sizeof(Address*) * (_pFileReply->nHops));
+			for (i=0; i < _pFileReply->nHops; i++) {
+				_pFileReply->pHosts[i] = new Address;
+				_pFileReply->pHosts[i]->Set(pTmp);
+				nProcessed += 6;
+				pTmp += 6;
+			}
+		}
+		else {
+			delete _pFileReply;
+			_pFileReply = NULL;
+			nProcessed = 0;
+		}
+	}
+	else {
+		ASSERT(nProcessed == 0);
+	}
+	
+	ASSERT(nProcessed == 0 || nProcessed > 4);
+	return (nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If we received a file request from the node, we would have stored it.  
+// 		We will return control of this file request to the caller.  
+strFileRequest * Node::GetFileRequest(void)
+{
+	strFileRequest *pReq;
+	
+	pReq = _pFileRequest;
+	_pFileRequest = NULL;
+	
+	return(pReq);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If we received a file reply from the node, we would have stored it.  
+// 		We will return control of this file reply to the caller.  
+strFileReply * Node::GetFileReply(void)
+{
+	strFileReply *pReply;
+	
+	pReply = _pFileReply;
+	_pFileReply = NULL;
+	
+	return(pReply);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// CJW: A message has been formed.  We just add it to the outgoing data queue.
+void Node::SendMsg(char *ptr, int len)
+{
+	ASSERT(ptr != NULL);
 	ASSERT(len > 0);
 	
 	Send(ptr, len);
@@ -803,9 +1654,16 @@ void Node::ReplyFileFound(strFileRequest *pReq, FileInfo *pInfo)
 		buffer[i++] =  pReq->szFile[j];
 	}
 	
-	ASSERT(_pServerInfo != NULL);
-	_pServerInfo->Get(&buffer[i]);
-	i +=  6;
+	// we dont know what ip address the rest of the network sees us as, so 
+	// we leave it blank, and the node we send this to will fill it in.  We 
+	// do know what port we are listening on though.
+	ASSERT(_nLocalPort > 0);
+	buffer[i++] = 0;
+	buffer[i++] = 0;
+	buffer[i++] = 0;
+	buffer[i++] = 0;
+	buffer[i++] = (_nLocalPort >> 8) & 0xff;
+	buffer[i++] = _nLocalPort & 0xff;
 	
 	for (j=0; j<pReq->nHops; j++) {
 		pReq->pHosts[j]->Get(&buffer[i]);
@@ -837,21 +1695,20 @@ int Node::ProcessLocalFile(char *pData, int nLength)
 	ASSERT(pData != NULL && nLength > 0);
 	ASSERT(pData[0] == 'L');
 	
-	if (nLength > 3 && _szLocalFile == NULL) {
+	// We can only serve one file at a time to a node.  If the node hasnt 
+	// finished with the last one yet, we leave this request in the queue.
+	if (nLength > 3 && _Upload.szFilename == NULL && _Upload.pFileInfo == NULL) {
 		pTmp = (unsigned char *) &pData[1];
 		flen = *pTmp;
 		
-		nProcessed = 2;
-		
 		ASSERT(flen > 0);
 		
 		if (nLength >= 2 + flen) {
-			ASSERT(_Data.szFilename == NULL)
-			_Data.szFilename = (char *) malloc(flen + 1);
-			strncpy(_Data.szFilename, (char *) &pData[2], flen);
-			_Data.szFilename[flen] = '\0';
+			_Upload.szFilename = (char *) malloc(flen + 1);
+			strncpy(_Upload.szFilename, (char *) &pData[2], flen);
+			_Upload.szFilename[flen] = '\0';
 		
-			nProcessed += flen;
+			nProcessed = 2 + flen;
 			
 			// we dont return anything yet.  We wait for the Network object to 
 			// notice that we have a LocalFile request to process.  When it 
@@ -862,42 +1719,276 @@ int Node::ProcessLocalFile(char *pData, int nLength)
 		ASSERT(nProcessed == 0);
 	}
 	
-	ASSERT(nProcessed == 0 || nProcessed >= 3);
-	return (nProcessed);
+	ASSERT(nProcessed == 0 || nProcessed >= 3);
+	return (nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the local file lookup, if there is one.  We return the string 
+// 		if we have one ready.  
+char *Node::GetLocalFile(void) 
+{
+	char *ptr = NULL;
+	
+	Lock();
+	if (_Upload.pFileInfo == NULL && _Upload.szFilename != NULL) {
+		ptr = _Upload.szFilename;
+		_Upload.szFilename = NULL;
+	}
+	Unlock();
+	
+	return(ptr);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The network cant answer the local file request yet (it is still 
+// 		making the file), so it gives it back to us to be returned again 
+// 		later.  We own the string again after this.
+void Node::HoldLocalFile(char *szLocalFile)
+{
+	ASSERT(szLocalFile != NULL);
+	
+	Lock();
+	if (_Upload.szFilename == NULL && _Upload.pFileInfo == NULL) {
+		_Upload.szFilename = szLocalFile;
+	}
+	else {
+		free(szLocalFile);
+	}
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The node asked if we have a localfile.  The network object looked up 
+// 		our file list and determined that we have this file (or maybe part of 
+// 		it).  We need to reply to the node that we have the file (and its 
+// 		length).  Then we need to mark the file as in use, and then wait for 
+// 		the chunck requests to come in.
+//
+// 		<--  A<flen><length*4><file*flen>
+void Node::SendFile(char *szLocalFile, FileInfo *pInfo)
+{
+	int nLength, nFlen;
+	unsigned char buffer[6];
+	
+	ASSERT(szLocalFile != NULL);
+	ASSERT(pInfo != NULL);
+	
+	nFlen = strlen(szLocalFile);
+	ASSERT(nFlen > 0 && nFlen < 256);
+	
+	pInfo->FileStart();
+	nLength = pInfo->GetLength();
+	ASSERT(nLength > 0);
+	
+	buffer[0] = 'A';
+	buffer[1] = (unsigned char) nFlen;
+	buffer[2] = (unsigned char) ((nLength >> 24) & 0xff);
+	buffer[3] = (unsigned char) ((nLength >> 16) & 0xff);
+	buffer[4] = (unsigned char) ((nLength >> 8) & 0xff);
+	buffer[5] = (unsigned char) (nLength & 0xff);
+	
+	Lock();
+	ASSERT(_Upload.pFileInfo == NULL);
+	ASSERT(_Upload.nChunks == 0);
+	
+	Send((char *) buffer, 6);
+	Send(szLocalFile, nFlen);
+	
+	_Upload.pFileInfo = pInfo;
+	_Upload.bComplete = false;
+	_Upload.nStart = GetTimeMs();
+	_Upload.nBytes = 0;
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the file that we are currently serving to this node.  Will 
+// 		return NULL if we are not serving a file.
+FileInfo * Node::GetUploadFile(void)
+{
+	FileInfo *pInfo;
+	
+	Lock();
+	pInfo = _Upload.pFileInfo;
+	Unlock();
+	
+	return(pInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the next chunk that the node has asked us for.  The chunk stays 
+// 		in the list until it has actually been sent with SendChunk, because we 
+// 		might not have the chunk yet if we are still receiving the file 
+// 		ourselves.
+bool Node::GetChunkRequest(int *nChunk)
+{
+	bool bGotIt = false;
+	
+	ASSERT(nChunk != NULL);
+	
+	Lock();
+	if (_Upload.nChunks > 0) {
+		ASSERT(_Upload.pChunks != NULL);
+		ASSERT(_Upload.pFileInfo != NULL);
+		*nChunk = _Upload.pChunks[0];
+		bGotIt = true;
+	}
+	Unlock();
+	
+	return(bGotIt);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Send a chunk of the file to the node.  The chunk must be the one at 
+// 		the head of the request list (from GetChunkRequest).  We keep track of 
+// 		the amount of data we have sent so that we can work out how quickly 
+// 		we are serving files.
+//
+//		<--  D<chunk*2><len*2><data*len>
+void Node::SendChunk(int nChunk, char *pData, int nSize)
+{
+	static strMetric *pBytesOut = Metrics::Counter("pacsrv_node_chunk_bytes_out_total", "Bytes of chunk data sent to nodes.");
+	unsigned char tele[5];
+	
+	ASSERT(nChunk > 0);
+	ASSERT(pData != NULL);
+	ASSERT(nSize > 0 && nSize <= MAX_CHUNK_SIZE);
+	
+	tele[0] = 'D';
+	tele[1] = (unsigned char) ((nChunk >> 8) & 0xff);
+	tele[2] = (unsigned char) (nChunk & 0xff);
+	tele[3] = (unsigned char) ((nSize >> 8) & 0xff);
+	tele[4] = (unsigned char) (nSize & 0xff);
+	
+	Lock();
+	ASSERT(_Upload.nChunks > 0);
+	ASSERT(_Upload.pChunks[0] == nChunk);
+	
+	Send((char *) tele, 5);
+	Send(pData, nSize);
+	
+	_Upload.nChunks--;
+	if (_Upload.nChunks > 0) {
+		memmove(&_Upload.pChunks[0], &_Upload.pChunks[1], sizeof(int) * _Upload.nChunks);
+	}
+	
+	_Upload.nBytes += nSize;
+	_Stats.nBytesOut += nSize;
+	Unlock();
+	
+	Metrics::Add(pBytesOut, nSize);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If the node has told us that it has finished with the file we are 
+// 		serving ('K'), then we return the FileInfo so that the Network object 
+// 		can release it.  We will log the throughput of the transfer at this 
+// 		point.
+FileInfo * Node::GetUploadDone(void)
+{
+	FileInfo *pInfo = NULL;
+	long long nTime;
+	
+	Lock();
+	if (_Upload.bComplete == true) {
+		ASSERT(_Upload.pFileInfo != NULL);
+		
+		nTime = GetTimeMs() - _Upload.nStart;
+		_Stats.nUploadMs += nTime;
+		if (nTime <= 0) { nTime = 1; }
+		
+		LOG_SYSTEM(LOG_NODE, "[Node:%d] Finished serving %s.  %d bytes in %d ms (%d kb/s)", _nID, _Upload.pFileInfo->GetFilename(), _Upload.nBytes, (int) nTime, (int) (((long long) _Upload.nBytes * 1000 / nTime) / 1024));
+		
+		pInfo = _Upload.pFileInfo;
+		_Upload.pFileInfo = NULL;
+		_Upload.bComplete = false;
+		_Upload.nChunks = 0;
+		_Upload.nBytes = 0;
+		_Upload.nStart = 0;
+	}
+	Unlock();
+	
+	return(pInfo);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Stop serving the file we are currently serving, and return it (or NULL 
+// 		if we werent serving anything).  This is used when the node is closed 
+// 		before it has finished getting the file.  The caller is responsible for 
+// 		releasing the FileInfo.
+FileInfo * Node::ReleaseUpload(void)
+{
+	FileInfo *pInfo;
+	
+	Lock();
+	pInfo = _Upload.pFileInfo;
+	if (pInfo != NULL) {
+		_Stats.nUploadMs += GetTimeMs() - _Upload.nStart;
+	}
+	
+	_Upload.pFileInfo = NULL;
+	_Upload.bComplete = false;
+	_Upload.nChunks = 0;
+	_Upload.nBytes = 0;
+	_Upload.nStart = 0;
+	Unlock();
+	
+	return(pInfo);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: Return the local file lookup, if there is one.  We return the string 
-// 		if we have one ready.  
-char *Node::GetLocalFile(void) 
+// CJW: Return the rate (bytes per second) that we have been serving chunks 
+// 		to this node.  This includes the file that we are serving now.
+int Node::GetUploadRate(void)
 {
-	char *ptr = NULL;
+	long long nTime, nBytes;
+	int nRate = 0;
+	
+	Lock();
+	nTime = _Stats.nUploadMs;
+	nBytes = _Stats.nBytesOut;
+	if (_Upload.pFileInfo != NULL) {
+		nTime += GetTimeMs() - _Upload.nStart;
+	}
+	Unlock();
 	
-	if (_Data.pFileInfo == NULL && _Data.szFilename != NULL) {
-		ptr = _Data.szFilename;
-		_Data.szFilename = NULL;
+	if (nTime > 0) {
+		nRate = (int) ((nBytes * 1000) / nTime);
 	}
 	
-	return(ptr);
+	return(nRate);
 }
 
 
 //-----------------------------------------------------------------------------
-// CJW: The node asked if we have a localfile.  The network object looked up 
-// 		our file list and determined that we have this file (or maybe part of 
-// 		it).  We need to reply to the node that we have the file (and its 
-// 		length).  Then we need to mark the file as in use, and then wait for 
-// 		the chunck requests to come in.
-//
-// 		<--  A<flen><length*4><file*flen>
-void Node::SendFile(char *szLocalFile, FileInfo *pInfo)
+// CJW: Fill in a copy of what the node is doing, for the stats page.
+void Node::GetStats(strNodeStats *pStats)
 {
-	int nLength;
-	
-	pInfo->FileStart();
-	nLength = pInfo->GetLength();
-	TODO("Incomplete");
+	ASSERT(pStats != NULL);
+	
+	Lock();
+	pStats->nID = _nID;
+	pStats->nRtt = _Ping.nRtt;
+	pStats->bValid = _Status.bValid;
+	pStats->bRelay = (_Relay.nRemote & NODE_MODE_RELAY) ? true : false;
+	pStats->bDownloading = (_Data.szFilename != NULL);
+	pStats->bChunkPending = (_Data.nChunk > 0 && _Data.pData == NULL);
+	pStats->bUploading = (_Upload.pFileInfo != NULL);
+	pStats->nQueued = _Upload.nChunks;
+	pStats->nBytesOut = _Stats.nBytesOut;
+	Unlock();
+	
+	pStats->nUploadRate = GetUploadRate();
 }
 
 
@@ -944,6 +2035,7 @@ int Node::ProcessLocalOK(char *pData, int nLength)
 	
 	ASSERT(pData != NULL && nLength > 0);
 	ASSERT(pData[0] == 'A');
+	ASSERT(_Data.szFilename != NULL);
 	
 	if (nLength > 6) {
 		pTmp = (unsigned char *) &pData[1];
@@ -962,12 +2054,17 @@ int Node::ProcessLocalOK(char *pData, int nLength)
 			len += ((unsigned char) pData[4]) << 8;
 			len +=  (unsigned char) pData[5];
 
-			ASSERT(_Data.pFileInfo == NULL);
-			_Data.pFileInfo = new FileInfo;
-			ASSERT(_Data.pFileInfo != NULL);
-			
-			_Data.pFileInfo->SetFile(szFilename);
-			_Data.pFileInfo->SetLength(len);
+			// The Network object will pick up the length and use it to 
+			// start asking for chunks.
+			ASSERT(strcmp(szFilename, _Data.szFilename) == 0);
+			ASSERT(_Data.nLength == 0);
+			if (len > 0) {
+				_Data.nLength = len;
+			}
+			if (_Data.nTraceTime > 0) {
+				Tracer::Span(Tracer::NodeTrack(_nID), "L/A", _Data.nTraceTime, _Data.szFilename, "length", len);
+				_Data.nTraceTime = 0;
+			}
 		}
 	}
 		
@@ -1006,10 +2103,14 @@ int Node::ProcessLocalFail(char *pData, int nLength)
 			strncpy(szFilename, &pData[2], len);
 			szFilename[len] = '\0';
 			
-			// free the filename so that we know that we are not currently processing the file.
+			// mark the file as refused, the Network object will release it 
+			// and then we know that we are not currently processing the file.
 			ASSERT(strcmp(szFilename, _Data.szFilename) == 0);
-			free(_Data.szFilename);
-			_Data.szFilename = NULL;
+			_Data.bRefused = true;
+			if (_Data.nTraceTime > 0) {
+				Tracer::Span(Tracer::NodeTrack(_nID), "L/N", _Data.nTraceTime, _Data.szFilename, NULL, 0);
+				_Data.nTraceTime = 0;
+			}
 		}
 	}
 	
@@ -1022,7 +2123,11 @@ int Node::ProcessLocalFail(char *pData, int nLength)
 
 //-----------------------------------------------------------------------------
 // CJW:	The node is requesting a particular chunk.  For this to be valid, the 
-// 		'L' telegram must already have been received and accepted.
+// 		'L' telegram must already have been received and accepted.  We add the 
+// 		chunk to our list of requests, and the Network object will send it when 
+// 		it gets to it.  If the node asks for a chunk when we are not serving it 
+// 		a file, or asks for a chunk that isnt in the file, then the node is not 
+// 		following the protocol and we close the connection.
 //     -->  C<chunk*2>
 //     <--  D<chunk*2><len*2><data*len>
 int Node::ProcessChunkRequest(char *pData, int nLength)
@@ -1033,16 +2138,34 @@ int Node::ProcessChunkRequest(char *pData, int nLength)
 	ASSERT(pData != NULL && nLength > 0);
 	ASSERT(pData[0] == 'C');
 	
-	if (nLength >= 3 && _Data.nChunk == 0) {
+	if (nLength >= 3) {
 		nChunk = 0;
 		nChunk += ((unsigned char) pData[1]) << 8;
 		nChunk +=  (unsigned char) pData[2];
-		
-		_Data.nChunk = nChunk;
-		ASSERT(_Data.nSize == 0);
-		ASSERT(_Data.szFilename != NULL);
-		
 		nProcessed = 3;
+		
+		if (_Upload.pFileInfo == NULL) {
+			if (_Upload.szFilename == NULL) {
+				LOG_SYSTEM(LOG_NODE, "[Node:%d] Chunk %d requested, but no file has been accepted.", _nID, nChunk);
+				Close();
+				_Status.bClosed = true;
+			}
+			else {
+				// we havent replied to the 'L' yet, so leave it in the queue.
+				nProcessed = 0;
+			}
+		}
+		else if (nChunk <= 0 || nChunk > _Upload.pFileInfo->GetChunkCount()) {
+			LOG_SYSTEM(LOG_NODE, "[Node:%d] Invalid chunk %d requested for %s.", _nID, nChunk, _Upload.pFileInfo->GetFilename());
+			Close();
+			_Status.bClosed = true;
+		}
+		else {
+			_Upload.pChunks = (int *) realloc(_Upload.pChunks, sizeof(int) * (_Upload.nChunks + 1));
+			ASSERT(_Upload.pChunks != NULL);
+			_Upload.pChunks[_Upload.nChunks] = nChunk;
+			_Upload.nChunks++;
+		}
 	}
 	
 	ASSERT(nProcessed == 0 || nProcessed == 3);
@@ -1075,13 +2198,23 @@ int Node::ProcessChunkData(char *pData, int nLength)
 		nLen +=  (unsigned char) pData[4];
 		ASSERT(nLen > 0);
 		
-		ASSERT(_Data.szFilename != NULL);
-		ASSERT(_Data.pData == NULL);
-		ASSERT(nChunk == _Data.nChunk);
-		_Data.pData = (char *) malloc(nLen);
-		_Data.nSize = nLen;
+		// if all the data hasnt arrived yet, then we leave it in the queue 
+		// until it has.
+		if (nLength >= 5 + nLen) {
+			ASSERT(_Data.szFilename != NULL);
+			ASSERT(_Data.pData == NULL);
+			ASSERT(nChunk == _Data.nChunk);
+			_Data.pData = (char *) malloc(nLen);
+			ASSERT(_Data.pData != NULL);
+			memcpy(_Data.pData, &pData[5], nLen);
+			_Data.nSize = nLen;
+			if (_Data.nTraceTime > 0) {
+				Tracer::Span(Tracer::NodeTrack(_nID), "chunk", _Data.nTraceTime, _Data.szFilename, "chunk", nChunk);
+				_Data.nTraceTime = 0;
+			}
 		
-		nProcessed = 5 + nLen;
+			nProcessed = 5 + nLen;
+		}
 	}
 	
 	ASSERT(nProcessed == 0 || nProcessed > 5);
@@ -1090,36 +2223,516 @@ int Node::ProcessChunkData(char *pData, int nLength)
 
 
 //-----------------------------------------------------------------------------
-// CJW:	The node is indicating that the file is complete.
+// CJW:	The node is indicating that it has finished getting the file we were 
+// 		serving to it.  Any chunks it asked for that we havent sent yet are no 
+// 		longer needed.  The Network object will notice that the upload is 
+// 		complete and release the file.  If the node sends the K before we have 
+// 		answered its L (it got the file somewhere else), we leave the K in the 
+// 		queue until the Network object has looked up the file, otherwise the 
+// 		upload would never be released.
 //     -->  K
 int Node::ProcessFileComplete(char *pData, int nLength)
 {
+	int nProcessed = 0;
+	
 	ASSERT(pData != NULL && nLength > 0);
 	ASSERT(pData[0] == 'K');
 	
-	ASSERT(_Data.szFilename != NULL);
-	free(_Data.szFilename);
-	_Data.szFilename = NULL;
-	
-	if (_Data.pData != NULL) {
-		free(_Data.pData);
-		_Data.pData = NULL;
-		_Data.nChunk = 0;
-		_Data.nSize = 0;
+	if (_Upload.szFilename == NULL) {
+		if (_Upload.pFileInfo != NULL) {
+			_Upload.bComplete = true;
+			_Upload.nChunks = 0;
+		}
+		nProcessed = 1;
 	}
 	
-	return(1);
+	return(nProcessed);
 }
 
 
 
 //-----------------------------------------------------------------------------
-// CJW: This function will initiate the connection to a remote port.  It will 
-//		be called from an external thread most likely, so we dont want to do 
-//		the actual connecting here, that will be done in the thread function 
-//		itself.
+// CJW: This function will initiate the connection to a remote port.  We dont 
+//		want to block the network thread while the connection is being made, 
+//		so the socket is non-blocking, and we only start the connection here.  
+//		CheckConnect() will need to be called until it is established or it 
+//		fails.  Returns false if we couldnt even start the connection.
 bool Node::Connect(char *szHost, int nPort)
 {
+	bool bStarted = false;
+	bool bResolved = false;
+	struct sockaddr_in sin;
+	int nFlags;
+	
+	ASSERT(szHost != NULL && nPort > 0);
+	ASSERT(_Status.bAccepted == false);
+	ASSERT(_Status.bConnect == false);
+	ASSERT(_Connect.nSocket < 0);
+	ASSERT(_pRemoteNode == NULL);
+	
+	_Status.bConnect = true;
+	
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(nPort);
+	if (inet_aton(szHost, &sin.sin_addr) != 0) {
+		bResolved = true;
+	}
+	else if (Resolver::Lookup(szHost, &sin.sin_addr) == RESOLVE_OK) {
+		// Not an ip address, so it is looked up in the background.  If that 
+		// hasnt finished yet we cant start the connection, so the caller 
+		// should wait until the lookup isnt pending any more.
+		bResolved = true;
+	}
+	
+	if (bResolved == true) {
+		_Connect.nSocket = socket(AF_INET, SOCK_STREAM, 0);
+		if (_Connect.nSocket >= 0) {
+			nFlags = fcntl(_Connect.nSocket, F_GETFL, 0);
+			fcntl(_Connect.nSocket, F_SETFL, nFlags | O_NONBLOCK);
+			
+			if (connect(_Connect.nSocket, (struct sockaddr *) &sin, sizeof(sin)) == 0 || errno == EINPROGRESS) {
+				_Status.bConnecting = true;
+				_Connect.nStart = GetTimeMs();
+				
+				_pRemoteNode = new Address;
+				_pRemoteNode->Set(inet_ntoa(sin.sin_addr), nPort);
+				bStarted = true;
+			}
+			else {
+				close(_Connect.nSocket);
+				_Connect.nSocket = -1;
+			}
+		}
+	}
+	
+	return(bStarted);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Check to see if the connection that we started has been established.  
+//		We dont wait at all, we just look to see if the socket is writable yet.  
+//		If it is, then we check to see if the connection actually worked, and 
+//		if so, we hand the socket over to the socket class so that it can be 
+//		handled like any other node.  If the connection has taken longer than 
+//		nTimeout milliseconds, then we give up on it.
+int Node::CheckConnect(int nTimeout)
+{
+	int nResult = NODE_CONNECT_PENDING;
+	struct pollfd fds;
+	int nError, nFlags;
+	socklen_t nLen;
+	
+	ASSERT(nTimeout > 0);
+	ASSERT(_Status.bConnecting == true);
+	ASSERT(_Connect.nSocket >= 0);
+	
+	fds.fd = _Connect.nSocket;
+	fds.events = POLLOUT;
+	fds.revents = 0;
+	
+	if (poll(&fds, 1, 0) > 0) {
+		nError = 0;
+		nLen = sizeof(nError);
+		if (getsockopt(_Connect.nSocket, SOL_SOCKET, SO_ERROR, &nError, &nLen) == 0 && nError == 0) {
+			// the socket class expects a normal blocking socket.
+			nFlags = fcntl(_Connect.nSocket, F_GETFL, 0);
+			fcntl(_Connect.nSocket, F_SETFL, nFlags & ~O_NONBLOCK);
+			
+			_Status.bConnecting = false;
+			_Status.bConnected = true;
+			_nLastActivity = time(NULL);
+			_Heartbeat.nLastCheck = time(NULL);
+			
+			BaseClient::Accept(_Connect.nSocket);
+			_Connect.nSocket = -1;
+			nResult = NODE_CONNECT_OK;
+		}
+		else {
+			nResult = NODE_CONNECT_FAILED;
+		}
+	}
+	else if ((GetTimeMs() - _Connect.nStart) > nTimeout) {
+		nResult = NODE_CONNECT_FAILED;
+	}
+	
+	if (nResult == NODE_CONNECT_FAILED) {
+		close(_Connect.nSocket);
+		_Connect.nSocket = -1;
+		_Status.bConnecting = false;
+		_Status.bClosed = true;
+	}
+	
+	return(nResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if we are still waiting for an outgoing connection to be 
+//		established.  The node cant be used for anything until then.
+bool Node::IsConnecting(void)
+{
+	return(_Status.bConnecting);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: We dont need this connection anymore, even though it hasnt finished 
+//		connecting yet.  We close the socket and mark the node as closed so 
+//		that it will be removed from the list.
+void Node::CancelConnect(void)
+{
+	ASSERT(_Status.bConnecting == true);
+	ASSERT(_Connect.nSocket >= 0);
+	
+	close(_Connect.nSocket);
+	_Connect.nSocket = -1;
+	_Status.bConnecting = false;
+	_Status.bClosed = true;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the init handshake has been completed with the remote 
+//		node.  For a connection we made, this is when we receive the 'V'.  For 
+//		one that was made to us, it is when we accept their 'I'.
+bool Node::IsValid(void)
+{
+	bool bValid;
+	
+	Lock();
+	bValid = _Status.bValid;
+	Unlock();
+	
+	return(bValid);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Now that we have connected to the remote node, we need to tell it what 
+//		protocol version we are using, and what port we are listening on so 
+//		that it can tell other nodes about us.  It will reply with a 'V' if it 
+//		is happy with that.
+//
+//		--> I<ver><port*2>
+void Node::SendInit(void)
+{
+	unsigned char buffer[4];
+	
+	ASSERT(_Status.bConnected == true);
+	ASSERT(_Status.bInit == false);
+	ASSERT(_nLocalPort > 0);
+	
+	Lock();
+	buffer[0] = 'I';
+	buffer[1] = _Dht.nVersion;
+	buffer[2] = (_nLocalPort >> 8) & 0xff;
+	buffer[3] = _nLocalPort & 0xff;
+	Send((char *) buffer, 4);
+	_Status.bInit = true;
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The node needs to know the port that our Network object is listening 
+//		on, because it needs to tell other nodes about it.
+void Node::SetLocalPort(int nPort)
+{
+	ASSERT(nPort > 0);
+	_nLocalPort = nPort;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If we are connecting out to a server from our server list, we keep a 
+//		pointer to its entry, so that the Network can tell the list whether the 
+//		connection worked or not.  The list owns the entry, not us.
+void Node::SetServerEntry(ServerInfo *pInfo)
+{
+	ASSERT(pInfo != NULL);
+	ASSERT(_pServerEntry == NULL);
+	_pServerEntry = pInfo;
+}
+
+ServerInfo * Node::GetServerEntry(void)
+{
+	return(_pServerEntry);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the address that the remote node can be reached at.  This will 
+//		be NULL for incoming connections that havent sent an 'I' yet.  The 
+//		node still owns the object.
+Address * Node::GetRemoteAddress(void)
+{
+	return(_pRemoteNode);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the protocol version that we are talking with the node.
+int Node::GetVersion(void)
+{
+	return(_Dht.nVersion);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Ask the node to get a file for us from a holder that we cant connect 
+// 		to.  The node connects to the holder (or already is), and we then ask 
+// 		the node for the file with 'L' like normal.  It serves the chunks to 
+// 		us as they arrive from the holder.
+//
+// 		Msg... O<flen><file*flen><holder*6>
+void Node::RequestProxy(char *szFilename, unsigned char *pHolder)
+{
+	unsigned char buffer[263];
+	int nLen, i;
+	
+	ASSERT(szFilename != NULL && pHolder != NULL);
+	ASSERT(_Dht.nVersion >= 2);
+	
+	nLen = strlen(szFilename);
+	ASSERT(nLen > 0 && nLen < 255);
+	
+	i = 0;
+	buffer[i++] = 'O';
+	buffer[i++] = nLen;
+	memcpy(&buffer[i], szFilename, nLen);
+	i += nLen;
+	memcpy(&buffer[i], pHolder, 6);
+	i += 6;
+	
+	Send((char *) buffer, i);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The node wants us to get a file for it from a holder.  We keep the 
+// 		request until the Network object gets it, and leave any more in the 
+// 		queue until then.
+//
+//		-->  O<flen><file*flen><holder*6>
+int Node::ProcessProxy(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	unsigned char *pTmp;
+	int nFlen;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'O');
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength >= 2 && _pProxyRequest == NULL) {
+		pTmp = (unsigned char *) &pData[1];
+		nFlen = pTmp[0];
+		
+		if (nLength >= 2 + nFlen + 6) {
+			if (nFlen > 0) {
+				_pProxyRequest = new strProxyRequest;
+				memcpy(_pProxyRequest->szFile, &pTmp[1], nFlen);
+				_pProxyRequest->szFile[nFlen] = '\0';
+				_pProxyRequest->pHolder = new Address;
+				_pProxyRequest->pHolder->Set(&pTmp[1 + nFlen]);
+			}
+			nProcessed = 2 + nFlen + 6;
+		}
+	}
+	
+	return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If the node asked us to get a file for it, we would have stored the 
+// 		request.  We will return control of it to the caller.
+strProxyRequest * Node::GetProxyRequest(void)
+{
+	strProxyRequest *pReq;
+	
+	pReq = _pProxyRequest;
+	_pProxyRequest = NULL;
+	
+	return(pReq);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Ask the node for a content defined chunk, by its hash.  We dont ask 
+// 		for more than NODE_HASH_PIPELINE at a time.
+//
+// 		Msg... B<hash*32>
+void Node::RequestHash(unsigned char *pHash)
+{
+	unsigned char buffer[33];
+	
+	ASSERT(pHash != NULL);
+	ASSERT(_Hash.nPending >= 0 && _Hash.nPending < NODE_HASH_PIPELINE);
+	ASSERT(_Dht.nVersion >= 2);
+	
+	memcpy(_Hash.pAsked[_Hash.nPending].pHash, pHash, 32);
+	_Hash.pAsked[_Hash.nPending].bReceived = false;
+	_Hash.pAsked[_Hash.nPending].pData = NULL;
+	_Hash.pAsked[_Hash.nPending].nSize = 0;
+	_Hash.nPending++;
+	
+	buffer[0] = 'B';
+	memcpy(&buffer[1], pHash, 32);
+	Send((char *) buffer, 33);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the number of chunks that we are waiting for the node to send 
+// 		us, that we asked for by their hash.
+int Node::GetHashPending(void)
+{
+	ASSERT(_Hash.nPending >= 0 && _Hash.nPending <= NODE_HASH_PIPELINE);
+	return(_Hash.nPending);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: If the node has replied to a chunk we asked for by hash, we return 
+// 		true, and the data (which is NULL if the node didnt have it).  The 
+// 		caller needs to free the data.
+bool Node::GetHashData(unsigned char *pHash, char **pData, int *nSize)
+{
+	bool bGot = false;
+	int i;
+	
+	ASSERT(pHash != NULL && pData != NULL && nSize != NULL);
+	
+	for (i=0; i<_Hash.nPending && bGot == false; i++) {
+		if (_Hash.pAsked[i].bReceived == true) {
+			memcpy(pHash, _Hash.pAsked[i].pHash, 32);
+			*pData = _Hash.pAsked[i].pData;
+			*nSize = _Hash.pAsked[i].nSize;
+			
+			_Hash.nPending--;
+			if (i < _Hash.nPending) {
+				memmove(&_Hash.pAsked[i], &_Hash.pAsked[i+1], (_Hash.nPending - i) * sizeof(_Hash.pAsked[0]));
+			}
+			bGot = true;
+		}
+	}
+	
+	return(bGot);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The node has asked us for a chunk by its hash.  We keep it until the 
+// 		Network object gets it, and leave any more in the queue until then.
+//
+//		-->  B<hash*32>
+int Node::ProcessHashRequest(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'B');
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength >= 33 && _Hash.bRequest == false) {
+		memcpy(_Hash.pRequest, &pData[1], 32);
+		_Hash.bRequest = true;
+		nProcessed = 33;
+	}
+	
+	return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the node has asked us for a chunk by its hash.
+bool Node::GetHashRequest(unsigned char *pHash)
+{
+	bool bRequest;
+	
+	ASSERT(pHash != NULL);
+	
+	bRequest = _Hash.bRequest;
+	if (bRequest == true) {
+		memcpy(pHash, _Hash.pRequest, 32);
+		_Hash.bRequest = false;
+	}
+	
+	return(bRequest);
+}
+
 
+//-----------------------------------------------------------------------------
+// CJW: Send the chunk that the node asked for by hash.  If we dont have it, 
+// 		the size is 0 and there is no data.
+//
+// 		Msg... E<hash*32><len*2><data*len>
+void Node::SendHashData(unsigned char *pHash, char *pData, int nSize)
+{
+	static strMetric *pBytesOut = Metrics::Counter("pacsrv_node_chunk_bytes_out_total", "Bytes of chunk data sent to nodes.");
+	unsigned char tele[35];
+	
+	ASSERT(pHash != NULL);
+	ASSERT(nSize >= 0 && nSize <= 0xffff);
+	ASSERT(pData != NULL || nSize == 0);
+	
+	tele[0] = 'E';
+	memcpy(&tele[1], pHash, 32);
+	tele[33] = (unsigned char) ((nSize >> 8) & 0xff);
+	tele[34] = (unsigned char) (nSize & 0xff);
+	
+	Lock();
+	Send((char *) tele, 35);
+	if (nSize > 0) {
+		Send(pData, nSize);
+		_Stats.nBytesOut += nSize;
+	}
+	Unlock();
+	
+	Metrics::Add(pBytesOut, nSize);
 }
 
+
+//-----------------------------------------------------------------------------
+// CJW: The node has sent us a chunk that we asked for by hash.  If it isnt 
+// 		one that we asked for, we ignore it.
+//
+//		-->  E<hash*32><len*2><data*len>
+int Node::ProcessHashData(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	int nSize, i;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	ASSERT(pData[0] == 'E');
+	ASSERT(_Status.bClosed == false);
+	ASSERT(_Status.bValid == true);
+	
+	if (nLength >= 35) {
+		nSize = ((unsigned char) pData[33] << 8) + (unsigned char) pData[34];
+		if (nLength >= 35 + nSize) {
+			i = 0;
+			while (i < _Hash.nPending && (_Hash.pAsked[i].bReceived == true || memcmp(_Hash.pAsked[i].pHash, &pData[1], 32) != 0)) {
+				i++;
+			}
+			if (i < _Hash.nPending) {
+				ASSERT(_Hash.pAsked[i].pData == NULL);
+				if (nSize > 0) {
+					_Hash.pAsked[i].pData = (char *) malloc(nSize);
+					ASSERT(_Hash.pAsked[i].pData != NULL);
+					memcpy(_Hash.pAsked[i].pData, &pData[35], nSize);
+				}
+				_Hash.pAsked[i].nSize = nSize;
+				_Hash.pAsked[i].bReceived = true;
+			}
+			nProcessed = 35 + nSize;
+		}
+	}
+	
+	return(nProcessed);
+}
@@ -49,9 +49,32 @@
 #include "baseclient.h"
 #include "address.h"
 #include "fileinfo.h"
+#include "serverinfo.h"
+#include "dht.h"
+
+
+//-----------------------------------------------------------------------------
+// Results from Node::CheckConnect() while an outgoing connection is being 
+// established.
+#define NODE_CONNECT_PENDING	0
+#define NODE_CONNECT_OK			1
+#define NODE_CONNECT_FAILED		2
+
+//-----------------------------------------------------------------------------
+// Flags in the 'M' telegram that a version 2 node sends to say what it is.  A 
+// relay takes lots of leaf connections, and answers for the files its leaves 
+// have.  Any other version 2 node is a leaf to the relays it is connected to.
+#define NODE_MODE_RELAY			0x01
+#define NODE_MODE_LEAF			0x02
+
+//-----------------------------------------------------------------------------
+// The number of chunks that we ask a node for by hash before it has replied 
+// to the first one.  The node answers them in the order they were asked.
+#define NODE_HASH_PIPELINE		4
 
 
 struct strFileRequest {
+	bool bDht;			// a DHT lookup ('U'), rather than a flooded request.
 	unsigned char nHops;
 	unsigned char nTtl;
 	unsigned char nFlen;
@@ -59,6 +82,7 @@ struct strFileRequest {
 	Address **pHosts;
 	
 	strFileRequest() {
+		bDht = false;
 		nHops = 0;
 		nTtl = 0;
 		nFlen = 0;
@@ -117,6 +141,64 @@ struct strFileReply {
 
 
 
+// A node has published that it has a file, and the record is being routed 
+// towards the node that should keep it.
+struct strDhtStore {
+	unsigned char nTtl;
+	unsigned char nFlen;
+	char szFile[256];
+	Address *pHolder;
+	
+	strDhtStore() {
+		nTtl = 0;
+		nFlen = 0;
+		szFile[0] = '\0';
+		pHolder = NULL;
+	}
+	
+	virtual ~strDhtStore() {
+		if (pHolder != NULL) {
+			delete pHolder; pHolder = NULL;
+		}
+	}
+};
+
+
+// A node has asked us to get a file from a holder that it cant connect to 
+// itself, so that it can get the chunks from us as they arrive.
+struct strProxyRequest {
+	char szFile[256];
+	Address *pHolder;
+	
+	strProxyRequest() {
+		szFile[0] = '\0';
+		pHolder = NULL;
+	}
+	
+	virtual ~strProxyRequest() {
+		if (pHolder != NULL) {
+			delete pHolder; pHolder = NULL;
+		}
+	}
+};
+
+
+// A copy of what a node is doing, so that it can be shown on the stats 
+// page without keeping the network locked while the page is written.
+struct strNodeStats {
+	int nID;
+	int nRtt;				// smoothed round trip time (ms), 0 if not known.
+	bool bValid;
+	bool bRelay;
+	bool bDownloading;		// we are getting a file from the node.
+	bool bChunkPending;		// and are waiting for a chunk.
+	bool bUploading;		// the node is getting a file from us.
+	int nQueued;			// chunks it has asked for that we havent sent.
+	long long nBytesOut;	// chunk data we have sent it.
+	int nUploadRate;		// bytes per second.
+};
+
+
 class Node : public BaseClient
 {
     public:
@@ -135,12 +217,18 @@ class Node : public BaseClient
     
         bool GetChunks(char **szFilename, char **pData, int *nChunk, int *nSize);
         void GetCurrentFile(char **szFilename);
+        bool GetFileLength(int *nLength);
+        bool IsChunkPending(void);
+        bool IsFileRefused(void);
+        bool HasRefused(char *szFilename);
+        void ClearRefused(char *szFilename);
         void FileComplete(void);
+        void RejectFile(void);
     
         void RequestChunk(int nChunk);
         bool ReadyForFile(void);
         void RequestFile(char *szFilename);
-		void RequestFileFromNetwork(char *szFilename);
+		void RequestFileFromNetwork(char *szFilename, int nTtl);
 		
 		void ReplyFileFound(strFileRequest *pReq, FileInfo *pInfo);
     
@@ -151,10 +239,57 @@ class Node : public BaseClient
 		void SendMsg(char *ptr, int len);
 		
 		char *GetLocalFile(void);
+		void HoldLocalFile(char *szLocalFile);
 		void SendFile(char *szLocalFile, FileInfo *pInfo);
 		void LocalFileFail(char *szLocalFile);
+		FileInfo * GetUploadFile(void);
+		bool GetChunkRequest(int *nChunk);
+		void SendChunk(int nChunk, char *pData, int nSize);
+		FileInfo * GetUploadDone(void);
+		FileInfo * ReleaseUpload(void);
+		int GetUploadRate(void);
+		void GetStats(strNodeStats *pStats);
 		
 		bool Connect(char *szHost, int nPort);
+		int CheckConnect(int nTimeout);
+		bool IsConnecting(void);
+		void CancelConnect(void);
+		bool IsValid(void);
+		void SendInit(void);
+		void SetLocalPort(int nPort);
+		void SetServerEntry(ServerInfo *pInfo);
+		ServerInfo * GetServerEntry(void);
+		Address * GetRemoteAddress(void);
+		int GetRtt(void);
+		
+		void SetDhtId(unsigned int nId);
+		bool HasDht(void);
+		unsigned int GetDhtId(void);
+		void RequestFileFromDht(char *szFilename, int nTtl);
+		void PublishFile(char *szFilename, int nTtl);
+		void ReplyFileHolder(strFileRequest *pReq, unsigned char *pHolder);
+		strDhtStore * GetDhtStore(void);
+		bool IsNewDht(void);
+		void SendDhtContacts(unsigned int *pIds, unsigned char *pAddresses, int nCount);
+		strDhtContact * GetDhtContacts(void);
+		
+		void SetRelay(bool bRelay);
+		void SetLeaf(bool bLeaf);
+		bool IsRelay(void);
+		bool IsLeaf(void);
+		bool IsNewRelay(void);
+		void SendHave(char *szFilename);
+		char * GetHave(void);
+		
+		int GetVersion(void);
+		void RequestProxy(char *szFilename, unsigned char *pHolder);
+		strProxyRequest * GetProxyRequest(void);
+		
+		void RequestHash(unsigned char *pHash);
+		int GetHashPending(void);
+		bool GetHashData(unsigned char *pHash, char **pData, int *nSize);
+		bool GetHashRequest(unsigned char *pHash);
+		void SendHashData(unsigned char *pHash, char *pData, int nSize);
     
     protected:
     
@@ -179,8 +314,19 @@ class Node : public BaseClient
         int ProcessChunkRequest(char *pData, int nLength);
         int ProcessChunkData(char *pData, int nLength);
         int ProcessFileComplete(char *pData, int nLength);
+        int ProcessDhtId(char *pData, int nLength);
+        int ProcessDhtStore(char *pData, int nLength);
+        int ProcessDhtContacts(char *pData, int nLength);
+        void SendDhtId(void);
+        void SendMode(void);
+        int ProcessMode(char *pData, int nLength);
+        int ProcessHave(char *pData, int nLength);
+        int ProcessProxy(char *pData, int nLength);
+        int ProcessHashRequest(char *pData, int nLength);
+        int ProcessHashData(char *pData, int nLength);
 
         void ProcessHeartbeat(void);
+        void TraceSent(void);
 
         Node *_pNext;
         int _nID;
@@ -201,22 +347,96 @@ class Node : public BaseClient
 			char *pData;
 			int nChunk;
 			int nSize;
-			FileInfo *pFileInfo;
+			int nLength;		// length of the file, from the 'A' reply.
+			bool bRefused;		// node replied with 'N'.
+			char *szRefused;	// last file the node didnt have.
+			long long nTraceTime;	// when the 'L' or 'C' was sent (Tracer::Now), 0 if not tracing.
 		} _Data;
 		
+		// When the remote node is downloading a file from us, we keep track of 
+		// it here.  This is seperate from _Data, because the remote node can 
+		// be getting a file from us at the same time that we are getting a 
+		// file from it.
+		struct {
+			char *szFilename;		// file asked for with 'L', waiting for the Network to look it up.
+			FileInfo *pFileInfo;	// file we are serving chunks from.
+			int *pChunks;			// chunks that have been asked for, but not sent yet.
+			int nChunks;
+			bool bComplete;			// 'K' has been received.
+			long long nStart;		// time (ms) that we started serving the file.
+			int nBytes;				// number of bytes of this file we have sent.
+		} _Upload;
+		
+		struct {
+			long long nBytesOut;	// total bytes of chunk data sent to this node.
+			long long nUploadMs;	// total time (ms) spent serving files to this node.
+		} _Stats;
+		
 		struct {
 			int nBeats;     // number of beats we have missed.
 			int nDelay;     // number of seconds before we indicate that we have missed a beat.
 			time_t nLastCheck;
 		} _Heartbeat;
 		
+		// We time how long it takes to get a reply to each ping, and keep a 
+		// smoothed round trip time for the connection.
+		struct {
+			long long nSent;	// time (ms) the outstanding ping was sent, 0 if none.
+			int nRtt;			// smoothed round trip time (ms), 0 if not known yet.
+		} _Ping;
+		
+		// When we are connecting out to another node, the socket is 
+		// non-blocking and is kept here until the connection is established, 
+		// then it is handed over to the socket class.
+		struct {
+			int nSocket;
+			long long nStart;		// time (ms) that the connect was started.
+		} _Connect;
+		
+		ServerInfo *_pServerEntry;	// entry in the server list that we connected out to.  Not owned by us.
+		int _nLocalPort;			// port that our Network object is listening on.
+		
 		struct strFileRequest *_pFileRequest;
 		struct strFileReply *_pFileReply;
+		struct strDhtStore *_pDhtStore;
+		struct strProxyRequest *_pProxyRequest;
+		
+		// The DHT id of each end of the connection.  We only send DHT 
+		// telegrams to nodes that have told us their id.
+		struct {
+			unsigned int nLocal;	// our id, 0 if we arent in the DHT.
+			unsigned int nRemote;
+			bool bRemote;			// the node has sent its id.
+			bool bNew;				// the node has just sent its id.
+			strDhtContact *pContacts;	// nodes it has told us about.
+			int nVersion;			// protocol version we are talking with the node.
+		} _Dht;
+		
+		struct {
+			bool bLocal;			// we are a relay.
+			bool bLeaf;				// we are a leaf of our relays.
+			int nRemote;			// NODE_MODE_ flags that the node sent.
+			bool bNew;				// the node has just told us it is a relay.
+			char *szHave;			// file a leaf has told us it has.
+		} _Relay;
+		
+		// Content defined chunks are asked for by their hash, separately 
+		// from the file we are getting.  We can have a few asked at once, 
+		// but the node's requests are taken one at a time.
+		struct {
+			int nPending;			// chunks we have asked the node for.
+			struct {
+				unsigned char pHash[32];
+				bool bReceived;		// the node has replied.
+				char *pData;		// NULL if the node didnt have it.
+				int nSize;
+			} pAsked[NODE_HASH_PIPELINE];
+			bool bRequest;			// the node has asked us for a chunk.
+			unsigned char pRequest[32];
+		} _Hash;
 		
 		Address *_pServerInfo;
 		Address *_pRemoteNode;
-		
-		char *_szLocalFile;
 };
 
 
@@ -12,6 +12,11 @@
 //		network), then we will get the file directly from the URL that is 
 //		given.
 //
+//		It can also be given a directory and a list of URLs (with -m), in 
+//		which case it will get all of the files at the same time over the one 
+//		connection to the daemon, and put them in the directory.  Any that 
+//		the network cant give us are got from their URLs.
+//
 //		This client application is supposed to be single threaded.  It is a 
 //		linear tool that does one thing and then exits.  That one thing is to 
 //		download a particular file (either from the pacsrv network or from the 
@@ -66,6 +71,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <DpMain.h>
 #include <DpSocketEx.h>
@@ -82,6 +91,10 @@
 // Number of seconds we will wait for a file from the network.
 #define HEARTBEAT_WAIT		30	
 
+// Number of seconds we will wait for more of a file once we know how big it 
+// is, before we give up and get it from the mirror instead.
+#define STALL_WAIT			60
+
 #define WIDTH_FILENAME		31
 #define WIDTH_BAR			20
 
@@ -95,16 +108,37 @@
 #define LOOP_LOOPS	10	
 
 
+// The state of each file that we are getting from the daemon.  Each one is a 
+// stream on the same connection, and the stream id is its index in the list.
+struct strStream {
+	char *szFile;		// the .part file that we write to.
+	char *szUrl;		// URL we can get the file from if the network cant.
+	char *szFilename;	// Filename that we are going to query the network with.
+	int fd;				// file descriptor that we will write the file with.
+	int nSize;			// full size of the file we are getting from the network.
+	int nDone;			// number of bytes we have written.
+	int nCredit;		// number of parts written that we havent told the daemon about.
+	bool bLength;		// true if we have received file length info.
+	bool bComplete;		// true if the file is completed.
+	bool bFailed;		// true if the network couldnt give us the file.
+	time_t tLast;		// when we last got the length or some of the file.
+};
+
+
 class Client : public DpSocketEx
 {
 	public:
 	protected:
 	private:
-		char *_szFile;			// File parameter that is supplied.
-		char *_szUrl;			// URL parameter that is supplied.
+		char *_szDir;			// directory to put the files in (multi mode).
 		char *_szServer;		// address (ip or name) of the daemon we need to talk to.
 		int   _nPort;			// port the daemon is listening on.
 		
+		struct {
+			strStream *pList;
+			int nCount;
+		} _Streams;
+		
 		struct {
 			int nFileSize;
 			int nDone;
@@ -122,20 +156,8 @@ class Client : public DpSocketEx
 		struct {
 			bool bStop;			// true if we should stop looping.
 			bool bInit;			// true if INIT has been sent.
-			bool bRequest;		// true if FILE REQUEST has been sent.
-			bool bFileLength;	// true if we have received file length info.
-			bool bComplete;		// true if the file is completed.
+			bool bRequest;		// true if FILE REQUESTs have been sent.
 		} _Status;
-		
-		struct {
-			char *szFilename;	// Filename that we are going to query the network with.
-			FILE *fp;			// file pointer that we will write the file with.
-			int nSize;			// full size of the file we are getting from the network.
-			struct {
-				int nCount;
-				int nSize;
-			} chunk, temp;
-		} _File;
 
 		
 		
@@ -144,10 +166,12 @@ class Client : public DpSocketEx
 		// CJW: Constructor.  Initialise our variables here.
 		Client() 
 		{
-			_szFile = NULL;
-			_szUrl = NULL;
+			_szDir = NULL;
 			_szServer = NULL;
 			
+			_Streams.pList = NULL;
+			_Streams.nCount = 0;
+			
 			_Stats.nFileSize = 0;
 			_Stats.nDone = 0;
 			_Stats.nStart = 0;
@@ -159,13 +183,6 @@ class Client : public DpSocketEx
 			_Status.bInit       = false;
 			_Status.bRequest    = false;
 			_Status.bStop       = false;
-			_Status.bFileLength = false;
-			
-			_File.szFilename = NULL;
-			_File.fp = NULL;
-			_File.nSize = 0;
-			_File.chunk.nCount = 0;
-			_File.chunk.nSize = 0;
 		}
 		
 		//---------------------------------------------------------------------
@@ -177,9 +194,23 @@ class Client : public DpSocketEx
 				_szServer = NULL; 
 			}
 			
-			if (_File.szFilename != NULL) {
-				free(_File.szFilename);
-				_File.szFilename = NULL;
+			while (_Streams.nCount > 0) {
+				_Streams.nCount--;
+				if (_Streams.pList[_Streams.nCount].fd >= 0) {
+					close(_Streams.pList[_Streams.nCount].fd);
+				}
+				if (_Streams.pList[_Streams.nCount].szFilename != NULL) {
+					free(_Streams.pList[_Streams.nCount].szFilename);
+				}
+				if (_szDir != NULL) {
+					// in multi mode we built the part filename ourselves.
+					free(_Streams.pList[_Streams.nCount].szFile);
+				}
+			}
+			
+			if (_Streams.pList != NULL) {
+				free(_Streams.pList);
+				_Streams.pList = NULL;
 			}
 		}
 		
@@ -188,35 +219,86 @@ class Client : public DpSocketEx
 		// 		parameters couldnt be parsed because there wasnt enough, or 
 		// 		there was too many, then we will return 0 and the application 
 		// 		should exit.
+		//
+		//		pacsrvclient <file.part> <url>
+		//		pacsrvclient -m <dir> <url> [<url>...]
+		//
+		//		The first form is how pacman calls us, with one file at a 
+		//		time.  The second form will get all the files at once over the 
+		//		same connection to the daemon, and put them in the directory.
 		bool ParseArgs(int argc, char **argv)
 		{
 			bool bValid = false;
+			char *szBase;
+			int i;
 	
-			ASSERT(_szFile == NULL && _szUrl == NULL);
+			ASSERT(_Streams.pList == NULL && _Streams.nCount == 0);
 			
-			if (argc == 3) {
-				_szFile = argv[1];
-				_szUrl = argv[2];
+			if (argc == 3 && strcmp(argv[1], "-m") != 0) {
+				AddStream(argv[1], argv[2]);
 		
-				if (strlen(_szFile) > WIDTH_FILENAME) {
-					strncpy(_Display.szFileDisplay, _szFile, (WIDTH_FILENAME - 3));
+				if (strlen(argv[1]) > WIDTH_FILENAME) {
+					strncpy(_Display.szFileDisplay, argv[1], (WIDTH_FILENAME - 3));
 					_Display.szFileDisplay[WIDTH_FILENAME-3] = '.';
 					_Display.szFileDisplay[WIDTH_FILENAME-2] = '.';
 					_Display.szFileDisplay[WIDTH_FILENAME-1] = '.';
 					_Display.szFileDisplay[WIDTH_FILENAME] = '\0';
 				}
 				else {
-					strncpy(_Display.szFileDisplay, _szFile, WIDTH_FILENAME);
+					strncpy(_Display.szFileDisplay, argv[1], WIDTH_FILENAME);
+					_Display.szFileDisplay[WIDTH_FILENAME] = '\0';
 				}
-				
-				if (_szFile != NULL && _szUrl != NULL) {
-					bValid = true;
+				bValid = true;
+			}
+			else if (argc >= 4 && strcmp(argv[1], "-m") == 0 && (argc - 3) <= CLIENT_MAX_STREAMS) {
+				_szDir = argv[2];
+				bValid = true;
+				for (i=3; i<argc && bValid == true; i++) {
+					szBase = strrchr(argv[i], '/');
+					if (szBase == NULL) { szBase = argv[i]; }
+					else { szBase++; }
+					
+					if (szBase[0] == '\0') {
+						bValid = false;
+					}
+					else {
+						AddStream(NULL, argv[i]);
+						_Streams.pList[_Streams.nCount-1].szFile = (char *) malloc(strlen(_szDir) + strlen(szBase) + 7);
+						ASSERT(_Streams.pList[_Streams.nCount-1].szFile != NULL);
+						sprintf(_Streams.pList[_Streams.nCount-1].szFile, "%s/%s.part", _szDir, szBase);
+					}
 				}
 			}
 			
 			return(bValid);
 		}
 		
+		//---------------------------------------------------------------------
+		// CJW: Add a file to our list of streams.  
+		void AddStream(char *szFile, char *szUrl)
+		{
+			strStream *pStream;
+			
+			ASSERT(szUrl != NULL);
+			
+			_Streams.pList = (strStream *) realloc(_Streams.pList, sizeof(strStream) * (_Streams.nCount + 1));
+			ASSERT(_Streams.pList != NULL);
+			pStream = &_Streams.pList[_Streams.nCount];
+			_Streams.nCount++;
+			
+			pStream->szFile = szFile;
+			pStream->szUrl = szUrl;
+			pStream->szFilename = NULL;
+			pStream->fd = -1;
+			pStream->nSize = 0;
+			pStream->nDone = 0;
+			pStream->nCredit = 0;
+			pStream->bLength = false;
+			pStream->bComplete = false;
+			pStream->bFailed = false;
+			pStream->tLast = 0;
+		}
+		
 		//---------------------------------------------------------------------
 		// CJW: Load the config information.  If we cannot load the file, or 
 		// 		the values are not valid, then we will return false.  Otherwise 
@@ -250,20 +332,31 @@ class Client : public DpSocketEx
 		// CJW: This function will display a status line to the screen.  We 
 		// 		will update this probably every second before we do the sleep.  
 		// 		Although, if we keep processing data from the server, we may
-		//		need to display this more often also.
+		//		need to display this more often also.  When we are getting 
+		//		more than one file, we show the progress of all of them 
+		//		together, and the size will grow as we find out how big each 
+		//		one is.
 		void DisplayStatus(void)
 		{
 			char szBar[WIDTH_BAR + 1];
 			int nPercent;
-			int i, j;
+			int i, j, nDone;
 			int nRate, nRateLo;
 			time_t nTime;
 			int nSeconds;
 			
-			ASSERT(_Display.szFileDisplay != NULL);
-			ASSERT(_Display.szFileDisplay[0] != '\0');
 			ASSERT(_Stats.nFileSize > 0);
 			
+			if (_Streams.nCount > 1) {
+				nDone = 0;
+				for (i=0; i<_Streams.nCount; i++) {
+					if (_Streams.pList[i].bComplete == true) { nDone++; }
+				}
+				snprintf(_Display.szFileDisplay, WIDTH_FILENAME + 1, "%d of %d files", nDone, _Streams.nCount);
+				_Display.nFileSize = 0;
+			}
+			ASSERT(_Display.szFileDisplay[0] != '\0');
+			
 			if (_Display.nFileSize == 0) {
 			
 				_Display.nFileSize = _Stats.nFileSize;
@@ -295,7 +388,7 @@ class Client : public DpSocketEx
 			ASSERT(_Display.cSizeInd != 'x');
 			
 			
-			nPercent = (_Stats.nDone / (_Stats.nFileSize / 100));
+			nPercent = (int) (((long long) _Stats.nDone * 100) / _Stats.nFileSize);
 			j = nPercent / (100/WIDTH_BAR);
 			for(i=0; i<WIDTH_BAR; i++) {
 				if (i<=j) {
@@ -327,18 +420,23 @@ class Client : public DpSocketEx
 		}
 
 		//---------------------------------------------------------------------
-		// CJW: Download the file.  If we cant, then we try and get it by 
-		// 		downloading the url.  This means that we will try to connect to 
-		// 		the daemon.  If the daemon has the file, we will get it from 
-		// 		there.  If it doesnt, or we couldnt connect to it, then we will 
-		// 		download the file from the URL instead.
+		// CJW: Download the files.  If we cant, then we try and get them by 
+		// 		downloading the urls.  This means that we will try to connect 
+		// 		to the daemon.  If the daemon has the files, we will get them 
+		// 		from there.  If it doesnt, or we couldnt connect to it, then we 
+		// 		will download the files that we didnt get from the URL instead.
 		bool Download(void)
 		{
 			bool bGotIt = false;
 			
 			if (DownloadNetwork() == false) {
 				fprintf(stderr, "File couldnt be found on the network, getting from mirror now.\n");
-				bGotIt = DownloadUrl();
+				if (_szDir == NULL) {
+					bGotIt = DownloadUrl();
+				}
+				else {
+					bGotIt = DownloadUrls();
+				}
 			}
 			else {
 				bGotIt = true;
@@ -349,23 +447,35 @@ class Client : public DpSocketEx
 		
 		
 		//---------------------------------------------------------------------
-		// CJW: Download the file from the network.  We need to connect to the 
-		// 		daemon, and request the file.  If we cannot connect to the 
-		// 		daemon, or if the file is not on the network, then we will 
-		// 		return a false.
+		// CJW: Download the files from the network.  We need to connect to 
+		// 		the daemon, and request the files.  If we cannot connect to 
+		// 		the daemon, or if any of the files is not on the network, then 
+		// 		we will return a false.
 		bool DownloadNetwork(void)
 		{
-			bool bGotIt = false;
-			int nLoops;
+			bool bGotIt = true;
+			int nLoops, nValid, i;
 			
 			ASSERT(_szServer != NULL);
 			ASSERT(_nPort > 0);
-			ASSERT(_szFile != NULL);
+			ASSERT(_Streams.nCount > 0);
 			
-			printf("Preparing Filename\n");
-			// Prepare the filename, removing the ".part" bit.
-			if (PrepareFilename() == true) {
-				printf("Prepared.\n");
+			// Prepare the filenames, removing the ".part" bit.  The ones we 
+			// cant ask the daemon for will be got from the mirror instead.
+			nValid = 0;
+			for (i=0; i<_Streams.nCount; i++) {
+				if (PrepareFilename(&_Streams.pList[i]) == true) {
+					nValid++;
+				}
+				else {
+					_Streams.pList[i].bFailed = true;
+				}
+			}
+			
+			if (nValid == 0) {
+				fprintf(stderr, "Unable to prepare filename\n");
+			}
+			else {
 			
 				// connect to the local server daemon.
 				if (Connect(_szServer, _nPort) == false) {
@@ -393,7 +503,9 @@ class Client : public DpSocketEx
 					Lock();
 					while(_Status.bStop == false) {
 						if (nLoops >= LOOP_LOOPS) { 
-							DisplayStatus(); 
+							if (_Stats.nFileSize > 0) {
+								DisplayStatus(); 
+							}
 							nLoops = 0; 
 						}
 						Unlock();
@@ -403,20 +515,19 @@ class Client : public DpSocketEx
 					}
 					Unlock();
 				}			
-				
-			}
-			else {
-				fprintf(stderr, "Unable to prepare filename\n");
 			}
 			
 			Lock();
-			if (_File.fp != NULL) {
-				fclose(_File.fp);
-				_File.fp = NULL;
-			}
-			
-			if (_Status.bComplete == true) {
-				bGotIt = true;
+			for (i=0; i<_Streams.nCount; i++) {
+				if (_Streams.pList[i].fd >= 0) {
+					close(_Streams.pList[i].fd);
+					_Streams.pList[i].fd = -1;
+				}
+				
+				if (_Streams.pList[i].bComplete == false) {
+					_Streams.pList[i].bFailed = true;
+					bGotIt = false;
+				}
 			}
 			Unlock();
 			
@@ -430,21 +541,29 @@ class Client : public DpSocketEx
 		// 		probably has ".part" at the end of it.  Also, if the file isnt 
 		// 		a .pkg.tar.gz file, then we dont want to request the daemon for 
 		// 		it.  
-		bool PrepareFilename(void)
+		bool PrepareFilename(strStream *pStream)
 		{
 			int nLength;
 			bool bValid = false;
+			char *szBase;
+			
+			ASSERT(pStream != NULL);
+			ASSERT(pStream->szFile != NULL);
+			ASSERT(pStream->szFilename == NULL);
 			
-			ASSERT(_szFile != NULL);
-			ASSERT(_File.szFilename == NULL);
+			// in multi mode the .part file has the directory in front of it, 
+			// but the network only knows the file by its name.
+			szBase = strrchr(pStream->szFile, '/');
+			if (szBase != NULL) { szBase++; }
+			else { szBase = pStream->szFile; }
 			
-			nLength = strlen(_szFile);
-			if (nLength > 16) {
-				if (strncmp(&_szFile[nLength - 16], ".pkg.tar.gz.part", 16) == 0) {
-					_File.szFilename = (char *) malloc((nLength - 16)+1);
-					ASSERT(_File.szFilename);
-					strncpy(_File.szFilename, _szFile, nLength - 5);
-					_File.szFilename[nLength-5] = '\0';
+			nLength = strlen(szBase);
+			if (nLength > 16 && nLength < 256 + 5) {
+				if (strncmp(&szBase[nLength - 16], ".pkg.tar.gz.part", 16) == 0) {
+					pStream->szFilename = (char *) malloc((nLength - 5)+1);
+					ASSERT(pStream->szFilename);
+					strncpy(pStream->szFilename, szBase, nLength - 5);
+					pStream->szFilename[nLength-5] = '\0';
 					bValid = true;
 				}
 			}
@@ -490,7 +609,7 @@ class Client : public DpSocketEx
 			// Now we need to actually check the contents of our received data. 
 			switch(pData[0]) {
 				case 'V':
-					SendFileRequest();
+					SendFileRequests();
 					nDone = 1;
 					break;
 				
@@ -500,24 +619,31 @@ class Client : public DpSocketEx
 					break;
 									
 				case 'L':
-					if (nLength >= 5) {
+					if (nLength >= 7) {
 						ProcessFileLength(pData, nLength);
-						nDone = 5;
+						nDone = 7;
 					}
 					break;
 									
-				case 'C':
-					if (nLength > 5) {
-						nTmp = ProcessChunk(pData, nLength);
+				case 'P':
+					if (nLength > 9) {
+						nTmp = ProcessPart(pData, nLength);
 						if (nTmp > 0) {
-							nDone = 5 + nTmp;
+							nDone = 9 + nTmp;
 						}
-						ASSERT((nTmp == 0 && nDone == 0) || (nTmp > 0 && nDone > 5))
+						ASSERT((nTmp == 0 && nDone == 0) || (nTmp > 0 && nDone > 9))
 					}
 					break;
 									
-				case 'Q':
 				case 'X':
+				case 'N':
+					if (nLength >= 3) {
+						ProcessRefused(pData, nLength);
+						nDone = 3;
+					}
+					break;
+									
+				case 'Q':
 				default:
 					_Status.bStop = true;
 					nDone = 1;
@@ -539,7 +665,12 @@ class Client : public DpSocketEx
 		// 		then change the status to indicate that we've sent it.
 		void SendInit(void)
 		{
-			Send("I\000\000", 3);
+			char buffer[3];
+			
+			buffer[0] = 'I';
+			buffer[1] = (CLIENT_PROTOCOL_VER >> 8) & 0xff;
+			buffer[2] = CLIENT_PROTOCOL_VER & 0xff;
+			Send(buffer, 3);
 			Lock();
 			_Status.bInit = true;
 			Unlock();
@@ -547,30 +678,66 @@ class Client : public DpSocketEx
 		
 		
 		//---------------------------------------------------------------------
-		// CJW: Queue the File request message that we need to send to the 
-		// 		daemon.  We then change the status to indicate that we've sent 
-		// 		it.
-		void SendFileRequest(void) 
+		// CJW: Queue the File request messages for all the files we want.  
+		// 		Each file gets its own stream, so the daemon can send us all 
+		// 		of them at the same time.
+		//
+		//		<-- F<stream*2><flen><file>
+		//		<-- U<stream*2><ulen*2><url>
+		//
+		//		We also tell the daemon the url of each file, so that it can 
+		//		get parts of it from the mirror while it searches the network.
+		void SendFileRequests(void) 
 		{
-			int nLength;
-			unsigned char ch;
+			char buffer[5];
+			int nLength, i;
 			
 			Lock();
-			ASSERT(_File.szFilename != NULL);
-			nLength = strlen(_File.szFilename);
-			ASSERT(nLength < 256);
-			
-			ch = (unsigned char) nLength;
-			
-			// *** to improve performance a little bit, we should put all this data into a buffer and then send once.
-			Send("F", 1);
-			Send((char *) &ch, 1);
-			Send(_File.szFilename, nLength);
+			for (i=0; i<_Streams.nCount; i++) {
+				if (_Streams.pList[i].bFailed == false) {
+					ASSERT(_Streams.pList[i].szFilename != NULL);
+					nLength = strlen(_Streams.pList[i].szFilename);
+					ASSERT(nLength > 0 && nLength < 256);
+					
+					buffer[0] = 'F';
+					buffer[1] = (char) ((i >> 8) & 0xff);
+					buffer[2] = (char) (i & 0xff);
+					buffer[3] = (char) nLength;
+					Send(buffer, 4);
+					Send(_Streams.pList[i].szFilename, nLength);
+					
+					nLength = strlen(_Streams.pList[i].szUrl);
+					if (nLength > 0 && nLength <= 0xffff) {
+						buffer[0] = 'U';
+						buffer[3] = (char) ((nLength >> 8) & 0xff);
+						buffer[4] = (char) (nLength & 0xff);
+						Send(buffer, 5);
+						Send(_Streams.pList[i].szUrl, nLength);
+					}
+				}
+			}
 			
 			_Status.bRequest = true;
 			Unlock();
 		}
 		
+		//---------------------------------------------------------------------
+		// CJW: Tell the daemon that we dont want anything more for this 
+		// 		stream.  Either we have it all, or we have given up on it.
+		//
+		//		<-- E<stream*2>
+		void SendStreamEnd(int nStream)
+		{
+			char buffer[3];
+			
+			ASSERT(nStream >= 0 && nStream < _Streams.nCount);
+			
+			buffer[0] = 'E';
+			buffer[1] = (char) ((nStream >> 8) & 0xff);
+			buffer[2] = (char) (nStream & 0xff);
+			Send(buffer, 3);
+		}
+		
 		//---------------------------------------------------------------------
 		// CJW: We check to see if we have moved to the next second, and if so, 
 		// 		we process our heartbeat stuff.  Every 5 seconds, we need to 
@@ -579,25 +746,61 @@ class Client : public DpSocketEx
 		// 		communications with the daemon.
 		//
 		//		We also want to increment the counter that keeps track of how 
-		//		long we have waited for a responce to a file request we have 
-		//		made.  If it takes longer than 30 seconds to get a responce we 
-		//		might as well stop this and get the file from the mirror 
-		//		instead.
+		//		long we have waited for a responce to the file requests we 
+		//		have made.  If it takes longer than 30 seconds to get a 
+		//		responce we might as well give up on the ones we havent heard 
+		//		about and get them from the mirror instead.  The same goes for 
+		//		a file that we know the length of, but that has stopped 
+		//		arriving.
 		void ProcessHeartbeat(void)
 		{	
 			time_t nTime;
+			bool bWaiting, bStalled;
+			int i;
 			
 			Lock();
 			nTime = time(NULL);
 			if (nTime > _Heartbeat.nLastCheck) {
 				_Heartbeat.nDelay ++;
 				
-				if (_Status.bFileLength == false) {
+				bStalled = false;
+				for (i=0; i<_Streams.nCount; i++) {
+					if (_Streams.pList[i].bLength == true && _Streams.pList[i].bComplete == false && _Streams.pList[i].bFailed == false) {
+						if ((nTime - _Streams.pList[i].tLast) > STALL_WAIT) {
+							_Streams.pList[i].bFailed = true;
+							if (_Streams.pList[i].fd >= 0) {
+								close(_Streams.pList[i].fd);
+								_Streams.pList[i].fd = -1;
+							}
+							SendStreamEnd(i);
+							bStalled = true;
+						}
+					}
+				}
+				if (bStalled == true) {
+					CheckFinished();
+				}
+				
+				bWaiting = false;
+				for (i=0; i<_Streams.nCount; i++) {
+					if (_Streams.pList[i].bLength == false && _Streams.pList[i].bFailed == false) {
+						bWaiting = true;
+					}
+				}
+				
+				if (bWaiting == true) {
 					_Heartbeat.nWait ++;
 				}
 				
 				if (_Heartbeat.nWait > HEARTBEAT_WAIT) {
-					_Status.bStop = true;
+					for (i=0; i<_Streams.nCount; i++) {
+						if (_Streams.pList[i].bLength == false && _Streams.pList[i].bFailed == false) {
+							_Streams.pList[i].bFailed = true;
+							SendStreamEnd(i);
+						}
+					}
+					_Heartbeat.nWait = 0;
+					CheckFinished();
 				}
 				else {
 					if (_Heartbeat.nDelay >= HEARTBEAT_DELAY) {
@@ -617,6 +820,48 @@ class Client : public DpSocketEx
 			Unlock();
 		}
 		
+		//---------------------------------------------------------------------
+		// CJW: If all of the streams are either complete or have failed, then 
+		// 		there is nothing more to do, and we can stop.
+		void CheckFinished(void)
+		{
+			bool bFinished = true;
+			int i;
+			
+			for (i=0; i<_Streams.nCount; i++) {
+				if (_Streams.pList[i].bComplete == false && _Streams.pList[i].bFailed == false) {
+					bFinished = false;
+				}
+			}
+			
+			if (bFinished == true) {
+				_Status.bStop = true;
+			}
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Get the stream that a telegram from the daemon is for.  If it 
+		// 		isnt one of ours, then the data stream is corrupted and we must 
+		// 		stop.  Returns NULL in that case.
+		strStream * GetStream(char *pData)
+		{
+			strStream *pStream = NULL;
+			int nStream;
+			
+			ASSERT(pData != NULL);
+			
+			nStream  = ((unsigned char) pData[1]) << 8;
+			nStream += (unsigned char) pData[2];
+			if (nStream < _Streams.nCount) {
+				pStream = &_Streams.pList[nStream];
+			}
+			else {
+				_Status.bStop = true;
+			}
+			
+			return(pStream);
+		}
+		
 		//---------------------------------------------------------------------
 		// CJW: We have received a FILE-LENGTH message from the daemon which 
 		// 		indicates that it has found the file we are looking for, on the 
@@ -627,84 +872,229 @@ class Client : public DpSocketEx
 		// 		information.  Because if we've already received it, and we 
 		// 		receive it again, its an indication of a corrupted stream and 
 		// 		we must stop.
+		//
+		//		--> L<stream*2><length*4>
 		void ProcessFileLength(char *pData, int nLength)
 		{
+			strStream *pStream;
 			
 			ASSERT(pData != NULL && nLength > 0);
-			ASSERT(nLength >= 5 && pData[0] == 'L');
+			ASSERT(nLength >= 7 && pData[0] == 'L');
 			
-			ASSERT(_File.nSize == 0);
-			ASSERT(_File.fp == NULL);
-			
-			if (_Status.bFileLength == true || _File.nSize != 0) {
+			pStream = GetStream(pData);
+			if (pStream == NULL) {
+				// the stream was invalid, and we have already stopped.
+			}
+			else if (pStream->bLength == true || pStream->bFailed == true) {
 				_Status.bStop = true;
 			}
 			else {
-				_Status.bFileLength = true;
+				ASSERT(pStream->fd < 0);
+				pStream->bLength = true;
+				pStream->tLast = time(NULL);
 				
-				_File.nSize = 0;
-				_File.nSize += ((unsigned char) pData[1]) << 24;
-				_File.nSize += ((unsigned char) pData[2]) << 16;
-				_File.nSize += ((unsigned char) pData[3]) << 8;
-				_File.nSize +=  (unsigned char) pData[4];
+				pStream->nSize = 0;
+				pStream->nSize += ((unsigned char) pData[3]) << 24;
+				pStream->nSize += ((unsigned char) pData[4]) << 16;
+				pStream->nSize += ((unsigned char) pData[5]) << 8;
+				pStream->nSize +=  (unsigned char) pData[6];
 														
-				// we are opening the filename that was passed as an argument to this application. (the one with .part)
-				_File.fp = fopen(_szFile, "w");		
-				if (_File.fp == NULL) {
+				_Stats.nFileSize += pStream->nSize;
+				
+				// we are opening the .part filename.  The chunks can arrive 
+				// in any order, so we make the file the full size straight 
+				// away, and then write each chunk where it belongs.
+				pStream->fd = open(pStream->szFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if (pStream->fd < 0) {
 					_Status.bStop = true;
 				}
+				else if (pStream->nSize > 0) {
+					if (posix_fallocate(pStream->fd, 0, pStream->nSize) != 0) {
+						// not all filesystems can do this, so we just set 
+						// the size instead.
+						if (ftruncate(pStream->fd, pStream->nSize) != 0) {
+							_Status.bStop = true;
+						}
+					}
+				}
 			}
 		}
 		
 		
 		//---------------------------------------------------------------------
-		// CJW: We are now apparently receiving a chunk of a file from the 
-		// 		daemon.  We need to make sure that it is the right chunk, and 
-		// 		also that all of it has arrived.  Once the entire chunk is in 
-		// 		the queue, we will pull it out, write it to the file, and 
-		// 		update our display.
+		// CJW: The daemon sends us the parts of each file in whatever order it 
+		// 		gets them from the network, along with which stream it is for, 
+		// 		and where in the file it belongs.
+		//
+		//		--> P<stream*2><offset*4><len*2><data>
 		//
 		//		We will return a 0, if there is not enough data, otherwise we 
-		//		will return the length of the chunk.
-		int ProcessChunk(char *pData, int nLength)
+		//		will return the length of the data.
+		int ProcessPart(char *pData, int nLength)
 		{
-			_File.temp.nSize = 0;
-
-			_File.temp.nCount = ((unsigned char) pData[1]) << 8;
-			_File.temp.nCount += (unsigned char) pData[2];
-												
-			if (_File.temp.nCount != _File.chunk.nCount) {
+			int nOffset, nSize;
+			strStream *pStream;
+			
+			ASSERT(pData != NULL && nLength > 9);
+			ASSERT(pData[0] == 'P');
+			
+			nOffset  = ((unsigned char) pData[3]) << 24;
+			nOffset += ((unsigned char) pData[4]) << 16;
+			nOffset += ((unsigned char) pData[5]) << 8;
+			nOffset +=  (unsigned char) pData[6];
+			
+			nSize  = ((unsigned char) pData[7]) << 8;
+			nSize += (unsigned char) pData[8];
+			
+			if (nSize <= 0) {
 				_Status.bStop = true;
 			}
+			else if ((nLength-9) >= nSize) {
+				pStream = GetStream(pData);
+				if (pStream != NULL) {
+					WritePart(pStream, nOffset, &pData[9], nSize);
+				}
+			}
 			else {
-				_File.chunk.nCount = _File.temp.nCount;
-
-				_File.temp.nSize = ((unsigned char) pData[3]) << 8;
-				_File.temp.nSize += (unsigned char) pData[4];
-													
-				if (_File.temp.nSize <= 0) {
-					_Status.bStop = true;
+				nSize = 0;
+			}
+			
+			ASSERT(nSize >= 0);
+			return(nSize);
+		}
+		
+		
+		//---------------------------------------------------------------------
+		// CJW: The daemon wont give us this file, or the network doesnt have 
+		// 		it, so we will get it from the mirror.
+		//
+		//		--> X<stream*2>
+		//		--> N<stream*2>
+		void ProcessRefused(char *pData, int nLength)
+		{
+			strStream *pStream;
+			
+			ASSERT(pData != NULL && nLength >= 3);
+			ASSERT(pData[0] == 'X' || pData[0] == 'N');
+			
+			pStream = GetStream(pData);
+			if (pStream != NULL) {
+				if (pStream->bComplete == false) {
+					pStream->bFailed = true;
+					if (pStream->fd >= 0) {
+						close(pStream->fd);
+						pStream->fd = -1;
+					}
 				}
-				else {
-					if ((nLength-1) >= (_File.temp.nSize + 4)) {
-						ASSERT(_File.fp != NULL);
-						
-						_Stats.nDone += _File.temp.nSize;
-						fwrite(&pData[5], _File.temp.nSize, 1, _File.fp);
+				CheckFinished();
+			}
+		}
+		
+		
+		//---------------------------------------------------------------------
+		// CJW: Write some of the file at the offset it belongs.  If it doesnt 
+		// 		fit in the file, or we cant write it, then something has gone 
+		// 		wrong and we stop.  Once we have all of the file, we are done 
+		// 		with that stream.  Every so often we let the daemon know that 
+		// 		we have written what it sent, so that it will send us more.
+		//
+		//		<-- W<stream*2><credit*2>
+		void WritePart(strStream *pStream, int nOffset, char *pData, int nSize)
+		{
+			char buffer[5];
+			int nStream;
+			
+			ASSERT(pStream != NULL);
+			ASSERT(pData != NULL && nSize > 0 && nOffset >= 0);
+			
+			nStream = pStream - _Streams.pList;
+			ASSERT(nStream >= 0 && nStream < _Streams.nCount);
+			
+			if (pStream->fd < 0 || (nOffset + nSize) > pStream->nSize) {
+				_Status.bStop = true;
+			}
+			else if (pwrite(pStream->fd, pData, nSize, nOffset) != nSize) {
+				_Status.bStop = true;
+			}
+			else {
+				pStream->nDone += nSize;
+				pStream->tLast = time(NULL);
+				_Stats.nDone += nSize;
+				if (pStream->nDone >= pStream->nSize) {
+					close(pStream->fd);
+					pStream->fd = -1;
+					pStream->bComplete = true;
+					SendStreamEnd(nStream);
+					if (_szDir != NULL) {
+						FinishFile(pStream);
 					}
-					else {
-						_File.temp.nSize = 0;
+					CheckFinished();
+				}
+				else {
+					pStream->nCredit++;
+					if (pStream->nCredit >= (CLIENT_WINDOW / 2)) {
+						buffer[0] = 'W';
+						buffer[1] = (char) ((nStream >> 8) & 0xff);
+						buffer[2] = (char) (nStream & 0xff);
+						buffer[3] = (char) ((pStream->nCredit >> 8) & 0xff);
+						buffer[4] = (char) (pStream->nCredit & 0xff);
+						Send(buffer, 5);
+						pStream->nCredit = 0;
 					}
 				}
 			}
-			
-			ASSERT(_File.temp.nSize >= 0);
-			return(_File.temp.nSize);
 		}
 		
 		
+		//---------------------------------------------------------------------
+		// CJW: In multi mode, we are the ones that need to move the .part 
+		// 		file to its real name once we have all of it.  Pacman does 
+		// 		this for us otherwise.
+		bool FinishFile(strStream *pStream)
+		{
+			bool bDone = false;
+			char *szFinal;
+			int nLength;
+			
+			ASSERT(pStream != NULL && pStream->szFile != NULL);
+			
+			nLength = strlen(pStream->szFile) - 5;
+			ASSERT(nLength > 0);
+			szFinal = (char *) malloc(nLength + 1);
+			ASSERT(szFinal != NULL);
+			strncpy(szFinal, pStream->szFile, nLength);
+			szFinal[nLength] = '\0';
+			
+			if (rename(pStream->szFile, szFinal) == 0) {
+				bDone = true;
+			}
+			else {
+				fprintf(stderr, "pacsrvclient: Unable to rename %s\n", pStream->szFile);
+			}
+			
+			free(szFinal);
+			
+			return(bDone);
+		}
 		
 		
+		//---------------------------------------------------------------------
+		// CJW: If the daemon told us the length, the .part file was made the 
+		// 		full size before any of it arrived, so whatever we didnt get 
+		// 		is a hole of zeros.  wget -c would think the file was already 
+		// 		finished, so we remove it and let wget start again.  If we 
+		// 		never got a length, the .part is what pacman left there from 
+		// 		an earlier download, and wget can carry on from it.
+		void DiscardPart(strStream *pStream)
+		{
+			ASSERT(pStream != NULL);
+			ASSERT(pStream->szFile != NULL);
+			ASSERT(pStream->fd < 0);
+			
+			if (pStream->bLength == true) {
+				unlink(pStream->szFile);
+			}
+		}
 		
 		
 		//---------------------------------------------------------------------
@@ -713,11 +1103,14 @@ class Client : public DpSocketEx
 		// 		it for us.
 		bool DownloadUrl(void)
 		{
-			ASSERT(_szUrl != NULL);
-			ASSERT(_szFile != NULL);
+			ASSERT(_Streams.nCount == 1);
+			ASSERT(_Streams.pList[0].szUrl != NULL);
+			ASSERT(_Streams.pList[0].szFile != NULL);
+			
+			DiscardPart(&_Streams.pList[0]);
 			
 			// This function will basically call wget and this process will cease to be.  If the function returns, then something went wrong.
-			execl("/usr/bin/wget", "-nv", "-c", "-O", _szFile, _szUrl, (char *) NULL);
+			execl("/usr/bin/wget", "wget", "-nv", "-c", "-O", _Streams.pList[0].szFile, _Streams.pList[0].szUrl, (char *) NULL);
 			
 			printf("Something went wrong with wget.\n");
 			
@@ -725,6 +1118,57 @@ class Client : public DpSocketEx
 		}
 
 		
+		//---------------------------------------------------------------------
+		// CJW: In multi mode we cant let wget replace us, because there may be 
+		// 		a number of files that we didnt get from the daemon.  So we 
+		// 		start a wget for each of them, and then wait for all of them 
+		// 		to finish.  
+		bool DownloadUrls(void)
+		{
+			bool bGotIt = true;
+			pid_t *pPids;
+			int nStatus, i;
+			
+			ASSERT(_szDir != NULL);
+			
+			pPids = (pid_t *) calloc(_Streams.nCount, sizeof(pid_t));
+			ASSERT(pPids != NULL);
+			
+			for (i=0; i<_Streams.nCount; i++) {
+				if (_Streams.pList[i].bComplete == false) {
+					ASSERT(_Streams.pList[i].szUrl != NULL);
+					ASSERT(_Streams.pList[i].szFile != NULL);
+					DiscardPart(&_Streams.pList[i]);
+					pPids[i] = fork();
+					if (pPids[i] == 0) {
+						execl("/usr/bin/wget", "wget", "-nv", "-c", "-O", _Streams.pList[i].szFile, _Streams.pList[i].szUrl, (char *) NULL);
+						_exit(1);
+					}
+					else if (pPids[i] < 0) {
+						bGotIt = false;
+					}
+				}
+			}
+			
+			for (i=0; i<_Streams.nCount; i++) {
+				if (pPids[i] > 0) {
+					if (waitpid(pPids[i], &nStatus, 0) < 0) {
+						bGotIt = false;
+					}
+					else if (WIFEXITED(nStatus) == 0 || WEXITSTATUS(nStatus) != 0) {
+						fprintf(stderr, "pacsrvclient: Failed to download: %s\n", _Streams.pList[i].szUrl);
+						bGotIt = false;
+					}
+					else if (FinishFile(&_Streams.pList[i]) == false) {
+						bGotIt = false;
+					}
+				}
+			}
+			
+			free(pPids);
+			
+			return(bGotIt);
+		}
 		
 };
 
@@ -754,7 +1198,7 @@ int main(int argc, char **argv)
 		}
 		else {
 			if (client.Download() == false) {
-				fprintf(stderr, "pacsrvclient: Failed to download: %s\n", argv[2]);
+				fprintf(stderr, "pacsrvclient: Failed to download: %s\n", argv[argc-1]);
 				nRet = 3;
 			}
 		}
@@ -764,6 +1208,3 @@ int main(int argc, char **argv)
 	
 	return nRet;
 }
-
-
-
@@ -31,12 +31,15 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
 
 #include <DpMain.h>
 
 #include "server.h"
 #include "config.h"
 #include "logger.h"
+#include "trace.h"
 
 #ifndef INI_FILE
 #define INI_FILE "../etc/pacsrv.conf"
@@ -51,6 +54,16 @@
 	#error DevPlus version must be 2.25 or higher.
 #endif
 
+//-----------------------------------------------------------------------------
+// CJW: SIGHUP asks for the config to be read again.  There isnt much we can 
+// 		do inside a signal handler, so the server does the reload the next 
+// 		time it goes round its loop.
+static void OnHangup(int)
+{
+	Config::RequestReload();
+}
+
+
 class myApp : public DpMain 
 {
 	private:
@@ -101,6 +114,10 @@ class myApp : public DpMain
 		// 		call the Shutdown() function.
 		virtual void OnStartup(void)
 		{
+			char *szLevel = NULL;
+			char *szCategories = NULL;
+			char *szTrace = NULL;
+			
 			printf("pacsrvd started.\n");
 			
 			ASSERT(_pServer == NULL);
@@ -128,6 +145,22 @@ class myApp : public DpMain
 			
 		 			ASSERT(INI_FILE != NULL);
 					_pConfig->Load(INI_FILE);
+					
+					// what to log, from the [log] part of the config.
+					_pConfig->Get("log", "level", &szLevel);
+					_pConfig->Get("log", "categories", &szCategories);
+					Logger::SetLevel(szLevel, szCategories);
+					if (szLevel != NULL) { free(szLevel); }
+					if (szCategories != NULL) { free(szCategories); }
+					
+					// tracing of file requests is off unless there is a 
+					// file to write it to.
+					if (_pConfig->Get("log", "trace", &szTrace) == true && szTrace != NULL) {
+						Tracer::Open(szTrace);
+						free(szTrace);
+					}
+					
+					signal(SIGHUP, OnHangup);
 		
 		
 					// start the local listener.
@@ -161,6 +194,8 @@ class myApp : public DpMain
 				_pServer = NULL;
 			}
 			
+			Tracer::Close();
+			
 			if(_pConfig != NULL) {
 				_pConfig->Release();
 				delete _pConfig;
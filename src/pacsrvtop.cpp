@@ -0,0 +1,370 @@
+//-----------------------------------------------------------------------------
+// pacsrvtop.cpp
+//
+//	Project: pacsrv
+//	Author: Clint Webb
+// 
+//		Shows what a running pacsrvd is doing, a bit like top.  The daemon 
+//		keeps a block of statistics in shared memory (see shmstats.h), which 
+//		we map in read-only and show every couple of seconds.  We dont talk 
+//		to the daemon at all, so it doesnt matter how often we look.
+//
+//		pacsrvtop [-d seconds] [-1]
+//
+//		-d is the delay between each update, and -1 shows it once and exits, 
+//		without clearing the screen, so that it can be used from a script.
+//
+//-----------------------------------------------------------------------------
+
+/***************************************************************************
+ *   Copyright (C) 2003-2006 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <DpIniFile.h>
+
+#define SHM_STATS_READER
+#include "shmstats.h"
+
+#ifndef INI_FILE
+#define INI_FILE "/etc/pacsrv.conf"
+#endif
+
+// Default seconds between each update.
+#define TOP_DELAY		2
+
+// Number of times we will try to get a copy of the block that wasnt being 
+// written while we copied it, before we give up until the next update.
+#define TOP_TRIES		100
+
+#define WIDTH_FILENAME	40
+
+
+class Top 
+{
+	private:
+		char *_szName;				// name of the shared memory.
+		strShmStats *_pShared;		// mapped in from the daemon.
+		strShmStats _Copy;			// the copy that we show.
+		int _nDelay;
+		bool _bOnce;
+		
+	public:
+		//---------------------------------------------------------------------
+		// CJW: Constructor.  
+		Top() 
+		{
+			_szName = NULL;
+			_pShared = NULL;
+			_nDelay = TOP_DELAY;
+			_bOnce = false;
+			memset(&_Copy, 0, sizeof(_Copy));
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Deconstructor.  
+		virtual ~Top() 
+		{
+			if (_pShared != NULL) {
+				munmap(_pShared, sizeof(strShmStats));
+				_pShared = NULL;
+			}
+			if (_szName != NULL) {
+				free(_szName);
+				_szName = NULL;
+			}
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Look at the arguments.  Returns false if they dont make sense.
+		bool ParseArgs(int argc, char **argv)
+		{
+			bool bValid = true;
+			int i;
+			
+			for (i=1; i<argc && bValid == true; i++) {
+				if (strcmp(argv[i], "-d") == 0 && (i+1) < argc) {
+					i++;
+					_nDelay = atoi(argv[i]);
+					if (_nDelay <= 0) { bValid = false; }
+				}
+				else if (strcmp(argv[i], "-1") == 0) {
+					_bOnce = true;
+				}
+				else {
+					bValid = false;
+				}
+			}
+			
+			return(bValid);
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Get the name of the shared memory from the [stats] part of the 
+		// 		config, if it is there.  If we cant read the config, we just 
+		// 		use the default name.
+		void LoadConfig(void) 
+		{
+			DpIniFile *pIni;
+			
+			pIni = new DpIniFile;
+			if (pIni != NULL) {
+				if (pIni->Load(INI_FILE) == true) {
+					if (pIni->SetGroup("stats") == true) {
+						pIni->GetValue("shm", &_szName);
+					}
+				}
+				delete pIni;
+			}
+			
+			if (_szName == NULL) {
+				_szName = strdup(SHM_STATS_NAME);
+			}
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Map in the shared memory.  Returns false if the daemon hasnt 
+		// 		made it.
+		bool Open(void) 
+		{
+			bool bOpened = false;
+			void *pMap;
+			int fd;
+			
+			fd = shm_open(_szName, O_RDONLY, 0);
+			if (fd >= 0) {
+				pMap = mmap(NULL, sizeof(strShmStats), PROT_READ, MAP_SHARED, fd, 0);
+				if (pMap != MAP_FAILED) {
+					_pShared = (strShmStats *) pMap;
+					bOpened = true;
+				}
+				close(fd);
+			}
+			
+			return(bOpened);
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Copy the block out of the shared memory.  If the sequence is 
+		// 		odd, or changes while we are copying, then the daemon was 
+		// 		writing it, and we need to try again.  Returns false if we 
+		// 		couldnt get a good copy.
+		bool Read(void) 
+		{
+			unsigned int nBefore, nAfter;
+			bool bRead = false;
+			int nTries = 0;
+			
+			while (bRead == false && nTries < TOP_TRIES) {
+				nBefore = _pShared->nSeq;
+				__sync_synchronize();
+				if ((nBefore & 1) == 0) {
+					memcpy(&_Copy, (void *) _pShared, sizeof(strShmStats));
+					__sync_synchronize();
+					nAfter = _pShared->nSeq;
+					if (nAfter == nBefore) {
+						bRead = true;
+					}
+				}
+				if (bRead == false) {
+					nTries++;
+					usleep(1000);
+				}
+			}
+			
+			return(bRead);
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Write a number of bytes in a short form.
+		void FormatBytes(char *szBuffer, int nMax, long long nBytes)
+		{
+			if (nBytes >= (1024 * 1024 * 1024)) {
+				snprintf(szBuffer, nMax, "%.1fG", (double) nBytes / (1024 * 1024 * 1024));
+			}
+			else if (nBytes >= (1024 * 1024)) {
+				snprintf(szBuffer, nMax, "%.1fM", (double) nBytes / (1024 * 1024));
+			}
+			else if (nBytes >= 1024) {
+				snprintf(szBuffer, nMax, "%.1fK", (double) nBytes / 1024);
+			}
+			else {
+				snprintf(szBuffer, nMax, "%lld", nBytes);
+			}
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Cut a filename down to fit in its column.
+		void FormatName(char *szBuffer, char *szName)
+		{
+			int nLength;
+			
+			nLength = strlen(szName);
+			if (nLength > WIDTH_FILENAME) {
+				strncpy(szBuffer, szName, WIDTH_FILENAME - 3);
+				strcpy(&szBuffer[WIDTH_FILENAME - 3], "...");
+			}
+			else {
+				strcpy(szBuffer, szName);
+			}
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Show the copy of the block.
+		void Display(void)
+		{
+			char szName[WIDTH_FILENAME + 1];
+			char szSent[16], szRate[16];
+			long long nAge;
+			struct timeval tv;
+			int i, nPercent;
+			
+			gettimeofday(&tv, NULL);
+			nAge = (((long long) tv.tv_sec * 1000) + (tv.tv_usec / 1000)) - _Copy.nUpdated;
+			
+			if (_bOnce == false) {
+				printf("\033[H\033[2J");
+			}
+			
+			printf("pacsrvd (pid %d)  updated %lld.%llds ago  nodes %d  files %d  clients %d\n", _Copy.nPid, nAge / 1000, (nAge % 1000) / 100, _Copy.nTotalNodes, _Copy.nTotalFiles, _Copy.nConnections);
+			if (kill(_Copy.nPid, 0) != 0 && errno == ESRCH) {
+				printf("** pacsrvd is no longer running.\n");
+			}
+			
+			printf("\n%6s %6s %5s %4s %4s %6s %8s %10s\n", "NODE", "RTT", "RELAY", "DOWN", "UP", "QUEUED", "SENT", "RATE");
+			for (i=0; i<_Copy.nNodes; i++) {
+				FormatBytes(szSent, sizeof(szSent), _Copy.pNodes[i].nBytesOut);
+				FormatBytes(szRate, sizeof(szRate), _Copy.pNodes[i].nUploadRate);
+				printf("%6d %4dms %5s %4s %4s %6d %8s %8s/s\n", 
+					_Copy.pNodes[i].nID, _Copy.pNodes[i].nRtt, 
+					_Copy.pNodes[i].bRelay ? "yes" : "-",
+					_Copy.pNodes[i].bChunkPending ? "C" : (_Copy.pNodes[i].bDownloading ? "L" : "-"),
+					_Copy.pNodes[i].bUploading ? "U" : "-",
+					_Copy.pNodes[i].nQueued, szSent, szRate);
+			}
+			if (_Copy.nTotalNodes > _Copy.nNodes) {
+				printf("  (%d more)\n", _Copy.nTotalNodes - _Copy.nNodes);
+			}
+			
+			printf("\n%-*s %5s %13s %4s %5s\n", WIDTH_FILENAME, "FILE", "DONE", "CHUNKS", "OUT", "USERS");
+			for (i=0; i<_Copy.nFiles; i++) {
+				FormatName(szName, _Copy.pFiles[i].szFile);
+				if (_Copy.pFiles[i].bLocal) {
+					printf("%-*s %5s %13s %4s %5d\n", WIDTH_FILENAME, szName, "local", "-", "-", _Copy.pFiles[i].nUsers);
+				}
+				else {
+					nPercent = 0;
+					if (_Copy.pFiles[i].nChunks > 0) {
+						nPercent = (_Copy.pFiles[i].nReceived * 100) / _Copy.pFiles[i].nChunks;
+					}
+					printf("%-*s %4d%% %6d/%-6d %4d %5d\n", WIDTH_FILENAME, szName, nPercent, _Copy.pFiles[i].nReceived, _Copy.pFiles[i].nChunks, _Copy.pFiles[i].nRequested, _Copy.pFiles[i].nUsers);
+				}
+			}
+			if (_Copy.nTotalFiles > _Copy.nFiles) {
+				printf("  (%d more)\n", _Copy.nTotalFiles - _Copy.nFiles);
+			}
+			
+			printf("\n%6s %6s %-*s %13s %6s %8s\n", "CLIENT", "STREAM", WIDTH_FILENAME, "FILE", "WAITING", "SENT", "IDLE");
+			for (i=0; i<_Copy.nClients; i++) {
+				FormatName(szName, _Copy.pClients[i].szFile);
+				printf("%6d %6d %-*s %6d/%-6d %6d %6dms\n", _Copy.pClients[i].nClient, _Copy.pClients[i].nStream, WIDTH_FILENAME, szName, _Copy.pClients[i].nWaiting + 1, _Copy.pClients[i].nChunks, _Copy.pClients[i].nSent, _Copy.pClients[i].nWaitMs);
+			}
+			
+			printf("\n%-*s %10s %8s %8s %8s\n", WIDTH_FILENAME, "TIMING", "COUNT", "MEAN", "P50", "P99");
+			for (i=0; i<_Copy.nTimings; i++) {
+				FormatName(szName, _Copy.pTimings[i].szName);
+				printf("%-*s %10lld %8lld %8lld %8lld\n", WIDTH_FILENAME, szName, _Copy.pTimings[i].nCount, _Copy.pTimings[i].nMean, _Copy.pTimings[i].nP50, _Copy.pTimings[i].nP99);
+			}
+			
+			fflush(stdout);
+		}
+		
+		//---------------------------------------------------------------------
+		// CJW: Keep showing the block until we are stopped (or just once).  
+		// 		Returns false if we couldnt get to it at all.
+		bool Run(void)
+		{
+			bool bOk = true;
+			bool bDone = false;
+			
+			if (Open() == false) {
+				fprintf(stderr, "pacsrvtop: Unable to open shared memory %s.  Is pacsrvd running?\n", _szName);
+				bOk = false;
+			}
+			else {
+				while (bDone == false) {
+					if (Read() == false) {
+						fprintf(stderr, "pacsrvtop: Unable to get a copy of the stats.\n");
+					}
+					else if (_Copy.nVersion != SHM_STATS_VERSION) {
+						fprintf(stderr, "pacsrvtop: pacsrvd is a different version (%d).\n", _Copy.nVersion);
+						bOk = false;
+						bDone = true;
+					}
+					else {
+						Display();
+					}
+					
+					if (_bOnce == true) {
+						bDone = true;
+					}
+					else if (bDone == false) {
+						sleep(_nDelay);
+					}
+				}
+			}
+			
+			return(bOk);
+		}
+};
+
+
+//-----------------------------------------------------------------------------
+// CJW: Main function.  
+int main(int argc, char **argv)
+{
+	Top top;
+	int nRet = 0;
+
+	if (top.ParseArgs(argc, argv) == false) {
+		fprintf(stderr, "usage: pacsrvtop [-d seconds] [-1]\n");
+		nRet = 1;
+	}
+	else {
+		top.LoadConfig();
+		if (top.Run() == false) {
+			nRet = 2;
+		}
+	}
+	
+	return nRet;
+}
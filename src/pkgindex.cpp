@@ -0,0 +1,407 @@
+//-----------------------------------------------------------------------------
+// pkgindex.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See pkgindex.h for details.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+
+#include <DevPlus.h>
+
+#include "pkgindex.h"
+#include "dht.h"
+#include "logger.h"
+
+
+//---------------------------------------------------------------------
+// CJW: Constructor.   Start with an empty index.
+PkgIndex::PkgIndex()
+{
+	int i;
+	
+	for (i=0; i<PKG_INDEX_BUCKETS; i++) {
+		_pBuckets[i] = NULL;
+	}
+	_nCount = 0;
+	_szPath = strdup(PKG_SYNC_PATH);
+	ASSERT(_szPath != NULL);
+	_tLoaded = 0;
+	_tLastCheck = 0;
+}
+    
+//---------------------------------------------------------------------
+// CJW: Deconstructor.  Clean up the lists.
+PkgIndex::~PkgIndex()
+{
+	Clear();
+	ASSERT(_nCount == 0);
+	
+	ASSERT(_szPath != NULL);
+	free(_szPath);
+	_szPath = NULL;
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Remove everything from the index.
+void PkgIndex::Clear(void)
+{
+	strPackage *pTmp;
+	int i;
+	
+	for (i=0; i<PKG_INDEX_BUCKETS; i++) {
+		while (_pBuckets[i] != NULL) {
+			pTmp = _pBuckets[i];
+			_pBuckets[i] = pTmp->pNext;
+			free(pTmp->szFile);
+			if (pTmp->szSha256 != NULL) {
+				free(pTmp->szSha256);
+			}
+			free(pTmp);
+			_nCount--;
+		}
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Set the directory that the sync databases are in.  Needs to be 
+// 		done before Load().
+void PkgIndex::SetPath(char *szPath)
+{
+	ASSERT(szPath != NULL && szPath[0] != '\0');
+	ASSERT(_szPath != NULL);
+	
+	free(_szPath);
+	_szPath = strdup(szPath);
+	ASSERT(_szPath != NULL);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the modified time of the newest database in the sync 
+// 		directory, so that we know if we need to load them again.
+time_t PkgIndex::GetNewest(void)
+{
+	DIR *pDir;
+	struct dirent *pEntry;
+	struct stat st;
+	char szPath[2048];
+	time_t tNewest = 0;
+	int nLen;
+	
+	ASSERT(_szPath != NULL);
+	
+	pDir = opendir(_szPath);
+	if (pDir != NULL) {
+		while ((pEntry = readdir(pDir)) != NULL) {
+			nLen = strlen(pEntry->d_name);
+			if (nLen > 3 && strcmp(&pEntry->d_name[nLen-3], ".db") == 0 && (strlen(_szPath) + nLen + 2) < sizeof(szPath)) {
+				sprintf(szPath, "%s/%s", _szPath, pEntry->d_name);
+				if (stat(szPath, &st) == 0 && st.st_mtime > tNewest) {
+					tNewest = st.st_mtime;
+				}
+			}
+		}
+		closedir(pDir);
+	}
+	
+	return(tNewest);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Load all of the .db files in the sync directory.  Whatever was in 
+// 		the index before is thrown away.
+void PkgIndex::Load(void)
+{
+	DIR *pDir;
+	struct dirent *pEntry;
+	char szPath[2048];
+	int nLen, nFiles = 0;
+	
+	ASSERT(_szPath != NULL);
+	
+	Clear();
+	_tLoaded = GetNewest();
+	_tLastCheck = time(NULL);
+	
+	pDir = opendir(_szPath);
+	if (pDir != NULL) {
+		while ((pEntry = readdir(pDir)) != NULL) {
+			nLen = strlen(pEntry->d_name);
+			if (nLen > 3 && strcmp(&pEntry->d_name[nLen-3], ".db") == 0 && (strlen(_szPath) + nLen + 2) < sizeof(szPath)) {
+				sprintf(szPath, "%s/%s", _szPath, pEntry->d_name);
+				if (LoadDb(szPath) > 0) {
+					nFiles++;
+				}
+			}
+		}
+		closedir(pDir);
+	}
+	
+	LOG_SYSTEM(LOG_CACHE, "[PkgIndex] Loaded %d packages from %d databases in %s.", _nCount, nFiles, _szPath);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Read one database.  It is a tar file (gzipped, but gzread will 
+// 		handle it if it isnt), and we only want the desc files out of it.  
+// 		Each entry has a 512 byte header with the name and the size (in 
+// 		octal), followed by the data padded out to 512 bytes.  Returns the 
+// 		number of desc files that were read.
+int PkgIndex::LoadDb(char *szDb)
+{
+	gzFile fp;
+	char pHeader[512];
+	char szSize[13];
+	char *pDesc;
+	char *pName;
+	int nSize, nPadded, nNameLen, nRead, nSkip;
+	int nDescs = 0;
+	bool bDone = false;
+	
+	ASSERT(szDb != NULL);
+	
+	fp = gzopen(szDb, "rb");
+	if (fp != NULL) {
+		pDesc = (char *) malloc(PKG_DESC_MAX + 1);
+		ASSERT(pDesc != NULL);
+		
+		while (bDone == false) {
+			if (gzread(fp, pHeader, 512) != 512 || pHeader[0] == '\0') {
+				// an empty header is the end of the archive.
+				bDone = true;
+			}
+			else {
+				memcpy(szSize, &pHeader[124], 12);
+				szSize[12] = '\0';
+				nSize = strtol(szSize, NULL, 8);
+				nPadded = ((nSize + 511) / 512) * 512;
+				
+				pName = pHeader;
+				nNameLen = strnlen(pName, 100);
+				
+				// only regular files called .../desc are any use to us.
+				if ((pHeader[156] == '0' || pHeader[156] == '\0') && nSize > 0 && nSize <= PKG_DESC_MAX 
+						&& nNameLen >= 4 && strncmp(&pName[nNameLen-4], "desc", 4) == 0 
+						&& (nNameLen == 4 || pName[nNameLen-5] == '/')) {
+					nRead = gzread(fp, pDesc, nPadded);
+					if (nRead != nPadded) {
+						bDone = true;
+					}
+					else {
+						pDesc[nSize] = '\0';
+						ParseDesc(pDesc, nSize);
+						nDescs++;
+					}
+				}
+				else {
+					// skip over the data, a bit at a time.
+					while (nPadded > 0 && bDone == false) {
+						nSkip = nPadded;
+						if (nSkip > PKG_DESC_MAX) { nSkip = PKG_DESC_MAX; }
+						if (gzread(fp, pDesc, nSkip) != nSkip) {
+							bDone = true;
+						}
+						nPadded -= nSkip;
+					}
+				}
+			}
+		}
+		
+		free(pDesc);
+		gzclose(fp);
+	}
+	
+	return(nDescs);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: A desc file is made up of sections, each with a %NAME% line and 
+// 		then the values, one per line, and a blank line at the end.  We want 
+// 		%FILENAME%, %CSIZE% (or %SIZE% in older databases, which meant the 
+// 		same thing), and %SHA256SUM%.  The data is changed as we go.
+void PkgIndex::ParseDesc(char *pDesc, int nLength)
+{
+	char *szLine, *szNext;
+	char *szSection = NULL;
+	char *szFile = NULL;
+	char *szSha256 = NULL;
+	int nSize = 0, nCSize = 0;
+	
+	ASSERT(pDesc != NULL && nLength > 0);
+	ASSERT(pDesc[nLength] == '\0');
+	
+	szLine = pDesc;
+	while (szLine != NULL) {
+		szNext = strchr(szLine, '\n');
+		if (szNext != NULL) {
+			*szNext = '\0';
+			szNext++;
+		}
+		
+		if (szLine[0] == '\0') {
+			szSection = NULL;
+		}
+		else if (szLine[0] == '%') {
+			szSection = szLine;
+		}
+		else if (szSection != NULL) {
+			if (strcmp(szSection, "%FILENAME%") == 0)		{ szFile = szLine; }
+			else if (strcmp(szSection, "%CSIZE%") == 0)		{ nCSize = atoi(szLine); }
+			else if (strcmp(szSection, "%SIZE%") == 0)		{ nSize = atoi(szLine); }
+			else if (strcmp(szSection, "%SHA256SUM%") == 0)	{ szSha256 = szLine; }
+			szSection = NULL;
+		}
+		
+		szLine = szNext;
+	}
+	
+	if (nCSize > 0) {
+		nSize = nCSize;
+	}
+	
+	if (szFile != NULL && szFile[0] != '\0' && nSize > 0) {
+		if (szSha256 != NULL && strlen(szSha256) != 64) {
+			szSha256 = NULL;
+		}
+		Add(szFile, nSize, szSha256);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Add a package to the index.  If the same file is in more than one 
+// 		database, the first one wins.
+void PkgIndex::Add(char *szFile, int nSize, char *szSha256)
+{
+	strPackage *pPkg;
+	int nBucket;
+	
+	ASSERT(szFile != NULL && nSize > 0);
+	
+	nBucket = Dht::Hash(szFile) % PKG_INDEX_BUCKETS;
+	pPkg = _pBuckets[nBucket];
+	while (pPkg != NULL && strcmp(pPkg->szFile, szFile) != 0) {
+		pPkg = pPkg->pNext;
+	}
+	
+	if (pPkg == NULL) {
+		pPkg = (strPackage *) malloc(sizeof(strPackage));
+		ASSERT(pPkg != NULL);
+		pPkg->szFile = strdup(szFile);
+		ASSERT(pPkg->szFile != NULL);
+		pPkg->nSize = nSize;
+		pPkg->szSha256 = NULL;
+		if (szSha256 != NULL) {
+			pPkg->szSha256 = strdup(szSha256);
+			ASSERT(pPkg->szSha256 != NULL);
+		}
+		pPkg->pNext = _pBuckets[nBucket];
+		_pBuckets[nBucket] = pPkg;
+		_nCount++;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Every now and then, check to see if the databases have been 
+// 		updated (which only needs a stat of each one).  If they have, we 
+// 		return true, and the caller loads them into a new index, since 
+// 		reading them takes a while and this one might be in use.  We wont 
+// 		say so again until the next check.
+bool PkgIndex::IsChanged(void)
+{
+	time_t tNow;
+	bool bChanged = false;
+	
+	tNow = time(NULL);
+	if ((tNow - _tLastCheck) >= PKG_INDEX_CHECK) {
+		_tLastCheck = tNow;
+		if (GetNewest() > _tLoaded) {
+			bChanged = true;
+		}
+	}
+	
+	return(bChanged);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Look up a file.  If it is in the index, we return true and fill in 
+// 		the size, and the sha256 (which is NULL if we dont know it, and 
+// 		belongs to the index).  Either of the parameters can be NULL.
+bool PkgIndex::Find(char *szFile, int *nSize, char **szSha256)
+{
+	strPackage *pPkg;
+	bool bFound = false;
+	
+	ASSERT(szFile != NULL);
+	
+	pPkg = _pBuckets[Dht::Hash(szFile) % PKG_INDEX_BUCKETS];
+	while (pPkg != NULL && bFound == false) {
+		if (strcmp(pPkg->szFile, szFile) == 0) {
+			bFound = true;
+			if (nSize != NULL)		{ *nSize = pPkg->nSize; }
+			if (szSha256 != NULL)	{ *szSha256 = pPkg->szSha256; }
+		}
+		else {
+			pPkg = pPkg->pNext;
+		}
+	}
+	
+	return(bFound);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the directory that the sync databases are in.
+char * PkgIndex::GetPath(void)
+{
+	ASSERT(_szPath != NULL);
+	return(_szPath);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the number of packages in the index.
+int PkgIndex::GetCount(void)
+{
+	ASSERT(_nCount >= 0);
+	return(_nCount);
+}
@@ -0,0 +1,94 @@
+//-----------------------------------------------------------------------------
+// pkgindex.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      This object reads the pacman sync databases (the repo .db files, which
+//      are gzipped tar files with a desc file for each package), and keeps
+//      the size and sha256 of each package file.  That way we know how big a
+//      file is as soon as it is asked for, without waiting for a node or the
+//      mirror to tell us, and we can check a file once we have all of it.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __PKGINDEX_H
+#define __PKGINDEX_H
+
+#include <time.h>
+
+//-----------------------------------------------------------------------------
+// Where pacman keeps its sync databases.  Can be changed with sync-path in 
+// the config.  Every PKG_INDEX_CHECK seconds we look to see if any of them 
+// have changed (pacman -Sy), and if so, a new index is loaded in the 
+// background and swapped in for the old one.
+#define PKG_SYNC_PATH       "/var/lib/pacman/sync"
+#define PKG_INDEX_CHECK     60
+
+// The index is a hash table of linked lists, with this many buckets.
+#define PKG_INDEX_BUCKETS   4096
+
+// desc files are small, anything bigger than this isnt one.
+#define PKG_DESC_MAX        65536
+
+
+struct strPackage {
+	char *szFile;
+	int nSize;
+	char *szSha256;			// NULL if the database didnt have one.
+	strPackage *pNext;
+};
+
+
+class PkgIndex 
+{
+    private:
+        strPackage *_pBuckets[PKG_INDEX_BUCKETS];
+        int _nCount;
+        char *_szPath;
+        time_t _tLoaded;        // newest database we have loaded.
+        time_t _tLastCheck;
+        
+        void Clear(void);
+        int LoadDb(char *szDb);
+        void ParseDesc(char *pDesc, int nLength);
+        void Add(char *szFile, int nSize, char *szSha256);
+        time_t GetNewest(void);
+    
+    public:
+        PkgIndex();
+        virtual ~PkgIndex();
+
+        void SetPath(char *szPath);
+        void Load(void);
+        bool IsChanged(void);
+        char * GetPath(void);
+        bool Find(char *szFile, int *nSize, char **szSha256);
+        int GetCount(void);
+};
+
+
+#endif
+
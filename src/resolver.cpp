@@ -0,0 +1,156 @@
+//-----------------------------------------------------------------------------
+// resolver.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See resolver.h for details.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include <DevPlus.h>
+
+#include "resolver.h"
+
+DpLock Resolver::_xLock;
+strResolve *Resolver::_pList = NULL;
+
+
+//-----------------------------------------------------------------------------
+// CJW: Look up the address of a host without blocking.  If we have looked it 
+// 		up recently, the address is returned straight away.  Otherwise a 
+// 		thread is started to do the lookup, and RESOLVE_PENDING is returned 
+// 		until it has finished.
+int Resolver::Lookup(char *szHost, struct in_addr *pAddr)
+{
+	strResolve *pEntry;
+	pthread_t xThread;
+	pthread_attr_t xAttr;
+	time_t tNow;
+	int nState;
+	
+	ASSERT(szHost != NULL && pAddr != NULL);
+	
+	tNow = time(NULL);
+	
+	_xLock.Lock();
+	
+	pEntry = _pList;
+	while (pEntry != NULL && strcmp(pEntry->szHost, szHost) != 0) {
+		pEntry = pEntry->pNext;
+	}
+	
+	if (pEntry == NULL) {
+		pEntry = (strResolve *) malloc(sizeof(strResolve));
+		ASSERT(pEntry != NULL);
+		pEntry->szHost = strdup(szHost);
+		ASSERT(pEntry->szHost != NULL);
+		pEntry->nState = RESOLVE_FAILED;
+		pEntry->tTime = 0;
+		pEntry->pNext = _pList;
+		_pList = pEntry;
+	}
+	
+	// if it is old (or it failed a while ago) then look it up again.  We 
+	// keep using the old address while the new lookup is going.
+	if (pEntry->nState != RESOLVE_PENDING) {
+		if ((pEntry->nState == RESOLVE_OK && (tNow - pEntry->tTime) >= RESOLVE_TIME) || (pEntry->nState == RESOLVE_FAILED && (tNow - pEntry->tTime) >= RESOLVE_RETRY)) {
+			if (pEntry->nState == RESOLVE_FAILED) {
+				pEntry->nState = RESOLVE_PENDING;
+			}
+			else {
+				// still usable, just mark it so that no-one else starts a lookup.
+				pEntry->tTime = tNow;
+			}
+			
+			pthread_attr_init(&xAttr);
+			pthread_attr_setdetachstate(&xAttr, PTHREAD_CREATE_DETACHED);
+			if (pthread_create(&xThread, &xAttr, LookupThread, pEntry) != 0) {
+				pEntry->nState = RESOLVE_FAILED;
+				pEntry->tTime = tNow;
+			}
+			pthread_attr_destroy(&xAttr);
+		}
+	}
+	
+	nState = pEntry->nState;
+	if (nState == RESOLVE_OK) {
+		*pAddr = pEntry->addr;
+	}
+	
+	_xLock.Unlock();
+	
+	return(nState);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Thread that does the actual lookup.  getaddrinfo is safe to use from 
+// 		a thread, and the entry is never freed, so we can write the result 
+// 		straight into it.
+void *Resolver::LookupThread(void *pArg)
+{
+	strResolve *pEntry;
+	struct addrinfo xHints, *pResult;
+	
+	ASSERT(pArg != NULL);
+	pEntry = (strResolve *) pArg;
+	
+	memset(&xHints, 0, sizeof(xHints));
+	xHints.ai_family = AF_INET;
+	xHints.ai_socktype = SOCK_STREAM;
+	pResult = NULL;
+	
+	if (getaddrinfo(pEntry->szHost, NULL, &xHints, &pResult) == 0 && pResult != NULL) {
+		_xLock.Lock();
+		pEntry->addr = ((struct sockaddr_in *) pResult->ai_addr)->sin_addr;
+		pEntry->nState = RESOLVE_OK;
+		pEntry->tTime = time(NULL);
+		_xLock.Unlock();
+	}
+	else {
+		_xLock.Lock();
+		if (pEntry->nState == RESOLVE_PENDING) {
+			pEntry->nState = RESOLVE_FAILED;
+		}
+		pEntry->tTime = time(NULL);
+		_xLock.Unlock();
+	}
+	
+	if (pResult != NULL) {
+		freeaddrinfo(pResult);
+	}
+	
+	return(NULL);
+}
+
@@ -0,0 +1,81 @@
+//-----------------------------------------------------------------------------
+// resolver.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      Host names (mirrors, and the servers in the config file) are looked
+//      up in a thread of their own so that the network thread never blocks
+//      on DNS.  The answers are kept for a while, so asking again each time
+//      round is cheap.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __RESOLVER_H
+#define __RESOLVER_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+#include <DpLock.h>
+
+//-----------------------------------------------------------------------------
+// The address of a host is kept for this many seconds.  A failed lookup is 
+// tried again after RESOLVE_RETRY.
+#define RESOLVE_TIME     300
+#define RESOLVE_RETRY    30
+
+#define RESOLVE_PENDING     0
+#define RESOLVE_OK          1
+#define RESOLVE_FAILED      2
+
+// A host name that has been (or is being) looked up.  These are never freed, 
+// the thread doing the lookup could still be using it, and there are only 
+// ever a few hosts that we look up by name.
+struct strResolve {
+	char *szHost;
+	int nState;
+	struct in_addr addr;
+	time_t tTime;			// when the lookup finished.
+	strResolve *pNext;
+};
+
+
+class Resolver
+{
+	public:
+		static int Lookup(char *szHost, struct in_addr *pAddr);
+		
+	protected:
+		static void *LookupThread(void *pArg);
+		
+	private:
+		static DpLock _xLock;
+		static strResolve *_pList;
+};
+
+
+#endif
+
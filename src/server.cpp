@@ -34,10 +34,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "server.h"
 #include "config.h"
 #include "logger.h"
+#include "metrics.h"
 
 
 //-----------------------------------------------------------------------------
@@ -49,11 +54,18 @@ Server::Server()
 {
 	Config config;
 	int nPort=0;
-	Logger logger;
+	char *szShm = NULL;
 		
 	Lock();
 	_Client.pList = NULL;
 	_Client.nCount = 0;
+	_pStats = NULL;
+	_pShm = NULL;
+	
+	ApplyConfig();
+	_Loop.nLastEnd = 0;
+	_Loop.tLastWarn = 0;
+	_Loop.nSuppressed = 0;
 	
 	_pNetwork = new Network;
 	if (_pNetwork != NULL) {
@@ -61,16 +73,40 @@ Server::Server()
 		if (_pNetwork->IsListening() == true) {
 	
 			if (config.Get("server", "port", &nPort) == false) {
-				logger.Error("Unable to find server port information in /etc/pacsrv.conf\n");
+				LOG_ERROR(LOG_SERVER, "Unable to find server port information in /etc/pacsrv.conf\n");
 			}
 			else {
 				ASSERT(nPort > 0);
 				if (Listen(nPort) == true) {
 					SetListening();
 				} else {
-					logger.Error("Cannot listen on port %d for Server.", nPort);
+					LOG_ERROR(LOG_SERVER, "Cannot listen on port %d for Server.", nPort);
 				}
-				logger.System("Server listening on port %d", nPort);
+				LOG_SYSTEM(LOG_SERVER, "Server listening on port %d", nPort);
+			}
+			
+			// the stats listener is optional, so it is only started if 
+			// there is a port for it.
+			nPort = 0;
+			if (config.Get("stats", "port", &nPort) == true && nPort > 0) {
+				_pStats = new StatsServer(_pNetwork, nPort);
+				ASSERT(_pStats != NULL);
+			}
+			
+			// the shared memory block for pacsrvtop is on unless it is 
+			// turned off.
+			config.Get("stats", "shm", &szShm);
+			if (szShm == NULL || strcmp(szShm, "none") != 0) {
+				_pShm = new ShmStats;
+				ASSERT(_pShm != NULL);
+				if (_pShm->Open(szShm != NULL ? szShm : (char *) SHM_STATS_NAME) == false) {
+					delete _pShm;
+					_pShm = NULL;
+				}
+			}
+			if (szShm != NULL) {
+				free(szShm);
+				szShm = NULL;
 			}
 		}
 	}
@@ -84,15 +120,17 @@ Server::Server()
 // 		network object since it was created by this instance.
 Server::~Server()
 {
-	Logger logger;
 	Lock();
 	
-	logger.System("Shutting down Server");
+	LOG_SYSTEM(LOG_SERVER, "Shutting down Server");
 	
 	ASSERT((_Client.pList == NULL && _Client.nCount == 0) || (_Client.pList != NULL && _Client.nCount > 0));
 	while(_Client.nCount > 0) {
 		_Client.nCount--;
 		if (_Client.pList[_Client.nCount] != NULL) {
+			if (_pNetwork != NULL) {
+				StopQueries(_Client.pList[_Client.nCount]);
+			}
 			delete _Client.pList[_Client.nCount];
 			_Client.pList[_Client.nCount] = NULL;
 		}
@@ -103,36 +141,91 @@ Server::~Server()
 		_Client.pList = NULL;
 	}
 	
+	// the stats object uses the network, so it has to go first.
+	if (_pStats != NULL) {
+		delete _pStats;
+		_pStats = NULL;
+	}
+	
+	if (_pShm != NULL) {
+		delete _pShm;
+		_pShm = NULL;
+	}
+	
 	if (_pNetwork != NULL) {
 		delete _pNetwork;
 		_pNetwork = NULL;
 	}
 	
-	logger.System("Server shutdown complete");
+	LOG_SYSTEM(LOG_SERVER, "Server shutdown complete");
 	
 	Unlock();
 }
 
 
+//-----------------------------------------------------------------------------
+// CJW: Get our settings out of the config.  This is done when we start, and 
+// 		again from OnIdle() when the config has been reloaded.  The ports 
+// 		still need a restart to change.
+void Server::ApplyConfig(void)
+{
+	Config config;
+	char *szLevel = NULL;
+	char *szCategories = NULL;
+	
+	_nConfigGeneration = Config::GetGeneration();
+	
+	if (config.Get("server", "loop-budget", &_Loop.nBudget) == false || _Loop.nBudget < 0) {
+		_Loop.nBudget = LOOP_BUDGET;
+	}
+	_Loop.nBudget *= 1000;
+	
+	// the log level is set from the config when we start, but if it is 
+	// changed we want to pick it up as well.
+	config.Get("log", "level", &szLevel);
+	config.Get("log", "categories", &szCategories);
+	Logger::SetLevel(szLevel, szCategories);
+	if (szLevel != NULL) { free(szLevel); }
+	if (szCategories != NULL) { free(szCategories); }
+}
+
+
 //-----------------------------------------------------------------------------
 // CJW: An incoming connection was established, and we need to process the 
-// 		socket.
+// 		socket.  Clients on this machine are always allowed, anything else has 
+// 		to be allowed by the [server] allow= and deny= lines.  If we cant tell 
+// 		where the client is, we dont let it in.
 void Server::OnAccept(int nSocket)
 {
+	static strMetric *pRefused = Metrics::Counter("pacsrv_server_refused_total", "Client connections refused by the [server] allow and deny lines.");
 	Client *pTmp;
-	Logger log;
 	char szName[32];
+	struct sockaddr_in sin;
+	socklen_t nLen;
 	
 	ASSERT(nSocket >= 0);
 	
-	pTmp = new Client;
-	pTmp->Accept(nSocket);
-	
-	szName[0] = '\0';
-	pTmp->GetPeerName(szName, 32);
-	log.System("New Client connection received from %s.", szName);
-	
-	AddClient(pTmp);
+	nLen = sizeof(sin);
+	if (getpeername(nSocket, (struct sockaddr *) &sin, &nLen) != 0 || sin.sin_family != AF_INET) {
+		LOG_SYSTEM(LOG_SERVER, "Refused Client connection, unable to get its address.");
+		Metrics::Add(pRefused, 1);
+		close(nSocket);
+	}
+	else if ((ntohl(sin.sin_addr.s_addr) >> 24) != 127 && Config::IsAllowed("server", ntohl(sin.sin_addr.s_addr)) == false) {
+		LOG_SYSTEM(LOG_SERVER, "Refused Client connection from %s.", inet_ntoa(sin.sin_addr));
+		Metrics::Add(pRefused, 1);
+		close(nSocket);
+	}
+	else {
+		pTmp = new Client;
+		pTmp->Accept(nSocket);
+		
+		szName[0] = '\0';
+		pTmp->GetPeerName(szName, 32);
+		LOG_SYSTEM(LOG_SERVER, "New Client connection received from %s.", szName);
+		
+		AddClient(pTmp);
+	}
 }
 
 
@@ -144,11 +237,62 @@ void Server::OnAccept(int nSocket)
 // 		can call functions from it directly.
 void Server::OnIdle(void)
 {
+	static strMetric *pLoop = Metrics::Histogram("pacsrv_server_loop_us", "Time taken by each pass of the server loop.");
+	static strMetric *pLag = Metrics::Histogram("pacsrv_server_loop_lag_us", "Time between the end of one pass of the server loop and the start of the next.");
+	static strMetric *pSlow = Metrics::Counter("pacsrv_slow_phases_total", "Loop phases that took longer than the loop budget.");
+	long long nStart, nTime;
+	int nPasses, nClients;
+	time_t tNow;
+	
 	Lock();
 	ASSERT((_Client.pList == NULL && _Client.nCount == 0) || (_Client.pList != NULL && _Client.nCount > 0));
 	Unlock();
 	
-	ProcessClients();
+	// a SIGHUP asks for the config to be read again.  The network thread 
+	// will notice the new snapshot by itself.
+	if (Config::IsReloadRequested() == true) {
+		if (Config::Reload() == true) {
+			LOG_SYSTEM(LOG_SERVER, "[Server] Reloaded the config (generation %d).", Config::GetGeneration());
+		}
+		else {
+			LOG_ERROR(LOG_SERVER, "[Server] Unable to reload the config, keeping the old one.");
+		}
+	}
+	if (Config::GetGeneration() != _nConfigGeneration) {
+		ApplyConfig();
+	}
+	
+	nStart = GetTimeUs();
+	if (_Loop.nLastEnd > 0) {
+		Metrics::Record(pLag, nStart - _Loop.nLastEnd);
+	}
+	
+	nPasses = ProcessClients();
+	
+	_Loop.nLastEnd = GetTimeUs();
+	nTime = _Loop.nLastEnd - nStart;
+	Metrics::Record(pLoop, nTime);
+	
+	// if it was slow, log it with what we were doing.
+	if (_Loop.nBudget > 0 && nTime > _Loop.nBudget) {
+		Metrics::Add(pSlow, 1);
+		tNow = time(NULL);
+		if ((tNow - _Loop.tLastWarn) >= LOOP_WARN_TIME) {
+			Lock();
+			nClients = _Client.nCount;
+			Unlock();
+			LOG_SYSTEM(LOG_SERVER, "[Server] Slow phase: ProcessClients took %lld ms (budget %d ms). %d client slots, %d passes of the clients, %d other slow passes since the last warning.", nTime / 1000, _Loop.nBudget / 1000, nClients, nPasses, _Loop.nSuppressed);
+			_Loop.tLastWarn = tNow;
+			_Loop.nSuppressed = 0;
+		}
+		else {
+			_Loop.nSuppressed++;
+		}
+	}
+	
+	if (_pShm != NULL && _pShm->IsDue() == true) {
+		PublishStats();
+	}
 }
 
 
@@ -164,16 +308,13 @@ void Server::OnIdle(void)
 // 		it is now waiting for.  If the network has already retreived it, then 
 // 		it will reply with the chunk.   If the chunk has not yet arrived from 
 // 		the network, then the it will ask again the next time.   Very simple, 
-// 		if not the most efficient.
-void Server::ProcessClients(void)
+// 		if not the most efficient.  Returns the number of times we went thru 
+// 		the clients.
+int Server::ProcessClients(void)
 {
-	int i;
+	int i, n, nSlots;
 	int max=0;
-	char *szQuery;
-	int nChunk, nSize, nLength;
-	char *pData;
 	bool bIdle, bCheck;
-	Logger log;
 	
 	Lock();
 	
@@ -189,45 +330,27 @@ void Server::ProcessClients(void)
 		for (i=0; i<_Client.nCount; i++) {
 			if (_Client.pList[i] != NULL) {
 				if (_Client.pList[i]->IsClosed() == true) {
-					// The client is no longer connected, so we should remove it from the list.
-					log.System("Deleting client that has been closed");
+					// The client is no longer connected, so we should remove 
+					// it from the list, and let the network know that it 
+					// doesnt need the file anymore.
+					LOG_SYSTEM(LOG_SERVER, "Deleting client that has been closed");
+					StopQueries(_Client.pList[i]);
 					delete _Client.pList[i];
 					_Client.pList[i] = NULL;
 				}
 				else {
-					
-					szQuery = NULL;
-					if (_Client.pList[i]->QueryData(&szQuery, &nChunk) == true) {
-						// this client had a file query request... pass it on 
-						// to the network.   This doesnt mean that it is a new 
-						// file.  It just means that the client is waiting for 
-						// a part of a file.  The network node will determine 
-						// if we have asked the network for the file.  
-						
-						ASSERT(szQuery != NULL);
-						ASSERT(nChunk >= 0);
-						
-						if (_pNetwork->RunQuery(szQuery, nChunk, &pData, &nSize, &nLength) == true) {
-							ASSERT(pData != NULL && nSize > 0 && nLength > 0);
-							// The client doesnt really know the size of the 
-							// file until we start getting some chunks.  The 
-							// network will know a little bit sooner, but why 
-							// make it complicated by processing that 
-							// information before a chunk arrives.  Since we 
-							// got some data from the network, we will pass it 
-							// back to the client and then indicate that we 
-							// arent idle.  If the network doesnt have the 
-							// chunk yet, then we will ask again next time we 
-							// loop thru.
-							
-							_Client.pList[i]->QueryResult(nChunk, pData, nSize, nLength);
-							
-							// The Idle flag just means we had some data ready 
-							// to send to at least once client.  So that we 
-							// can send as much information as possible to the 
-							// client in each iteration (of all the clients), 
-							// we want it to immediately check to see if there 
-							// is more data to send to the client.
+					// a client can be downloading a number of files at 
+					// once, so we process each of its streams.
+					nSlots = _Client.pList[i]->GetStreamSlots();
+					for (n=0; n<nSlots; n++) {
+						if (ProcessStream(_Client.pList[i], n) == true) {
+							// The Idle flag just means we had some data 
+							// ready to send to at least once client.  So 
+							// that we can send as much information as 
+							// possible to the client in each iteration (of 
+							// all the clients), we want it to immediately 
+							// check to see if there is more data to send to 
+							// the client.
 							bIdle = false;
 						}
 					}
@@ -252,6 +375,110 @@ void Server::ProcessClients(void)
 	}
 		
 	Unlock();
+	
+	return(max);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Process one stream of a client.  If the client has just asked for a 
+//      file, then we let the network know, so that it can find it (and where 
+//      the mirror has it, if the client told us).  Then we 
+//      ask the network for any chunks the client is waiting for.  When the 
+//      stream is finished with, we let the network know that it doesnt need 
+//      the file for this client anymore.  Returns true if we sent any data 
+//      to the client.
+bool Server::ProcessStream(Client *pClient, int nSlot)
+{
+	bool bSent = false;
+	char *szQuery;
+	char *szUrl;
+	int pChunks[CLIENT_WINDOW];
+	int nCount, nSize, nLength;
+	char *pData;
+	int j;
+	
+	ASSERT(pClient != NULL && nSlot >= 0);
+	ASSERT(_pNetwork != NULL);
+	
+	szQuery = NULL;
+	if (pClient->QueryStart(nSlot, &szQuery) == true) {
+		ASSERT(szQuery != NULL);
+		_pNetwork->StartQuery(szQuery);
+	}
+	
+	// if the client told us where the file is on the mirror, the network 
+	// can get some of it from there while it searches.
+	szQuery = NULL;
+	szUrl = NULL;
+	if (pClient->QueryMirror(nSlot, &szQuery, &szUrl) == true) {
+		ASSERT(szQuery != NULL && szUrl != NULL);
+		_pNetwork->SetMirror(szQuery, szUrl);
+	}
+	
+	szQuery = NULL;
+	nCount = pClient->QueryData(nSlot, &szQuery, pChunks, CLIENT_WINDOW);
+	for (j=0; j<nCount; j++) {
+		// this client had a file query request... pass it on to the 
+		// network.   This doesnt mean that it is a new file.  It just means 
+		// that the client is waiting for some parts of a file.  
+		
+		ASSERT(szQuery != NULL);
+		ASSERT(pChunks[j] >= 0);
+		
+		if (_pNetwork->RunQuery(szQuery, pChunks[j], &pData, &nSize, &nLength) == false) {
+			// we dont have the chunk yet, but if the network knows how big 
+			// the file is, the client can be told now.  Knowing how big it 
+			// is doesnt mean that anyone has it though.
+			if (_pNetwork->IsNotFound(szQuery) == true) {
+				// the network has already looked, and nobody has it.
+				pClient->QueryNotFound(nSlot);
+				j = nCount;
+			}
+			else if (nLength > 0) {
+				pClient->QueryLength(nSlot, nLength);
+			}
+		}
+		else {
+			ASSERT(pData != NULL && nSize > 0 && nLength > 0);
+			// Since we got some data from the network, we will pass it back 
+			// to the client.  If the network doesnt have the chunk yet, then 
+			// we will ask again next time we loop thru.
+			pClient->QueryResult(nSlot, pChunks[j], pData, nSize, nLength);
+			bSent = true;
+		}
+	}
+	
+	szQuery = NULL;
+	if (pClient->QueryFinished(nSlot, &szQuery) == true) {
+		ASSERT(szQuery != NULL);
+		_pNetwork->EndQuery(szQuery);
+		pClient->QueryRelease(nSlot);
+	}
+	
+	return(bSent);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: The client is going away, so we need to let the network know that it 
+//      doesnt need any of the files that the client was still getting.
+void Server::StopQueries(Client *pClient)
+{
+	char *szQuery;
+	int n, nSlots;
+	
+	ASSERT(pClient != NULL);
+	ASSERT(_pNetwork != NULL);
+	
+	nSlots = pClient->GetStreamSlots();
+	for (n=0; n<nSlots; n++) {
+		szQuery = NULL;
+		if (pClient->QueryStop(n, &szQuery) == true) {
+			ASSERT(szQuery != NULL);
+			_pNetwork->EndQuery(szQuery);
+		}
+	}
 }
 
 
@@ -285,3 +512,104 @@ void Server::AddClient(Client *pClient)
 	Unlock();
 }
 
+
+//-----------------------------------------------------------------------------
+// CJW: Fill in the shared stats block for pacsrvtop, and publish it.  The 
+// 		nodes and files are copied out of the network (which only locks it 
+// 		while they are copied), the client streams are got from each client, 
+// 		and the timings come from the latency histograms in the metrics.
+void Server::PublishStats(void)
+{
+	strShmStats *pBlock;
+	strNodeStats *pNodes;
+	strFileStats *pFiles;
+	strStreamStats *pStreams;
+	strMetric *pMetric;
+	strShmTiming *pTiming;
+	long long nNow;
+	int nCount, nStreams, i;
+	
+	ASSERT(_pShm != NULL);
+	ASSERT(_pNetwork != NULL);
+	
+	pBlock = _pShm->GetBlock();
+	ASSERT(pBlock != NULL);
+	
+	pNodes = _pNetwork->GetNodeStats(&nCount);
+	pBlock->nTotalNodes = nCount;
+	pBlock->nNodes = 0;
+	for (i=0; i<nCount && i<SHM_MAX_NODES; i++) {
+		pBlock->pNodes[i].nID = pNodes[i].nID;
+		pBlock->pNodes[i].nRtt = pNodes[i].nRtt;
+		pBlock->pNodes[i].nUploadRate = pNodes[i].nUploadRate;
+		pBlock->pNodes[i].nQueued = pNodes[i].nQueued;
+		pBlock->pNodes[i].nBytesOut = pNodes[i].nBytesOut;
+		pBlock->pNodes[i].bRelay = pNodes[i].bRelay;
+		pBlock->pNodes[i].bDownloading = pNodes[i].bDownloading;
+		pBlock->pNodes[i].bChunkPending = pNodes[i].bChunkPending;
+		pBlock->pNodes[i].bUploading = pNodes[i].bUploading;
+		pBlock->nNodes++;
+	}
+	if (pNodes != NULL) { free(pNodes); pNodes = NULL; }
+	
+	pFiles = _pNetwork->GetFileStats(&nCount);
+	pBlock->nTotalFiles = nCount;
+	pBlock->nFiles = 0;
+	for (i=0; i<nCount && i<SHM_MAX_FILES; i++) {
+		strncpy(pBlock->pFiles[i].szFile, pFiles[i].szFile, SHM_NAME_SIZE-1);
+		pBlock->pFiles[i].szFile[SHM_NAME_SIZE-1] = '\0';
+		pBlock->pFiles[i].nChunks = pFiles[i].nChunks;
+		pBlock->pFiles[i].nReceived = pFiles[i].nReceived;
+		pBlock->pFiles[i].nRequested = pFiles[i].nRequested;
+		pBlock->pFiles[i].nUsers = pFiles[i].nUsers;
+		pBlock->pFiles[i].bLocal = pFiles[i].bLocal;
+		pBlock->nFiles++;
+	}
+	if (pFiles != NULL) { free(pFiles); pFiles = NULL; }
+	
+	pStreams = (strStreamStats *) malloc(sizeof(strStreamStats) * SHM_MAX_CLIENTS);
+	ASSERT(pStreams != NULL);
+	nStreams = 0;
+	nCount = 0;
+	Lock();
+	for (i=0; i<_Client.nCount; i++) {
+		if (_Client.pList[i] != NULL) {
+			nStreams += _Client.pList[i]->GetStreamStats(&pStreams[nStreams], SHM_MAX_CLIENTS - nStreams);
+			nCount++;
+		}
+	}
+	Unlock();
+	
+	nNow = GetTimeMs();
+	pBlock->nConnections = nCount;
+	pBlock->nClients = nStreams;
+	for (i=0; i<nStreams; i++) {
+		pBlock->pClients[i].nClient = pStreams[i].nClient;
+		pBlock->pClients[i].nStream = pStreams[i].nStream;
+		strncpy(pBlock->pClients[i].szFile, pStreams[i].szQuery, SHM_NAME_SIZE-1);
+		pBlock->pClients[i].szFile[SHM_NAME_SIZE-1] = '\0';
+		pBlock->pClients[i].nWaiting = pStreams[i].nChunk;
+		pBlock->pClients[i].nChunks = pStreams[i].nChunks;
+		pBlock->pClients[i].nSent = pStreams[i].nSent;
+		pBlock->pClients[i].nWaitMs = (int) (nNow - pStreams[i].nLast);
+	}
+	free(pStreams);
+	
+	pBlock->nTimings = 0;
+	pMetric = Metrics::GetFirst();
+	while (pMetric != NULL && pBlock->nTimings < SHM_MAX_TIMINGS) {
+		if (pMetric->nType == METRIC_HISTOGRAM) {
+			pTiming = &pBlock->pTimings[pBlock->nTimings];
+			strncpy(pTiming->szName, pMetric->szName, SHM_NAME_SIZE-1);
+			pTiming->szName[SHM_NAME_SIZE-1] = '\0';
+			pTiming->nCount = pMetric->nValue;
+			pTiming->nMean = pTiming->nCount > 0 ? pMetric->nSum / pTiming->nCount : 0;
+			pTiming->nP50 = Metrics::GetPercentile(pMetric, 50);
+			pTiming->nP99 = Metrics::GetPercentile(pMetric, 99);
+			pBlock->nTimings++;
+		}
+		pMetric = pMetric->pNext;
+	}
+	
+	_pShm->Publish();
+}
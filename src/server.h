@@ -49,6 +49,8 @@
 #include "baseserver.h"
 #include "client.h"
 #include "network.h"
+#include "stats.h"
+#include "shmstats.h"
 
 class Server : public BaseServer
 {
@@ -61,15 +63,30 @@ class Server : public BaseServer
 		virtual void OnIdle(void);
 		
 	private:
+		void ApplyConfig(void);
 		void CheckConnections(void);
-		void ProcessClients(void);
+		int ProcessClients(void);
+		bool ProcessStream(Client *pClient, int nSlot);
+		void StopQueries(Client *pClient);
 		void AddClient(Client *pClient);
+		void PublishStats(void);
 		
 		struct {
 			Client **pList;
 			int nCount;
 		} _Client;
 		Network *_pNetwork;
+		StatsServer *_pStats;		// NULL if there is no [stats] port.
+		ShmStats *_pShm;			// NULL if shm=none in [stats].
+		int _nConfigGeneration;		// the config snapshot our settings came from.
+		
+		// ProcessClients() is timed, and logged if it goes over the budget.
+		struct {
+			int nBudget;			// us, 0 if it isnt logged.
+			long long nLastEnd;		// when the last pass finished (us).
+			time_t tLastWarn;
+			int nSuppressed;		// slow passes not logged since the last warning.
+		} _Loop;
 };
 
 
@@ -42,6 +42,7 @@ ServerInfo::ServerInfo()
 	_nLastTime = 0;
 	_nFailed = 0;
 	_bConnected = false;
+	_nType = SERVER_TYPE_DIRECT;
 }
 		
 //-----------------------------------------------------------------------------
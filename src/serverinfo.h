@@ -54,6 +54,7 @@ struct ServerInfo
 		time_t  _nLastTime;
 		int     _nFailed;
 		bool 	_bConnected;
+		int		_nType;			// SERVER_TYPE_RELAY once it has told us it is one.
 };
 
 
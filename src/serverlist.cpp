@@ -31,6 +31,11 @@
  ***************************************************************************/
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include "serverlist.h"
 
@@ -72,8 +77,9 @@ ServerList::~ServerList()
 //
 //		To accomplish this, we will go thru the list of servers one at 
 //		a time, and keep track of the one with the oldest attempt-time, 
-//		and least number of failures.
-ServerInfo * ServerList::GetNextServer(void)
+//		and least number of failures.  If bRelay is true, then we only 
+//		want a server that we know is a relay.
+ServerInfo * ServerList::GetNextServer(bool bRelay)
 {
 	ServerInfo *pInfo = NULL;
 	time_t nTime;
@@ -81,7 +87,7 @@ ServerInfo * ServerList::GetNextServer(void)
 			
 	nTime = time(NULL);
 	for(i=0; i<_nItems; i++) {
-		if (_pList[i] != NULL) {
+		if (_pList[i] != NULL && (bRelay == false || _pList[i]->_nType == SERVER_TYPE_RELAY)) {
 			if (_pList[i]->_bConnected == false) {
 				if (_pList[i]->_nLastTime == 0) {
 					if (pInfo == NULL) { 
@@ -89,7 +95,7 @@ ServerInfo * ServerList::GetNextServer(void)
 						i=_nItems;
 					}
 				}
-				else if ((nTime - _pList[i]->_nLastTime) < NODE_WAIT_TIME) {
+				else if ((nTime - _pList[i]->_nLastTime) >= NODE_WAIT_TIME) {
 					if (pInfo == NULL) { pInfo = _pList[i]; }
 					else {
 						if (pInfo->_nFailed > _pList[i]->_nFailed) {
@@ -115,7 +121,7 @@ ServerInfo * ServerList::GetNextServer(void)
 //---------------------------------------------------------------------
 // CJW: Convert the server and port information into an address, and 
 // 		then add it to our list.
-void ServerList::AddServer(char *szServer, int nPort)
+ServerInfo * ServerList::AddServer(char *szServer, int nPort)
 {
 	Address *pAddress;
 	
@@ -123,26 +129,163 @@ void ServerList::AddServer(char *szServer, int nPort)
 	pAddress = new Address;
 	pAddress->Set(szServer, nPort);
 	
-	AddServer(pAddress);
+	return(AddServer(pAddress));
 }
 		
 
 //---------------------------------------------------------------------
-// CJW: Add a server to the list.
-void ServerList::AddServer(Address *pAddress)
+// CJW: Add a server to the list.  The list takes control of the address 
+// 		object.  If the server is already in the list, then we dont add it 
+// 		again, we delete the address and return the one we already have.
+ServerInfo * ServerList::AddServer(Address *pAddress)
 {
 	ServerInfo *pInfo;
 	
 	ASSERT(pAddress != NULL);
 	ASSERT((_pList == NULL && _nItems == 0) || (_pList != NULL && _nItems >= 0));
+	
+	pInfo = FindServer(pAddress);
+	if (pInfo != NULL) {
+		delete pAddress;
+	}
+	else {
+		pInfo = new ServerInfo;
+		pInfo->_pAddress = pAddress;
 			
-	pInfo = new ServerInfo;
-	pInfo->_pAddress = pAddress;
-			
-	_pList = (ServerInfo **) realloc(_pList, sizeof(ServerInfo *) * (_nItems+1));
-	ASSERT(_pList != NULL);
-	_pList[_nItems] = pInfo;
-	_nItems++;
+		_pList = (ServerInfo **) realloc(_pList, sizeof(ServerInfo *) * (_nItems+1));
+		ASSERT(_pList != NULL);
+		_pList[_nItems] = pInfo;
+		_nItems++;
+	}
+	
+	return(pInfo);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Look in the list for a server with this address.  Return NULL if 
+// 		we dont have it.
+ServerInfo * ServerList::FindServer(Address *pAddress)
+{
+	ServerInfo *pInfo = NULL;
+	int i;
+	
+	ASSERT(pAddress != NULL);
+	
+	for (i=0; i<_nItems && pInfo == NULL; i++) {
+		if (_pList[i] != NULL) {
+			ASSERT(_pList[i]->_pAddress != NULL);
+			if (_pList[i]->_pAddress->IsSame(pAddress) == true) {
+				pInfo = _pList[i];
+			}
+		}
+	}
+	
+	return(pInfo);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Load the list of servers that we saved the last time we were 
+// 		running.  Each line in the file is an ip address and port, and 
+// 		the type if it is a relay.  
+// 		These servers are added to the list just like any other server, 
+// 		so that we can connect to them straight away without having to 
+// 		rely on the query host.  Returns false if we couldnt read the file.
+bool ServerList::Load(char *szFile)
+{
+	bool bLoaded = false;
+	FILE *fp;
+	char szLine[256];
+	char szServer[MAX_SERVER_LEN + 1];
+	int nPort, nType;
+	ServerInfo *pInfo;
+	
+	ASSERT(szFile != NULL);
+	
+	fp = fopen(szFile, "r");
+	if (fp != NULL) {
+		while (fgets(szLine, sizeof(szLine), fp) != NULL) {
+			nType = SERVER_TYPE_DIRECT;
+			if (sscanf(szLine, "%15s %d %d", szServer, &nPort, &nType) >= 2) {
+				if (nPort > 0 && nPort < 65536) {
+					pInfo = AddServer(szServer, nPort);
+					ASSERT(pInfo != NULL);
+					if (nType == SERVER_TYPE_RELAY) {
+						pInfo->_nType = nType;
+					}
+				}
+			}
+		}
+		fclose(fp);
+		bLoaded = true;
+	}
+	
+	return(bLoaded);
 }
 
 
+//---------------------------------------------------------------------
+// CJW: Save the list of servers so that we can use them the next time 
+// 		we start.  We dont bother saving servers that we keep failing to 
+// 		connect to.  Returns false if we couldnt write the file.
+bool ServerList::Save(char *szFile)
+{
+	bool bSaved = false;
+	char *szTemp, *pSlash;
+	FILE *fp;
+	int i;
+	
+	ASSERT(szFile != NULL);
+	
+	// the directory wont be there the first time we save (the default one 
+	// is in /var/cache), so we make it if we can.
+	szTemp = (char *) malloc(strlen(szFile) + 5);
+	ASSERT(szTemp != NULL);
+	strcpy(szTemp, szFile);
+	pSlash = strrchr(szTemp, '/');
+	if (pSlash != NULL && pSlash != szTemp) {
+		*pSlash = '\0';
+		mkdir(szTemp, 0755);
+	}
+	
+	// the list is written to a temp file and then renamed over the old one, 
+	// so if we crash part way thru, we still have the last list.
+	sprintf(szTemp, "%s.tmp", szFile);
+	
+	fp = fopen(szTemp, "w");
+	if (fp != NULL) {
+		bSaved = true;
+		for (i=0; i<_nItems; i++) {
+			if (_pList[i] != NULL) {
+				ASSERT(_pList[i]->_pAddress != NULL);
+				if (_pList[i]->_nFailed < NODE_SAVE_FAILS) {
+					if (_pList[i]->_nType == SERVER_TYPE_RELAY) {
+						fprintf(fp, "%s %d %d\n", _pList[i]->_pAddress->GetServer(), _pList[i]->_pAddress->GetPort(), _pList[i]->_nType);
+					}
+					else {
+						fprintf(fp, "%s %d\n", _pList[i]->_pAddress->GetServer(), _pList[i]->_pAddress->GetPort());
+					}
+				}
+			}
+		}
+		
+		if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+			bSaved = false;
+		}
+		if (fclose(fp) != 0) {
+			bSaved = false;
+		}
+		
+		if (bSaved == true && rename(szTemp, szFile) != 0) {
+			bSaved = false;
+		}
+		if (bSaved == false) {
+			unlink(szTemp);
+		}
+	}
+	
+	free(szTemp);
+	
+	return(bSaved);
+}
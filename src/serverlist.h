@@ -50,6 +50,11 @@
 // of time we must wait before attempting that particular server again.
 #define NODE_WAIT_TIME	300
 
+//-----------------------------------------------------------------------------
+// When saving the server list, any server that has failed this many times in 
+// a row is not worth remembering.
+#define NODE_SAVE_FAILS	3
+
 
 
 
@@ -64,9 +69,13 @@ class ServerList
 		ServerList();
 		virtual ~ServerList();
 		
-		void AddServer(char *szServer, int nPort);
-		void AddServer(Address *pServerInfo);
-		ServerInfo * GetNextServer(void);
+		ServerInfo * AddServer(char *szServer, int nPort);
+		ServerInfo * AddServer(Address *pServerInfo);
+		ServerInfo * FindServer(Address *pAddress);
+		ServerInfo * GetNextServer(bool bRelay);
+		
+		bool Load(char *szFile);
+		bool Save(char *szFile);
 		
     
     protected:
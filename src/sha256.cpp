@@ -0,0 +1,185 @@
+//-----------------------------------------------------------------------------
+// sha256.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See sha256.h for details.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+
+#include <DevPlus.h>
+
+#include "sha256.h"
+
+
+static const unsigned int _pK[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x,n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+
+//---------------------------------------------------------------------
+// CJW: Constructor.  Start with the initial hash values.
+Sha256::Sha256()
+{
+	_pState[0] = 0x6a09e667;
+	_pState[1] = 0xbb67ae85;
+	_pState[2] = 0x3c6ef372;
+	_pState[3] = 0xa54ff53a;
+	_pState[4] = 0x510e527f;
+	_pState[5] = 0x9b05688c;
+	_pState[6] = 0x1f83d9ab;
+	_pState[7] = 0x5be0cd19;
+	_nBuffer = 0;
+	_nTotal = 0;
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Deconstructor.  Nothing to clean up.
+Sha256::~Sha256()
+{
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Process one 64 byte block.
+void Sha256::Transform(const unsigned char *pBlock)
+{
+	unsigned int w[64];
+	unsigned int a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+	
+	ASSERT(pBlock != NULL);
+	
+	for (i=0; i<16; i++) {
+		w[i] = (pBlock[i*4] << 24) | (pBlock[i*4+1] << 16) | (pBlock[i*4+2] << 8) | pBlock[i*4+3];
+	}
+	for (i=16; i<64; i++) {
+		w[i] = (ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10)) + w[i-7] 
+		     + (ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3)) + w[i-16];
+	}
+	
+	a = _pState[0]; b = _pState[1]; c = _pState[2]; d = _pState[3];
+	e = _pState[4]; f = _pState[5]; g = _pState[6]; h = _pState[7];
+	
+	for (i=0; i<64; i++) {
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + _pK[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	
+	_pState[0] += a; _pState[1] += b; _pState[2] += c; _pState[3] += d;
+	_pState[4] += e; _pState[5] += f; _pState[6] += g; _pState[7] += h;
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Add some more data to the hash.
+void Sha256::Update(const char *pData, int nLength)
+{
+	int nCopy;
+	
+	ASSERT(pData != NULL || nLength == 0);
+	ASSERT(nLength >= 0);
+	
+	_nTotal += nLength;
+	while (nLength > 0) {
+		nCopy = 64 - _nBuffer;
+		if (nCopy > nLength) { nCopy = nLength; }
+		memcpy(&_pBuffer[_nBuffer], pData, nCopy);
+		_nBuffer += nCopy;
+		pData += nCopy;
+		nLength -= nCopy;
+		
+		if (_nBuffer == 64) {
+			Transform(_pBuffer);
+			_nBuffer = 0;
+		}
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Pad out the last block and return the 32 byte digest.  The object 
+// 		shouldnt be used again after this.
+void Sha256::Final(unsigned char *pDigest)
+{
+	unsigned long long nBits;
+	int i;
+	
+	ASSERT(pDigest != NULL);
+	
+	nBits = _nTotal * 8;
+	_pBuffer[_nBuffer++] = 0x80;
+	if (_nBuffer > 56) {
+		memset(&_pBuffer[_nBuffer], 0, 64 - _nBuffer);
+		Transform(_pBuffer);
+		_nBuffer = 0;
+	}
+	memset(&_pBuffer[_nBuffer], 0, 56 - _nBuffer);
+	for (i=0; i<8; i++) {
+		_pBuffer[63 - i] = (unsigned char) (nBits >> (i * 8));
+	}
+	Transform(_pBuffer);
+	_nBuffer = 0;
+	
+	for (i=0; i<8; i++) {
+		pDigest[i*4]   = (_pState[i] >> 24) & 0xff;
+		pDigest[i*4+1] = (_pState[i] >> 16) & 0xff;
+		pDigest[i*4+2] = (_pState[i] >> 8) & 0xff;
+		pDigest[i*4+3] = _pState[i] & 0xff;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Write the digest as lowercase hex, the way the sync databases have 
+// 		it.  szHex needs room for (SHA256_SIZE*2)+1 chars.
+void Sha256::ToHex(unsigned char *pDigest, char *szHex)
+{
+	int i;
+	
+	ASSERT(pDigest != NULL && szHex != NULL);
+	
+	for (i=0; i<SHA256_SIZE; i++) {
+		sprintf(&szHex[i*2], "%02x", pDigest[i]);
+	}
+	szHex[SHA256_SIZE*2] = '\0';
+}
@@ -0,0 +1,63 @@
+//-----------------------------------------------------------------------------
+// sha256.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      A small SHA-256 implementation, so that files got from the network can
+//      be checked against the checksums in the pacman sync databases before
+//      they are put in the package cache.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#define SHA256_SIZE     32
+
+
+class Sha256 
+{
+    public:
+        Sha256();
+        virtual ~Sha256();
+
+        void Update(const char *pData, int nLength);
+        void Final(unsigned char *pDigest);
+        
+        static void ToHex(unsigned char *pDigest, char *szHex);
+    
+    private:
+        void Transform(const unsigned char *pBlock);
+        
+        unsigned int _pState[8];
+        unsigned char _pBuffer[64];
+        int _nBuffer;               // bytes waiting in the buffer.
+        unsigned long long _nTotal; // total bytes added.
+};
+
+
+#endif
+
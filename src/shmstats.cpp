@@ -0,0 +1,181 @@
+//-----------------------------------------------------------------------------
+// shmstats.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See "shmstats.h" for more information about this class.
+//
+//-----------------------------------------------------------------------------
+
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <DevPlus.h>
+
+#include "shmstats.h"
+#include "common.h"
+#include "logger.h"
+
+
+//-----------------------------------------------------------------------------
+// CJW: Constructor.  Nothing is shared until Open() is called.
+ShmStats::ShmStats()
+{
+	_szName = NULL;
+	_pShared = NULL;
+	_pBlock = NULL;
+	_nLast = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Deconstructor.  The segment is removed, so that pacsrvtop can tell 
+// 		that we arent running anymore.
+ShmStats::~ShmStats()
+{
+	if (_pShared != NULL) {
+		munmap(_pShared, sizeof(strShmStats));
+		_pShared = NULL;
+	}
+	
+	if (_szName != NULL) {
+		shm_unlink(_szName);
+		free(_szName);
+		_szName = NULL;
+	}
+	
+	if (_pBlock != NULL) {
+		free(_pBlock);
+		_pBlock = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Create the shared memory segment (or take over one that was left 
+// 		behind) and map it in.  Returns false if we couldnt, in which case 
+// 		nothing will be published.
+bool ShmStats::Open(char *szName)
+{
+	bool bOpened = false;
+	int fd;
+	void *pMap;
+	
+	ASSERT(szName != NULL);
+	ASSERT(_pShared == NULL && _szName == NULL);
+	
+	fd = shm_open(szName, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		LOG_ERROR(LOG_SERVER, "[Stats] Unable to create shared memory %s", szName);
+	}
+	else {
+		if (ftruncate(fd, sizeof(strShmStats)) != 0) {
+			LOG_ERROR(LOG_SERVER, "[Stats] Unable to size shared memory %s", szName);
+		}
+		else {
+			pMap = mmap(NULL, sizeof(strShmStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (pMap == MAP_FAILED) {
+				LOG_ERROR(LOG_SERVER, "[Stats] Unable to map shared memory %s", szName);
+			}
+			else {
+				_pShared = (strShmStats *) pMap;
+				_szName = strdup(szName);
+				ASSERT(_szName != NULL);
+				
+				_pBlock = (strShmStats *) calloc(1, sizeof(strShmStats));
+				ASSERT(_pBlock != NULL);
+				
+				// whatever was left in it by a daemon that didnt shut down 
+				// cleanly is cleared out, but the sequence carries on so 
+				// that a reader that is watching doesnt get confused.
+				_pBlock->nSeq = _pShared->nSeq & ~1u;
+				_pShared->nSeq = _pBlock->nSeq + 1;
+				__sync_synchronize();
+				memset(((char *) _pShared) + sizeof(_pShared->nSeq), 0, sizeof(strShmStats) - sizeof(_pShared->nSeq));
+				_pShared->nVersion = SHM_STATS_VERSION;
+				_pShared->nPid = getpid();
+				__sync_synchronize();
+				_pShared->nSeq = _pBlock->nSeq + 2;
+				
+				LOG_SYSTEM(LOG_SERVER, "[Stats] Publishing stats in shared memory %s", szName);
+				bOpened = true;
+			}
+		}
+		close(fd);
+	}
+	
+	return(bOpened);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if it is time to publish the block again.
+bool ShmStats::IsDue(void)
+{
+	return(_pShared != NULL && (GetTimeMs() - _nLast) >= SHM_STATS_TIME);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the copy of the block that should be filled in before calling 
+// 		Publish().  
+strShmStats * ShmStats::GetBlock(void)
+{
+	ASSERT(_pBlock != NULL);
+	return(_pBlock);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Copy the block into the shared memory.  The sequence is made odd 
+// 		while it is being copied, so that a reader knows to try again.  Only 
+// 		the Server thread calls this, so there is only ever one writer.
+void ShmStats::Publish(void)
+{
+	unsigned int nSeq;
+	
+	ASSERT(_pShared != NULL && _pBlock != NULL);
+	
+	_nLast = GetTimeMs();
+	_pBlock->nVersion = SHM_STATS_VERSION;
+	_pBlock->nPid = getpid();
+	_pBlock->nUpdated = _nLast;
+	
+	nSeq = _pShared->nSeq;
+	ASSERT((nSeq & 1) == 0);
+	
+	_pShared->nSeq = nSeq + 1;
+	__sync_synchronize();
+	memcpy(((char *) _pShared) + sizeof(_pShared->nSeq), ((char *) _pBlock) + sizeof(_pBlock->nSeq), sizeof(strShmStats) - sizeof(_pShared->nSeq));
+	__sync_synchronize();
+	_pShared->nSeq = nSeq + 2;
+}
@@ -0,0 +1,156 @@
+//-----------------------------------------------------------------------------
+// shmstats.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      A block of statistics that the daemon keeps in POSIX shared memory, 
+//      so that pacsrvtop can show what it is doing without talking to it.  
+//      The Server object fills in a copy of the block once a second and then 
+//      copies it into the shared memory.  
+//
+//      The block is protected by a sequence lock.  The daemon makes nSeq odd 
+//      before it starts writing and even again when it has finished, so a 
+//      reader copies the block and then checks that nSeq was the same even 
+//      number before and after.  If it wasnt, it tries again.  The daemon 
+//      never waits for a reader.
+//
+//      This file is also used by pacsrvtop, so it must not need anything 
+//      from the daemon.
+//
+//-----------------------------------------------------------------------------
+
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __SHMSTATS_H
+#define __SHMSTATS_H
+
+//-----------------------------------------------------------------------------
+// Name of the shared memory segment, unless there is a shm in the [stats] 
+// part of the config.  The version is changed whenever the block changes.
+#define SHM_STATS_NAME      "/pacsrv-stats"
+#define SHM_STATS_VERSION   1
+
+// Milliseconds between each update of the block.
+#define SHM_STATS_TIME      1000
+
+// Size of the lists in the block.  If there are more than this, the rest are 
+// only counted.
+#define SHM_MAX_NODES       64
+#define SHM_MAX_FILES       64
+#define SHM_MAX_CLIENTS     64
+#define SHM_MAX_TIMINGS     32
+#define SHM_NAME_SIZE       96
+
+
+struct strShmNode {
+	int nID;
+	int nRtt;				// ms, 0 if not known yet.
+	int nUploadRate;		// bytes per second.
+	int nQueued;			// chunks it has asked for that we havent sent.
+	long long nBytesOut;
+	char bRelay;
+	char bDownloading;
+	char bChunkPending;
+	char bUploading;
+};
+
+struct strShmFile {
+	char szFile[SHM_NAME_SIZE];
+	int nChunks;			// 0 if we dont know the length yet.
+	int nReceived;
+	int nRequested;			// asked of a node and not arrived yet.
+	int nUsers;
+	char bLocal;
+};
+
+struct strShmClient {
+	int nClient;
+	int nStream;
+	char szFile[SHM_NAME_SIZE];
+	int nWaiting;			// chunk the client is waiting for.
+	int nChunks;			// 0 if we dont know the length yet.
+	int nSent;
+	int nWaitMs;			// time since the last chunk was sent (or the stream started).
+};
+
+// A latency histogram from the metrics, such as how long each pass of the 
+// network and server loops took.
+struct strShmTiming {
+	char szName[SHM_NAME_SIZE];
+	long long nCount;
+	long long nMean;
+	long long nP50;
+	long long nP99;
+};
+
+struct strShmStats {
+	volatile unsigned int nSeq;
+	int nVersion;
+	int nPid;
+	long long nUpdated;		// time (ms) the block was last written.
+	
+	int nNodes;				// number in the list.
+	int nTotalNodes;		// number we have.
+	strShmNode pNodes[SHM_MAX_NODES];
+	
+	int nFiles;
+	int nTotalFiles;
+	strShmFile pFiles[SHM_MAX_FILES];
+	
+	int nClients;			// streams in the list.
+	int nConnections;		// clients that are connected.
+	strShmClient pClients[SHM_MAX_CLIENTS];
+	
+	int nTimings;
+	strShmTiming pTimings[SHM_MAX_TIMINGS];
+};
+
+
+//-----------------------------------------------------------------------------
+// The daemon's side of the block.  The reader's side is in pacsrvtop.
+#ifndef SHM_STATS_READER
+
+class ShmStats
+{
+    public:
+        ShmStats();
+        virtual ~ShmStats();
+        
+        bool Open(char *szName);
+        bool IsDue(void);
+        strShmStats * GetBlock(void);
+        void Publish(void);
+    
+    private:
+        char *_szName;
+        strShmStats *_pShared;      // the shared memory, NULL if it isnt open.
+        strShmStats *_pBlock;       // the copy that is filled in.
+        long long _nLast;           // when it was last published (ms).
+};
+
+#endif
+
+
+#endif
@@ -0,0 +1,630 @@
+//-----------------------------------------------------------------------------
+// stats.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See "stats.h" for more information about this class.
+//
+//-----------------------------------------------------------------------------
+
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <DevPlus.h>
+
+#include "stats.h"
+#include "metrics.h"
+#include "logger.h"
+
+
+//-----------------------------------------------------------------------------
+// CJW: Constructor.
+StatsConnection::StatsConnection()
+{
+	Lock();
+	_bRequested = false;
+	_bHttp = false;
+	_bReplied = false;
+	_tStart = time(NULL);
+	Unlock();
+}
+
+//-----------------------------------------------------------------------------
+// CJW: Deconstructor.
+StatsConnection::~StatsConnection()
+{
+	Lock();
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the whole request has arrived, and the page hasnt been 
+// 		sent yet.
+bool StatsConnection::IsRequested(void)
+{
+	bool bRequested;
+	
+	Lock();
+	bRequested = (_bRequested == true && _bReplied == false);
+	Unlock();
+	
+	return(bRequested);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the connection has been open too long without sending 
+// 		us a request.
+bool StatsConnection::IsExpired(void)
+{
+	bool bExpired;
+	
+	Lock();
+	bExpired = (_bRequested == false && (time(NULL) - _tStart) > STATS_TIMEOUT);
+	Unlock();
+	
+	return(bExpired);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Send the page, with a HTTP header if the request was a HTTP one, and 
+// 		then close the connection.
+void StatsConnection::Reply(char *pPage, int nLength)
+{
+	char szHeader[160];
+	int nHeader;
+	
+	ASSERT(pPage != NULL && nLength >= 0);
+	
+	Lock();
+	ASSERT(_bRequested == true && _bReplied == false);
+	if (_bHttp == true) {
+		nHeader = snprintf(szHeader, sizeof(szHeader), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", nLength);
+		Send(szHeader, nHeader);
+	}
+	if (nLength > 0) {
+		Send(pPage, nLength);
+	}
+	_bReplied = true;
+	Close();
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Wait until we have the whole request.  For HTTP that is all the 
+// 		headers (up to the blank line), otherwise it is the first line.  We 
+// 		dont care what was asked for, everyone gets the same page.  Once we 
+// 		have it, anything else that is sent is thrown away.
+int StatsConnection::OnReceive(char *pData, int nLength)
+{
+	int nProcessed = 0;
+	int i;
+	
+	ASSERT(pData != NULL && nLength > 0);
+	
+	Lock();
+	
+	if (_bRequested == true) {
+		nProcessed = nLength;
+	}
+	else if (nLength >= 4 && strncmp(pData, "GET ", 4) == 0) {
+		for (i=1; i<nLength && _bRequested == false; i++) {
+			if (pData[i] == '\n' && (pData[i-1] == '\n' || (i >= 2 && pData[i-1] == '\r' && pData[i-2] == '\n'))) {
+				_bRequested = true;
+				_bHttp = true;
+			}
+		}
+	}
+	else {
+		for (i=0; i<nLength && _bRequested == false; i++) {
+			if (pData[i] == '\n') {
+				_bRequested = true;
+			}
+		}
+	}
+	
+	if (_bRequested == true) {
+		nProcessed = nLength;
+	}
+	else if (nLength > STATS_MAX_REQUEST) {
+		Close();
+		nProcessed = nLength;
+	}
+	
+	Unlock();
+	
+	return(nProcessed);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Constructor.  Start listening on the port that was in the config.  If 
+// 		we cant, then the daemon keeps going without it.
+StatsServer::StatsServer(Network *pNetwork, int nPort)
+{
+	ASSERT(pNetwork != NULL);
+	ASSERT(nPort > 0);
+	
+	Lock();
+	_pNetwork = pNetwork;
+	_Connections.pList = NULL;
+	_Connections.nCount = 0;
+	_Page.pData = NULL;
+	_Page.nLength = 0;
+	_Page.nMax = 0;
+	
+	if (Listen(nPort) == true) {
+		SetListening();
+		LOG_SYSTEM(LOG_SERVER, "Stats listening on port %d", nPort);
+	}
+	else {
+		LOG_ERROR(LOG_SERVER, "Cannot listen on port %d for Stats.", nPort);
+	}
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Deconstructor.  Close any connections that are still open.
+StatsServer::~StatsServer()
+{
+	Lock();
+	
+	ASSERT((_Connections.pList == NULL && _Connections.nCount == 0) || (_Connections.pList != NULL && _Connections.nCount > 0));
+	while (_Connections.nCount > 0) {
+		_Connections.nCount--;
+		if (_Connections.pList[_Connections.nCount] != NULL) {
+			delete _Connections.pList[_Connections.nCount];
+			_Connections.pList[_Connections.nCount] = NULL;
+		}
+	}
+	
+	if (_Connections.pList != NULL) {
+		free(_Connections.pList);
+		_Connections.pList = NULL;
+	}
+	
+	if (_Page.pData != NULL) {
+		free(_Page.pData);
+		_Page.pData = NULL;
+	}
+	
+	_pNetwork = NULL;
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: A connection has come in.  We only want to be scraped from this 
+// 		machine, so anything else is closed straight away.  Otherwise we add 
+// 		it to the list, using an empty slot if there is one.
+void StatsServer::OnAccept(int nSocket)
+{
+	StatsConnection *pTmp;
+	struct sockaddr_in sin;
+	socklen_t nLen;
+	int i;
+	bool bAdded;
+	
+	ASSERT(nSocket >= 0);
+	
+	nLen = sizeof(sin);
+	if (getpeername(nSocket, (struct sockaddr *) &sin, &nLen) != 0 || sin.sin_family != AF_INET || ntohl(sin.sin_addr.s_addr) != INADDR_LOOPBACK) {
+		LOG_SYSTEM(LOG_SERVER, "[Stats] Refused connection that isnt from this machine.");
+		close(nSocket);
+	}
+	else {
+		pTmp = new StatsConnection;
+		ASSERT(pTmp != NULL);
+		pTmp->Accept(nSocket);
+		
+		Lock();
+		bAdded = false;
+		for (i=0; i<_Connections.nCount && bAdded == false; i++) {
+			if (_Connections.pList[i] == NULL) {
+				_Connections.pList[i] = pTmp;
+				bAdded = true;
+			}
+		}
+		
+		if (bAdded == false) {
+			_Connections.pList = (StatsConnection **) realloc(_Connections.pList, sizeof(StatsConnection *) * (_Connections.nCount + 1));
+			ASSERT(_Connections.pList != NULL);
+			_Connections.pList[_Connections.nCount] = pTmp;
+			_Connections.nCount++;
+		}
+		Unlock();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Everything is done from our own thread, so that writing the page 
+// 		doesnt hold up the network or the clients.
+void StatsServer::OnIdle(void)
+{
+	ProcessConnections();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Go thru the connections, removing the ones that have closed or have 
+// 		taken too long, and sending the page to the ones that have asked for 
+// 		it.  If more than one has asked at the same time, they all get the 
+// 		same page.
+void StatsServer::ProcessConnections(void)
+{
+	int i;
+	bool bRendered = false;
+	
+	Lock();
+	
+	for (i=0; i<_Connections.nCount; i++) {
+		if (_Connections.pList[i] != NULL) {
+			if (_Connections.pList[i]->IsClosed() == true) {
+				delete _Connections.pList[i];
+				_Connections.pList[i] = NULL;
+			}
+			else if (_Connections.pList[i]->IsRequested() == true) {
+				if (bRendered == false) {
+					Render();
+					bRendered = true;
+				}
+				_Connections.pList[i]->Reply(_Page.pData, _Page.nLength);
+			}
+			else if (_Connections.pList[i]->IsExpired() == true) {
+				_Connections.pList[i]->Close();
+			}
+		}
+	}
+	
+	// If this is the last one in the list, reduce the count.
+	if (_Connections.nCount > 0) {
+		if (_Connections.pList[_Connections.nCount-1] == NULL) {
+			_Connections.nCount--;
+			if (_Connections.nCount == 0) {
+				free(_Connections.pList);
+				_Connections.pList = NULL;
+			}
+		}
+	}
+	
+	Unlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Build the page.
+void StatsServer::Render(void)
+{
+	static strMetric *pScrapes = Metrics::Counter("pacsrv_stats_scrapes_total", "Times the stats page has been written.");
+	
+	Metrics::Add(pScrapes, 1);
+	
+	_Page.nLength = 0;
+	RenderMetrics();
+	RenderNodes();
+	RenderFiles();
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Write out everything in the metrics registry.  The list can be walked 
+// 		without a lock.  The buckets of a histogram are summed as we go, so 
+// 		that the count always agrees with them even if a value is recorded 
+// 		while we are reading.  Only the buckets that have something in them 
+// 		are written, since there are hundreds of them.
+void StatsServer::RenderMetrics(void)
+{
+	strMetric *pMetric;
+	long long nCount;
+	int i;
+	int pHits[DEFAULT_TTL+1];
+	int nHits;
+	
+	pMetric = Metrics::GetFirst();
+	while (pMetric != NULL) {
+		if (pMetric->nType == METRIC_HISTOGRAM) {
+			PrintHeader(pMetric->szName, pMetric->szHelp, "histogram");
+			nCount = 0;
+			for (i=0; i<METRIC_BUCKETS; i++) {
+				if (pMetric->pBuckets[i] > 0) {
+					nCount += pMetric->pBuckets[i];
+					Print("%s_bucket{le=\"%lld\"} %lld\n", pMetric->szName, Metrics::GetBucketTop(i), nCount);
+				}
+			}
+			Print("%s_bucket{le=\"+Inf\"} %lld\n", pMetric->szName, nCount);
+			Print("%s_sum %lld\n", pMetric->szName, pMetric->nSum);
+			Print("%s_count %lld\n", pMetric->szName, nCount);
+		}
+		else {
+			if (pMetric->nType == METRIC_COUNTER) {
+				PrintHeader(pMetric->szName, pMetric->szHelp, "counter");
+			}
+			else {
+				PrintHeader(pMetric->szName, pMetric->szHelp, "gauge");
+			}
+			Print("%s %lld\n", pMetric->szName, pMetric->nValue);
+		}
+		pMetric = pMetric->pNext;
+	}
+	
+	ASSERT(_pNetwork != NULL);
+	nHits = _pNetwork->GetHitHistogram(pHits, DEFAULT_TTL+1);
+	if (PrintOwnHeader("pacsrv_search_found_ttl", "Files found by our searches, by how far the search went.", "gauge") == true) {
+		for (i=0; i<nHits; i++) {
+			Print("pacsrv_search_found_ttl{ttl=\"%d\"} %d\n", i, pHits[i]);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Write a gauge for each of the things that each node is doing.  The 
+// 		nodes are copied out of the network first, so it isnt locked while we 
+// 		write them.
+void StatsServer::RenderNodes(void)
+{
+	strNodeStats *pList;
+	int nCount, i;
+	
+	ASSERT(_pNetwork != NULL);
+	pList = _pNetwork->GetNodeStats(&nCount);
+	ASSERT((pList == NULL && nCount == 0) || (pList != NULL && nCount > 0));
+	
+	if (PrintOwnHeader("pacsrv_node_srtt_ms", "Smoothed round trip time to the node, 0 if not known yet.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_node_srtt_ms{node=\"%d\"} %d\n", pList[i].nID, pList[i].nRtt);
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_node_downloading", "1 if we are getting a file from the node.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_node_downloading{node=\"%d\"} %d\n", pList[i].nID, pList[i].bDownloading ? 1 : 0);
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_node_chunk_pending", "1 if we are waiting for a chunk from the node.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_node_chunk_pending{node=\"%d\"} %d\n", pList[i].nID, pList[i].bChunkPending ? 1 : 0);
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_node_uploading", "1 if the node is getting a file from us.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_node_uploading{node=\"%d\"} %d\n", pList[i].nID, pList[i].bUploading ? 1 : 0);
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_node_upload_queued", "Chunks the node has asked for that we havent sent yet.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_node_upload_queued{node=\"%d\"} %d\n", pList[i].nID, pList[i].nQueued);
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_node_upload_bytes_total", "Chunk data we have sent to the node.", "counter") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_node_upload_bytes_total{node=\"%d\"} %lld\n", pList[i].nID, pList[i].nBytesOut);
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_node_upload_rate", "Bytes per second that we have been serving the node.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_node_upload_rate{node=\"%d\"} %d\n", pList[i].nID, pList[i].nUploadRate);
+		}
+	}
+	
+	if (pList != NULL) {
+		free(pList);
+		pList = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Write the gauges for each file in the network's list.  The local files 
+// 		are the ones we are serving, so they dont have chunks coming in.
+void StatsServer::RenderFiles(void)
+{
+	strFileStats *pList;
+	int nCount, i;
+	
+	ASSERT(_pNetwork != NULL);
+	pList = _pNetwork->GetFileStats(&nCount);
+	ASSERT((pList == NULL && nCount == 0) || (pList != NULL && nCount > 0));
+	
+	if (PrintOwnHeader("pacsrv_file_users", "Clients and nodes that are using the file.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_file_users{file=");
+			PrintLabel(pList[i].szFile);
+			Print(",local=\"%d\"} %d\n", pList[i].bLocal ? 1 : 0, pList[i].nUsers);
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_file_chunks", "Chunks in the file, 0 if we dont know how big it is yet.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			Print("pacsrv_file_chunks{file=");
+			PrintLabel(pList[i].szFile);
+			Print("} %d\n", pList[i].nChunks);
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_file_chunks_received", "Chunks of a network file that we have got.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			if (pList[i].bLocal == false) {
+				Print("pacsrv_file_chunks_received{file=");
+				PrintLabel(pList[i].szFile);
+				Print("} %d\n", pList[i].nReceived);
+			}
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_file_chunks_outstanding", "Chunks of a network file that have been asked for and havent arrived.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			if (pList[i].bLocal == false) {
+				Print("pacsrv_file_chunks_outstanding{file=");
+				PrintLabel(pList[i].szFile);
+				Print("} %d\n", pList[i].nRequested);
+			}
+		}
+	}
+	
+	if (PrintOwnHeader("pacsrv_file_complete_ratio", "How much of a network file we have got, from 0 to 1.", "gauge") == true) {
+		for (i=0; i<nCount; i++) {
+			if (pList[i].bLocal == false) {
+				Print("pacsrv_file_complete_ratio{file=");
+				PrintLabel(pList[i].szFile);
+				Print("} %.4f\n", pList[i].nChunks > 0 ? (double) pList[i].nReceived / pList[i].nChunks : 0.0);
+			}
+		}
+	}
+	
+	if (pList != NULL) {
+		free(pList);
+		pList = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Write the HELP and TYPE lines that go before a metric.
+void StatsServer::PrintHeader(char *szName, char *szHelp, char *szType)
+{
+	ASSERT(szName != NULL && szType != NULL);
+	
+	if (szHelp != NULL) {
+		Print("# HELP %s %s\n", szName, szHelp);
+	}
+	Print("# TYPE %s %s\n", szName, szType);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Write the header for one of the metrics that we make up here rather
+// 		than getting from the registry.  The registry has already been
+// 		written by then, so if something has registered the same name, a
+// 		second TYPE line would make the whole page get rejected.  In that
+// 		case we leave ours out, and return false so that the caller doesnt
+// 		write its values either.
+bool StatsServer::PrintOwnHeader(char *szName, char *szHelp, char *szType)
+{
+	bool bOk = true;
+	
+	ASSERT(szName != NULL && szType != NULL);
+	
+	if (Metrics::Find(szName) != NULL) {
+		LOG_ERROR(LOG_SERVER, "Stats metric '%s' is also in the registry, leaving it out.", szName);
+		bOk = false;
+	}
+	else {
+		PrintHeader(szName, szHelp, szType);
+	}
+	
+	return(bOk);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Write a label value in quotes.  Backslashes, quotes and newlines need 
+// 		to be escaped.  Our filenames shouldnt have any, but they come from 
+// 		other nodes, so we cant be sure.
+void StatsServer::PrintLabel(char *szValue)
+{
+	char szBuffer[(256*2)+3];
+	int i, j;
+	
+	ASSERT(szValue != NULL);
+	
+	j = 0;
+	szBuffer[j++] = '"';
+	for (i=0; szValue[i] != '\0' && i < 256; i++) {
+		if (szValue[i] == '\\' || szValue[i] == '"') {
+			szBuffer[j++] = '\\';
+			szBuffer[j++] = szValue[i];
+		}
+		else if (szValue[i] == '\n') {
+			szBuffer[j++] = '\\';
+			szBuffer[j++] = 'n';
+		}
+		else {
+			szBuffer[j++] = szValue[i];
+		}
+	}
+	szBuffer[j++] = '"';
+	szBuffer[j] = '\0';
+	ASSERT(j < (int) sizeof(szBuffer));
+	
+	Print("%s", szBuffer);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Add some formatted text to the end of the page, growing the buffer if 
+// 		it isnt big enough.
+void StatsServer::Print(char *szFormat, ...)
+{
+	va_list args;
+	int nLen;
+	
+	ASSERT(szFormat != NULL);
+	
+	if (_Page.pData == NULL) {
+		ASSERT(_Page.nMax == 0 && _Page.nLength == 0);
+		_Page.nMax = 4096;
+		_Page.pData = (char *) malloc(_Page.nMax);
+		ASSERT(_Page.pData != NULL);
+	}
+	
+	va_start(args, szFormat);
+	nLen = vsnprintf(&_Page.pData[_Page.nLength], _Page.nMax - _Page.nLength, szFormat, args);
+	va_end(args);
+	ASSERT(nLen >= 0);
+	
+	if (_Page.nLength + nLen >= _Page.nMax) {
+		while (_Page.nLength + nLen >= _Page.nMax) {
+			_Page.nMax *= 2;
+		}
+		_Page.pData = (char *) realloc(_Page.pData, _Page.nMax);
+		ASSERT(_Page.pData != NULL);
+		
+		va_start(args, szFormat);
+		nLen = vsnprintf(&_Page.pData[_Page.nLength], _Page.nMax - _Page.nLength, szFormat, args);
+		va_end(args);
+		ASSERT(_Page.nLength + nLen < _Page.nMax);
+	}
+	
+	_Page.nLength += nLen;
+}
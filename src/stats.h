@@ -0,0 +1,118 @@
+//-----------------------------------------------------------------------------
+// stats.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      An optional listener that lets a monitoring system scrape our metrics.
+//      It is turned on by giving a port in the [stats] section of the config,
+//      and only takes connections from this machine.  A connection sends a 
+//      HTTP GET (or just a line of text, so that it can be looked at with 
+//      netcat), and gets back every metric in the Prometheus text format, 
+//      along with gauges for each node we are connected to and each file in 
+//      our list.  The connection is closed once the page has been sent.
+//
+//      The page is written in this object's thread.  The network is only 
+//      locked while the node and file values are copied out of it.
+//
+//-----------------------------------------------------------------------------
+
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <time.h>
+
+#include "baseserver.h"
+#include "baseclient.h"
+#include "network.h"
+
+//-----------------------------------------------------------------------------
+// A connection is closed if it hasnt sent a request within STATS_TIMEOUT 
+// seconds, or if the request is bigger than STATS_MAX_REQUEST bytes.
+#define STATS_TIMEOUT       10
+#define STATS_MAX_REQUEST   4096
+
+
+class StatsConnection : public BaseClient
+{
+    public:
+        StatsConnection();
+        virtual ~StatsConnection();
+        
+        bool IsRequested(void);
+        bool IsExpired(void);
+        void Reply(char *pPage, int nLength);
+        
+    protected:
+        virtual int OnReceive(char *pData, int nLength);
+        
+    private:
+        bool _bRequested;       // we have the whole request.
+        bool _bHttp;            // it was a HTTP request, so the reply needs a header.
+        bool _bReplied;
+        time_t _tStart;
+};
+
+
+class StatsServer : public BaseServer
+{
+    public:
+        StatsServer(Network *pNetwork, int nPort);
+        virtual ~StatsServer();
+        
+    protected:
+        virtual void OnAccept(int);
+        virtual void OnIdle(void);
+        
+    private:
+        void ProcessConnections(void);
+        void Render(void);
+        void RenderMetrics(void);
+        void RenderNodes(void);
+        void RenderFiles(void);
+        void PrintHeader(char *szName, char *szHelp, char *szType);
+        bool PrintOwnHeader(char *szName, char *szHelp, char *szType);
+        void PrintLabel(char *szValue);
+        void Print(char *szFormat, ...);
+        
+        struct {
+            StatsConnection **pList;
+            int nCount;
+        } _Connections;
+        
+        // the page is built up here, and kept between scrapes so that the 
+        // buffer only needs to grow now and then.
+        struct {
+            char *pData;
+            int nLength;
+            int nMax;
+        } _Page;
+        
+        Network *_pNetwork;     // not owned by us.
+};
+
+
+#endif
@@ -0,0 +1,248 @@
+//-----------------------------------------------------------------------------
+// trace.cpp
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      See "trace.h" for more information about this class.
+//
+//-----------------------------------------------------------------------------
+
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <DevPlus.h>
+
+#include "trace.h"
+#include "common.h"
+#include "logger.h"
+
+
+FILE * Tracer::_pFile = NULL;
+DpLock Tracer::_xLock;
+int Tracer::_nPid = 0;
+
+
+//---------------------------------------------------------------------
+// CJW: Start writing the trace to this file.  Anything that was in it is 
+// 		replaced.  Returns false if the file couldnt be opened, and then 
+// 		tracing stays off.
+bool Tracer::Open(char *szPath)
+{
+	bool bOpened = false;
+	
+	ASSERT(szPath != NULL);
+	
+	_xLock.Lock();
+	ASSERT(_pFile == NULL);
+	_pFile = fopen(szPath, "w");
+	if (_pFile != NULL) {
+		_nPid = getpid();
+		fprintf(_pFile, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"pacsrvd\"}},\n", _nPid);
+		bOpened = true;
+	}
+	_xLock.Unlock();
+	
+	if (bOpened == true) {
+		LOG_SYSTEM(LOG_MAIN, "Tracing file requests to %s", szPath);
+	}
+	else {
+		LOG_ERROR(LOG_MAIN, "Unable to open trace file %s", szPath);
+	}
+	
+	return(bOpened);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Finish off the array and close the file.  
+void Tracer::Close(void)
+{
+	_xLock.Lock();
+	if (_pFile != NULL) {
+		fprintf(_pFile, "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"sort_index\":0}}\n]\n", _nPid);
+		fclose(_pFile);
+		_pFile = NULL;
+	}
+	_xLock.Unlock();
+}
+
+
+//---------------------------------------------------------------------
+// CJW: The events are buffered by stdio, so they are flushed out every now 
+// 		and then, so that the trace can be looked at while we are running.
+void Tracer::Flush(void)
+{
+	_xLock.Lock();
+	if (_pFile != NULL) {
+		fflush(_pFile);
+	}
+	_xLock.Unlock();
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the time in microseconds, which is what the trace format 
+// 		uses.
+long long Tracer::Now(void)
+{
+	return(GetTimeUs());
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the track for a file.  It is a hash (FNV-1a) of the name, so 
+// 		that we dont need to keep a list of them.
+int Tracer::FileTrack(char *szFile)
+{
+	unsigned int nHash = 2166136261u;
+	int i;
+	
+	ASSERT(szFile != NULL);
+	
+	for (i=0; szFile[i] != '\0'; i++) {
+		nHash ^= (unsigned char) szFile[i];
+		nHash *= 16777619u;
+	}
+	
+	return(TRACE_FILE_TRACK + (int) (nHash % TRACE_FILE_TRACK));
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Return the track for a node.
+int Tracer::NodeTrack(int nNode)
+{
+	ASSERT(nNode > 0 && nNode < TRACE_FILE_TRACK);
+	return(nNode);
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Give a track the name that it is shown with.  It can be named again 
+// 		each time it is used, the viewer just keeps the last one.
+void Tracer::NameTrack(int nTrack, char *szName)
+{
+	ASSERT(szName != NULL);
+	
+	_xLock.Lock();
+	if (_pFile != NULL) {
+		fprintf(_pFile, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", _nPid, nTrack);
+		PrintString(szName);
+		fprintf(_pFile, "}},\n");
+	}
+	_xLock.Unlock();
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Write a span that started at nStart (from Now()) and ends now.  The 
+// 		file and the key are put in the args of the span if they arent NULL.
+void Tracer::Span(int nTrack, char *szName, long long nStart, char *szFile, char *szKey, long long nValue)
+{
+	long long nNow;
+	
+	ASSERT(szName != NULL);
+	
+	if (_pFile != NULL) {
+		nNow = Now();
+		if (nStart <= 0 || nStart > nNow) {
+			nStart = nNow;
+		}
+		Write(nTrack, szName, 'X', nStart, nNow - nStart, szFile, szKey, nValue);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Write an event that happened now.
+void Tracer::Instant(int nTrack, char *szName, char *szFile, char *szKey, long long nValue)
+{
+	ASSERT(szName != NULL);
+	
+	if (_pFile != NULL) {
+		Write(nTrack, szName, 'i', Now(), 0, szFile, szKey, nValue);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Write one event.  
+void Tracer::Write(int nTrack, char *szName, char ph, long long nStart, long long nDuration, char *szFile, char *szKey, long long nValue)
+{
+	ASSERT(szName != NULL);
+	
+	_xLock.Lock();
+	if (_pFile != NULL) {
+		fprintf(_pFile, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,", szName, ph, nStart);
+		if (ph == 'X') {
+			fprintf(_pFile, "\"dur\":%lld,", nDuration);
+		}
+		else {
+			fprintf(_pFile, "\"s\":\"t\",");
+		}
+		fprintf(_pFile, "\"pid\":%d,\"tid\":%d,\"args\":{", _nPid, nTrack);
+		if (szFile != NULL) {
+			fprintf(_pFile, "\"file\":");
+			PrintString(szFile);
+		}
+		if (szKey != NULL) {
+			fprintf(_pFile, "%s\"%s\":%lld", szFile != NULL ? "," : "", szKey, nValue);
+		}
+		fprintf(_pFile, "}},\n");
+	}
+	_xLock.Unlock();
+}
+
+
+//---------------------------------------------------------------------
+// CJW: Write a JSON string.  The filenames come from other nodes, so we 
+// 		cant trust them not to have quotes or control characters in them.  
+// 		Must be called with the lock held.
+void Tracer::PrintString(char *szValue)
+{
+	int i;
+	
+	ASSERT(szValue != NULL);
+	ASSERT(_pFile != NULL);
+	
+	fputc('"', _pFile);
+	for (i=0; szValue[i] != '\0'; i++) {
+		if (szValue[i] == '"' || szValue[i] == '\\') {
+			fputc('\\', _pFile);
+			fputc(szValue[i], _pFile);
+		}
+		else if ((unsigned char) szValue[i] < 0x20) {
+			fprintf(_pFile, "\\u%04x", (unsigned char) szValue[i]);
+		}
+		else {
+			fputc(szValue[i], _pFile);
+		}
+	}
+	fputc('"', _pFile);
+}
@@ -0,0 +1,90 @@
+//-----------------------------------------------------------------------------
+// trace.h
+//
+//  Project: pacsrv
+//  Author: Clint Webb
+//
+//      Optional tracing of where the time goes when a file is got from the 
+//      network.  When trace is set in the [log] part of the config, the 
+//      spans and events of each file request are written to that file as 
+//      Chrome trace JSON, which can be opened in Perfetto (ui.perfetto.dev) 
+//      or chrome://tracing.
+//
+//      Each file gets its own track, with a span for the whole request, a 
+//      span for the search, and events for the first chunk the client asked 
+//      for that we didnt have, each F flood, each G reply and each chunk 
+//      sent to the client.  Each node also gets a track, with a span for each 
+//      L/A exchange and each chunk from when it was asked for to when it 
+//      arrived, since a node only gets one of those at a time.
+//
+//      The events are written with the array format, so a trace that was cut 
+//      short by a crash can still be opened.
+//
+//-----------------------------------------------------------------------------
+
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdio.h>
+#include <DpLock.h>
+
+//-----------------------------------------------------------------------------
+// The node tracks use the node id as the thread id, and the file tracks use a 
+// hash of the filename above TRACE_FILE_TRACK, so that they cant clash.  Node 
+// ids are always below MAX_NODE_ID.
+#define TRACE_FILE_TRACK    1000000000
+
+
+class Tracer 
+{
+    private:
+        static FILE *_pFile;
+        static DpLock _xLock;
+        static int _nPid;
+        
+        static void Write(int nTrack, char *szName, char ph, long long nStart, long long nDuration, char *szFile, char *szKey, long long nValue);
+        static void PrintString(char *szValue);
+    
+    public:
+        static bool Open(char *szPath);
+        static void Close(void);
+        static void Flush(void);
+        
+        static inline bool IsOn(void) {
+            return(_pFile != NULL);
+        }
+        
+        static long long Now(void);
+        static int FileTrack(char *szFile);
+        static int NodeTrack(int nNode);
+        
+        static void NameTrack(int nTrack, char *szName);
+        static void Span(int nTrack, char *szName, long long nStart, char *szFile, char *szKey, long long nValue);
+        static void Instant(int nTrack, char *szName, char *szFile, char *szKey, long long nValue);
+};
+
+
+#endif
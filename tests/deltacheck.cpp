@@ -0,0 +1,439 @@
+//-----------------------------------------------------------------------------
+// deltacheck.cpp
+//
+//  Project: pacsrv
+//
+//      Checks the deltas and recipes that are sent between nodes, and which
+//      versions of a package we will make a delta between.  The deltas and
+//      recipes come from other nodes, so as well as making sure they work,
+//      we make sure that ones which have been cut short, or which lie about
+//      their lengths, are refused rather than trusted.
+//
+//      Run it from the src directory with "make check".  It prints each
+//      check that fails, and exits with the number of failures.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include <DevPlus.h>
+
+#include "delta.h"
+#include "cdc.h"
+#include "filelist.h"
+
+
+// versions of a package in the cache.  They are given mtimes in the
+// opposite order to their versions, so that only the versions can be used
+// to put them in order.
+#define FOO_0		"foo-1.0-1-any.pkg.tar.zst"
+#define FOO_1		"foo-1.2-1-any.pkg.tar.zst"
+#define FOO_2		"foo-1.10-1-any.pkg.tar.zst"
+#define FOO_NEXT	"foo-1.11-1-any.pkg.tar.zst"
+#define FOO_ARCH	"foo-1.5-1-x86_64.pkg.tar.zst"
+#define FOO_BAR		"foo-bar-1.3-1-any.pkg.tar.zst"
+
+
+static int _nFailed = 0;
+
+
+//-----------------------------------------------------------------------------
+// CJW: Note a check that didnt work out.
+static void Check(bool bOk, const char *szWhat)
+{
+	if (bOk == false) {
+		printf("FAIL: %s\n", szWhat);
+		_nFailed++;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Make up some data that doesnt repeat, so that a delta can only copy
+// 		the parts that really are the same.
+static char * MakeData(int nSize, unsigned int nSeed)
+{
+	char *pData;
+	int i;
+
+	pData = (char *) malloc(nSize);
+	ASSERT(pData != NULL);
+
+	for (i=0; i<nSize; i++) {
+		nSeed = (nSeed * 1103515245) + 12345;
+		pData[i] = (char) ((nSeed >> 16) & 0xff);
+	}
+
+	return(pData);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if the delta rebuilds the target from the base.
+static bool Applies(char *pBase, int nBase, char *pDelta, int nDelta, char *pTarget, int nTarget)
+{
+	char *pOut = NULL;
+	int nOut = 0;
+	bool bOk = false;
+
+	if (Delta::Apply(pBase, nBase, pDelta, nDelta, &pOut, &nOut) == true) {
+		bOk = (nOut == nTarget && memcmp(pOut, pTarget, nTarget) == 0);
+		free(pOut);
+	}
+
+	return(bOk);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if Apply refuses the delta.
+static bool Refused(char *pBase, int nBase, char *pDelta, int nDelta)
+{
+	char *pOut = NULL;
+	int nOut = 0;
+	bool bRefused = true;
+
+	if (Delta::Apply(pBase, nBase, pDelta, nDelta, &pOut, &nOut) == true) {
+		bRefused = false;
+		free(pOut);
+	}
+
+	return(bRefused);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return true if ParseRecipe refuses the recipe.
+static bool RecipeRefused(char *pRecipe, int nRecipe)
+{
+	strCdcEntry *pEntries;
+	int nEntries = 0, nLength = 0;
+	bool bRefused = true;
+
+	pEntries = ChunkStore::ParseRecipe(pRecipe, nRecipe, &nEntries, &nLength);
+	if (pEntries != NULL) {
+		bRefused = false;
+		free(pEntries);
+	}
+
+	return(bRefused);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Write a 4 byte number the way the deltas and recipes have them.
+static void PutInt(char *pData, int nValue)
+{
+	unsigned char *pTmp = (unsigned char *) pData;
+
+	pTmp[0] = (nValue >> 24) & 0xff;
+	pTmp[1] = (nValue >> 16) & 0xff;
+	pTmp[2] = (nValue >> 8) & 0xff;
+	pTmp[3] = nValue & 0xff;
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Make a delta with a single operation, for the ones that lie.
+static int MakeOp(char *pDelta, int nTarget, char cOp, int nFirst, int nSecond)
+{
+	int nLen;
+
+	memcpy(pDelta, DELTA_MAGIC, 4);
+	PutInt(&pDelta[4], nTarget);
+	pDelta[8] = cOp;
+	PutInt(&pDelta[9], nFirst);
+	nLen = 13;
+	if (cOp == DELTA_COPY) {
+		PutInt(&pDelta[13], nSecond);
+		nLen = 17;
+	}
+
+	return(nLen);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Put a file in the cache, with this modified time.
+static void AddPackage(char *szCache, const char *szFile, time_t tModified)
+{
+	char szPath[2048];
+	struct utimbuf ut;
+	FILE *fp;
+
+	snprintf(szPath, sizeof(szPath), "%s/%s", szCache, szFile);
+	fp = fopen(szPath, "wb");
+	ASSERT(fp != NULL);
+	fputs(szFile, fp);
+	fclose(fp);
+
+	ut.actime = tModified;
+	ut.modtime = tModified;
+	utime(szPath, &ut);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Throw away the cache directory, and the packages in it.
+static void RemoveCache(char *szCache)
+{
+	const char *pFiles[] = { FOO_0, FOO_1, FOO_2, FOO_ARCH, FOO_BAR, NULL };
+	char szPath[2048];
+	int i;
+
+	for (i=0; pFiles[i] != NULL; i++) {
+		snprintf(szPath, sizeof(szPath), "%s/%s", szCache, pFiles[i]);
+		unlink(szPath);
+	}
+	rmdir(szCache);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Deltas between two versions of a file, and ones that are no good.
+static void CheckDeltas(void)
+{
+	char *pBase, *pTarget, *pDelta, *pOther;
+	char pBad[32];
+	int nBase, nTarget, nDelta, nOther, nLen, i;
+	bool bAll;
+
+	// the target is the base with a bit changed, a bit put in, and a bit
+	// more on the end.
+	nBase = 100000;
+	pBase = MakeData(nBase, 1);
+	nTarget = nBase + 3000;
+	pTarget = (char *) malloc(nTarget);
+	ASSERT(pTarget != NULL);
+	memcpy(pTarget, pBase, 40000);
+	memset(&pTarget[20000], 'x', 100);
+	memcpy(&pTarget[40000], "inserted", 8);
+	memcpy(&pTarget[40008], &pBase[40000], nBase - 40000);
+	memset(&pTarget[nBase + 8], 'y', nTarget - nBase - 8);
+
+	pDelta = NULL;
+	nDelta = 0;
+	Check(Delta::Create(pBase, nBase, pTarget, nTarget, &pDelta, &nDelta) == true, "a delta is made");
+	Check(pDelta != NULL && nDelta > 8 && nDelta < (nTarget / 10), "the delta is much smaller than the file");
+	Check(Applies(pBase, nBase, pDelta, nDelta, pTarget, nTarget) == true, "the delta rebuilds the file");
+
+	// every length short of the whole delta.
+	bAll = true;
+	for (i=0; i<nDelta; i++) {
+		if (Refused(pBase, nBase, pDelta, i) == false) {
+			bAll = false;
+		}
+	}
+	Check(bAll == true, "a delta that has been cut short is refused");
+
+	// a base that is too short for the copies.
+	Check(Refused(pBase, nBase / 2, pDelta, nDelta) == true, "a delta for a longer base is refused");
+
+	// the length of the target.
+	PutInt(&pDelta[4], nTarget + 1);
+	Check(Refused(pBase, nBase, pDelta, nDelta) == true, "a delta that says the file is longer is refused");
+	PutInt(&pDelta[4], nTarget - 1);
+	Check(Refused(pBase, nBase, pDelta, nDelta) == true, "a delta that says the file is shorter is refused");
+	PutInt(&pDelta[4], 0);
+	Check(Refused(pBase, nBase, pDelta, nDelta) == true, "a delta for an empty file is refused");
+	PutInt(&pDelta[4], nTarget);
+	Check(Applies(pBase, nBase, pDelta, nDelta, pTarget, nTarget) == true, "the delta works again once it is put back");
+	free(pDelta);
+
+	// single operations that lie.
+	nLen = MakeOp(pBad, 100, DELTA_COPY, nBase - 50, 100);
+	Check(Refused(pBase, nBase, pBad, nLen) == true, "a copy past the end of the base is refused");
+	nLen = MakeOp(pBad, 100, DELTA_COPY, -1, 100);
+	Check(Refused(pBase, nBase, pBad, nLen) == true, "a copy from before the base is refused");
+	nLen = MakeOp(pBad, 100, DELTA_COPY, 0, 200);
+	Check(Refused(pBase, nBase, pBad, nLen) == true, "a copy past the end of the file is refused");
+	nLen = MakeOp(pBad, 100, DELTA_COPY, 0, 0);
+	Check(Refused(pBase, nBase, pBad, nLen) == true, "an empty copy is refused");
+	nLen = MakeOp(pBad, 100, DELTA_COPY, 0, 100);
+	Check(Applies(pBase, nBase, pBad, nLen, pBase, 100) == true, "a copy that is right works");
+	nLen = MakeOp(pBad, 4, DELTA_LITERAL, 100, 0);
+	memcpy(&pBad[nLen], "abcd", 4);
+	Check(Refused(pBase, nBase, pBad, nLen + 4) == true, "a literal longer than the delta is refused");
+	nLen = MakeOp(pBad, 4, DELTA_LITERAL, 4, 0);
+	memcpy(&pBad[nLen], "abcd", 4);
+	Check(Applies(pBase, nBase, pBad, nLen + 4, (char *) "abcd", 4) == true, "a literal that is right works");
+	pBad[8] = 'Z';
+	Check(Refused(pBase, nBase, pBad, nLen + 4) == true, "an unknown operation is refused");
+	memcpy(pBad, "XXXX", 4);
+	Check(Refused(pBase, nBase, pBad, nLen + 4) == true, "a delta without the magic is refused");
+
+	// a file that has nothing in common with the base is all literal.
+	nOther = 5000;
+	pOther = MakeData(nOther, 2);
+	pDelta = NULL;
+	Check(Delta::Create(pBase, nBase, pOther, nOther, &pDelta, &nDelta) == true && Applies(pBase, nBase, pDelta, nDelta, pOther, nOther) == true, "a delta from an unrelated base still works");
+	if (pDelta != NULL) { free(pDelta); }
+	pDelta = NULL;
+	Check(Delta::Create(pOther, 100, pTarget, nTarget, &pDelta, &nDelta) == true && Applies(pOther, 100, pDelta, nDelta, pTarget, nTarget) == true, "a delta from a base shorter than a block works");
+	if (pDelta != NULL) { free(pDelta); }
+
+	free(pOther);
+	free(pTarget);
+	free(pBase);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Recipes, and ones that are no good.
+static void CheckRecipes(void)
+{
+	strCdcEntry *pEntries;
+	char *pData, *pRecipe;
+	int nData, nRecipe, nEntries, nLength, nPos, i;
+	bool bAll;
+
+	nData = 300000;
+	pData = MakeData(nData, 3);
+	pRecipe = ChunkStore::MakeRecipe(pData, nData, &nRecipe);
+	Check(pRecipe != NULL && nRecipe > 12, "a recipe is made");
+
+	nEntries = 0;
+	nLength = 0;
+	pEntries = ChunkStore::ParseRecipe(pRecipe, nRecipe, &nEntries, &nLength);
+	Check(pEntries != NULL && nLength == nData && nEntries > 1, "the recipe is read back");
+	if (pEntries != NULL) {
+		bAll = true;
+		nPos = 0;
+		for (i=0; i<nEntries; i++) {
+			if (pEntries[i].nOffset != nPos || pEntries[i].nLength < 1 || pEntries[i].nLength > CDC_MAX_CHUNK) {
+				bAll = false;
+			}
+			nPos += pEntries[i].nLength;
+		}
+		Check(bAll == true && nPos == nData, "the chunks of the recipe cover the file");
+		free(pEntries);
+	}
+
+	bAll = true;
+	for (i=0; i<nRecipe; i++) {
+		if (RecipeRefused(pRecipe, i) == false) {
+			bAll = false;
+		}
+	}
+	Check(bAll == true, "a recipe that has been cut short is refused");
+
+	PutInt(&pRecipe[4], nData + 1);
+	Check(RecipeRefused(pRecipe, nRecipe) == true, "a recipe that says the file is longer is refused");
+	PutInt(&pRecipe[4], nData - 1);
+	Check(RecipeRefused(pRecipe, nRecipe) == true, "a recipe that says the file is shorter is refused");
+	PutInt(&pRecipe[4], nData);
+
+	PutInt(&pRecipe[8], nEntries + 1);
+	Check(RecipeRefused(pRecipe, nRecipe) == true, "a recipe that says it has more chunks is refused");
+	PutInt(&pRecipe[8], nEntries - 1);
+	Check(RecipeRefused(pRecipe, nRecipe) == true, "a recipe that says it has fewer chunks is refused");
+	PutInt(&pRecipe[8], nEntries);
+
+	// the length of the first chunk.
+	pRecipe[12] = 0;
+	pRecipe[13] = 0;
+	Check(RecipeRefused(pRecipe, nRecipe) == true, "a recipe with an empty chunk is refused");
+	pRecipe[12] = 0x7f;
+	pRecipe[13] = 0xff;
+	Check(RecipeRefused(pRecipe, nRecipe) == true, "a recipe whose chunks dont add up to the file is refused");
+
+	memcpy(pRecipe, "XXXX", 4);
+	Check(RecipeRefused(pRecipe, nRecipe) == true, "a recipe without the magic is refused");
+
+	free(pRecipe);
+	free(pData);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Which versions of a package we will make a delta between.
+static void CheckAdjacent(char *szCache)
+{
+	FileList *pList;
+	char szOlder[256];
+	time_t tNow;
+
+	Check(FileList::CompareVersions((char *) "1.10", (char *) "1.9") > 0, "1.10 is newer than 1.9");
+	Check(FileList::CompareVersions((char *) "1.0rc1", (char *) "1.0") < 0, "a release candidate is older than the release");
+	Check(FileList::CompareVersions((char *) "1.0", (char *) "1.0.1") < 0, "1.0.1 is newer than 1.0");
+	Check(FileList::CompareVersions((char *) "1.0-2", (char *) "1.0-10") < 0, "the release is compared as a number");
+	Check(FileList::CompareVersions((char *) "1:0.9-1", (char *) "2.0-1") > 0, "the epoch comes first");
+	Check(FileList::CompareVersions((char *) "0:1.0-1", (char *) "1.0-1") == 0, "a missing epoch is 0");
+	Check(FileList::CompareVersions((char *) "1.0", (char *) "1.0-3") == 0, "the release is only compared if both have one");
+
+	tNow = time(NULL);
+	AddPackage(szCache, FOO_0, tNow);
+	AddPackage(szCache, FOO_1, tNow - 100);
+	AddPackage(szCache, FOO_2, tNow - 200);
+	AddPackage(szCache, FOO_ARCH, tNow - 150);
+	AddPackage(szCache, FOO_BAR, tNow - 150);
+
+	pList = new FileList;
+	pList->SetPath(szCache);
+
+	Check(pList->IsAdjacent((char *) FOO_2, (char *) FOO_1) == true, "1.2 comes just before 1.10");
+	Check(pList->IsAdjacent((char *) FOO_1, (char *) FOO_0) == true, "1.0 comes just before 1.2");
+	Check(pList->IsAdjacent((char *) FOO_2, (char *) FOO_0) == false, "1.2 is between 1.0 and 1.10");
+	Check(pList->IsAdjacent((char *) FOO_1, (char *) FOO_2) == false, "a newer version isnt a base");
+	Check(pList->IsAdjacent((char *) FOO_2, (char *) FOO_2) == false, "a file isnt a base for itself");
+	Check(pList->IsAdjacent((char *) FOO_2, (char *) FOO_ARCH) == false, "another arch isnt a base");
+	Check(pList->IsAdjacent((char *) FOO_BAR, (char *) FOO_1) == false, "another package isnt a base");
+	Check(pList->IsAdjacent((char *) FOO_NEXT, (char *) FOO_2) == false, "a target that we dont have isnt made");
+	Check(pList->IsAdjacent((char *) "foo", (char *) FOO_0) == false, "a name that isnt a package isnt made");
+
+	Check(pList->FindOlder((char *) FOO_NEXT, szOlder, sizeof(szOlder)) == true && strcmp(szOlder, FOO_2) == 0, "the newest older version is used");
+	Check(pList->FindOlder((char *) FOO_1, szOlder, sizeof(szOlder)) == true && strcmp(szOlder, FOO_0) == 0, "a newer version isnt used");
+	Check(pList->FindOlder((char *) FOO_0, szOlder, sizeof(szOlder)) == false, "there is nothing older than the oldest");
+
+	delete pList;
+}
+
+
+int main(void)
+{
+	char szCache[] = "/tmp/pacsrv-delta.XXXXXX";
+
+	if (mkdtemp(szCache) == NULL) {
+		printf("deltacheck: unable to make a cache directory.\n");
+		exit(1);
+	}
+
+	CheckDeltas();
+	CheckRecipes();
+	CheckAdjacent(szCache);
+
+	RemoveCache(szCache);
+
+	if (_nFailed == 0) {
+		printf("deltacheck: all checks passed.\n");
+	}
+
+	return(_nFailed);
+}
@@ -0,0 +1,143 @@
+#!/bin/sh
+#-----------------------------------------------------------------------------
+# loopback.sh
+#
+#	Project: pacsrv
+#
+#		Runs a small pacsrv network on this machine, to test that a file can 
+#		be found through the search and the DHT.  Each daemon gets its own 
+#		directory with an etc/pacsrv.conf, a cache and a log.  The daemons 
+#		only know about the one started before them, so the mesh starts off 
+#		as a chain, and the first node has a test package in its cache that 
+#		none of the others have.  The last node is then asked for it with 
+#		pacsrvclient, and it has to arrive the same as it left.
+#
+#		Run it from the src directory with "make loopback", which builds the 
+#		daemon and a pacsrvclient that reads ../etc/pacsrv.conf.
+#
+#			NODES	number of daemons (default 5).
+#			PORT	first network port, the server ports are PORT+100 (18100).
+#			DHT		yes or no, to compare the DHT with the flood (yes).
+#			WAIT	seconds to let the mesh form before asking (20).
+#			KEEP	set to keep the directories (and logs) afterwards.
+#
+#-----------------------------------------------------------------------------
+
+NODES=${NODES:-5}
+PORT=${PORT:-18100}
+DHT=${DHT:-yes}
+WAIT=${WAIT:-20}
+
+SRC=$(pwd)
+DAEMON=$SRC/pacsrvd
+CLIENT=$SRC/pacsrvclient-loopback
+WORK=$(mktemp -d /tmp/pacsrv-loopback.XXXXXX)
+PKG=loopback-test-1.0-1.pkg.tar.gz
+PIDS=""
+RESULT=1
+
+if [ ! -x "$DAEMON" ] || [ ! -x "$CLIENT" ]; then
+	echo "loopback: build with 'make loopback' first." >&2
+	exit 2
+fi
+
+cleanup() {
+	for pid in $PIDS; do
+		kill -INT $pid 2>/dev/null
+	done
+	sleep 2
+	for pid in $PIDS; do
+		kill -KILL $pid 2>/dev/null
+	done
+	if [ -z "$KEEP" ]; then
+		rm -rf "$WORK"
+	else
+		echo "loopback: left everything in $WORK"
+	fi
+}
+trap cleanup EXIT INT TERM
+
+# write the config for node $1.
+make_config() {
+	n=$1
+	dir=$WORK/node$n
+	mkdir -p $dir/etc $dir/run $dir/cache $dir/sync $dir/download
+	
+	cat > $dir/etc/pacsrv.conf <<END
+[network]
+port=$((PORT + n))
+cache-path=$dir/cache
+save-files=yes
+sync-path=$dir/sync
+peer-file=$dir/peers
+min-connections=2
+max-connections=10
+mirror-parallel=0
+miss-time=0
+dht=$DHT
+dht-id=$((n * 7919))
+relay=no
+
+[server]
+port=$((PORT + 100 + n))
+
+[log]
+level=test
+categories=all
+
+[stats]
+shm=none
+
+[client]
+server=127.0.0.1
+port=$((PORT + 100 + n))
+END
+
+	if [ $n -gt 1 ]; then
+		cat >> $dir/etc/pacsrv.conf <<END
+
+[direct]
+server=127.0.0.1
+port=$((PORT + n - 1))
+END
+	fi
+}
+
+
+# the daemon reads ../etc/pacsrv.conf, so it is started from the run 
+# directory of its node.
+n=1
+while [ $n -le $NODES ]; do
+	make_config $n
+	(cd $WORK/node$n/run && exec "$DAEMON" > $WORK/node$n/run/stdout 2>&1) &
+	PIDS="$PIDS $!"
+	n=$((n + 1))
+done
+
+head -c 300000 /dev/urandom > $WORK/node1/cache/$PKG
+
+echo "loopback: $NODES daemons started in $WORK, waiting $WAIT seconds for the mesh."
+sleep $WAIT
+
+# the url cant be reached, so the file has to come from the network.
+START=$(date +%s)
+(cd $WORK/node$NODES/run && timeout 120 "$CLIENT" -m $WORK/node$NODES/download http://127.0.0.1:1/$PKG)
+STATUS=$?
+END=$(date +%s)
+
+if [ $STATUS -ne 0 ]; then
+	echo "loopback: FAILED, pacsrvclient returned $STATUS."
+elif ! cmp -s $WORK/node1/cache/$PKG $WORK/node$NODES/download/$PKG; then
+	echo "loopback: FAILED, the file that arrived is different."
+else
+	echo "loopback: OK, got $PKG through $NODES nodes in $((END - START)) seconds (dht=$DHT)."
+	RESULT=0
+fi
+
+for f in $WORK/node*/run/pacsrvd-log*; do
+	if grep -q "DHT" $f 2>/dev/null; then
+		echo "  $(basename $(dirname $(dirname $f))): $(grep -c 'DHT' $f) DHT lines in the log."
+	fi
+done
+
+exit $RESULT
@@ -0,0 +1,241 @@
+//-----------------------------------------------------------------------------
+// pkgcheck.cpp
+//
+//  Project: pacsrv
+//
+//      Checks the package index and the saving of remote files into the
+//      cache, using the small sync databases in tests/sync.  They were made
+//      up for this, and the contents of each package are generated here from
+//      its filename, so that the sizes and checksums in the databases match.
+//
+//      Run it from the src directory with "make check".  It prints each
+//      check that fails, and exits with the number of failures.
+//
+//-----------------------------------------------------------------------------
+
+
+/***************************************************************************
+ *   Copyright (C) 2003-2005 by Clinton Webb,,,                            *
+ *   Copyright (C) 2006-2007 by Hyper-Active Systems,Australia,,           *
+ *   pacsrv@hyper-active.com.au                                            *
+ *                                                                         *
+ *   This library is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This library is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <DevPlus.h>
+
+#include "pkgindex.h"
+#include "fileinfo.h"
+
+
+#define ALPHA	"alpha-1.0-1-x86_64.pkg.tar.zst"
+#define BETA	"beta-2.0-1-any.pkg.tar.xz"
+#define GAMMA	"gamma-1-1-any.pkg.tar.zst"
+#define DELTA	"delta-3-1-any.pkg.tar.zst"
+#define EPSILON	"epsilon-0.5-2-x86_64.pkg.tar.zst"
+#define ZETA	"zeta-1-1-any.pkg.tar.zst"
+
+
+static int _nFailed = 0;
+
+
+//-----------------------------------------------------------------------------
+// CJW: Note a check that didnt work out.
+static void Check(bool bOk, const char *szWhat)
+{
+	if (bOk == false) {
+		printf("FAIL: %s\n", szWhat);
+		_nFailed++;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Make up the contents of a package.  This has to match what was used
+// 		to make the checksums in tests/sync.
+static char * MakeData(const char *szFile, int nSize, bool bCorrupt)
+{
+	char *pData;
+	int i, nLen;
+
+	pData = (char *) malloc(nSize);
+	ASSERT(pData != NULL);
+
+	nLen = strlen(szFile);
+	for (i=0; i<nSize; i++) {
+		pData[i] = (char) (((i * 7) + nLen) & 0xff);
+	}
+	if (bCorrupt == true) {
+		pData[nSize / 2] ^= 0x55;
+	}
+
+	return(pData);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Fill in a remote file as if all of its chunks had come from the
+// 		nodes.
+static void FillFile(FileInfo *pInfo, const char *szFile, int nSize, bool bCorrupt)
+{
+	char *pData;
+
+	pData = MakeData(szFile, nSize, bCorrupt);
+	pInfo->SaveData(pData, nSize);
+	free(pData);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Get a package the way the network would, and try to put it in the
+// 		cache.  Returns the FILE_SAVE_ result.
+static int SaveOne(PkgIndex *pIndex, char *szCache, const char *szFile, int nSize, bool bCorrupt)
+{
+	FileInfo *pInfo;
+	char *szSha256 = NULL;
+	int nResult;
+
+	pIndex->Find((char *) szFile, NULL, &szSha256);
+
+	pInfo = new FileInfo;
+	pInfo->SetFile((char *) szFile);
+	pInfo->SetLength(nSize);
+	FillFile(pInfo, szFile, nSize, bCorrupt);
+	nResult = pInfo->SaveFile(szCache, szSha256, pIndex->GetCount() > 0);
+	delete pInfo;
+
+	return(nResult);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Return the size of a file in the cache, or -1 if it isnt there.
+static int CacheSize(char *szCache, const char *szFile)
+{
+	char szPath[2048];
+	struct stat st;
+	int nSize = -1;
+
+	snprintf(szPath, sizeof(szPath), "%s/%s", szCache, szFile);
+	if (stat(szPath, &st) == 0) {
+		nSize = st.st_size;
+	}
+
+	return(nSize);
+}
+
+
+//-----------------------------------------------------------------------------
+// CJW: Throw away the cache directory, and anything that was saved in it.
+static void RemoveCache(char *szCache)
+{
+	const char *pFiles[] = { ALPHA, BETA, GAMMA, DELTA, EPSILON, ZETA, NULL };
+	char szPath[2048];
+	int i;
+
+	for (i=0; pFiles[i] != NULL; i++) {
+		snprintf(szPath, sizeof(szPath), "%s/%s", szCache, pFiles[i]);
+		unlink(szPath);
+	}
+	rmdir(szCache);
+}
+
+
+int main(int argc, char **argv)
+{
+	PkgIndex *pIndex;
+	FileInfo *pInfo;
+	char szCache[] = "/tmp/pacsrv-check.XXXXXX";
+	char *szSha256;
+	int nSize;
+
+	if (argc != 2) {
+		printf("usage: %s <sync dir>\n", argv[0]);
+		exit(1);
+	}
+
+	if (mkdtemp(szCache) == NULL) {
+		printf("pkgcheck: unable to make a cache directory.\n");
+		exit(1);
+	}
+
+	// the databases.
+	pIndex = new PkgIndex;
+	pIndex->SetPath(argv[1]);
+	pIndex->Load();
+	Check(pIndex->GetCount() == 5, "both databases are loaded, and only the desc files are read");
+
+	nSize = 0; szSha256 = NULL;
+	Check(pIndex->Find((char *) ALPHA, &nSize, &szSha256) == true, "alpha is in the gzipped database");
+	Check(nSize == 70000 && szSha256 != NULL, "alpha has its %CSIZE% and checksum");
+	nSize = 0;
+	Check(pIndex->Find((char *) BETA, &nSize, NULL) == true && nSize == 100, "beta has the older %SIZE%");
+	szSha256 = (char *) "x";
+	Check(pIndex->Find((char *) GAMMA, NULL, &szSha256) == true && szSha256 == NULL, "gamma doesnt have a checksum");
+	szSha256 = (char *) "x";
+	Check(pIndex->Find((char *) DELTA, NULL, &szSha256) == true && szSha256 == NULL, "a short checksum is ignored");
+	Check(pIndex->Find((char *) EPSILON, &nSize, NULL) == true && nSize == 32768, "epsilon is in the plain tar database");
+	Check(pIndex->Find((char *) ZETA, NULL, NULL) == false, "zeta isnt in any database");
+
+	// saving what we got into the cache.
+	Check(SaveOne(pIndex, szCache, ALPHA, 70000, false) == FILE_SAVE_OK, "a good file is saved");
+	Check(CacheSize(szCache, ALPHA) == 70000, "all of the saved file is there");
+	Check(SaveOne(pIndex, szCache, ALPHA, 70000, false) == FILE_SAVE_EXISTS, "a file already in the cache is left alone");
+	Check(SaveOne(pIndex, szCache, EPSILON, 32768, true) == FILE_SAVE_BADSUM, "a bad file isnt saved");
+	Check(CacheSize(szCache, EPSILON) < 0, "nothing is left behind for the bad file");
+	Check(SaveOne(pIndex, szCache, GAMMA, 5000, false) == FILE_SAVE_UNVERIFIED, "a file without a checksum isnt saved");
+	Check(SaveOne(pIndex, szCache, ZETA, 1000, false) == FILE_SAVE_UNVERIFIED, "a file that isnt indexed isnt saved");
+	Check(CacheSize(szCache, ZETA) < 0, "nothing is left behind for the unindexed file");
+
+	// a bad file is dropped, and is good once it has been got again.
+	szSha256 = NULL;
+	pIndex->Find((char *) BETA, NULL, &szSha256);
+	pInfo = new FileInfo;
+	pInfo->SetFile((char *) BETA);
+	pInfo->SetLength(100);
+	FillFile(pInfo, BETA, 100, true);
+	Check(pInfo->SaveFile(szCache, szSha256, true) == FILE_SAVE_BADSUM && pInfo->GetBadSums() == 1, "the bad sum is counted");
+	pInfo->DropChunks();
+	Check(pInfo->IsReceived() == false && pInfo->IsComplete() == false && pInfo->IsSaved() == false, "the dropped file is got again");
+	FillFile(pInfo, BETA, 100, false);
+	Check(pInfo->SaveFile(szCache, szSha256, true) == FILE_SAVE_OK && pInfo->GetBadSums() == 0, "the file got again is saved");
+	Check(CacheSize(szCache, BETA) == 100, "all of the file got again is there");
+	delete pInfo;
+
+	delete pIndex;
+
+	// without any databases, there is nothing to check against.
+	pIndex = new PkgIndex;
+	pIndex->SetPath(szCache);
+	pIndex->Load();
+	Check(pIndex->GetCount() == 0, "a directory without databases is empty");
+	Check(SaveOne(pIndex, szCache, ZETA, 1000, false) == FILE_SAVE_OK, "everything is saved without databases");
+	delete pIndex;
+
+	RemoveCache(szCache);
+
+	if (_nFailed == 0) {
+		printf("pkgcheck: all checks passed.\n");
+	}
+
+	return(_nFailed);
+}